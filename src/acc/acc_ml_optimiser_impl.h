@@ -258,12 +258,8 @@ void getFourierTransformsAndCtfs(long int part_id,
         if (baseMLO->do_preread_images)
         {
 
-            img().reshape(baseMLO->mydata.particles[part_id].img);
             CTIC(accMLO->timer,"ParaReadPrereadImages");
-            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(baseMLO->mydata.particles[part_id].img)
-            {
-                DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(baseMLO->mydata.particles[part_id].img, n);
-            }
+            baseMLO->mydata.getPrereadImage(part_id, img());
             CTOC(accMLO->timer,"ParaReadPrereadImages");
         }
         else
@@ -278,7 +274,7 @@ void getFourierTransformsAndCtfs(long int part_id,
             else
             {
                 CTIC(accMLO->timer,"ParaRead2DImages");
-                img() = baseMLO->exp_imgs[op.metadata_offset];
+                baseMLO->getPooledImage(op.metadata_offset, img());
                 CTOC(accMLO->timer,"ParaRead2DImages");
             }
         }
@@ -3745,7 +3741,10 @@ if (thread_id == 0)
 baseMLO->timer.toc(baseMLO->TIMING_ESP_DIFF2_A);
 #endif
 		CTIC(timer,"getFourierTransformsAndCtfs");
-		getFourierTransformsAndCtfs<MlClass>(part_id, op, sp, baseMLO, myInstance, ptrFactory, ibody);
+		{
+			TraceSpan trace_span("FT/CTF prep");
+			getFourierTransformsAndCtfs<MlClass>(part_id, op, sp, baseMLO, myInstance, ptrFactory, ibody);
+		}
 		CTOC(timer,"getFourierTransformsAndCtfs");
 
 		// To deal with skipped alignments/rotations
@@ -3852,11 +3851,17 @@ baseMLO->timer.toc(baseMLO->TIMING_ESP_DIFF2_B);
 				Mweight.streamSync();
 
 				CTIC(timer,"getAllSquaredDifferencesCoarse");
-				getAllSquaredDifferencesCoarse<MlClass>(ipass, op, sp, baseMLO, myInstance, Mweight, ptrFactory, ibody);
+				{
+					TraceSpan trace_span("coarse diff2");
+					getAllSquaredDifferencesCoarse<MlClass>(ipass, op, sp, baseMLO, myInstance, Mweight, ptrFactory, ibody);
+				}
 				CTOC(timer,"getAllSquaredDifferencesCoarse");
 
 				CTIC(timer,"convertAllSquaredDifferencesToWeightsCoarse");
-				convertAllSquaredDifferencesToWeights<MlClass>(ipass, op, sp, baseMLO, myInstance, CoarsePassWeights, FinePassClassMasks, Mweight, ptrFactory, ibody);
+				{
+					TraceSpan trace_span("weights");
+					convertAllSquaredDifferencesToWeights<MlClass>(ipass, op, sp, baseMLO, myInstance, CoarsePassWeights, FinePassClassMasks, Mweight, ptrFactory, ibody);
+				}
                 CTOC(timer,"convertAllSquaredDifferencesToWeightsCoarse");
 			}
 			else
@@ -3909,14 +3914,20 @@ baseMLO->timer.toc(baseMLO->TIMING_ESP_DIFF2_D);
 				//bundleD2.allAlloc();
 
                 CTIC(timer,"getAllSquaredDifferencesFine");
-				getAllSquaredDifferencesFine<MlClass>(ipass, op, sp, baseMLO, myInstance, FinePassWeights, FinePassClassMasks, FineProjectionData, ptrFactory, ibody);
+				{
+					TraceSpan trace_span("fine diff2");
+					getAllSquaredDifferencesFine<MlClass>(ipass, op, sp, baseMLO, myInstance, FinePassWeights, FinePassClassMasks, FineProjectionData, ptrFactory, ibody);
+				}
 				CTOC(timer,"getAllSquaredDifferencesFine");
 				FinePassWeights.weights.cpToHost();
 
 				AccPtr<XFLOAT> Mweight = ptrFactory.make<XFLOAT>(); //DUMMY
 
 				CTIC(timer,"convertAllSquaredDifferencesToWeightsFine");
-                convertAllSquaredDifferencesToWeights<MlClass>(ipass, op, sp, baseMLO, myInstance, FinePassWeights, FinePassClassMasks, Mweight, ptrFactory, ibody);
+				{
+					TraceSpan trace_span("weights");
+					convertAllSquaredDifferencesToWeights<MlClass>(ipass, op, sp, baseMLO, myInstance, FinePassWeights, FinePassClassMasks, Mweight, ptrFactory, ibody);
+				}
                 CTOC(timer,"convertAllSquaredDifferencesToWeightsFine");
 
 			}
@@ -3952,7 +3963,10 @@ if (thread_id == 0)
 baseMLO->timer.toc(baseMLO->TIMING_ESP_DIFF2_E);
 #endif
 		CTIC(timer,"storeWeightedSums");
-		storeWeightedSums<MlClass>(op, sp, baseMLO, myInstance, FinePassWeights, FineProjectionData, FinePassClassMasks, ptrFactory, ibody, bundleSWS);
+		{
+			TraceSpan trace_span("storeWeightedSums");
+			storeWeightedSums<MlClass>(op, sp, baseMLO, myInstance, FinePassWeights, FineProjectionData, FinePassClassMasks, ptrFactory, ibody, bundleSWS);
+		}
 		CTOC(timer,"storeWeightedSums");
 
         FinePassWeights.dual_free_all();
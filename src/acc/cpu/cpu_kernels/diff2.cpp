@@ -0,0 +1,259 @@
+#include <cstddef>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(__INTEL_COMPILER)
+#define DIFF2_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include "src/acc/settings.h"
+
+namespace CpuKernels
+{
+
+/*
+ * Implementations of diff2_coarse_tile for different instruction sets. The tile is traversed
+ * in 2x2 blocks of (orientation, translation), so that each load of a projection and a shifted
+ * image is used twice, with the remaining orientations and translations done one at a time.
+ */
+
+static void diff2_coarse_tile_generic(
+		const XFLOAT *ref_real, const XFLOAT *ref_imag, int nr_orient,
+		const XFLOAT *img_real, const XFLOAT *img_imag, int nr_trans,
+		const XFLOAT *corr, int nr_pixels,
+		XFLOAT *g_diff2s, size_t diff2s_stride)
+{
+	for (int o = 0; o < nr_orient; o++)
+	{
+		const XFLOAT *r_real = ref_real + (size_t)o * nr_pixels;
+		const XFLOAT *r_imag = ref_imag + (size_t)o * nr_pixels;
+
+		for (int t = 0; t < nr_trans; t++)
+		{
+			const XFLOAT *i_real = img_real + (size_t)t * nr_pixels;
+			const XFLOAT *i_imag = img_imag + (size_t)t * nr_pixels;
+
+			XFLOAT sum = 0.;
+			#pragma omp simd reduction(+:sum)
+			for (int p = 0; p < nr_pixels; p++)
+			{
+				XFLOAT diff_real = r_real[p] - i_real[p];
+				XFLOAT diff_imag = r_imag[p] - i_imag[p];
+				sum += (diff_real * diff_real + diff_imag * diff_imag) * corr[p];
+			}
+
+			g_diff2s[(size_t)o * diff2s_stride + t] += sum;
+		}
+	}
+}
+
+#if defined(DIFF2_X86_DISPATCH) && !defined(ACC_DOUBLE_PRECISION)
+
+__attribute__((target("avx2,fma")))
+static inline __m256 diff2_avx2(__m256 r_real, __m256 r_imag, __m256 i_real, __m256 i_imag, __m256 corr, __m256 sum)
+{
+	__m256 diff_real = _mm256_sub_ps(r_real, i_real);
+	__m256 diff_imag = _mm256_sub_ps(r_imag, i_imag);
+	__m256 d = _mm256_mul_ps(diff_real, diff_real);
+	d = _mm256_fmadd_ps(diff_imag, diff_imag, d);
+	return _mm256_fmadd_ps(d, corr, sum);
+}
+
+__attribute__((target("avx2,fma")))
+static inline float hsum_avx2(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static void diff2_coarse_tile_avx2(
+		const float *ref_real, const float *ref_imag, int nr_orient,
+		const float *img_real, const float *img_imag, int nr_trans,
+		const float *corr, int nr_pixels,
+		float *g_diff2s, size_t diff2s_stride)
+{
+	const int nr_vec = nr_pixels - nr_pixels % 8;
+
+	for (int o = 0; o < nr_orient; o += 2)
+	{
+		const int no = (o + 1 < nr_orient) ? 2 : 1;
+		const float *r0_real = ref_real + (size_t)o * nr_pixels;
+		const float *r0_imag = ref_imag + (size_t)o * nr_pixels;
+		const float *r1_real = ref_real + (size_t)(o + no - 1) * nr_pixels;
+		const float *r1_imag = ref_imag + (size_t)(o + no - 1) * nr_pixels;
+
+		for (int t = 0; t < nr_trans; t += 2)
+		{
+			const int nt = (t + 1 < nr_trans) ? 2 : 1;
+			const float *i0_real = img_real + (size_t)t * nr_pixels;
+			const float *i0_imag = img_imag + (size_t)t * nr_pixels;
+			const float *i1_real = img_real + (size_t)(t + nt - 1) * nr_pixels;
+			const float *i1_imag = img_imag + (size_t)(t + nt - 1) * nr_pixels;
+
+			__m256 s00 = _mm256_setzero_ps(), s01 = _mm256_setzero_ps();
+			__m256 s10 = _mm256_setzero_ps(), s11 = _mm256_setzero_ps();
+
+			for (int p = 0; p < nr_vec; p += 8)
+			{
+				__m256 c = _mm256_loadu_ps(corr + p);
+				__m256 a_real = _mm256_loadu_ps(r0_real + p), a_imag = _mm256_loadu_ps(r0_imag + p);
+				__m256 b_real = _mm256_loadu_ps(r1_real + p), b_imag = _mm256_loadu_ps(r1_imag + p);
+				__m256 u_real = _mm256_loadu_ps(i0_real + p), u_imag = _mm256_loadu_ps(i0_imag + p);
+				__m256 v_real = _mm256_loadu_ps(i1_real + p), v_imag = _mm256_loadu_ps(i1_imag + p);
+
+				s00 = diff2_avx2(a_real, a_imag, u_real, u_imag, c, s00);
+				s01 = diff2_avx2(a_real, a_imag, v_real, v_imag, c, s01);
+				s10 = diff2_avx2(b_real, b_imag, u_real, u_imag, c, s10);
+				s11 = diff2_avx2(b_real, b_imag, v_real, v_imag, c, s11);
+			}
+
+			float sum[2][2] = {{hsum_avx2(s00), hsum_avx2(s01)}, {hsum_avx2(s10), hsum_avx2(s11)}};
+
+			for (int p = nr_vec; p < nr_pixels; p++)
+			{
+				for (int i = 0; i < 2; i++)
+					for (int j = 0; j < 2; j++)
+					{
+						const float *r_real = (i == 0) ? r0_real : r1_real, *r_imag = (i == 0) ? r0_imag : r1_imag;
+						const float *m_real = (j == 0) ? i0_real : i1_real, *m_imag = (j == 0) ? i0_imag : i1_imag;
+						float diff_real = r_real[p] - m_real[p];
+						float diff_imag = r_imag[p] - m_imag[p];
+						sum[i][j] += (diff_real * diff_real + diff_imag * diff_imag) * corr[p];
+					}
+			}
+
+			for (int i = 0; i < no; i++)
+				for (int j = 0; j < nt; j++)
+					g_diff2s[(size_t)(o + i) * diff2s_stride + t + j] += sum[i][j];
+		}
+	}
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 diff2_avx512(__m512 r_real, __m512 r_imag, __m512 i_real, __m512 i_imag, __m512 corr, __m512 sum)
+{
+	__m512 diff_real = _mm512_sub_ps(r_real, i_real);
+	__m512 diff_imag = _mm512_sub_ps(r_imag, i_imag);
+	__m512 d = _mm512_mul_ps(diff_real, diff_real);
+	d = _mm512_fmadd_ps(diff_imag, diff_imag, d);
+	return _mm512_fmadd_ps(d, corr, sum);
+}
+
+__attribute__((target("avx512f")))
+static void diff2_coarse_tile_avx512(
+		const float *ref_real, const float *ref_imag, int nr_orient,
+		const float *img_real, const float *img_imag, int nr_trans,
+		const float *corr, int nr_pixels,
+		float *g_diff2s, size_t diff2s_stride)
+{
+	const int nr_vec = nr_pixels - nr_pixels % 16;
+	const __mmask16 tail = (__mmask16)((1u << (nr_pixels - nr_vec)) - 1u);
+
+	for (int o = 0; o < nr_orient; o += 2)
+	{
+		const int no = (o + 1 < nr_orient) ? 2 : 1;
+		const float *r0_real = ref_real + (size_t)o * nr_pixels;
+		const float *r0_imag = ref_imag + (size_t)o * nr_pixels;
+		const float *r1_real = ref_real + (size_t)(o + no - 1) * nr_pixels;
+		const float *r1_imag = ref_imag + (size_t)(o + no - 1) * nr_pixels;
+
+		for (int t = 0; t < nr_trans; t += 2)
+		{
+			const int nt = (t + 1 < nr_trans) ? 2 : 1;
+			const float *i0_real = img_real + (size_t)t * nr_pixels;
+			const float *i0_imag = img_imag + (size_t)t * nr_pixels;
+			const float *i1_real = img_real + (size_t)(t + nt - 1) * nr_pixels;
+			const float *i1_imag = img_imag + (size_t)(t + nt - 1) * nr_pixels;
+
+			__m512 s00 = _mm512_setzero_ps(), s01 = _mm512_setzero_ps();
+			__m512 s10 = _mm512_setzero_ps(), s11 = _mm512_setzero_ps();
+
+			for (int p = 0; p < nr_pixels; p += 16)
+			{
+				// The masked loads of the last vector read zeros beyond the tile
+				__mmask16 m = (p < nr_vec) ? (__mmask16)0xFFFF : tail;
+				__m512 c = _mm512_maskz_loadu_ps(m, corr + p);
+				__m512 a_real = _mm512_maskz_loadu_ps(m, r0_real + p), a_imag = _mm512_maskz_loadu_ps(m, r0_imag + p);
+				__m512 b_real = _mm512_maskz_loadu_ps(m, r1_real + p), b_imag = _mm512_maskz_loadu_ps(m, r1_imag + p);
+				__m512 u_real = _mm512_maskz_loadu_ps(m, i0_real + p), u_imag = _mm512_maskz_loadu_ps(m, i0_imag + p);
+				__m512 v_real = _mm512_maskz_loadu_ps(m, i1_real + p), v_imag = _mm512_maskz_loadu_ps(m, i1_imag + p);
+
+				s00 = diff2_avx512(a_real, a_imag, u_real, u_imag, c, s00);
+				s01 = diff2_avx512(a_real, a_imag, v_real, v_imag, c, s01);
+				s10 = diff2_avx512(b_real, b_imag, u_real, u_imag, c, s10);
+				s11 = diff2_avx512(b_real, b_imag, v_real, v_imag, c, s11);
+			}
+
+			float sum[2][2] = {{_mm512_reduce_add_ps(s00), _mm512_reduce_add_ps(s01)},
+			                   {_mm512_reduce_add_ps(s10), _mm512_reduce_add_ps(s11)}};
+
+			for (int i = 0; i < no; i++)
+				for (int j = 0; j < nt; j++)
+					g_diff2s[(size_t)(o + i) * diff2s_stride + t + j] += sum[i][j];
+		}
+	}
+}
+
+#endif // DIFF2_X86_DISPATCH && !ACC_DOUBLE_PRECISION
+
+typedef void (*Diff2CoarseTileFunction)(
+		const XFLOAT *, const XFLOAT *, int,
+		const XFLOAT *, const XFLOAT *, int,
+		const XFLOAT *, int,
+		XFLOAT *, size_t);
+
+struct Diff2CoarseTileDispatch
+{
+	Diff2CoarseTileFunction function;
+	const char *isa;
+
+	// Choose the implementation once, for the instruction sets of the CPU we are running on
+	Diff2CoarseTileDispatch()
+	:	function(diff2_coarse_tile_generic), isa("generic")
+	{
+#if defined(DIFF2_X86_DISPATCH) && !defined(ACC_DOUBLE_PRECISION)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+		{
+			function = diff2_coarse_tile_avx512;
+			isa = "avx512";
+		}
+		else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		{
+			function = diff2_coarse_tile_avx2;
+			isa = "avx2";
+		}
+#endif
+	}
+};
+
+static const Diff2CoarseTileDispatch &diff2CoarseTileDispatch()
+{
+	static const Diff2CoarseTileDispatch dispatch;
+	return dispatch;
+}
+
+void diff2_coarse_tile(
+		const XFLOAT *ref_real,
+		const XFLOAT *ref_imag,
+		int nr_orient,
+		const XFLOAT *img_real,
+		const XFLOAT *img_imag,
+		int nr_trans,
+		const XFLOAT *corr,
+		int nr_pixels,
+		XFLOAT *g_diff2s,
+		size_t diff2s_stride)
+{
+	diff2CoarseTileDispatch().function(ref_real, ref_imag, nr_orient, img_real, img_imag, nr_trans,
+	                                   corr, nr_pixels, g_diff2s, diff2s_stride);
+}
+
+const char *diff2_coarse_tile_isa()
+{
+	return diff2CoarseTileDispatch().isa;
+}
+
+} // namespace CpuKernels
@@ -326,6 +326,34 @@ void diff2_coarse_3D(
 }
 */
 
+/* Weighted squared differences between a tile of projections and a tile of shifted images:
+ *
+ *   g_diff2s[o * diff2s_stride + t] += sum_p corr[p] * |ref[o][p] - img[t][p]|^2
+ *
+ * for o < nr_orient and t < nr_trans, with the real and imaginary parts of projection o at
+ * ref_real/ref_imag + o * nr_pixels, and those of shifted image t at img_real/img_imag + t * nr_pixels.
+ * This uses AVX-512 or AVX2 when the CPU supports them (see diff2.cpp).
+ */
+void diff2_coarse_tile(
+		const XFLOAT *ref_real,
+		const XFLOAT *ref_imag,
+		int nr_orient,
+		const XFLOAT *img_real,
+		const XFLOAT *img_imag,
+		int nr_trans,
+		const XFLOAT *corr,
+		int nr_pixels,
+		XFLOAT *g_diff2s,
+		size_t diff2s_stride);
+
+// Name of the instruction set used by diff2_coarse_tile: "avx512", "avx2" or "generic"
+const char *diff2_coarse_tile_isa();
+
+/* The coarse diff2s are calculated in tiles of block_sz Fourier pixels: for each tile, the image
+ * is shifted by all translations once, and the tile is then compared with the projections of
+ * eulers_per_block orientations at a time, so that both the shifted images and the projections
+ * stay in cache. prefetch_fraction is only used by the GPU kernels.
+ */
 template<bool REF3D, bool DATA3D, int block_sz, int eulers_per_block, int prefetch_fraction>
 #ifndef __INTEL_COMPILER
 __attribute__((always_inline))
@@ -359,101 +387,111 @@ inline void diff2_coarse(
 	const int maxR = projector.maxR;
 	const unsigned pass_num(ceilfracf(image_size,block_sz));
 
-#ifndef __INTEL_COMPILER
 	// pre-compute sin and cos for x and y component
-	XFLOAT sin_x[translation_num][xSize], cos_x[translation_num][xSize];
-	XFLOAT sin_y[translation_num][ySize], cos_y[translation_num][ySize];
-	XFLOAT sin_z[translation_num][zSize], cos_z[translation_num][zSize];
+	std::vector<XFLOAT> sin_x(translation_num * xSize), cos_x(translation_num * xSize);
+	std::vector<XFLOAT> sin_y(translation_num * ySize), cos_y(translation_num * ySize);
+	std::vector<XFLOAT> sin_z(translation_num * zSize), cos_z(translation_num * zSize);
 
 	if (DATA3D)  {
 		computeSincosLookupTable3D(translation_num, trans_x, trans_y, trans_z,
-								xSize, ySize, zSize,                               
-								&sin_x[0][0], &cos_x[0][0], 
-								&sin_y[0][0], &cos_y[0][0],
-								&sin_z[0][0], &cos_z[0][0]);
+								xSize, ySize, zSize,
+								&sin_x[0], &cos_x[0],
+								&sin_y[0], &cos_y[0],
+								&sin_z[0], &cos_z[0]);
 	} else {
-		computeSincosLookupTable2D(translation_num, trans_x, trans_y, 
+		computeSincosLookupTable2D(translation_num, trans_x, trans_y,
 								xSize, ySize,
-								&sin_x[0][0], &cos_x[0][0], 
-								&sin_y[0][0], &cos_y[0][0]);	
+								&sin_x[0], &cos_x[0],
+								&sin_y[0], &cos_y[0]);
 	}
-	
-	XFLOAT trans_cos_x[block_sz], trans_sin_x[block_sz];
-	XFLOAT trans_cos_y[block_sz], trans_sin_y[block_sz];
-	XFLOAT trans_cos_z[block_sz], trans_sin_z[block_sz];
-#endif  // not Intel Compiler
-	
-	int x[pass_num][block_sz], y[pass_num][block_sz], z[pass_num][block_sz];
-	XFLOAT s_real[pass_num][block_sz];
-	XFLOAT s_imag[pass_num][block_sz];
-	XFLOAT s_corr[pass_num][block_sz];
-	
-	// Pre-calculate x/y/z
-	for (unsigned pass = 0; pass < pass_num; pass++) { // finish an entire ref image each block
-   		unsigned long start = pass * block_sz;
+
+	int x[block_sz], y[block_sz], z[block_sz];
+	XFLOAT s_corr[block_sz];
+
+	// Shifted image tile for all translations, and projection tile for eulers_per_block orientations
+	std::vector<XFLOAT> s_img_real(translation_num * block_sz), s_img_imag(translation_num * block_sz);
+	XFLOAT s_ref_real[eulers_per_block][block_sz];
+	XFLOAT s_ref_imag[eulers_per_block][block_sz];
+
+	for (unsigned pass = 0; pass < pass_num; pass++) {
+		unsigned long start = pass * block_sz;
 		unsigned long elements = block_sz;
 		if (start + block_sz >= image_size)
 			elements = image_size - start;
 
-		// Rotate the reference image per block_sz, saved in cache
-		#pragma omp simd
 		for (int tid=0; tid<elements; tid++){
 			unsigned long pixel = (unsigned long)start + (unsigned long)tid;
 
 			if(DATA3D)
 			{
-				z[pass][tid] = floorfracf(pixel, xSize*ySize);
+				z[tid] = floorfracf(pixel, xSize*ySize);
 				int xy = pixel % (xSize*ySize);
-				x[pass][tid] =             xy  % xSize;
-				y[pass][tid] = floorfracf( xy,   xSize);
-				if (z[pass][tid] > maxR)
-					z[pass][tid] -= zSize;
+				x[tid] =             xy  % xSize;
+				y[tid] = floorfracf( xy,   xSize);
+				if (z[tid] > maxR)
+					z[tid] -= zSize;
 			}
 			else
 			{
-				x[pass][tid] =            pixel % xSize;
-				y[pass][tid] = floorfracf(pixel, xSize);
-				z[pass][tid] = (XFLOAT)0.0;
+				x[tid] =            pixel % xSize;
+				y[tid] = floorfracf(pixel, xSize);
+				z[tid] = 0;
 			}
-			if (y[pass][tid] > maxR)
-				y[pass][tid] -= ySize;
+			if (y[tid] > maxR)
+				y[tid] -= ySize;
 
-			s_real[pass][tid] = g_real[pixel];
-			s_imag[pass][tid] = g_imag[pixel];
-			s_corr[pass][tid] = g_corr[pixel] * (XFLOAT)0.5;
+			s_corr[tid] = g_corr[pixel] * (XFLOAT)0.5;
 		}
 
-		// Make sure un-used elements are zeroed - just in case
-		if (elements != block_sz)
-			for (int tid=elements; tid < block_sz; tid++)
-			{
-				x[pass][tid] = (XFLOAT)0.0;
-				y[pass][tid] = (XFLOAT)0.0;
-			}
-	}
+		// Un-used elements of the tile contribute nothing
+		for (int tid=elements; tid < block_sz; tid++)
+		{
+			x[tid] = y[tid] = z[tid] = 0;
+			s_corr[tid] = (XFLOAT)0.0;
+		}
 
-	XFLOAT diff2s[translation_num][eulers_per_block];
-	XFLOAT diffi[eulers_per_block];
+		// Shift the image tile by all translations
+		for(unsigned long i=0; i<translation_num; i++) {
+			XFLOAT *img_real = &s_img_real[i * block_sz];
+			XFLOAT *img_imag = &s_img_imag[i * block_sz];
 
-	for (unsigned long block = 0; block < grid_size; block++) {
-		//Prefetch euler matrices with cacheline friendly index
-		XFLOAT s_eulers[eulers_per_block * 16];
-		for (int e = 0; e < eulers_per_block; e++)
-			for (int i = 0; i < 9; i++)
-				s_eulers[e*16+i] = g_eulers[(size_t)block * (size_t)eulers_per_block * (size_t)9 + e*9+i];
+			for (int tid=0; tid<elements; tid++) {
+				unsigned long pixel = (unsigned long)start + (unsigned long)tid;
+				int xidx = x[tid];
+				int yidx = y[tid];
 
-		//Setup variables
-		XFLOAT s_ref_real[eulers_per_block][block_sz];
-		XFLOAT s_ref_imag[eulers_per_block][block_sz];
+				XFLOAT cos_tx = (xidx < 0) ?  cos_x[i * xSize - xidx] : cos_x[i * xSize + xidx];
+				XFLOAT sin_tx = (xidx < 0) ? -sin_x[i * xSize - xidx] : sin_x[i * xSize + xidx];
+				XFLOAT cos_ty = (yidx < 0) ?  cos_y[i * ySize - yidx] : cos_y[i * ySize + yidx];
+				XFLOAT sin_ty = (yidx < 0) ? -sin_y[i * ySize - yidx] : sin_y[i * ySize + yidx];
+
+				XFLOAT ss = sin_tx * cos_ty + cos_tx * sin_ty;
+				XFLOAT cc = cos_tx * cos_ty - sin_tx * sin_ty;
 
-		memset(&diff2s[0][0], 0, sizeof(XFLOAT) * translation_num * eulers_per_block);
+				if(DATA3D) {
+					int zidx = z[tid];
+					XFLOAT cos_tz = (zidx < 0) ?  cos_z[i * zSize - zidx] : cos_z[i * zSize + zidx];
+					XFLOAT sin_tz = (zidx < 0) ? -sin_z[i * zSize - zidx] : sin_z[i * zSize + zidx];
+
+					XFLOAT s = ss;
+					ss = s  * cos_tz + cc * sin_tz;
+					cc = cc * cos_tz - s  * sin_tz;
+				}
+
+				img_real[tid] = cc * g_real[pixel] - ss * g_imag[pixel];
+				img_imag[tid] = cc * g_imag[pixel] + ss * g_real[pixel];
+			}
+
+			for (int tid=elements; tid < block_sz; tid++)
+				img_real[tid] = img_imag[tid] = (XFLOAT)0.0;
+		}
 
-		//Step through data
-		for (unsigned pass = 0; pass < pass_num; pass++) { // finish an entire ref image each block
-			unsigned long start = pass * block_sz;
-			unsigned long elements = block_sz;
-			if (start + block_sz >= image_size)
-				elements = image_size - start;
+		for (unsigned long block = 0; block < grid_size; block++) {
+			//Prefetch euler matrices with cacheline friendly index
+			XFLOAT s_eulers[eulers_per_block * 16];
+			for (int e = 0; e < eulers_per_block; e++)
+				for (int i = 0; i < 9; i++)
+					s_eulers[e*16+i] = g_eulers[(size_t)block * (size_t)eulers_per_block * (size_t)9 + e*9+i];
 
 			for (int i = 0; i < eulers_per_block; i ++) {
 				#pragma omp simd
@@ -461,7 +499,7 @@ inline void diff2_coarse(
 
 					if(DATA3D) // if DATA3D, then REF3D as well.
 						projector.project3Dmodel(
-								x[pass][tid], y[pass][tid], z[pass][tid],
+								x[tid], y[tid], z[tid],
 								s_eulers[i*16  ],
 								s_eulers[i*16+1],
 								s_eulers[i*16+2],
@@ -475,7 +513,7 @@ inline void diff2_coarse(
 								s_ref_imag[i][tid]);
 					else if(REF3D)
 						projector.project3Dmodel(
-								x[pass][tid], y[pass][tid], 
+								x[tid], y[tid],
 								s_eulers[i*16  ],
 								s_eulers[i*16+1],
 								s_eulers[i*16+3],
@@ -483,10 +521,10 @@ inline void diff2_coarse(
 								s_eulers[i*16+6],
 								s_eulers[i*16+7],
 								s_ref_real[i][tid],
-								s_ref_imag[i][tid]);                    
+								s_ref_imag[i][tid]);
 					else
 						projector.project2Dmodel(
-								x[pass][tid], y[pass][tid], 
+								x[tid], y[tid],
 								s_eulers[i*16  ],
 								s_eulers[i*16+1],
 								s_eulers[i*16+3],
@@ -494,114 +532,17 @@ inline void diff2_coarse(
 								s_ref_real[i][tid],
 								s_ref_imag[i][tid]);
 				}
-			}
-
-			for(unsigned long i=0; i<translation_num; i++) {
-				XFLOAT tx = trans_x[i];
-				XFLOAT ty = trans_y[i];
-				XFLOAT tz = trans_z[i];                 
-
-#ifndef __INTEL_COMPILER
-				for (int tid=0; tid<elements; tid++) {
-
-					int xidx = x[pass][tid];
-					int yidx = y[pass][tid];
-					int zidx;
-
-					if(DATA3D) {
-						zidx = z[pass][tid];
-						if ( zidx < 0) {
-							trans_cos_z[tid] =  cos_z[i][-zidx];
-							trans_sin_z[tid] = -sin_z[i][-zidx];            
-						}
-						else {
-							trans_cos_z[tid] = cos_z[i][zidx];
-							trans_sin_z[tid] = sin_z[i][zidx];
-						}
-					}
-
-					if ( yidx < 0) {
-						trans_cos_y[tid] =  cos_y[i][-yidx];
-						trans_sin_y[tid] = -sin_y[i][-yidx];            
-					}
-					else {
-						trans_cos_y[tid] = cos_y[i][yidx];
-						trans_sin_y[tid] = sin_y[i][yidx];
-					}
-
-					if ( xidx < 0) {
-						trans_cos_x[tid] =  cos_x[i][-xidx];
-						trans_sin_x[tid] = -sin_x[i][-xidx];            
-					}
-					else {
-						trans_cos_x[tid] = cos_x[i][xidx];
-						trans_sin_x[tid] = sin_x[i][xidx];
-					}					
-				}  // tid  						
-#endif  // not Intel Compiler
-
-				for (int j = 0; j < eulers_per_block; j ++)
-					diffi[j] = 0.0;
-
-#if _OPENMP > 201307	// For OpenMP 4.5 and later
-				#pragma omp simd reduction(+:diffi)
-#endif
-				for (int tid=0; tid<block_sz; tid++) {
-// This will generate masked SVML routines for Intel compiler
-					unsigned long pixel = (unsigned long)start + (unsigned long)tid;
-					if(pixel >= image_size)
-						continue;                
-
-					XFLOAT real, imag;
-#ifndef __INTEL_COMPILER
-					if(DATA3D) {
-//						translatePixel(x[tid], y[tid], z[tid], tx, ty, tz, s_real[tid], s_imag[tid], real, imag);
-						XFLOAT s  = trans_sin_x[tid] * trans_cos_y[tid] + trans_cos_x[tid] * trans_sin_y[tid];
-						XFLOAT c  = trans_cos_x[tid] * trans_cos_y[tid] - trans_sin_x[tid] * trans_sin_y[tid];
-
-						XFLOAT ss = s * trans_cos_z[tid] + c * trans_sin_z[tid];
-						XFLOAT cc = c * trans_cos_z[tid] - s * trans_sin_z[tid];				
 
-						real = cc * s_real[pass][tid] - ss * s_imag[pass][tid];
-						imag = cc * s_imag[pass][tid] + ss * s_real[pass][tid];
-					}
-					else  { // 2D data
-//						translatePixel(x[tid], y[tid],         tx, ty,     s_real[tid], s_imag[tid], real, imag);
-						XFLOAT ss = trans_sin_x[tid] * trans_cos_y[tid] + trans_cos_x[tid] * trans_sin_y[tid];
-						XFLOAT cc = trans_cos_x[tid] * trans_cos_y[tid] - trans_sin_x[tid] * trans_sin_y[tid];
-			
-						real = cc * s_real[pass][tid] - ss * s_imag[pass][tid];
-						imag = cc * s_imag[pass][tid] + ss * s_real[pass][tid];
-					}
-#else  // Intel Compiler - accept the (hopefully vectorized) sincos call every iteration rather than caching
-					if(DATA3D)
-						translatePixel(x[pass][tid], y[pass][tid], z[pass][tid], tx, ty, tz,
-										s_real[pass][tid], s_imag[pass][tid], real, imag);
-					else
-						translatePixel(x[pass][tid], y[pass][tid], tx, ty,
-										s_real[pass][tid], s_imag[pass][tid], real, imag);
-#endif  // not Intel Compiler
-
-#ifdef __INTEL_COMPILER
-					#pragma unroll(eulers_per_block)
-#endif
-					for (int j = 0; j < eulers_per_block; j ++) {
-						XFLOAT diff_real =  s_ref_real[j][tid] - real;
-						XFLOAT diff_imag =  s_ref_imag[j][tid] - imag;
-
-						diffi[j] += (diff_real * diff_real + diff_imag * diff_imag) * s_corr[pass][tid];
-					}
-				} // for tid
-				for (int j = 0; j < eulers_per_block; j ++)
-					diff2s[i][j] += diffi[j];
-			}  // for each translation
-		}  // for each pass
+				for (int tid=elements; tid < block_sz; tid++)
+					s_ref_real[i][tid] = s_ref_imag[i][tid] = (XFLOAT)0.0;
+			}
 
-		XFLOAT *pData = g_diff2s + (size_t)block * (size_t)eulers_per_block * (size_t)translation_num;
-		for(int i=0; i<eulers_per_block; i++)
-			for(unsigned long j=0; j<translation_num; j++)
-				pData[i*translation_num + j] += diff2s[j][i];
-	} // block
+			diff2_coarse_tile(&s_ref_real[0][0], &s_ref_imag[0][0], eulers_per_block,
+			                  &s_img_real[0], &s_img_imag[0], translation_num,
+			                  s_corr, block_sz,
+			                  g_diff2s + (size_t)block * (size_t)eulers_per_block * (size_t)translation_num, translation_num);
+		} // block
+	}  // for each pass
 }
 
 template<bool REF3D>
@@ -0,0 +1,523 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <chrono>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <src/args.h>
+#include <src/image.h>
+#include <src/fftw.h>
+#include <src/ctf.h>
+#include <src/projector.h>
+#include <src/euler.h>
+#include <src/funcs.h>
+#include <src/time.h>
+#include <src/metadata_table.h>
+#include <src/jaz/single_particle/obs_model.h>
+
+/* Measures the speed of relion_refine on a synthetic data set, so that changes in performance
+ * can be measured without a real data set.
+ *
+ * Particles are projected from a given map (or from a generated map of Gaussian blobs) at random
+ * orientations and offsets, multiplied with random CTFs and white noise is added. Then relion_refine
+ * is run in a fixed set of configurations, with and without --cpu, each with --trace. For each run,
+ * the wall time, particles per second, the memory high-water mark and the time spent in each step
+ * (summed over all threads, from the traces) are written to benchmark.json.
+ */
+
+class benchmark
+{
+	public:
+
+	IOParser parser;
+
+	FileName fn_out, fn_ref, fn_refine;
+	int box_size, nr_particles, random_seed, nr_iter, nr_threads, nr_pool;
+	RFLOAT angpix, snr, defocus_min, defocus_max, particle_diameter;
+	std::vector<std::string> configurations, modes;
+	bool do_only_synthesise, do_keep_synthetic;
+
+	struct Result
+	{
+		std::string configuration, mode;
+		bool success;
+		double wall_seconds, expectation_seconds, max_rss_Mb;
+		std::map<std::string, double> phase_thread_seconds;
+	};
+
+	std::vector<Result> results;
+
+	void read(int argc, char **argv)
+	{
+		parser.setCommandLine(argc, argv);
+
+		int data_section = parser.addSection("Synthetic data");
+		fn_out = parser.getOption("--o", "Output directory", "Benchmark/");
+		fn_ref = parser.getOption("--ref", "Map to project the particles from (default: generate a map of Gaussian blobs)", "");
+		box_size = textToInteger(parser.getOption("--box", "Box size of the particles (and of the generated map) in pixels", "128"));
+		angpix = textToFloat(parser.getOption("--angpix", "Pixel size in Angstrom (default: from the header of --ref, or 1.5 for a generated map)", "-1"));
+		nr_particles = textToInteger(parser.getOption("--n", "Number of particles", "2000"));
+		snr = textToFloat(parser.getOption("--snr", "Signal-to-noise ratio (in variance) of the particles", "0.05"));
+		defocus_min = textToFloat(parser.getOption("--defocus_min", "Minimum defocus in Angstrom", "8000"));
+		defocus_max = textToFloat(parser.getOption("--defocus_max", "Maximum defocus in Angstrom", "25000"));
+		random_seed = textToInteger(parser.getOption("--random_seed", "Seed for the synthetic data and for relion_refine, so that runs can be compared", "1"));
+		do_only_synthesise = parser.checkOption("--only_synthesise", "Only make the synthetic data set, do not run relion_refine");
+
+		int run_section = parser.addSection("Refinement runs");
+		std::string configurations_str = parser.getOption("--configurations", "Comma-separated list of runs: class2d, class3d and/or local3d (3D classification with local angular searches)", "class2d,class3d,local3d");
+		std::string modes_str = parser.getOption("--modes", "Comma-separated list of code paths: cpu (original CPU code) and/or altcpu (relion_refine --cpu)", "cpu,altcpu");
+		nr_iter = textToInteger(parser.getOption("--iter", "Number of iterations of each run", "2"));
+		nr_threads = textToInteger(parser.getOption("--j", "Number of threads of relion_refine", "1"));
+		nr_pool = textToInteger(parser.getOption("--pool", "Number of particles pooled per thread task (--pool of relion_refine)", "3"));
+		fn_refine = parser.getOption("--refine", "relion_refine executable (default: the one next to this program)", "");
+		do_keep_synthetic = !parser.checkOption("--remove_data", "Remove the synthetic particles at the end");
+
+		if (parser.checkForErrors())
+		{
+			REPORT_ERROR("Errors encountered on the command line (see above), exiting...");
+		}
+
+		tokenize(configurations_str, configurations, ",");
+		tokenize(modes_str, modes, ",");
+		for (int i = 0; i < configurations.size(); i++)
+			if (configurations[i] != "class2d" && configurations[i] != "class3d" && configurations[i] != "local3d")
+				REPORT_ERROR("Unknown configuration in --configurations: " + configurations[i]);
+		for (int i = 0; i < modes.size(); i++)
+			if (modes[i] != "cpu" && modes[i] != "altcpu")
+				REPORT_ERROR("Unknown code path in --modes: " + modes[i]);
+
+		if (fn_out[fn_out.length() - 1] != '/')
+			fn_out += "/";
+	}
+
+	void makeReference(Image<RFLOAT> &vol)
+	{
+		if (fn_ref != "")
+		{
+			vol.read(fn_ref);
+			if (angpix < 0.)
+				angpix = vol.samplingRateX();
+			if (XSIZE(vol()) != box_size)
+			{
+				std::cout << " Using the box size of the map: " << XSIZE(vol()) << std::endl;
+				box_size = XSIZE(vol());
+			}
+		}
+		else
+		{
+			if (angpix < 0.)
+				angpix = 1.5;
+
+			// Blobs of 2 to 4 pixels inside a sphere of a quarter of the box
+			vol().initZeros(box_size, box_size, box_size);
+			vol().setXmippOrigin();
+			const int nr_blobs = 60;
+			const RFLOAT radius = box_size / 4.;
+			for (int iblob = 0; iblob < nr_blobs; iblob++)
+			{
+				RFLOAT x, y, z;
+				do
+				{
+					x = rnd_unif(-radius, radius);
+					y = rnd_unif(-radius, radius);
+					z = rnd_unif(-radius, radius);
+				}
+				while (x*x + y*y + z*z > radius*radius);
+				const RFLOAT sigma = rnd_unif(2., 4.);
+				const RFLOAT weight = rnd_unif(0.5, 1.);
+
+				FOR_ALL_ELEMENTS_IN_ARRAY3D(vol())
+				{
+					const RFLOAT r2 = (k-z)*(k-z) + (i-y)*(i-y) + (j-x)*(j-x);
+					if (r2 < 16. * sigma * sigma)
+						A3D_ELEM(vol(), k, i, j) += weight * exp(-r2 / (2. * sigma * sigma));
+				}
+			}
+		}
+
+		vol().setXmippOrigin();
+		vol.setSamplingRateInHeader(angpix);
+		vol.write(fn_out + "ref.mrc");
+	}
+
+	void synthesise()
+	{
+		std::cout << " Synthesising " << nr_particles << " particles in " << fn_out << " ..." << std::endl;
+
+		Image<RFLOAT> vol;
+		makeReference(vol);
+		particle_diameter = 0.7 * box_size * angpix;
+
+		MetaDataTable MDopt, MDimg, MDgeneral;
+		MDopt.addObject();
+		MDopt.setValue(EMDL_IMAGE_OPTICS_GROUP, 1);
+		std::string optics_group_name = "optics1";
+		MDopt.setValue(EMDL_IMAGE_OPTICS_GROUP_NAME, optics_group_name);
+		MDopt.setValue(EMDL_CTF_VOLTAGE, 300.);
+		MDopt.setValue(EMDL_CTF_CS, 2.7);
+		MDopt.setValue(EMDL_CTF_Q0, 0.1);
+		MDopt.setValue(EMDL_IMAGE_PIXEL_SIZE, angpix);
+		MDopt.setValue(EMDL_IMAGE_SIZE, box_size);
+		MDopt.setValue(EMDL_IMAGE_DIMENSIONALITY, 2);
+		ObservationModel obsModel(MDopt);
+
+		Projector projector(box_size, TRILINEAR, 2., 10, 3);
+		MultidimArray<RFLOAT> dummy;
+		projector.computeFourierTransformMap(vol(), dummy, box_size);
+
+		Image<RFLOAT> img;
+		img().initZeros(box_size, box_size);
+		MultidimArray<Complex> F2D;
+		MultidimArray<RFLOAT> Fctf;
+		FourierTransformer transformer;
+		transformer.setReal(img());
+		transformer.getFourierAlias(F2D);
+		Matrix2D<RFLOAT> A3D;
+
+		const FileName fn_stack = fn_out + "particles.mrcs";
+		init_progress_bar(nr_particles);
+		for (long int ipart = 0; ipart < nr_particles; ipart++)
+		{
+			const RFLOAT rot = rnd_unif(0., 360.);
+			const RFLOAT tilt = RAD2DEG(acos(rnd_unif(-1., 1.)));
+			const RFLOAT psi = rnd_unif(0., 360.);
+			const RFLOAT xoff = rnd_gaus(0., 2.);
+			const RFLOAT yoff = rnd_gaus(0., 2.);
+			const RFLOAT defU = rnd_unif(defocus_min, defocus_max);
+			const RFLOAT defV = defU + rnd_gaus(0., 200.);
+			const RFLOAT defAngle = rnd_unif(0., 180.);
+
+			Euler_rotation3DMatrix(rot, tilt, psi, A3D);
+			F2D.initZeros();
+			projector.get2DFourierTransform(F2D, A3D);
+			shiftImageInFourierTransform(F2D, F2D, box_size, -xoff, -yoff);
+
+			CTF ctf;
+			ctf.setValuesByGroup(&obsModel, 0, defU, defV, defAngle);
+			Fctf.resize(F2D);
+			ctf.getFftwImage(Fctf, box_size, box_size, angpix, false, false, false, true);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(F2D)
+			{
+				DIRECT_MULTIDIM_ELEM(F2D, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+			}
+
+			transformer.inverseFourierTransform(F2D, img());
+			CenterFFT(img(), false);
+
+			// White noise for the given SNR, then normalise the whole image
+			RFLOAT avg, stddev, minval, maxval;
+			img().computeStats(avg, stddev, minval, maxval);
+			const RFLOAT noise_stddev = (stddev > 0.) ? stddev / sqrt(snr) : 1.;
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img())
+			{
+				DIRECT_MULTIDIM_ELEM(img(), n) += rnd_gaus(0., noise_stddev);
+			}
+			img().computeStats(avg, stddev, minval, maxval);
+			img() -= avg;
+			img() /= stddev;
+
+			FileName fn_img;
+			fn_img.compose(ipart + 1, fn_stack);
+			img.setSamplingRateInHeader(angpix);
+			img.write(fn_img, -1, false, (ipart == 0) ? WRITE_OVERWRITE : WRITE_APPEND);
+
+			MDimg.addObject();
+			MDimg.setValue(EMDL_IMAGE_NAME, fn_img);
+			MDimg.setValue(EMDL_MICROGRAPH_NAME, std::string("mic") + integerToString(ipart / 100 + 1, 4) + ".mrc");
+			MDimg.setValue(EMDL_IMAGE_OPTICS_GROUP, 1);
+			MDimg.setValue(EMDL_CTF_DEFOCUSU, defU);
+			MDimg.setValue(EMDL_CTF_DEFOCUSV, defV);
+			MDimg.setValue(EMDL_CTF_DEFOCUS_ANGLE, defAngle);
+			MDimg.setValue(EMDL_ORIENT_ROT, rot);
+			MDimg.setValue(EMDL_ORIENT_TILT, tilt);
+			MDimg.setValue(EMDL_ORIENT_PSI, psi);
+			MDimg.setValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, xoff * angpix);
+			MDimg.setValue(EMDL_ORIENT_ORIGIN_Y_ANGSTROM, yoff * angpix);
+			MDimg.setValue(EMDL_PARTICLE_RANDOM_SUBSET, (int)(ipart % 2 + 1));
+
+			if (ipart % 60 == 0) progress_bar(ipart);
+		}
+		progress_bar(nr_particles);
+
+		ObservationModel::saveNew(MDimg, MDopt, MDgeneral, fn_out + "particles.star");
+	}
+
+	std::vector<std::string> refineArguments(const std::string &configuration, const std::string &mode, const FileName &fn_run)
+	{
+		std::vector<std::string> args;
+		args.push_back("--i");                 args.push_back(fn_out + "particles.star");
+		args.push_back("--o");                 args.push_back(fn_run);
+		args.push_back("--iter");              args.push_back(integerToString(nr_iter));
+		args.push_back("--j");                 args.push_back(integerToString(nr_threads));
+		args.push_back("--pool");              args.push_back(integerToString(nr_pool));
+		args.push_back("--particle_diameter"); args.push_back(floatToString(particle_diameter));
+		args.push_back("--random_seed");       args.push_back(integerToString(random_seed));
+		args.push_back("--ctf");
+		args.push_back("--flatten_solvent");
+		args.push_back("--zero_mask");
+		args.push_back("--norm");
+		args.push_back("--scale");
+		args.push_back("--oversampling");      args.push_back("1");
+		args.push_back("--trace");
+
+		if (configuration == "class2d")
+		{
+			args.push_back("--K");            args.push_back("4");
+			args.push_back("--tau2_fudge");   args.push_back("2");
+			args.push_back("--psi_step");     args.push_back("12");
+			args.push_back("--offset_range"); args.push_back("5");
+			args.push_back("--offset_step");  args.push_back("2");
+		}
+		else if (configuration == "class3d")
+		{
+			args.push_back("--ref");           args.push_back(fn_out + "ref.mrc");
+			args.push_back("--ini_high");      args.push_back("20");
+			args.push_back("--K");             args.push_back("2");
+			args.push_back("--tau2_fudge");    args.push_back("4");
+			args.push_back("--healpix_order"); args.push_back("2");
+			args.push_back("--offset_range");  args.push_back("5");
+			args.push_back("--offset_step");   args.push_back("2");
+			args.push_back("--sym");           args.push_back("C1");
+		}
+		else if (configuration == "local3d")
+		{
+			// Local searches around the true orientations, as in the last iterations of auto-refine
+			args.push_back("--ref");           args.push_back(fn_out + "ref.mrc");
+			args.push_back("--ini_high");      args.push_back("10");
+			args.push_back("--K");             args.push_back("1");
+			args.push_back("--tau2_fudge");    args.push_back("4");
+			args.push_back("--healpix_order"); args.push_back("4");
+			args.push_back("--sigma_ang");     args.push_back("3");
+			args.push_back("--offset_range");  args.push_back("3");
+			args.push_back("--offset_step");   args.push_back("1");
+			args.push_back("--sym");           args.push_back("C1");
+		}
+
+		if (mode == "altcpu")
+			args.push_back("--cpu");
+
+		return args;
+	}
+
+	FileName refineExecutable()
+	{
+		if (fn_refine != "")
+			return fn_refine;
+
+		// By default, use the relion_refine that was built with this program
+		char path[PATH_MAX];
+		ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+		if (len > 0)
+		{
+			path[len] = '\0';
+			FileName fn_exe = std::string(path);
+			FileName fn_candidate = fn_exe.beforeLastOf("/") + "/relion_refine";
+			if (exists(fn_candidate))
+				return fn_candidate;
+		}
+
+		return "relion_refine";
+	}
+
+	// Sum the durations of all spans in a trace of relion_refine, per name
+	void addTrace(const FileName &fn_trace, Result &result)
+	{
+		std::ifstream in(fn_trace.c_str());
+		if (!in)
+		{
+			std::cerr << " WARNING: cannot read trace " << fn_trace << std::endl;
+			return;
+		}
+
+		std::string line;
+		while (std::getline(in, line))
+		{
+			if (line.find("\"ph\":\"X\"") == std::string::npos)
+				continue;
+
+			size_t name_start = line.find("{\"name\":\"");
+			size_t name_end = line.find("\",\"ph\"");
+			size_t dur_start = line.find("\"dur\":");
+			if (name_start == std::string::npos || name_end == std::string::npos || dur_start == std::string::npos)
+				continue;
+
+			name_start += 9;
+			const std::string name = line.substr(name_start, name_end - name_start);
+			const double seconds = textToDouble(line.substr(dur_start + 6, line.find(',', dur_start) - dur_start - 6)) * 1e-6;
+
+			result.phase_thread_seconds[name] += seconds;
+			if (name == "expectation")
+				result.expectation_seconds += seconds;
+		}
+	}
+
+	Result runRefine(const std::string &configuration, const std::string &mode)
+	{
+		Result result;
+		result.configuration = configuration;
+		result.mode = mode;
+		result.success = false;
+		result.wall_seconds = result.expectation_seconds = result.max_rss_Mb = 0.;
+
+		const FileName fn_dir = fn_out + configuration + "_" + mode + "/";
+		mktree(fn_dir);
+		const FileName fn_run = fn_dir + "run";
+		const FileName fn_exe = refineExecutable();
+		std::vector<std::string> args = refineArguments(configuration, mode, fn_run);
+
+		std::cout << " Running " << configuration << " (" << mode << "): " << fn_exe;
+		for (int i = 0; i < args.size(); i++)
+			std::cout << " " << args[i];
+		std::cout << std::endl;
+
+		std::vector<char *> argv;
+		argv.push_back((char *)fn_exe.c_str());
+		for (int i = 0; i < args.size(); i++)
+			argv.push_back((char *)args[i].c_str());
+		argv.push_back(NULL);
+
+		const FileName fn_log = fn_dir + "run.log";
+		const auto start = std::chrono::steady_clock::now();
+
+		pid_t pid = fork();
+		if (pid < 0)
+			REPORT_ERROR("Cannot start a new process for " + fn_exe);
+		if (pid == 0)
+		{
+			// Keep the output of relion_refine in the run directory
+			if (freopen(fn_log.c_str(), "w", stdout) == NULL || freopen(fn_log.c_str(), "a", stderr) == NULL)
+				_exit(127);
+			execvp(argv[0], &argv[0]);
+			_exit(127);
+		}
+
+		int status;
+		struct rusage usage;
+		if (wait4(pid, &status, 0, &usage) < 0)
+			REPORT_ERROR("Error while waiting for " + fn_exe);
+
+		result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.max_rss_Mb = usage.ru_maxrss / 1024.; // in kB on Linux
+		result.success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+		if (!result.success)
+		{
+			std::cerr << " WARNING: " << configuration << " (" << mode << ") failed, see " << fn_log << std::endl;
+			return result;
+		}
+
+		for (int iter = 1; iter <= nr_iter; iter++)
+		{
+			FileName fn_trace;
+			fn_trace.compose(fn_run + "_it", iter, "", 3);
+			addTrace(fn_trace + "_trace.json", result);
+		}
+
+		return result;
+	}
+
+	void writeResults()
+	{
+		const FileName fn_json = fn_out + "benchmark.json";
+		std::ofstream fh(fn_json.c_str());
+		if (!fh)
+			REPORT_ERROR("Cannot write to file: " + fn_json);
+
+		fh << "{\n \"box_size\": " << box_size << ",\n \"angpix\": " << angpix
+		   << ",\n \"nr_particles\": " << nr_particles << ",\n \"nr_iterations\": " << nr_iter
+		   << ",\n \"nr_threads\": " << nr_threads << ",\n \"pool\": " << nr_pool
+		   << ",\n \"random_seed\": " << random_seed << ",\n \"runs\": [";
+
+		std::cout << std::endl << " configuration  mode     wall(s)  particles/s  particles/s(E-step)  max RSS(Mb)" << std::endl;
+		for (int i = 0; i < results.size(); i++)
+		{
+			const Result &r = results[i];
+			const double particles = (double)nr_particles * nr_iter;
+			const double rate = (r.success && r.wall_seconds > 0.) ? particles / r.wall_seconds : 0.;
+			const double rate_expectation = (r.success && r.expectation_seconds > 0.) ? particles / r.expectation_seconds : 0.;
+
+			fh << ((i > 0) ? ",\n" : "\n") << "  {\"configuration\": \"" << r.configuration << "\", \"mode\": \"" << r.mode << "\""
+			   << ", \"success\": " << (r.success ? "true" : "false")
+			   << ", \"wall_seconds\": " << r.wall_seconds
+			   << ", \"particles_per_second\": " << rate
+			   << ", \"expectation_particles_per_second\": " << rate_expectation
+			   << ", \"max_rss_Mb\": " << r.max_rss_Mb
+			   << ", \"phase_thread_seconds\": {";
+			for (std::map<std::string, double>::const_iterator it = r.phase_thread_seconds.begin(); it != r.phase_thread_seconds.end(); ++it)
+				fh << ((it != r.phase_thread_seconds.begin()) ? ", " : "") << "\"" << it->first << "\": " << it->second;
+			fh << "}}";
+
+			std::cout << " " << r.configuration << std::string(15 - XMIPP_MIN(14, r.configuration.length()), ' ')
+			          << r.mode << std::string(9 - XMIPP_MIN(8, r.mode.length()), ' ');
+			if (r.success)
+				std::cout << r.wall_seconds << "  " << rate << "  " << rate_expectation << "  " << r.max_rss_Mb << std::endl;
+			else
+				std::cout << "failed" << std::endl;
+		}
+
+		fh << "\n ]\n}\n";
+		std::cout << std::endl << " Written results to " << fn_json << std::endl;
+	}
+
+	void run()
+	{
+		mktree(fn_out);
+		init_random_generator(random_seed);
+
+		synthesise();
+		if (do_only_synthesise)
+			return;
+
+		for (int i = 0; i < configurations.size(); i++)
+			for (int j = 0; j < modes.size(); j++)
+				results.push_back(runRefine(configurations[i], modes[j]));
+
+		writeResults();
+
+		if (!do_keep_synthetic)
+		{
+			std::remove((fn_out + "particles.mrcs").c_str());
+			std::remove((fn_out + "particles.star").c_str());
+		}
+	}
+};
+
+int main(int argc, char **argv)
+{
+	benchmark app;
+
+	try
+	{
+		app.read(argc, argv);
+		app.run();
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE;
+		return RELION_EXIT_FAILURE;
+	}
+
+	return RELION_EXIT_SUCCESS;
+}
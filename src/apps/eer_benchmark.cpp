@@ -0,0 +1,124 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <iostream>
+#include <omp.h>
+
+#include <src/args.h>
+#include <src/image.h>
+#include <src/renderEER.h>
+
+/* Measures how fast an EER movie is decoded and rendered, as in motion correction:
+ * first with one thread per fraction (group of hardware frames), then with all threads
+ * working on each fraction in turn.
+ */
+
+class eer_benchmark
+{
+	public:
+
+	IOParser parser;
+
+	FileName fn_movie;
+	int n_threads, eer_upsampling, eer_grouping, n_repeats;
+
+	void read(int argc, char **argv)
+	{
+		parser.setCommandLine(argc, argv);
+
+		int general_section = parser.addSection("Options");
+		fn_movie = parser.getOption("--i", "Input EER movie");
+		n_threads = textToInteger(parser.getOption("--j", "Number of threads", "1"));
+		eer_upsampling = textToInteger(parser.getOption("--eer_upsampling", "EER upsampling (1 = physical or 2 = 2x super-resolution)", "1"));
+		eer_grouping = textToInteger(parser.getOption("--eer_grouping", "Number of hardware frames per fraction", "32"));
+		n_repeats = textToInteger(parser.getOption("--repeat", "Number of times to render the movie for each test", "3"));
+
+		if (parser.checkForErrors())
+		{
+			REPORT_ERROR("Errors encountered on the command line (see above), exiting...");
+		}
+	}
+
+	void report(const std::string &label, double seconds, int n_hardware_frames, long long n_electrons)
+	{
+		std::cout << " " << label << ": " << seconds << " s per movie, "
+		          << n_hardware_frames / seconds << " hardware frames/s, "
+		          << n_electrons / seconds / 1e6 << " M electrons/s" << std::endl;
+	}
+
+	void run()
+	{
+		EERRenderer renderer;
+		renderer.read(fn_movie, eer_upsampling);
+
+		const int n_hardware_frames = renderer.getNFrames();
+		const int n_fractions = n_hardware_frames / eer_grouping;
+		if (n_fractions < 1)
+			REPORT_ERROR("The movie has fewer hardware frames than --eer_grouping.");
+
+		std::cout << " Movie: " << fn_movie << " with " << n_hardware_frames << " hardware frames, rendered into "
+		          << n_fractions << " fractions of " << renderer.getWidth() << " x " << renderer.getHeight() << " pixels" << std::endl;
+
+		// The first rendering also reads the movie into memory
+		double t0 = omp_get_wtime();
+		MultidimArray<float> frame;
+		renderer.renderFrames(1, eer_grouping, frame);
+		std::cout << " Reading the movie and rendering the first fraction: " << omp_get_wtime() - t0 << " s" << std::endl;
+
+		std::vector<MultidimArray<float> > fractions(n_fractions);
+		long long n_electrons = 0;
+
+		t0 = omp_get_wtime();
+		for (int repeat = 0; repeat < n_repeats; repeat++)
+		{
+			n_electrons = 0;
+			#pragma omp parallel for num_threads(n_threads) schedule(dynamic) reduction(+:n_electrons)
+			for (int ifraction = 0; ifraction < n_fractions; ifraction++)
+				n_electrons += renderer.renderFrames(ifraction * eer_grouping + 1, (ifraction + 1) * eer_grouping, fractions[ifraction]);
+		}
+		report("One thread per fraction  ", (omp_get_wtime() - t0) / n_repeats, n_fractions * eer_grouping, n_electrons);
+
+		t0 = omp_get_wtime();
+		for (int repeat = 0; repeat < n_repeats; repeat++)
+		{
+			n_electrons = 0;
+			for (int ifraction = 0; ifraction < n_fractions; ifraction++)
+				n_electrons += renderer.renderFrames(ifraction * eer_grouping + 1, (ifraction + 1) * eer_grouping, fractions[ifraction], n_threads);
+		}
+		report("All threads per fraction ", (omp_get_wtime() - t0) / n_repeats, n_fractions * eer_grouping, n_electrons);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	eer_benchmark app;
+
+	try
+	{
+		app.read(argc, argv);
+		app.run();
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE;
+		return RELION_EXIT_FAILURE;
+	}
+
+	return RELION_EXIT_SUCCESS;
+}
@@ -180,6 +180,7 @@ if(do_gpu)
 	int expert_section = parser.addSection("Expert options");
 	verb = textToInteger(parser.getOption("--verb", "Verbosity", "1"));
 	padding = textToInteger(parser.getOption("--pad", "Padding factor for Fourier transforms", "2"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads for the calculation of the probability-ratio maps on the CPU", "1"));
 	random_seed = textToInteger(parser.getOption("--random_seed", "Number for the random seed generator", "1"));
 	workFrac = textToFloat(parser.getOption("--shrink", "Reduce micrograph to this fraction size, during correlation calc (saves memory and time)", "1.0"));
 	LoG_max_search = textToFloat(parser.getOption("--Log_max_search", "Maximum diameter in LoG-picking multi-scale approach is this many times the min/max diameter", "5."));
@@ -525,38 +526,50 @@ void AutoPicker::initialise(int rank)
 			MultidimArray<RFLOAT> dummy;
    			int lowpass_size = 2 * CEIL(my_ori_size * angpix_ref / lowpass);
 			projector.computeFourierTransformMap(Istk(), dummy, lowpass_size);
-			MultidimArray<RFLOAT> Mref(my_ori_size, my_ori_size);
-			MultidimArray<Complex> Fref;
-			FourierTransformer transformer;
-			transformer.setReal(Mref);
-			transformer.getFourierAlias(Fref);
-
+			// Calculate the projections in Fourier space, and transform them back in batches of directions
+			const long int nr_dirs = sampling.NrDirections();
+			const long int batch_size = 64;
+			MultidimArray<Complex> Fref(my_ori_size, my_ori_size/2 + 1), Fprojs;
+			MultidimArray<RFLOAT> Mref, Mprojs;
 			Image<RFLOAT> Iprojs;
 			FileName fn_img, fn_proj = fn_odir + "reference_projections.mrcs";
-			for (long int idir = 0; idir < sampling.NrDirections(); idir++)
+			for (long int first_dir = 0; first_dir < nr_dirs; first_dir += batch_size)
 			{
-				RFLOAT rot = sampling.rot_angles[idir];
-				RFLOAT tilt = sampling.tilt_angles[idir];
-				Matrix2D<RFLOAT> A;
-
-				Euler_angles2matrix(rot, tilt, 0., A, false);
-				Fref.initZeros();
-				projector.get2DFourierTransform(Fref, A);
-				// Shift the image back to the center...
-				CenterFFTbySign(Fref);
-				transformer.inverseFourierTransform();
-				Mref.setXmippOrigin();
-				Mrefs.push_back(Mref);
+				const long int nr_batch = XMIPP_MIN(batch_size, nr_dirs - first_dir);
+				Fprojs.resize(nr_batch, 1, my_ori_size, my_ori_size/2 + 1);
+				Mprojs.resize(nr_batch, 1, my_ori_size, my_ori_size);
 
-				if (verb > 0)
+				for (long int i = 0; i < nr_batch; i++)
 				{
-					// Also write out a stack with the 2D reference projections
-					Iprojs()=Mref;
-					fn_img.compose(idir+1,fn_proj);
-					if (idir == 0)
-						Iprojs.write(fn_img, -1, false, WRITE_OVERWRITE);
-					else
-						Iprojs.write(fn_img, -1, false, WRITE_APPEND);
+					RFLOAT rot = sampling.rot_angles[first_dir + i];
+					RFLOAT tilt = sampling.tilt_angles[first_dir + i];
+					Matrix2D<RFLOAT> A;
+
+					Euler_angles2matrix(rot, tilt, 0., A, false);
+					Fref.initZeros();
+					projector.get2DFourierTransform(Fref, A);
+					// Shift the image back to the center...
+					CenterFFTbySign(Fref);
+					Fprojs.setImage(i, Fref);
+				}
+				FourierTransformer::inverseFourierTransformStack(Fprojs, Mprojs, false);
+
+				for (long int i = 0; i < nr_batch; i++)
+				{
+					Mprojs.getImage(i, Mref);
+					Mref.setXmippOrigin();
+					Mrefs.push_back(Mref);
+
+					if (verb > 0)
+					{
+						// Also write out a stack with the 2D reference projections
+						Iprojs() = Mref;
+						fn_img.compose(first_dir + i + 1, fn_proj);
+						if (first_dir + i == 0)
+							Iprojs.write(fn_img, -1, false, WRITE_OVERWRITE);
+						else
+							Iprojs.write(fn_img, -1, false, WRITE_APPEND);
+					}
 				}
 			}
 		}
@@ -3386,7 +3399,7 @@ void AutoPicker::autoPickLoGOneMicrograph(FileName &fn_mic, long int imic)
 void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 {
 	Image<RFLOAT> Imic;
-	MultidimArray<Complex > Faux, Faux2, Fmic;
+	MultidimArray<Complex > Faux, Faux2, Fmic, Fmic_ctf;
 	MultidimArray<RFLOAT> Maux, Mstddev, Mmean, Mstddev2, Mavg, Mdiff2, MsumX2, Mccf_best, Mpsi_best, Fctf, Mccf_best_combined, Mpsi_best_combined;
 	MultidimArray<int> Mclass_best_combined;
 	FourierTransformer transformer;
@@ -3599,6 +3612,17 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 		windowFourierTransform(Fmic, Faux, downsize_mic);
 		Fmic = Faux;
 
+		// The CTF is real, so correlating the micrograph with the CTF-multiplied references is the same as correlating
+		// the CTF-multiplied micrograph with the references: multiply the micrograph once, instead of every reference and psi
+		Fmic_ctf = Fmic;
+		if (do_ctf)
+		{
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fmic_ctf)
+			{
+				DIRECT_MULTIDIM_ELEM(Fmic_ctf, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+			}
+		}
+
 	}// end if do_read_fom_maps
 #ifdef TIMING
 	timer.toc(TIMING_B1);
@@ -3679,34 +3703,17 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 #ifdef TIMING
 			timer.tic(TIMING_B3);
 #endif
-			Mccf_best.initConstant(-LARGE_NUMBER);
-			bool is_first_psi = true;
-			for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
+			// The expected ratio of probabilities for this (ctf-corrected) reference, and the sum_ref_under_circ_mask
+			// and sum_ref_under_circ_mask2, are calculated from the reference at the first psi angle
 			{
-				// Get the Euler matrix
+				// Get the FT of the (non-ctf-corrected) template at psi = 0
 				Matrix2D<RFLOAT> A(3,3);
-				Euler_angles2matrix(0., 0., psi, A);
-
-				// Now get the FT of the rotated (non-ctf-corrected) template
+				Euler_angles2matrix(0., 0., 0., A);
 				Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
 				PPref[iref].get2DFourierTransform(Faux, A);
 
-#ifdef DEBUG
-				std::cerr << " psi= " << psi << std::endl;
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				tt().resize(micrograph_size, micrograph_size);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mref_rot.spi");
-
-				windowFourierTransform(Fmic, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mmic.spi");
-
-#endif
 #ifdef TIMING
-	timer.tic(TIMING_B4);
+				timer.tic(TIMING_B4);
 #endif
 				// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
 				if (do_ctf)
@@ -3715,141 +3722,172 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 					{
 						DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
 					}
-#ifdef TIMING
-	timer.toc(TIMING_B4);
-#endif
-#ifdef DEBUG
-				MultidimArray<RFLOAT> ttt(micrograph_size, micrograph_size);
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, ttt);
-				ttt.setXmippOrigin();
-				tt().resize(particle_size, particle_size);
-				tt().setXmippOrigin();
-				FOR_ALL_ELEMENTS_IN_ARRAY2D(tt())
-				{
-					A2D_ELEM(tt(), i, j) = A2D_ELEM(ttt, i, j);
 				}
-				tt.write("Mref_rot_ctf.spi");
+#ifdef TIMING
+				timer.toc(TIMING_B4);
 #endif
-				}
 
-				if (is_first_psi)
-				{
 #ifdef TIMING
-	timer.tic(TIMING_B5);
+				timer.tic(TIMING_B5);
 #endif
-					// Calculate the expected ratio of probabilities for this CTF-corrected reference
-					// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
-					// Do this also if we're not recalculating the fom maps...
-					// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
-					windowFourierTransform(Faux, Faux2, micrograph_size);
-					CenterFFTbySign(Faux2);
-					Maux.resize(micrograph_size, micrograph_size);
-					transformer.inverseFourierTransform(Faux2, Maux);
-					Maux.setXmippOrigin();
+				// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
+				windowFourierTransform(Faux, Faux2, micrograph_size);
+				CenterFFTbySign(Faux2);
+				Maux.resize(micrograph_size, micrograph_size);
+				transformer.inverseFourierTransform(Faux2, Maux);
+				Maux.setXmippOrigin();
 #ifdef DEBUG
-					Image<RFLOAT> ttt;
-					ttt()=Maux;
-					ttt.write("Maux.spi");
+				Image<RFLOAT> ttt;
+				ttt()=Maux;
+				ttt.write("Maux.spi");
 #endif
-					sum_ref_under_circ_mask = 0.;
-					sum_ref2_under_circ_mask = 0.;
-					RFLOAT suma2 = 0.;
-					RFLOAT sumn = 1.;
-					MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
-					Mctfref.setXmippOrigin();
-					FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
+				sum_ref_under_circ_mask = 0.;
+				sum_ref2_under_circ_mask = 0.;
+				RFLOAT suma2 = 0.;
+				RFLOAT sumn = 1.;
+				MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
+				Mctfref.setXmippOrigin();
+				FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
+				{
+					if (i*i + j*j < particle_radius2)
 					{
-						if (i*i + j*j < particle_radius2)
-						{
-							suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
-							sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
-							sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							sumn += 1.;
-						}
+						suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+						suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
+						sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
+						sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+						sumn += 1.;
+					}
 #ifdef DEBUG
-						A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
+					A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
 #endif
-					}
-					sum_ref_under_circ_mask /= sumn;
-					sum_ref2_under_circ_mask /= sumn;
-					expected_Pratio = exp(suma2 / (2. * sumn));
+				}
+				sum_ref_under_circ_mask /= sumn;
+				sum_ref2_under_circ_mask /= sumn;
+				expected_Pratio = exp(suma2 / (2. * sumn));
 #ifdef DEBUG
-					std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
-					tt()=Mctfref;
-					tt.write("Mctfref.spi");
-					std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
-					std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
-					std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
-					std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
-					std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
+				std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
+				tt()=Mctfref;
+				tt.write("Mctfref.spi");
+				std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
+				std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
+				std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
+				std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
+				std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
 #endif
 
-					// Maux goes back to the workSize
-					Maux.resize(workSize, workSize);
+				// Maux goes back to the workSize
+				Maux.resize(workSize, workSize);
 #ifdef TIMING
-					timer.toc(TIMING_B5);
+				timer.toc(TIMING_B5);
 #endif
-				}
+			}
+
+			// Now calculate the cross-correlations for all psi angles in parallel.
+			// Each thread keeps track of the best values and their psi angles in its own maps, which are combined afterwards
+			// such that the first psi angle with the best value is kept, just as in a serial loop over psi.
+			std::vector<RFLOAT> psis;
+			for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
+				psis.push_back(psi);
 
 #ifdef TIMING
-				timer.tic(TIMING_B6);
+			timer.tic(TIMING_B6);
 #endif
-				// Now multiply template and micrograph to calculate the cross-correlation
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+			Mccf_best.initConstant(-LARGE_NUMBER);
+			RelionError *thread_error = NULL;
+			#pragma omp parallel num_threads(nr_threads)
+			{
+				// Three maps per thread: the cross-correlation of the current psi, and the best values and their psi angles
+				MultidimArray<Complex> Fref, Fcc;
+				MultidimArray<RFLOAT> Mcc(workSize, workSize), Mccf_thread(workSize, workSize), Mpsi_thread(workSize, workSize);
+				FourierTransformer thread_transformer;
+				Mccf_thread.initConstant(-LARGE_NUMBER);
+
+				#pragma omp for schedule(dynamic)
+				for (int ipsi = 0; ipsi < psis.size(); ipsi++)
 				{
-					DIRECT_MULTIDIM_ELEM(Faux, n) = conj(DIRECT_MULTIDIM_ELEM(Faux, n)) * DIRECT_MULTIDIM_ELEM(Fmic, n);
-				}
+					if (thread_error != NULL)
+						continue;
 
-				// If we're not doing shrink, then Faux is bigger than Faux2!
-				windowFourierTransform(Faux, Faux2, workSize);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, Maux);
-#ifdef DEBUG
-				tt()=Maux*normfft;
-				tt.write("Mcc.spi");
-#endif
+					try
+					{
+						RFLOAT psi = psis[ipsi];
+
+						// Get the Euler matrix
+						Matrix2D<RFLOAT> A(3,3);
+						Euler_angles2matrix(0., 0., psi, A);
+
+						// Now get the FT of the rotated template
+						Fref.initZeros(downsize_mic, downsize_mic/2 + 1);
+						PPref[iref].get2DFourierTransform(Fref, A);
+
+						// Now multiply template and (CTF-multiplied) micrograph to calculate the cross-correlation
+						FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fref)
+						{
+							DIRECT_MULTIDIM_ELEM(Fref, n) = conj(DIRECT_MULTIDIM_ELEM(Fref, n)) * DIRECT_MULTIDIM_ELEM(Fmic_ctf, n);
+						}
 
-				// Calculate ratio of prabilities P(ref)/P(zero)
-				// Keep track of the best values and their corresponding iref and psi
+						// If we're not doing shrink, then Fref is bigger than Fcc!
+						windowFourierTransform(Fref, Fcc, workSize);
+						CenterFFTbySign(Fcc);
+						thread_transformer.inverseFourierTransform(Fcc, Mcc);
 
-				// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
-				// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Maux)
+						// Calculate ratio of prabilities P(ref)/P(zero)
+						// Keep track of the best values and their corresponding psi
+
+						// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
+						// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
+						FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mcc)
+						{
+							RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Mcc, n);
+							diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
+							if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
+								diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
+							diff2 += sum_ref2_under_circ_mask;
+							diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
+
+							// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
+							diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
+							if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_thread, n))
+							{
+								DIRECT_MULTIDIM_ELEM(Mccf_thread, n) = diff2;
+								DIRECT_MULTIDIM_ELEM(Mpsi_thread, n) = psi;
+							}
+						}
+					}
+					catch (RelionError XE)
+					{
+						#pragma omp critical(AutoPicker_thread_error)
+						{
+							if (thread_error == NULL)
+								thread_error = new RelionError(XE);
+						}
+					}
+				} // end for psi
+
+				#pragma omp critical(AutoPicker_best_ccf)
 				{
-					RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Maux, n);
-					diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
-					if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
-						diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
-					diff2 += sum_ref2_under_circ_mask;
-					diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
-
-					// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
-					diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
-#ifdef DEBUG
-					DIRECT_MULTIDIM_ELEM(Maux, n) = diff2;
-#endif
-					if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mccf_thread)
 					{
-						DIRECT_MULTIDIM_ELEM(Mccf_best, n) = diff2;
-						DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi;
+						RFLOAT ccf = DIRECT_MULTIDIM_ELEM(Mccf_thread, n);
+						RFLOAT best = DIRECT_MULTIDIM_ELEM(Mccf_best, n);
+						if (ccf > best || (ccf == best && ccf > -LARGE_NUMBER && DIRECT_MULTIDIM_ELEM(Mpsi_thread, n) < DIRECT_MULTIDIM_ELEM(Mpsi_best, n)))
+						{
+							DIRECT_MULTIDIM_ELEM(Mccf_best, n) = ccf;
+							DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = DIRECT_MULTIDIM_ELEM(Mpsi_thread, n);
+						}
 					}
 				}
-#ifdef DEBUG
-				std::cerr << " Maux.computeMax()= " << Maux.computeMax() << std::endl;
-				tt()=Maux;
-				tt.write("Mccf.spi");
-			    std::cerr << " Press any key to continue... "  << std::endl;
-			    char c;
-			    std::cin >> c;
-#endif
-			    is_first_psi = false;
+			}
+
+			if (thread_error != NULL)
+			{
+				RelionError XE(*thread_error);
+				delete thread_error;
+				throw XE;
+			}
 #ifdef TIMING
-	timer.toc(TIMING_B6);
+			timer.toc(TIMING_B6);
 #endif
-			} // end for psi
 #ifdef TIMING
 	timer.toc(TIMING_B3);
 #endif
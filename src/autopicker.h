@@ -148,6 +148,9 @@ public:
 	// Padding to use for Projectors
 	int padding;
 
+	// Number of threads for the calculation of the probability-ratio maps (over psi angles) on the CPU
+	int nr_threads;
+
 	// Maxmimum value in the Gaussian blob reference
 	RFLOAT gauss_max_value;
 
@@ -25,6 +25,7 @@
  */
 
 #include "src/backprojector.h"
+#include "src/performance_trace.h"
 
 #ifdef TIMING
 	#define RCTIC(timer,label) (timer.tic(label))
@@ -1386,6 +1387,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
                                 bool printTimes,
                                 Image<RFLOAT>* weight_out)
 {
+	TraceSpan trace_span("reconstruct");
 #ifdef TIMING
 	Timer ReconTimer;
 	int ReconS_1 = ReconTimer.setNew(" RcS1_Init ");
@@ -2001,6 +2003,7 @@ void BackProjector::reconstructGrad(
 		bool use_fsc,
 		bool printTimes)
 {
+	TraceSpan trace_span("reconstruct");
 	const int max_r2 = ROUND(r_max * padding_factor) * ROUND(r_max * padding_factor);
 	RFLOAT oversampling_correction = (ref_dim == 3) ? (padding_factor * padding_factor * padding_factor) : (padding_factor * padding_factor);
 
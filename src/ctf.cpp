@@ -48,6 +48,7 @@
 #include "src/metadata_table.h"
 #include <src/jaz/single_particle/obs_model.h>
 #include <src/jaz/gravis/t2Matrix.h>
+#include <tuple>
 
 using namespace gravis;
 
@@ -310,6 +311,101 @@ t2Vector<RFLOAT> CTF::getGammaGrad(RFLOAT X, RFLOAT Y) const
 	                        2.0 * K1 * Ayy * Y + 2.0 * K1 * Axy * X + 4.0 * K2 * u2 * Y);
 }
 
+/* Frequency tables ------------------------------------------------------------------- */
+namespace
+{
+	typedef std::tuple<int, int, RFLOAT, RFLOAT, RFLOAT, RFLOAT, RFLOAT, RFLOAT> CtfFrequencyTableKey;
+
+	std::map<CtfFrequencyTableKey, std::shared_ptr<CtfFrequencyTable> > ctf_frequency_tables;
+
+	// Memory taken by the cached tables, and the maximum before the cache is cleared
+	size_t ctf_frequency_tables_bytes = 0;
+	const size_t max_ctf_frequency_tables_bytes = (size_t)1 << 30;
+	bool ctf_frequency_tables_warned = false;
+}
+
+std::shared_ptr<const CtfFrequencyTable> CtfFrequencyTable::get(int xdim, int ydim, RFLOAT xs, RFLOAT ys, const Matrix2D<RFLOAT>* M)
+{
+	CtfFrequencyTableKey key = (M == NULL) ?
+		CtfFrequencyTableKey(xdim, ydim, xs, ys, 1., 0., 0., 1.) :
+		CtfFrequencyTableKey(xdim, ydim, xs, ys, (*M)(0,0), (*M)(0,1), (*M)(1,0), (*M)(1,1));
+
+	std::shared_ptr<CtfFrequencyTable> table;
+	#pragma omp critical(CtfFrequencyTable_get)
+	{
+		std::map<CtfFrequencyTableKey, std::shared_ptr<CtfFrequencyTable> >::iterator it = ctf_frequency_tables.find(key);
+		if (it == ctf_frequency_tables.end())
+		{
+			// xx, xy, yy, u2 and inv_d0
+			const size_t bytes = 5 * (size_t)xdim * ydim * sizeof(RFLOAT);
+			if (!ctf_frequency_tables.empty() && ctf_frequency_tables_bytes + bytes > max_ctf_frequency_tables_bytes)
+			{
+				if (!ctf_frequency_tables_warned)
+				{
+					std::cerr << "Warning: the CTF frequency tables take more than "
+					          << (max_ctf_frequency_tables_bytes >> 20) << " MB. They will be recalculated"
+					          << " whenever the cache is full, which slows down the CTF calculations." << std::endl;
+					ctf_frequency_tables_warned = true;
+				}
+
+				ctf_frequency_tables.clear();
+				ctf_frequency_tables_bytes = 0;
+			}
+
+			table = std::make_shared<CtfFrequencyTable>();
+			table->initialise(xdim, ydim, xs, ys, M);
+			ctf_frequency_tables[key] = table;
+			ctf_frequency_tables_bytes += bytes;
+		}
+		else
+		{
+			table = it->second;
+		}
+	}
+
+	return table;
+}
+
+void CtfFrequencyTable::initialise(int _xdim, int _ydim, RFLOAT xs, RFLOAT ys, const Matrix2D<RFLOAT>* M)
+{
+	xdim = _xdim;
+	ydim = _ydim;
+
+	const size_t size = (size_t)xdim * ydim;
+	xx.resize(size);
+	xy.resize(size);
+	yy.resize(size);
+	u2.resize(size);
+	inv_d0.resize(size);
+
+	for (int i = 0; i < ydim; i++)
+	for (int j = 0; j < xdim; j++)
+	{
+		// Same frequencies as FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D
+		const int ip = (i < xdim) ? i : i - ydim;
+		RFLOAT X = (RFLOAT)j / xs;
+		RFLOAT Y = (RFLOAT)ip / ys;
+
+		if (M != NULL)
+		{
+			RFLOAT Xd = (*M)(0,0) * X + (*M)(0,1) * Y;
+			RFLOAT Yd = (*M)(1,0) * X + (*M)(1,1) * Y;
+
+			X = Xd;
+			Y = Yd;
+		}
+
+		const size_t n = (size_t)i * xdim + j;
+		xx[n] = X * X;
+		xy[n] = X * Y;
+		yy[n] = Y * Y;
+		u2[n] = X * X + Y * Y;
+
+		// Niko Grigorieff's formulae, as in CTF::getCTF (1/d0 is 0 at the origin)
+		inv_d0[n] = 1. / (0.245 * pow(u2[n], -0.8325) + 2.81);
+	}
+}
+
 /* Generate a complete CTF Image ------------------------------------------------------ */
 void CTF::getFftwImage(MultidimArray<RFLOAT> &result, int orixdim, int oriydim, RFLOAT angpix,
                        bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak,
@@ -400,6 +496,31 @@ void CTF::getFftwImage(MultidimArray<RFLOAT> &result, int orixdim, int oriydim,
 		RFLOAT xs = (RFLOAT)orixdim * angpix;
 		RFLOAT ys = (RFLOAT)oriydim * angpix;
 
+		// The frequency terms are the same for all particles in an optics group: only the
+		// particle-dependent terms are evaluated here, in simple loops over all pixels that
+		// the compiler can vectorise (including sin and exp, where the math library allows)
+		const bool has_mag = (obsModel != 0 && obsModel->hasMagMatrices);
+		Matrix2D<RFLOAT> M;
+		if (has_mag)
+			M = obsModel->getMagMatrix(opticsGroup);
+		std::shared_ptr<const CtfFrequencyTable> table = CtfFrequencyTable::get(XSIZE(result), YSIZE(result), xs, ys, has_mag ? &M : NULL);
+
+		const long int size = YXSIZE(result);
+		RFLOAT* dest = MULTIDIM_ARRAY(result);
+		const RFLOAT* xx = table->xx.data();
+		const RFLOAT* xy = table->xy.data();
+		const RFLOAT* yy = table->yy.data();
+		const RFLOAT* u2 = table->u2.data();
+
+		const RFLOAT Kxx = K1 * Axx, Kxy = K1 * 2.0 * Axy, Kyy = K1 * Ayy;
+		const RFLOAT Kconst = - K5 - K3;
+
+		// Gamma
+		for (long int n = 0; n < size; n++)
+		{
+			dest[n] = Kxx * xx[n] + Kxy * xy[n] + Kyy * yy[n] + K2 * u2[n] * u2[n] + Kconst;
+		}
+
 		if (obsModel != 0 && obsModel->hasEvenZernike)
 		{
 			if (orixdim != oriydim)
@@ -425,30 +546,80 @@ void CTF::getFftwImage(MultidimArray<RFLOAT> &result, int orixdim, int oriydim,
 			const BufferedImage<RFLOAT>& gammaOffset = obsModel->getGammaOffset(opticsGroup, oriydim);
 
 			for (int y1 = 0; y1 < result.ydim; y1++)
-			for (int x1 = 0; x1 < result.xdim; x1++)
 			{
-				RFLOAT x = x1 / xs;
-				RFLOAT y = y1 <= result.ydim/2? y1 / ys : (y1 - result.ydim) / ys;
-
-				const int x0 = x1;
 				const int y0 = y1 <= result.ydim/2? y1 : gammaOffset.ydim + y1 - result.ydim;
+				RFLOAT* dest_row = dest + (long int)y1 * result.xdim;
 
-				DIRECT_A2D_ELEM(result, y1, x1) = getCTF(
-					x, y, do_abs, do_only_flip_phases,
-					do_intact_until_first_peak, do_damping,
-					gammaOffset(x0,y0), do_intact_after_first_peak);
+				for (int x1 = 0; x1 < result.xdim; x1++)
+				{
+					dest_row[x1] += gammaOffset(x1,y0);
+				}
+			}
+		}
+
+		// -sin(gamma), or 1 where the CTF is left intact
+		if (do_intact_until_first_peak || do_intact_after_first_peak)
+		{
+			for (long int n = 0; n < size; n++)
+			{
+				const RFLOAT gamma = dest[n];
+				const bool intact = (do_intact_until_first_peak && ABS(gamma) < PI/2.) ||
+				                    (do_intact_after_first_peak && ABS(gamma) > PI/2.);
+				dest[n] = intact ? 1. : -sin(gamma);
 			}
 		}
 		else
 		{
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(result)
+			for (long int n = 0; n < size; n++)
 			{
-				RFLOAT x = (RFLOAT)jp / xs;
-				RFLOAT y = (RFLOAT)ip / ys;
+				dest[n] = -sin(dest[n]);
+			}
+		}
 
-				DIRECT_A2D_ELEM(result, i, j) = getCTF(x, y, do_abs, do_only_flip_phases,
-				                                       do_intact_until_first_peak, do_damping, 0.0, do_intact_after_first_peak);
+		if (do_damping)
+		{
+			if (dose >= 0.)
+			{
+				const RFLOAT* inv_d0 = table->inv_d0.data();
+				const RFLOAT half_dose = 0.5 * dose;
+
+				for (long int n = 0; n < size; n++)
+				{
+					dest[n] *= exp(-half_dose * inv_d0[n]);
+				}
 			}
+			else
+			{
+				// B-factor decay (K4 = -Bfac/4)
+				for (long int n = 0; n < size; n++)
+				{
+					dest[n] *= exp(K4 * u2[n]);
+				}
+			}
+		}
+
+		for (long int n = 0; n < size; n++)
+		{
+			RFLOAT ctf = dest[n];
+
+			if (do_abs)
+			{
+				ctf = ABS(ctf);
+			}
+			else if (do_only_flip_phases)
+			{
+				ctf = (ctf < 0.) ? -1. : 1.;
+			}
+
+			ctf *= scale;
+
+			// Don't allow very small values of CTF to prevent division by zero in GPU code (as in getCTF)
+			if (fabs(ctf) < 1e-8)
+			{
+				ctf = SGN(ctf) * 1e-8;
+			}
+
+			dest[n] = ctf;
 		}
 	}
 }
@@ -51,8 +51,38 @@
 #include <src/jaz/image/buffered_image.h>
 #include <src/jaz/gravis/t2Vector.h>
 #include <map>
+#include <memory>
 
 
+/* The frequency terms of an FFTW-format CTF image that do not depend on the particle:
+ * they only depend on the size of the image, its pixel size and the anisotropic
+ * magnification of its optics group. They are calculated once, and shared (also between
+ * threads) by all CTF images of that size. The cache is cleared when its tables would take
+ * more than 1 GB; tables that are still in use stay alive until they are released.
+ */
+class CtfFrequencyTable
+{
+public:
+
+	// Size of the (FFTW-format) CTF images
+	int xdim, ydim;
+
+	/* For every pixel (in the order of the image): X^2, XY and Y^2 (after magnification),
+	 * u^2 = X^2 + Y^2 (in 1/A^2), and 1/d0 for the exposure filter (Grant & Grigorieff, 2015)
+	 */
+	std::vector<RFLOAT> xx, xy, yy, u2, inv_d0;
+
+	/* Get the (cached) table for images of xdim x ydim with frequencies (jp/xs, ip/ys),
+	 * with xs and ys the size of the original image in Angstroms
+	 * M is the magnification matrix, or NULL for none.
+	 */
+	static std::shared_ptr<const CtfFrequencyTable> get(int xdim, int ydim, RFLOAT xs, RFLOAT ys, const Matrix2D<RFLOAT>* M = NULL);
+
+private:
+
+	void initialise(int xdim, int ydim, RFLOAT xs, RFLOAT ys, const Matrix2D<RFLOAT>* M);
+};
+
 class CTF
 {
 protected:
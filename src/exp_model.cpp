@@ -18,9 +18,121 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/exp_model.h"
+#include "src/float16.h"
+#include "src/particle_job_scheduler.h"
 #include <sys/statvfs.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 using namespace gravis;
 
+// Precedes the data of a compressed pre-read image (see setPrereadImage)
+struct PrereadImageHeader
+{
+	int codec;
+	long int xdim, ydim, zdim;
+	long int xinit, yinit, zinit;
+};
+
+void Experiment::setPrereadImage(long int part_id, const MultidimArray<float> &img)
+{
+	ExpParticle &particle = particles[part_id];
+
+	if (preread_compression == PREREAD_FLOAT32)
+	{
+		particle.img = img;
+		return;
+	}
+
+	// Store the values in half precision, first all low bytes, then all high bytes.
+	// The high bytes (sign and exponent) vary little, so this byte-shuffling helps the compression below.
+	const size_t n = MULTIDIM_SIZE(img);
+	std::vector<unsigned char> shuffled(2 * n);
+	for (size_t i = 0; i < n; i++)
+	{
+		const float16 h = float2half(img.data[i]);
+		shuffled[i] = h & 0xff;
+		shuffled[n + i] = h >> 8;
+	}
+
+	PrereadImageHeader header;
+	header.codec = PREREAD_FLOAT16;
+	header.xdim = XSIZE(img);
+	header.ydim = YSIZE(img);
+	header.zdim = ZSIZE(img);
+	header.xinit = STARTINGX(img);
+	header.yinit = STARTINGY(img);
+	header.zinit = STARTINGZ(img);
+
+	const unsigned char* data = shuffled.data();
+	size_t size = shuffled.size();
+
+#ifdef HAVE_ZLIB
+	std::vector<unsigned char> compressed;
+	if (preread_compression == PREREAD_FLOAT16_LZ)
+	{
+		uLongf compressed_size = compressBound(size);
+		compressed.resize(compressed_size);
+		if (compress2(compressed.data(), &compressed_size, data, size, Z_BEST_SPEED) == Z_OK && compressed_size < size)
+		{
+			header.codec = PREREAD_FLOAT16_LZ;
+			data = compressed.data();
+			size = compressed_size;
+		}
+	}
+#endif
+
+	particle.img_packed.resize(sizeof(header) + size);
+	memcpy(particle.img_packed.data(), &header, sizeof(header));
+	memcpy(particle.img_packed.data() + sizeof(header), data, size);
+}
+
+void Experiment::getPrereadImage(long int part_id, MultidimArray<RFLOAT> &img) const
+{
+	const ExpParticle &particle = particles[part_id];
+
+	if (particle.img_packed.size() == 0)
+	{
+		img.reshape(particle.img);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(particle.img)
+		{
+			DIRECT_MULTIDIM_ELEM(img, n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(particle.img, n);
+		}
+		return;
+	}
+
+	PrereadImageHeader header;
+	memcpy(&header, particle.img_packed.data(), sizeof(header));
+
+	img.resize(header.zdim, header.ydim, header.xdim);
+	STARTINGX(img) = header.xinit;
+	STARTINGY(img) = header.yinit;
+	STARTINGZ(img) = header.zinit;
+
+	const size_t n = MULTIDIM_SIZE(img);
+	const unsigned char* shuffled = particle.img_packed.data() + sizeof(header);
+
+	std::vector<unsigned char> buffer;
+	if (header.codec == PREREAD_FLOAT16_LZ)
+	{
+#ifdef HAVE_ZLIB
+		buffer.resize(2 * n);
+		uLongf size = buffer.size();
+		if (uncompress(buffer.data(), &size, shuffled, particle.img_packed.size() - sizeof(header)) != Z_OK || size != 2 * n)
+			REPORT_ERROR("Experiment::getPrereadImage: cannot decompress the image of particle " + particle.name);
+		shuffled = buffer.data();
+#else
+		REPORT_ERROR("Experiment::getPrereadImage: BUG: compressed image without zlib support");
+#endif
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		const float16 h = shuffled[i] | (shuffled[n + i] << 8);
+		img.data[i] = half2float(h);
+	}
+}
+
 long int Experiment::numberOfParticles(int random_subset)
 {
 	if (random_subset == 0)
@@ -450,6 +562,44 @@ void Experiment::randomiseParticlesOrder(int seed, bool do_split_random_halves,
 	}
 }
 
+void Experiment::groupParticlesByStack(long int first, long int last, int nr_blocks)
+{
+	if (nr_blocks < 1 || last < first)
+		return;
+
+	std::vector<FileName> fn_stacks(last - first + 1);
+	for (long int i = first; i <= last; i++)
+	{
+		long int dump;
+		particles[sorted_idx[i]].name.decompose(dump, fn_stacks[i - first]);
+	}
+
+	// Sort positions in the range rather than particle ids, as the stack names are stored per position
+	std::vector<long int> order(last - first + 1), grouped_idx(last - first + 1);
+	for (long int i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	for (int iblock = 0; iblock < nr_blocks; iblock++)
+	{
+		long int block_first = ParticleJobScheduler::blockStart(first, last, iblock, nr_blocks) - first;
+		long int block_end = ParticleJobScheduler::blockStart(first, last, iblock + 1, nr_blocks) - first;
+		std::stable_sort(order.begin() + block_first, order.begin() + block_end,
+			[&](long int a, long int b)
+			{
+				const int og_a = particles[sorted_idx[first + a]].optics_group;
+				const int og_b = particles[sorted_idx[first + b]].optics_group;
+				if (og_a != og_b)
+					return og_a < og_b;
+				return fn_stacks[a] < fn_stacks[b];
+			});
+	}
+
+	for (long int i = 0; i < order.size(); i++)
+		grouped_idx[i] = sorted_idx[first + order[i]];
+	for (long int i = 0; i < order.size(); i++)
+		sorted_idx[first + i] = grouped_idx[i];
+}
+
 void Experiment::initialiseBodies(int _nr_bodies)
 {
 	if (_nr_bodies < 2)
@@ -1032,7 +1182,7 @@ bool Experiment::read(FileName fn_exp, FileName fn_tomo, FileName fn_motion,
                 if (is_tomo || is_3D)
                 {
                     img.read(img_name);
-                    particles[part_id].img = img();
+                    setPrereadImage(part_id, img());
                 }
                 else
                 {
@@ -1044,7 +1194,7 @@ bool Experiment::read(FileName fn_exp, FileName fn_tomo, FileName fn_motion,
                     }
                     img.readFromOpenFile(img_name, hFile, -1, false);
                     img().setXmippOrigin();
-                    particles[part_id].img = img();
+                    setPrereadImage(part_id, img());
     			}
             }
 
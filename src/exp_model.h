@@ -89,6 +89,14 @@ public:
 	}
 };
 
+// How the images of --preread_images are kept in RAM
+enum PrereadCompression
+{
+	PREREAD_FLOAT32,    // as they were read
+	PREREAD_FLOAT16,    // in half precision: half the memory
+	PREREAD_FLOAT16_LZ  // in half precision, byte-shuffled and compressed losslessly with zlib
+};
+
 class ExpParticle
 {
 public:
@@ -102,6 +110,9 @@ public:
     // Pre-read array of the image in RAM
     MultidimArray<float> img;
 
+    // Or the pre-read image in compressed form (see Experiment::setPrereadImage)
+    std::vector<unsigned char> img_packed;
+
     // Which tomogram does this particle belong to
     int tomogram_id;
 
@@ -132,6 +143,7 @@ public:
         id = copy.id;
         name = copy.name;
         img = copy.img;
+        img_packed = copy.img_packed;
         tomogram_id = copy.tomogram_id;
         group_id = copy.group_id;
         random_subset = copy.random_subset;
@@ -146,6 +158,7 @@ public:
         id = copy.id;
         name = copy.name;
         img = copy.img;
+        img_packed = copy.img_packed;
         tomogram_id = copy.tomogram_id;
         group_id = copy.group_id;
         random_subset = copy.random_subset;
@@ -247,8 +260,12 @@ public:
 	// Is this sub-tomograms?
 	bool is_tomo, is_3D;
 
+	// How to keep pre-read images in RAM (this is not reset by clear())
+	PrereadCompression preread_compression;
+
 	// Empty Constructor
 	Experiment()
+	: preread_compression(PREREAD_FLOAT32)
 	{
 		clear();
 	}
@@ -278,6 +295,12 @@ public:
 		MDimg.setName("images");
 	}
 
+	// Keep a pre-read image of a particle in RAM, compressed according to preread_compression
+	void setPrereadImage(long int part_id, const MultidimArray<float> &img);
+
+	// Get the pre-read image of a particle (decompressing it if necessary); this is thread-safe
+	void getPrereadImage(long int part_id, MultidimArray<RFLOAT> &img) const;
+
 	// Calculate the total number of particles in this experiment
 	long int numberOfParticles(int random_subset = 0);
 
@@ -346,6 +369,12 @@ public:
 	// Randomise the order of the particles
 	void randomiseParticlesOrder(int seed, bool do_split_random_halves = false, int subsets_size = -1);
 
+	/* Divide the particles first..last (in sorted order) into nr_blocks blocks (see ParticleJobScheduler::blockStart),
+	 * and sort the particles inside each block on their optics group and then on the stack they are in,
+	 * so that whoever processes a block reads its stacks one after the other
+	 */
+	void groupParticlesByStack(long int first, long int last, int nr_blocks);
+
 	// Make sure the images inside each particle are in the right order
 	void orderImagesInParticles();
 
@@ -48,6 +48,7 @@
 #include "src/args.h"
 #include <string.h>
 #include <math.h>
+#include <map>
 
 //#define TIMING_FFTW
 #ifdef TIMING_FFTW
@@ -66,6 +67,235 @@
 
 //#define DEBUG_PLANS
 
+// Plan cache --------------------------------------------------------------
+namespace
+{
+	struct PlanKey
+	{
+		int type, sign, howmany, in_alignment, out_alignment;
+		bool in_place;
+		std::vector<int> n;
+
+		bool operator<(const PlanKey &other) const
+		{
+			if (type != other.type) return type < other.type;
+			if (sign != other.sign) return sign < other.sign;
+			if (howmany != other.howmany) return howmany < other.howmany;
+			if (in_alignment != other.in_alignment) return in_alignment < other.in_alignment;
+			if (out_alignment != other.out_alignment) return out_alignment < other.out_alignment;
+			if (in_place != other.in_place) return in_place < other.in_place;
+			return n < other.n;
+		}
+	};
+
+	struct CachedPlan
+	{
+		FFTWPlanCache::Plan plan;
+		long int nr_users;
+		unsigned long last_used;
+	};
+
+	// Only accessed inside critical(FourierTransformer_fftw_plan)
+	std::map<PlanKey, CachedPlan> plan_cache;
+	std::map<FFTWPlanCache::Plan, PlanKey> plan_keys;
+	unsigned long plan_clock = 0;
+	long int nr_unused_plans = 0;
+
+	void destroyPlan(std::map<PlanKey, CachedPlan>::iterator it)
+	{
+#ifdef RELION_SINGLE_PRECISION
+		fftwf_destroy_plan(it->second.plan);
+#else
+		fftw_destroy_plan(it->second.plan);
+#endif
+		plan_keys.erase(it->second.plan);
+		plan_cache.erase(it);
+	}
+
+	// Destroy the least recently used unused plans, until there are no more than FFTW_PLAN_CACHE_MAX_UNUSED
+	void evictUnusedPlans()
+	{
+		while (nr_unused_plans > FFTW_PLAN_CACHE_MAX_UNUSED)
+		{
+			std::map<PlanKey, CachedPlan>::iterator oldest = plan_cache.end();
+			for (std::map<PlanKey, CachedPlan>::iterator it = plan_cache.begin(); it != plan_cache.end(); it++)
+			{
+				if (it->second.nr_users == 0 && (oldest == plan_cache.end() || it->second.last_used < oldest->second.last_used))
+					oldest = it;
+			}
+
+			destroyPlan(oldest);
+			nr_unused_plans--;
+		}
+	}
+
+	int alignmentOf(void *ptr)
+	{
+#ifdef RELION_SINGLE_PRECISION
+		return fftwf_alignment_of((float*)ptr);
+#else
+		return fftw_alignment_of((double*)ptr);
+#endif
+	}
+}
+
+FFTWPlanCache::Plan FFTWPlanCache::acquire(TransformType type, int sign, const std::vector<int> &n, int howmany, void *in, void *out)
+{
+	PlanKey key;
+	key.type = type;
+	key.sign = sign;
+	key.howmany = howmany;
+	key.in_alignment = alignmentOf(in);
+	key.out_alignment = alignmentOf(out);
+	key.in_place = (in == out);
+	key.n = n;
+
+	// Distances between the transforms in a batch
+	long int real_dist = 1, complex_dist = 1;
+	for (int i = 0; i < n.size(); i++)
+	{
+		real_dist *= n[i];
+		complex_dist *= (i + 1 < n.size()) ? n[i] : n[i] / 2 + 1;
+	}
+	if (type == COMPLEX_TO_COMPLEX)
+		complex_dist = real_dist;
+
+	Plan plan = NULL;
+
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		std::map<PlanKey, CachedPlan>::iterator it = plan_cache.find(key);
+		if (it != plan_cache.end())
+		{
+			plan = it->second.plan;
+			if (it->second.nr_users == 0)
+				nr_unused_plans--;
+			it->second.nr_users++;
+		}
+		else
+		{
+			RCTIC(TIMING_FFTW_PLAN);
+			const int rank = n.size();
+			switch (type)
+			{
+			case REAL_TO_COMPLEX:
+#ifdef RELION_SINGLE_PRECISION
+				plan = fftwf_plan_many_dft_r2c(rank, &n[0], howmany, (float*)in, NULL, 1, real_dist,
+				                               (fftwf_complex*)out, NULL, 1, complex_dist, FFTW_ESTIMATE);
+#else
+				plan = fftw_plan_many_dft_r2c(rank, &n[0], howmany, (double*)in, NULL, 1, real_dist,
+				                              (fftw_complex*)out, NULL, 1, complex_dist, FFTW_ESTIMATE);
+#endif
+				break;
+			case COMPLEX_TO_REAL:
+#ifdef RELION_SINGLE_PRECISION
+				plan = fftwf_plan_many_dft_c2r(rank, &n[0], howmany, (fftwf_complex*)in, NULL, 1, complex_dist,
+				                               (float*)out, NULL, 1, real_dist, FFTW_ESTIMATE);
+#else
+				plan = fftw_plan_many_dft_c2r(rank, &n[0], howmany, (fftw_complex*)in, NULL, 1, complex_dist,
+				                              (double*)out, NULL, 1, real_dist, FFTW_ESTIMATE);
+#endif
+				break;
+			case COMPLEX_TO_COMPLEX:
+#ifdef RELION_SINGLE_PRECISION
+				plan = fftwf_plan_many_dft(rank, &n[0], howmany, (fftwf_complex*)in, NULL, 1, complex_dist,
+				                           (fftwf_complex*)out, NULL, 1, complex_dist, sign, FFTW_ESTIMATE);
+#else
+				plan = fftw_plan_many_dft(rank, &n[0], howmany, (fftw_complex*)in, NULL, 1, complex_dist,
+				                          (fftw_complex*)out, NULL, 1, complex_dist, sign, FFTW_ESTIMATE);
+#endif
+				break;
+			}
+			RCTOC(TIMING_FFTW_PLAN);
+
+			if (plan != NULL)
+			{
+				CachedPlan cached;
+				cached.plan = plan;
+				cached.nr_users = 1;
+				cached.last_used = ++plan_clock;
+				plan_cache[key] = cached;
+				plan_keys[plan] = key;
+			}
+		}
+	}
+
+	if (plan == NULL)
+		REPORT_ERROR("FFTW plans cannot be created");
+
+#ifdef DEBUG_PLANS
+	std::cerr << " ACQUIRE plan= " << plan << " type= " << type << " howmany= " << howmany << std::endl;
+#endif
+
+	return plan;
+}
+
+void FFTWPlanCache::retain(Plan plan)
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		std::map<Plan, PlanKey>::iterator it = plan_keys.find(plan);
+		if (it != plan_keys.end())
+		{
+			CachedPlan &cached = plan_cache[it->second];
+			if (cached.nr_users == 0)
+				nr_unused_plans--;
+			cached.nr_users++;
+		}
+	}
+}
+
+void FFTWPlanCache::release(Plan plan)
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		std::map<Plan, PlanKey>::iterator it = plan_keys.find(plan);
+		if (it != plan_keys.end())
+		{
+			CachedPlan &cached = plan_cache[it->second];
+			cached.nr_users--;
+			if (cached.nr_users == 0)
+			{
+				cached.last_used = ++plan_clock;
+				nr_unused_plans++;
+				evictUnusedPlans();
+			}
+		}
+	}
+}
+
+bool FFTWPlanCache::destroyUnusedPlans()
+{
+	bool is_empty;
+
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		std::map<PlanKey, CachedPlan>::iterator it = plan_cache.begin();
+		while (it != plan_cache.end())
+		{
+			if (it->second.nr_users > 0)
+				it++;
+			else
+				destroyPlan(it++);
+		}
+		nr_unused_plans = 0;
+
+		is_empty = plan_cache.empty();
+	}
+
+	return is_empty;
+}
+
+size_t FFTWPlanCache::size()
+{
+	size_t result;
+
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	result = plan_cache.size();
+
+	return result;
+}
+
 // Constructors and destructors --------------------------------------------
 FourierTransformer::FourierTransformer():
 		plans_are_set(false)
@@ -92,6 +322,12 @@ FourierTransformer::FourierTransformer(const FourierTransformer& op) :
 	clear();
 	// New object is an extact copy of op
 	*this = op;
+	// which shares its plans
+	if (plans_are_set)
+	{
+		FFTWPlanCache::retain(fPlanForward);
+		FFTWPlanCache::retain(fPlanBackward);
+	}
 }
 
 void FourierTransformer::init()
@@ -116,15 +352,22 @@ void FourierTransformer::clear()
 
 void FourierTransformer::cleanup()
 {
-	// First clear object and destroy plans
+	// First clear object and release plans
 	clear();
-	// Then clean up all the junk fftw keeps lying around
-	// SOMEHOW THE FOLLOWING IS NOT ALLOWED WHEN USING MULTPLE TRANSFORMER OBJECTS....
+	// Then destroy the plans nobody uses any more, and if that were all of them,
+	// clean up all the junk fftw keeps lying around.
+	// This is still not allowed while other threads make plans outside the plan cache (e.g. NewFFT).
+	if (FFTWPlanCache::destroyUnusedPlans())
+	{
+		#pragma omp critical(FourierTransformer_fftw_plan)
+		{
 #ifdef RELION_SINGLE_PRECISION
-	fftwf_cleanup();
+			fftwf_cleanup();
 #else
-	fftw_cleanup();
+			fftw_cleanup();
 #endif
+		}
+	}
 
 #ifdef DEBUG_PLANS
 	std::cerr << "CLEANED-UP this= "<<this<< std::endl;
@@ -134,20 +377,12 @@ void FourierTransformer::cleanup()
 
 void FourierTransformer::destroyPlans()
 {
-	// Anything to do with plans has to be protected for threads!
-	#pragma omp critical(FourierTransformer_fftw_plan)
+	// The plans stay in the cache for other transformers
+	if (plans_are_set)
 	{
-		if (plans_are_set)
-		{
-#ifdef RELION_SINGLE_PRECISION
-			fftwf_destroy_plan(fPlanForward);
-			fftwf_destroy_plan(fPlanBackward);
-#else
-			fftw_destroy_plan(fPlanForward);
-			fftw_destroy_plan(fPlanBackward);
-#endif
-			plans_are_set = false;
-		}
+		FFTWPlanCache::release(fPlanForward);
+		FFTWPlanCache::release(fPlanBackward);
+		plans_are_set = false;
 	}
 }
 
@@ -188,7 +423,7 @@ void FourierTransformer::setReal(MultidimArray<RFLOAT> &input, bool force_new_pl
 			if (YSIZE(input)==1)
 				ndim=1;
 		}
-		int *N = new int[ndim];
+		std::vector<int> N(ndim);
 		switch (ndim)
 		{
 		case 1:
@@ -205,40 +440,20 @@ void FourierTransformer::setReal(MultidimArray<RFLOAT> &input, bool force_new_pl
 			break;
 		}
 
-		// Destroy both forward and backward plans if they already exist
+		// Release both forward and backward plans if they already exist
 		destroyPlans();
 
-		// Make new plans
+		// Get plans from the cache (or make new ones)
+		fPlanForward = FFTWPlanCache::acquire(FFTWPlanCache::REAL_TO_COMPLEX, FFTW_FORWARD, N, 1,
+		                                      MULTIDIM_ARRAY(*fReal), MULTIDIM_ARRAY(fFourier));
+		fPlanBackward = FFTWPlanCache::acquire(FFTWPlanCache::COMPLEX_TO_REAL, FFTW_BACKWARD, N, 1,
+		                                       MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
 		plans_are_set = true;
 
-		RCTIC(TIMING_FFTW_PLAN);
-
-		#pragma omp critical(FourierTransformer_fftw_plan)
-		{
-#ifdef RELION_SINGLE_PRECISION
-			fPlanForward = fftwf_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-							  (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-			fPlanBackward = fftwf_plan_dft_c2r(ndim, N,
-							   (fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-							   FFTW_ESTIMATE);
-#else
-			fPlanForward = fftw_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-							 (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-			fPlanBackward = fftw_plan_dft_c2r(ndim, N,
-							  (fftw_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-							  FFTW_ESTIMATE);
-#endif
-		}	
-		RCTOC(TIMING_FFTW_PLAN);
-
-		if (fPlanForward == NULL || fPlanBackward == NULL)
-			REPORT_ERROR("FFTW plans cannot be created");
-
 #ifdef DEBUG_PLANS
 		std::cerr << " SETREAL fPlanForward= " << fPlanForward << " fPlanBackward= " << fPlanBackward  <<" this= "<<this<< std::endl;
 #endif
 
-		delete [] N;
 		dataPtr=MULTIDIM_ARRAY(*fReal);
 		complexDataPtr = MULTIDIM_ARRAY(fFourier);
 
@@ -267,7 +482,7 @@ void FourierTransformer::setReal(MultidimArray<Complex > &input, bool force_new_
 			if (YSIZE(input)==1)
 				ndim=1;
 		}
-		int *N = new int[ndim];
+		std::vector<int> N(ndim);
 		switch (ndim)
 		{
 		case 1:
@@ -284,32 +499,15 @@ void FourierTransformer::setReal(MultidimArray<Complex > &input, bool force_new_
 			break;
 		}
 
-		// Destroy both forward and backward plans if they already exist
+		// Release both forward and backward plans if they already exist
 		destroyPlans();
 
+		fPlanForward = FFTWPlanCache::acquire(FFTWPlanCache::COMPLEX_TO_COMPLEX, FFTW_FORWARD, N, 1,
+		                                      MULTIDIM_ARRAY(*fComplex), MULTIDIM_ARRAY(fFourier));
+		fPlanBackward = FFTWPlanCache::acquire(FFTWPlanCache::COMPLEX_TO_COMPLEX, FFTW_BACKWARD, N, 1,
+		                                       MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fComplex));
 		plans_are_set = true;
 
-		RCTIC(TIMING_FFTW_PLAN);
-		#pragma omp critical(FourierTransformer_fftw_plan)
-		{
-#ifdef RELION_SINGLE_PRECISION
-			fPlanForward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(*fComplex),
-						      (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-			fPlanBackward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(fFourier),
-						       (fftwf_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-#else
-			fPlanForward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(*fComplex),
-						     (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-			fPlanBackward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(fFourier),
-						      (fftw_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-#endif
-		}		
-		RCTOC(TIMING_FFTW_PLAN);
-
-		if (fPlanForward == NULL || fPlanBackward == NULL)
-			REPORT_ERROR("FFTW plans cannot be created");
-
-		delete [] N;
 		complexDataPtr=MULTIDIM_ARRAY(*fComplex);
 	}
 }
@@ -382,6 +580,79 @@ void FourierTransformer::inverseFourierTransform()
 	Transform(FFTW_BACKWARD);
 }
 
+// Dimensions of one image in a stack, slowest first
+static std::vector<int> stackImageSize(long int xdim, long int ydim, long int zdim)
+{
+	std::vector<int> N;
+	if (zdim > 1) N.push_back(zdim);
+	if (zdim > 1 || ydim > 1) N.push_back(ydim);
+	N.push_back(xdim);
+	return N;
+}
+
+void FourierTransformer::FourierTransformStack(MultidimArray<RFLOAT> &stack, MultidimArray<Complex> &Fstack)
+{
+	if (MULTIDIM_SIZE(stack) == 0)
+		REPORT_ERROR("FourierTransformer::FourierTransformStack: empty stack");
+
+	const long int nimg = NSIZE(stack);
+	Fstack.reshape(nimg, ZSIZE(stack), YSIZE(stack), XSIZE(stack) / 2 + 1);
+
+	std::vector<int> N = stackImageSize(XSIZE(stack), YSIZE(stack), ZSIZE(stack));
+	FFTWPlanCache::Plan plan = FFTWPlanCache::acquire(FFTWPlanCache::REAL_TO_COMPLEX, FFTW_FORWARD, N, nimg,
+	                                                  MULTIDIM_ARRAY(stack), MULTIDIM_ARRAY(Fstack));
+
+	RCTIC(TIMING_FFTW_EXECUTE);
+#ifdef RELION_SINGLE_PRECISION
+	fftwf_execute_dft_r2c(plan, MULTIDIM_ARRAY(stack), (fftwf_complex*) MULTIDIM_ARRAY(Fstack));
+#else
+	fftw_execute_dft_r2c(plan, MULTIDIM_ARRAY(stack), (fftw_complex*) MULTIDIM_ARRAY(Fstack));
+#endif
+	RCTOC(TIMING_FFTW_EXECUTE);
+
+	FFTWPlanCache::release(plan);
+
+	// Normalise each transform by the size of one image, as in Transform()
+	RCTIC(TIMING_FFTW_NORMALISE);
+	const RFLOAT size = (RFLOAT)(ZYXSIZE(stack));
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fstack)
+		DIRECT_MULTIDIM_ELEM(Fstack, n) /= size;
+	RCTOC(TIMING_FFTW_NORMALISE);
+}
+
+void FourierTransformer::inverseFourierTransformStack(MultidimArray<Complex> &Fstack, MultidimArray<RFLOAT> &stack, bool preserveInput)
+{
+	if (MULTIDIM_SIZE(stack) == 0)
+		REPORT_ERROR("FourierTransformer::inverseFourierTransformStack: the output stack has not been sized");
+	if (NSIZE(Fstack) != NSIZE(stack) || ZSIZE(Fstack) != ZSIZE(stack) ||
+	    YSIZE(Fstack) != YSIZE(stack) || XSIZE(Fstack) != XSIZE(stack) / 2 + 1)
+		REPORT_ERROR("FourierTransformer::inverseFourierTransformStack: stacks of different sizes");
+
+	// c2r transforms overwrite their input
+	MultidimArray<Complex> Fcopy;
+	Complex *in = MULTIDIM_ARRAY(Fstack);
+	if (preserveInput)
+	{
+		Fcopy = Fstack;
+		in = MULTIDIM_ARRAY(Fcopy);
+	}
+
+	const long int nimg = NSIZE(stack);
+	std::vector<int> N = stackImageSize(XSIZE(stack), YSIZE(stack), ZSIZE(stack));
+	FFTWPlanCache::Plan plan = FFTWPlanCache::acquire(FFTWPlanCache::COMPLEX_TO_REAL, FFTW_BACKWARD, N, nimg,
+	                                                  in, MULTIDIM_ARRAY(stack));
+
+	RCTIC(TIMING_FFTW_EXECUTE);
+#ifdef RELION_SINGLE_PRECISION
+	fftwf_execute_dft_c2r(plan, (fftwf_complex*) in, MULTIDIM_ARRAY(stack));
+#else
+	fftw_execute_dft_c2r(plan, (fftw_complex*) in, MULTIDIM_ARRAY(stack));
+#endif
+	RCTOC(TIMING_FFTW_EXECUTE);
+
+	FFTWPlanCache::release(plan);
+}
+
 // Inforce Hermitian symmetry ---------------------------------------------
 void FourierTransformer::enforceHermitianSymmetry()
 {
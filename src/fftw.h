@@ -47,6 +47,7 @@
 #define __RELIONFFTW_H
 
 #include <fftw3.h>
+#include <vector>
 #include "src/multidim_array.h"
 #include "src/funcs.h"
 #include "src/tabfuncs.h"
@@ -130,6 +131,53 @@
 #define FFTW2D_ELEM(V, ip, jp) \
 	(DIRECT_A2D_ELEM((V), ((ip < 0) ? (ip + YSIZE(V)) : (ip)), (jp)))
 
+/** Process-wide cache of FFTW plans.
+ * @ingroup FourierW
+ *
+ * A plan is made once for each transform type, direction, size, number of transforms and
+ * memory alignment of the arrays, and is then shared by all FourierTransformers in all threads.
+ * Executing a plan on new arrays (fftw_execute_dft_r2c etc.) is thread-safe as long as the arrays
+ * have the same alignment as those the plan was made for; only making and destroying plans is
+ * serialised (in the same critical section as all other FFTW planning in RELION).
+ *
+ * Plans are reference counted: a plan that is no longer used by anyone stays in the cache
+ * for the next transform of the same size. At most FFTW_PLAN_CACHE_MAX_UNUSED unused plans are
+ * kept; beyond that, the least recently used ones are destroyed. destroyUnusedPlans() destroys
+ * all of them.
+ */
+#define FFTW_PLAN_CACHE_MAX_UNUSED 32
+
+class FFTWPlanCache
+{
+public:
+
+	enum TransformType {REAL_TO_COMPLEX, COMPLEX_TO_REAL, COMPLEX_TO_COMPLEX};
+
+#ifdef RELION_SINGLE_PRECISION
+	typedef fftwf_plan Plan;
+#else
+	typedef fftw_plan Plan;
+#endif
+
+	/** Get a plan for howmany contiguous transforms of size n (slowest dimension first)
+	 * from in to out, and increase its reference count. in and out are only used for their
+	 * alignment: they are not written to. Reports an error if FFTW cannot make the plan.
+	 */
+	static Plan acquire(TransformType type, int sign, const std::vector<int> &n, int howmany, void *in, void *out);
+
+	/** Increase the reference count of a plan from acquire() */
+	static void retain(Plan plan);
+
+	/** Decrease the reference count of a plan from acquire() */
+	static void release(Plan plan);
+
+	/** Destroy all plans that are not used. Returns true if the cache is now empty. */
+	static bool destroyUnusedPlans();
+
+	/** Number of plans in the cache */
+	static size_t size();
+};
+
 /** Fourier Transformer class.
  * @ingroup FourierW
  *
@@ -236,6 +284,17 @@ public:
 			Transform(FFTW_BACKWARD);
 		}
 
+	/** Compute the Fourier transforms of all images in a stack (NSIZE(stack) images) in one call.
+	    Fstack is resized to hold the NSIZE(stack) transforms, which are normalised as in
+	    FourierTransform. This does not change the state of the transformer. */
+	static void FourierTransformStack(MultidimArray<RFLOAT> &stack, MultidimArray<Complex> &Fstack);
+
+	/** Compute the inverse Fourier transforms of all images in a stack of Fourier transforms in one call.
+	    The output stack must already have the right size (NSIZE and real-space image size).
+	    If preserveInput is false, Fstack is used as workspace and its contents are destroyed,
+	    otherwise a copy is made. This does not change the state of the transformer. */
+	static void inverseFourierTransformStack(MultidimArray<Complex> &Fstack, MultidimArray<RFLOAT> &stack, bool preserveInput = true);
+
 	/** Get Fourier coefficients. */
 	template <typename T>
 		void getFourierAlias(T& V) {V.alias(fFourier); return;}
@@ -339,11 +398,12 @@ public:
 	/** Clear object */
 	void clear();
 
-	/** This calls fftw_cleanup.
+	/** Clear object, destroy all plans that are no longer used by any transformer
+	    and, if there are none left, call fftw_cleanup.
 	*/
 	void cleanup();
 
-	/** Destroy both forward and backward fftw planes (mutex locked */
+	/** Release both forward and backward fftw plans to the plan cache */
 	void destroyPlans();
 
 	/** Computes the transform, specified in Init() function
@@ -99,7 +99,10 @@ inline float16 float2half(float f32)
 
 	fractional += 1 << 12; // add 1 to 13th bit to round.
 	if (fractional & (1 << 23)) // carry up
+	{
 		exponent++;
+		fractional &= 0x007fffffu;
+	}
 
 	if (exponent > 127 + 15) // Overflow: don't create INF but truncate to MAX.
 	{
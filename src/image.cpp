@@ -18,6 +18,177 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/image.h"
+#include <map>
+#include <mutex>
+#include <sys/resource.h>
+
+namespace
+{
+	struct CachedImageHandler
+	{
+		std::string fn_file; // as opened, e.g. "particles.mrcs" or "particles.dat:mrcs"
+		std::string fn_path; // as on disc, e.g. "particles.dat"
+		bool stale;          // opened for writing while this handler was in use
+		unsigned long last_used;
+	};
+
+	std::mutex image_handler_mutex;
+	std::map<fImageHandler*, CachedImageHandler> idle_image_handlers, used_image_handlers;
+	unsigned long image_handler_clock = 0;
+}
+
+int fImageHandlerCache::capacity()
+{
+	static const int max_handlers = []() -> int {
+		const char *env = getenv("RELION_IMAGE_HANDLE_CACHE");
+		if (env != NULL)
+			return std::max(0, atoi(env));
+
+		// Leave most file descriptors to the rest of the program
+		struct rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+			return 256;
+		return std::min((rlim_t)256, limit.rlim_cur / 4);
+	}();
+
+	return max_handlers;
+}
+
+fImageHandler* fImageHandlerCache::acquire(const FileName &name, long int select_img)
+{
+	if (capacity() == 0)
+		return NULL;
+
+	long int dump;
+	FileName fn_file;
+	name.decompose(dump, fn_file);
+
+	// Only for single images from stacks
+	if (dump <= 0 && select_img < 0)
+		return NULL;
+
+	FileName ext_name = fn_file.getFileFormat();
+	if (ext_name.contains("tif") || ext_name.contains("img") || ext_name.contains("hed"))
+		return NULL;
+
+	FileName fn_path = fn_file.removeFileFormat();
+	size_t found = fn_path.find_first_of("%");
+	if (found != std::string::npos)
+		fn_path = fn_path.substr(0, found);
+
+	{
+		std::lock_guard<std::mutex> lock(image_handler_mutex);
+
+		std::map<fImageHandler*, CachedImageHandler>::iterator it;
+		for (it = idle_image_handlers.begin(); it != idle_image_handlers.end(); it++)
+		{
+			if (it->second.fn_file == fn_file)
+			{
+				fImageHandler *hFile = it->first;
+				used_image_handlers[hFile] = it->second;
+				idle_image_handlers.erase(it);
+				return hFile;
+			}
+		}
+	}
+
+	fImageHandler *hFile = new fImageHandler();
+	try
+	{
+		hFile->openFile(fn_file);
+	}
+	catch (RelionError XE)
+	{
+		delete hFile;
+		throw;
+	}
+
+	CachedImageHandler entry;
+	entry.fn_file = fn_file;
+	entry.fn_path = fn_path;
+	entry.stale = false;
+	entry.last_used = 0;
+
+	std::lock_guard<std::mutex> lock(image_handler_mutex);
+	used_image_handlers[hFile] = entry;
+
+	return hFile;
+}
+
+void fImageHandlerCache::release(fImageHandler *hFile, bool reuse)
+{
+	std::vector<fImageHandler*> to_close;
+
+	{
+		std::lock_guard<std::mutex> lock(image_handler_mutex);
+
+		std::map<fImageHandler*, CachedImageHandler>::iterator it = used_image_handlers.find(hFile);
+		if (it == used_image_handlers.end())
+			REPORT_ERROR("fImageHandlerCache::release: BUG: this handler was not taken from the cache");
+
+		CachedImageHandler entry = it->second;
+		used_image_handlers.erase(it);
+
+		if (!reuse || entry.stale)
+		{
+			to_close.push_back(hFile);
+		}
+		else
+		{
+			// The next reader starts from the beginning of the file, as after opening it
+			rewind(hFile->fimg);
+
+			entry.last_used = ++image_handler_clock;
+			idle_image_handlers[hFile] = entry;
+
+			while (idle_image_handlers.size() > capacity())
+			{
+				std::map<fImageHandler*, CachedImageHandler>::iterator oldest = idle_image_handlers.begin();
+				for (it = idle_image_handlers.begin(); it != idle_image_handlers.end(); it++)
+				{
+					if (it->second.last_used < oldest->second.last_used)
+						oldest = it;
+				}
+				to_close.push_back(oldest->first);
+				idle_image_handlers.erase(oldest);
+			}
+		}
+	}
+
+	// The destructor of fImageHandler closes the file
+	for (int i = 0; i < to_close.size(); i++)
+		delete to_close[i];
+}
+
+void fImageHandlerCache::forget(const FileName &fn_path)
+{
+	std::vector<fImageHandler*> to_close;
+
+	{
+		std::lock_guard<std::mutex> lock(image_handler_mutex);
+
+		std::map<fImageHandler*, CachedImageHandler>::iterator it;
+		for (it = idle_image_handlers.begin(); it != idle_image_handlers.end();)
+		{
+			if (it->second.fn_path == fn_path)
+			{
+				to_close.push_back(it->first);
+				idle_image_handlers.erase(it++);
+			}
+			else
+				it++;
+		}
+
+		for (it = used_image_handlers.begin(); it != used_image_handlers.end(); it++)
+		{
+			if (it->second.fn_path == fn_path)
+				it->second.stale = true;
+		}
+	}
+
+	for (int i = 0; i < to_close.size(); i++)
+		delete to_close[i];
+}
 
 //#define DEBUG_REGULARISE_HELICAL_SEGMENTS
 
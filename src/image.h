@@ -64,6 +64,7 @@
 #include "src/metadata_table.h"
 #include "src/fftw.h"
 #include "src/float16.h"
+#include "src/mapped_stack.h"
 
 /// @defgroup Images Images
 //@{
@@ -95,7 +96,7 @@ typedef enum
 typedef enum
 {
 	WRITE_OVERWRITE, //forget about the old file and overwrite it
-	WRITE_APPEND,	 //append and object at the end of a stack, so far can not append stacks
+	WRITE_APPEND,	 //append an object at the end of a stack (for MRC stacks: all images of the object)
 	WRITE_REPLACE,	 //replace a particular object by another
 	WRITE_READONLY	 //only can read the file
 } WriteMode;
@@ -196,6 +197,40 @@ extern "C" {
 	}
 }
 
+class fImageHandler;
+
+/** Cache of open image files
+ * Reading many single images from the same stacks (e.g. "12@particles.mrcs") through
+ * Image::read would otherwise open the stack and parse its header for every image.
+ * Instead, Image::read takes an open handler for the stack out of this cache and gives it
+ * back afterwards, so that the next read (by any thread) can use it. Each handler is used
+ * by one thread at a time. The least recently used handlers are closed when the cache holds
+ * more than a maximum number of them, which depends on the limit on open files.
+ *
+ * Set the environment variable RELION_IMAGE_HANDLE_CACHE to the maximum number of cached
+ * handlers, or to 0 to open the stacks for every image.
+ */
+class fImageHandlerCache
+{
+public:
+	/* Take an open handler for the file of an image out of the cache, or open the file
+	 * Returns NULL if the cache is disabled or not suitable for this image.
+	 */
+	static fImageHandler* acquire(const FileName &name, long int select_img);
+
+	/* Give a handler back after use
+	 * Handlers that failed (reuse = false), or whose file was opened for writing in
+	 * the meantime, are closed.
+	 */
+	static void release(fImageHandler *hFile, bool reuse = true);
+
+	// Close all cached handlers of a file, e.g. because it is being written to
+	static void forget(const FileName &fn_file);
+
+	// Maximum number of cached handlers
+	static int capacity();
+};
+
 /** File handler class
  * This struct is used to share the File handlers with Image Collection class
  */
@@ -208,6 +243,7 @@ public:
 	FileName  ext_name; // Filename extension
 	bool	  exist;    // Shows if the file exists
 	bool	  isTiff;   // Shows if this is a TIFF file
+	std::vector<char> header; // Raw header of the file, stored by readMRC to parse it only once
 
 	/** Empty constructor
 	 */
@@ -267,6 +303,14 @@ public:
 
 		exist = exists(fileName);
 
+		// Readers should not see the stack through an outdated mapping or header
+		if (mode != WRITE_READONLY && exist)
+		{
+			MappedStack::forget(fileName);
+			fImageHandlerCache::forget(fileName);
+		}
+		header.clear();
+
 		std::string wmChar;
 
 		switch (mode)
@@ -410,6 +454,7 @@ private:
 	bool mmapOn; // Mapping when loading from file
 	int mFd; // Handle the file in reading method and mmap
 	size_t mappedSize; // Size of the mapped file
+	std::vector<char> *cached_header; // Header stored in the file handler that is being read from
 
 public:
 	/** Empty constructor
@@ -466,6 +511,7 @@ public:
 		clearHeader();
 		replaceNsize=0;
 		mmapOn = false;
+		cached_header = NULL;
 	}
 
 	/** Clear the header of the image
@@ -521,6 +567,31 @@ public:
 		if (name == "")
 			REPORT_ERROR("ERROR: trying to read image with empty file name!");
 		int err = 0;
+
+		// Single images from MRC stacks are copied from a shared mapping of the stack
+		if (readdata && !mapData && MappedStack::enabled() && readFromMappedStack(name, select_img, err))
+			return err;
+
+		if (!mapData)
+		{
+			fImageHandler *hCached = fImageHandlerCache::acquire(name, select_img);
+			if (hCached != NULL)
+			{
+				try
+				{
+					err = _read(name, *hCached, readdata, select_img, mapData, is_2D);
+				}
+				catch (RelionError XE)
+				{
+					fImageHandlerCache::release(hCached, false);
+					throw;
+				}
+
+				fImageHandlerCache::release(hCached, err >= 0);
+				return err;
+			}
+		}
+
 		fImageHandler hFile;
 		hFile.openFile(name);
 		err = _read(name, hFile, readdata, select_img, mapData, is_2D);
@@ -1106,6 +1177,49 @@ public:
 		return 0;
 	}
 
+	/** Read the raw data from a stack that is mapped in memory
+	 * Returns false if the mapping does not hold all the data, e.g. because the file has grown since it was mapped.
+	 */
+	bool readDataFromMemory(const char* map, size_t map_size, long int select_img, DataType datatype)
+	{
+		size_t pagesize, nr_elements;
+		if (datatype == UHalf)
+		{
+			if (YXSIZE(data) % 2 != 0) REPORT_ERROR("For UHalf, YXSIZE(data) must be even.");
+			pagesize = ZYXSIZE(data) / 2;
+			nr_elements = pagesize * 2;
+		}
+		else
+		{
+			pagesize = ZYXSIZE(data) * gettypesize(datatype);
+			nr_elements = ZYXSIZE(data);
+		}
+
+		if (select_img < 0)
+			select_img = 0;
+
+		const size_t myoffset = offset + select_img * pagesize;
+		if (myoffset + NSIZE(data) * pagesize > map_size)
+			return false;
+
+		data.coreAllocateReuse();
+
+		std::vector<char> swapped;
+		for (size_t myn = 0; myn < NSIZE(data); myn++)
+		{
+			char* page = const_cast<char*>(map + myoffset + myn * pagesize);
+			if (swap)
+			{
+				swapped.assign(page, page + pagesize);
+				page = swapped.data();
+				swapPage(page, pagesize, datatype);
+			}
+			castPage2T(page, MULTIDIM_ARRAY(data) + myn * nr_elements, datatype, nr_elements);
+		}
+
+		return true;
+	}
+
 	/** Data access
 	 *
 	 * This operator can be used to access the data multidimarray.
@@ -1384,6 +1498,54 @@ public:
 	}
 
 private:
+	/* Read a single image from an MRC stack through MappedStack
+	 * Returns false if this is not possible, in which case the image should be read from the file.
+	 */
+	bool readFromMappedStack(const FileName &name, long int select_img, int &err)
+	{
+		if (!name.getFileFormat().contains("mrcs"))
+			return false;
+
+		long int dump;
+		FileName fn_stack;
+		name.decompose(dump, fn_stack);
+		// Subtract 1 to have numbering 0...N-1 instead of 1...N
+		if (dump > 0)
+			dump--;
+		if (select_img == -1)
+			select_img = dump;
+		if (select_img < 0)
+			return false;
+
+		fn_stack = fn_stack.removeFileFormat();
+		size_t found = fn_stack.find_first_of("%");
+		if (found != std::string::npos)
+			fn_stack = fn_stack.substr(0, found);
+
+		std::shared_ptr<const MappedStack> stack = MappedStack::get(fn_stack);
+		if (!stack)
+			return false;
+
+		dataflag = 1;
+		mmapOn = false;
+		fimg = NULL;
+		fhed = NULL;
+		filename = name;
+
+		MDMainHeader.clear();
+		MDMainHeader.addObject();
+
+		if (!readMRCFromMemory(stack->data(), stack->size(), select_img, name))
+		{
+			// Map the stack again next time
+			MappedStack::forget(fn_stack);
+			return false;
+		}
+
+		err = 0;
+		return true;
+	}
+
 	int _read(const FileName &name, fImageHandler &hFile, bool readdata=true, long int select_img = -1,
 			  bool mapData = false, bool is_2D = false)
 	{
@@ -1398,6 +1560,7 @@ private:
 		FileName ext_name = hFile.ext_name;
 		fimg = hFile.fimg;
 		fhed = hFile.fhed;
+		cached_header = &hFile.header;
 
 		long int dump;
 		name.decompose(dump, filename);
@@ -1447,6 +1610,8 @@ private:
 		else
 			err = readSPIDER(select_img);
 
+		cached_header = NULL;
+
 		// Negative errors are bad.
 		return err;
 	}
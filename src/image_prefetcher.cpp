@@ -0,0 +1,180 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/image_prefetcher.h"
+#include "src/performance_trace.h"
+
+ImagePrefetcher::ImagePrefetcher()
+:	next_image(0), nr_consumers(0), nr_finished(0)
+{}
+
+void ImagePrefetcher::reset(const std::vector<FileName> &_fn_imgs, int nr_buffers, int _nr_consumers)
+{
+	fn_imgs = _fn_imgs;
+	status.assign(fn_imgs.size(), NOT_READ);
+	image_buffer.assign(fn_imgs.size(), -1);
+	errors.clear();
+
+	// Keep the buffers of the previous list: images of the same size are read without reallocation
+	if (nr_buffers < 1) nr_buffers = 1;
+	buffers.resize(nr_buffers);
+	free_buffers.resize(nr_buffers);
+	for (int i = 0; i < nr_buffers; i++)
+		free_buffers[i] = i;
+
+	next_image = 0;
+	nr_consumers = _nr_consumers;
+	nr_finished = 0;
+}
+
+void ImagePrefetcher::readImages()
+{
+	// Only open/close stacks once
+	fImageHandler hFile;
+	FileName fn_stack, fn_open_stack = "";
+	long int dump;
+
+	while (true)
+	{
+		long int i;
+		int ibuf;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			while (true)
+			{
+				// Skip the images that have been read directly by the processing threads
+				while (next_image < fn_imgs.size() && status[next_image] != NOT_READ)
+					next_image++;
+
+				if (next_image >= fn_imgs.size() || nr_finished >= nr_consumers)
+					return;
+
+				if (free_buffers.size() > 0)
+					break;
+
+				buffer_freed.wait(lock);
+			}
+
+			i = next_image++;
+			ibuf = free_buffers.back();
+			free_buffers.pop_back();
+			status[i] = READING;
+			image_buffer[i] = ibuf;
+		}
+
+		ImageStatus result = IN_BUFFER;
+
+		try
+		{
+			fn_imgs[i].decompose(dump, fn_stack);
+			if (fn_stack != fn_open_stack)
+			{
+				hFile.openFile(fn_stack, WRITE_READONLY);
+				fn_open_stack = fn_stack;
+			}
+			TraceSpan trace_span("read image");
+			buffers[ibuf].readFromOpenFile(fn_imgs[i], hFile, -1, false);
+		}
+		catch (RelionError XE)
+		{
+			// Let the thread that asks for this image report the error
+			result = FAILED;
+			fn_open_stack = "";
+
+			std::lock_guard<std::mutex> lock(mutex);
+			errors.insert(std::make_pair(i, XE));
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			status[i] = result;
+			if (result == FAILED)
+			{
+				free_buffers.push_back(ibuf);
+				image_buffer[i] = -1;
+			}
+		}
+
+		image_read.notify_all();
+		if (result == FAILED) buffer_freed.notify_one();
+	}
+}
+
+void ImagePrefetcher::getImage(long int i, MultidimArray<RFLOAT> &img)
+{
+	if (i < 0 || i >= fn_imgs.size())
+		REPORT_ERROR("ImagePrefetcher::getImage: image index out of range");
+
+	int ibuf = -1;
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (status[i] == READING)
+			image_read.wait(lock);
+
+		if (status[i] == FAILED)
+			throw errors.find(i)->second;
+
+		if (status[i] == TAKEN)
+			REPORT_ERROR("ImagePrefetcher::getImage: BUG: image " + fn_imgs[i] + " was asked for twice");
+
+		if (status[i] == IN_BUFFER)
+			ibuf = image_buffer[i];
+
+		status[i] = TAKEN;
+	}
+
+	if (ibuf < 0)
+	{
+		// No I/O thread has started on this image: do not wait for one
+		Image<RFLOAT> direct;
+		{
+			TraceSpan trace_span("read image");
+			direct.read(fn_imgs[i]);
+		}
+		img = direct();
+	}
+	else
+	{
+		img = buffers[ibuf]();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			free_buffers.push_back(ibuf);
+			image_buffer[i] = -1;
+		}
+
+		buffer_freed.notify_one();
+	}
+
+	img.setXmippOrigin();
+}
+
+void ImagePrefetcher::finished()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		nr_finished++;
+	}
+
+	buffer_freed.notify_all();
+}
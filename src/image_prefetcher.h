@@ -0,0 +1,90 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef IMAGE_PREFETCHER_H
+#define IMAGE_PREFETCHER_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include "src/image.h"
+
+/* Reads a list of images on dedicated I/O threads, ahead of the threads that process them.
+ *
+ * The images are read in order into a ring of reusable buffers, so that at most nr_buffers
+ * images are held in memory. The I/O threads call readImages(), the processing threads
+ * call getImage() for each image and finished() once they are done.
+ *
+ * An image that no I/O thread has started on yet is read by the thread that asks for it,
+ * so the processing threads never wait for an I/O thread that is itself waiting for a
+ * free buffer, whatever the order in which they ask for the images.
+ */
+class ImagePrefetcher
+{
+public:
+
+	ImagePrefetcher();
+
+	/* Start on a new list of images (e.g. "000001@particles.mrcs")
+	 * This should only be called when no threads are using the prefetcher.
+	 */
+	void reset(const std::vector<FileName> &fn_imgs, int nr_buffers, int nr_consumers);
+
+	/* Main loop of an I/O thread
+	 * Returns when all images have been read, or when all processing threads are finished.
+	 */
+	void readImages();
+
+	/* Get image i of the list, with its origin in the centre
+	 * Waits if an I/O thread is reading it, otherwise reads it directly.
+	 */
+	void getImage(long int i, MultidimArray<RFLOAT> &img);
+
+	// A processing thread will not ask for any more images
+	void finished();
+
+	// Number of images in the current list
+	long int size() const
+	{
+		return fn_imgs.size();
+	}
+
+private:
+
+	enum ImageStatus {NOT_READ, READING, IN_BUFFER, FAILED, TAKEN};
+
+	std::vector<FileName> fn_imgs;
+	std::vector<ImageStatus> status;
+	std::vector<int> image_buffer;
+	std::map<long int, RelionError> errors;
+
+	std::vector<Image<RFLOAT> > buffers;
+	std::vector<int> free_buffers;
+
+	// The first image that may not have been claimed yet
+	long int next_image;
+	int nr_consumers, nr_finished;
+
+	std::mutex mutex;
+	std::condition_variable image_read, buffer_freed;
+};
+
+#endif
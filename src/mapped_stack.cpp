@@ -0,0 +1,125 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/mapped_stack.h"
+#include <map>
+#include <mutex>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Maximum number of stacks that are kept mapped when nobody is reading from them
+#define MAPPED_STACK_MAX 1024
+
+namespace
+{
+	struct MappedStackEntry
+	{
+		std::shared_ptr<const MappedStack> stack;
+		unsigned long last_used;
+	};
+
+	std::mutex mapped_stack_mutex;
+	std::map<std::string, MappedStackEntry> mapped_stacks;
+	unsigned long mapped_stack_clock = 0;
+}
+
+MappedStack::~MappedStack()
+{
+	munmap((void*)ptr, length);
+}
+
+bool MappedStack::enabled()
+{
+	static const bool use_mmap = []() -> bool {
+		const char *env = getenv("RELION_MMAP_STACKS");
+		return (env != NULL && strcmp(env, "1") == 0);
+	}();
+
+	return use_mmap;
+}
+
+std::shared_ptr<const MappedStack> MappedStack::get(const std::string &fn_stack)
+{
+	std::lock_guard<std::mutex> lock(mapped_stack_mutex);
+
+	mapped_stack_clock++;
+
+	std::map<std::string, MappedStackEntry>::iterator it = mapped_stacks.find(fn_stack);
+	if (it != mapped_stacks.end())
+	{
+		const MappedStack &stack = *it->second.stack;
+		struct stat st;
+		if (stat(fn_stack.c_str(), &st) == 0 && (size_t)st.st_size == stack.length && (long int)st.st_ino == stack.inode
+		    && (long int)st.st_mtim.tv_sec == stack.mtime_sec && (long int)st.st_mtim.tv_nsec == stack.mtime_nsec)
+		{
+			it->second.last_used = mapped_stack_clock;
+			return it->second.stack;
+		}
+
+		// The file has been changed or replaced: map it again
+		mapped_stacks.erase(it);
+	}
+
+	int fd = open(fn_stack.c_str(), O_RDONLY);
+	if (fd < 0)
+		return std::shared_ptr<const MappedStack>();
+
+	struct stat st;
+	void *ptr = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	// The mapping keeps the file accessible: no need to hold on to a file descriptor
+	close(fd);
+
+	if (ptr == MAP_FAILED)
+		return std::shared_ptr<const MappedStack>();
+
+	// Particles are usually read in random order: don't read ahead more than the requested pages
+	madvise(ptr, st.st_size, MADV_RANDOM);
+
+	if (mapped_stacks.size() >= MAPPED_STACK_MAX)
+	{
+		std::map<std::string, MappedStackEntry>::iterator oldest = mapped_stacks.begin();
+		for (it = mapped_stacks.begin(); it != mapped_stacks.end(); it++)
+		{
+			if (it->second.last_used < oldest->second.last_used)
+				oldest = it;
+		}
+
+		// Readers that still hold the mapping keep it alive until they are done
+		mapped_stacks.erase(oldest);
+	}
+
+	MappedStackEntry &entry = mapped_stacks[fn_stack];
+	entry.stack.reset(new MappedStack((const char*)ptr, st.st_size, st.st_ino, st.st_mtim.tv_sec, st.st_mtim.tv_nsec));
+	entry.last_used = mapped_stack_clock;
+
+	return entry.stack;
+}
+
+void MappedStack::forget(const std::string &fn_stack)
+{
+	std::lock_guard<std::mutex> lock(mapped_stack_mutex);
+	mapped_stacks.erase(fn_stack);
+}
@@ -0,0 +1,84 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef MAPPED_STACK_H
+#define MAPPED_STACK_H
+
+#include <memory>
+#include <string>
+
+/* A read-only memory mapping of an image stack, shared by all threads of the process.
+ *
+ * Image::read uses this to read single images from MRC stacks: after the first access
+ * to a stack, reading an image from it is a copy from the page cache, without opening,
+ * seeking or reading the file. The mappings stay alive between reads, up to a maximum
+ * number of stacks, after which the least recently used ones are released. A mapping
+ * is only unmapped once no reader holds on to it any more.
+ *
+ * Before a mapping is reused, the size, modification time and inode of the file are checked,
+ * so that a stack that has been rewritten (e.g. replaced through a rename) is mapped again.
+ * A stack that is truncated by another process while it is being read from still causes a
+ * SIGBUS, which is why this is only used when the environment variable RELION_MMAP_STACKS
+ * is set to 1. By default, stacks are read through stdio.
+ */
+class MappedStack
+{
+public:
+
+	~MappedStack();
+
+	/* Get the mapping of a stack, mapping it if necessary
+	 * Returns a null pointer if the file cannot be mapped (e.g. it does not exist), so
+	 * that the caller can fall back to reading it normally and report the error.
+	 */
+	static std::shared_ptr<const MappedStack> get(const std::string &fn_stack);
+
+	// Drop the mapping of a stack, e.g. because it is being written to or it has grown
+	static void forget(const std::string &fn_stack);
+
+	// Should Image::read use mapped stacks?
+	static bool enabled();
+
+	const char* data() const
+	{
+		return ptr;
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+
+private:
+
+	MappedStack(const char* _ptr, size_t _length, long int _inode, long int _mtime_sec, long int _mtime_nsec)
+	:	ptr(_ptr), length(_length), inode(_inode), mtime_sec(_mtime_sec), mtime_nsec(_mtime_nsec)
+	{}
+
+	MappedStack(const MappedStack&);
+	MappedStack& operator=(const MappedStack&);
+
+	const char* ptr;
+	size_t length;
+
+	// The file that was mapped, to see whether it has changed since
+	long int inode, mtime_sec, mtime_nsec;
+};
+
+#endif
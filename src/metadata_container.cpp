@@ -20,124 +20,11 @@
 #include "src/metadata_container.h"
 
 MetaDataContainer::MetaDataContainer()
-    :   doubles(0), ints(0), bools(0), strings(0), intVectors(0), doubleVectors(0), unknowns(0)
+:	table(0),
+	row(-1)
 {}
 
-
-MetaDataContainer::MetaDataContainer(
-        MetaDataTable *table, long doubleCount, long intCount,
-        long boolCount, long stringCount, long intVectorCount, long doubleVectorCount, long unknownCount)
-: table(table),
-  doubles(doubleCount, 0),
-  ints(intCount, 0),
-  bools(boolCount, false),
-  strings(stringCount, ""),
-  intVectors(intVectorCount),
-  doubleVectors(doubleVectorCount),
-  unknowns(unknownCount)
-{}
-
-MetaDataContainer::MetaDataContainer(
-        MetaDataTable *table, MetaDataContainer* mdc)
-: table(table),
-  doubles(mdc->doubles),
-  ints(mdc->ints),
-  bools(mdc->bools),
-  strings(mdc->strings),
-  intVectors(mdc->intVectors),
-  doubleVectors(mdc->doubleVectors),
-  unknowns(mdc->unknowns)
+MetaDataContainer::MetaDataContainer(const MetaDataTable* table, long row)
+:	table(table),
+	row(row)
 {}
-
-void MetaDataContainer::getValue(long offset, double& dest) const
-{
-    dest = doubles[offset];
-}
-
-void MetaDataContainer::getValue(long offset, float& dest) const
-{
-    dest = (float)doubles[offset];
-}
-
-void MetaDataContainer::getValue(long offset, int& dest) const
-{
-    dest = (int)ints[offset];
-}
-
-void MetaDataContainer::getValue(long offset, long& dest) const
-{
-    dest = ints[offset];
-}
-
-void MetaDataContainer::getValue(long offset, bool& dest) const
-{
-    dest = bools[offset];
-}
-
-void MetaDataContainer::getValue(long offset, std::vector<int>& dest) const
-{
-    dest = intVectors[offset];
-}
-
-void MetaDataContainer::getValue(long offset, std::vector<double>& dest) const
-{
-	dest = doubleVectors[offset];
-}
-
-void MetaDataContainer::getValue(long offset, std::vector<float>& dest) const
-{
-	dest.resize(doubleVectors[offset].size());
-	std::copy(doubleVectors[offset].begin(), doubleVectors[offset].end(), dest.begin());
-}
-
-void MetaDataContainer::getValue(long offset, std::string& dest) const
-{
-	dest = (strings[offset] == "\"\"") ? "" : strings[offset];
-}
-
-void MetaDataContainer::setValue(long offset, const double& src)
-{
-    doubles[offset] = src;
-}
-
-void MetaDataContainer::setValue(long offset, const float& src)
-{
-    doubles[offset] = src;
-}
-
-void MetaDataContainer::setValue(long offset, const int& src)
-{
-    ints[offset] = src;
-}
-
-void MetaDataContainer::setValue(long offset, const long& src)
-{
-    ints[offset] = src;
-}
-
-void MetaDataContainer::setValue(long offset, const bool& src)
-{
-    bools[offset] = src;
-}
-
-void MetaDataContainer::setValue(long offset, const std::string& src)
-{
-	strings[offset] = (src.length() == 0) ? "\"\"" : src;
-}
-
-void MetaDataContainer::setValue(long offset, const std::vector<int>& src)
-{
-    intVectors[offset] = src;
-}
-
-void MetaDataContainer::setValue(long offset, const std::vector<double>& src)
-{
-	doubleVectors[offset] = src;
-}
-
-void MetaDataContainer::setValue(long offset, const std::vector<float>& src)
-{
-	doubleVectors[offset].resize(src.size());
-	std::copy(src.begin(), src.end(), doubleVectors[offset].begin());
-}
-
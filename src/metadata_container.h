@@ -31,46 +31,25 @@
 
 class MetaDataTable;
 
+/*	class MetaDataContainer:
+ *
+ *	- a light-weight handle to a single row (object) of a MetaDataTable
+ *	- the values themselves live in the typed columns of the table,
+ *	  so copying a MetaDataContainer does not copy any data
+ *
+ *	A MetaDataContainer is what MetaDataTable::getObject() returns, and what
+ *	addObject() and setObject() take to copy a row from one table into another.
+ *	It is only valid as long as the table it points to is not destroyed.
+ */
 class MetaDataContainer
 {
-    public:
-		
-		MetaDataContainer();
-		MetaDataContainer(MetaDataTable* table, long doubleCount, long intCount,
-						  long boolCount, long stringCount, long intVectorCount, long doubleVectorCount, long unknownCount);
-		MetaDataContainer(MetaDataTable* table, MetaDataContainer* mdc);
+	public:
 
-		
-			MetaDataTable* table;
-	
-			std::vector<double> doubles;
-			std::vector<long> ints;
-			std::vector<bool> bools;
-			std::vector<std::string> strings;
-            std::vector<std::vector<int> > intVectors;
-            std::vector<std::vector<double> > doubleVectors;
-			std::vector<std::string> unknowns;
+		MetaDataContainer();
+		MetaDataContainer(const MetaDataTable* table, long row);
 
-			
-		void getValue(long offset, double& dest) const;
-		void getValue(long offset, float& dest) const;
-		void getValue(long offset, int& dest) const;
-		void getValue(long offset, long& dest) const;
-		void getValue(long offset, bool& dest) const;
-		void getValue(long offset, std::string& dest) const;
-        void getValue(long offset, std::vector<int>& dest) const;
-        void getValue(long offset, std::vector<double>& dest) const;
-		void getValue(long offset, std::vector<float>& dest) const;
-		
-		void setValue(long offset, const double& src);
-		void setValue(long offset, const float& src);
-		void setValue(long offset, const int& src);
-		void setValue(long offset, const long& src);
-		void setValue(long offset, const bool& src);
-		void setValue(long offset, const std::string& src);
-        void setValue(long offset, const std::vector<int>& src);
-        void setValue(long offset, const std::vector<double>& src);
-		void setValue(long offset, const std::vector<float>& src);
+		const MetaDataTable* table;
+		long row;
 };
 
 #endif
@@ -42,72 +42,68 @@
  *	e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <omp.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "src/metadata_table.h"
 #include "src/metadata_label.h"
 
 MetaDataTable::MetaDataTable()
-:	objects(0),
+:	objectCount(0),
 	label2offset(EMDL_LAST_LABEL, -1),
+	activeLabels(0),
 	current_objectID(0),
-	doubleLabels(0),
-	intLabels(0),
-	boolLabels(0),
-	stringLabels(0),
-    intVectorLabels(0),
-    doubleVectorLabels(0),
-	unknownLabels(0),
 	isList(false),
 	name(""),
 	comment(""),
-	version(CURRENT_MDT_VERSION),
-	activeLabels(0)
+	version(CURRENT_MDT_VERSION)
 {
 }
 
 MetaDataTable::MetaDataTable(const MetaDataTable &MD)
-:	objects(MD.objects.size()),
+:	doubleColumns(MD.doubleColumns),
+	intColumns(MD.intColumns),
+	boolColumns(MD.boolColumns),
+	stringColumns(MD.stringColumns),
+	intVectorColumns(MD.intVectorColumns),
+	doubleVectorColumns(MD.doubleVectorColumns),
+	unknownColumns(MD.unknownColumns),
+	objectCount(MD.objectCount),
 	label2offset(MD.label2offset),
-	unknownLabelPosition2Offset(MD.unknownLabelPosition2Offset),
+	activeLabels(MD.activeLabels),
 	unknownLabelNames(MD.unknownLabelNames),
+	unknownLabelPosition2Offset(MD.unknownLabelPosition2Offset),
 	current_objectID(0),
-	doubleLabels(MD.doubleLabels),
-	intLabels(MD.intLabels),
-	boolLabels(MD.boolLabels),
-	stringLabels(MD.stringLabels),
-    intVectorLabels(MD.intVectorLabels),
-	doubleVectorLabels(MD.doubleVectorLabels),
-	unknownLabels(MD.unknownLabels),
 	isList(MD.isList),
 	name(MD.name),
 	comment(MD.comment),
-	version(MD.version),
-	activeLabels(MD.activeLabels)
+	version(MD.version)
 {
-	for (size_t idx = 0; idx < MD.objects.size(); idx++)
-	{
-		objects[idx] = new MetaDataContainer(*(MD.objects[idx]));
-		objects[idx]->table = this;
-	}
 }
 
 MetaDataTable& MetaDataTable::operator = (const MetaDataTable &MD)
 {
 	if (this != &MD)
 	{
-		clear();
+		doubleColumns = MD.doubleColumns;
+		intColumns = MD.intColumns;
+		boolColumns = MD.boolColumns;
+		stringColumns = MD.stringColumns;
+		intVectorColumns = MD.intVectorColumns;
+		doubleVectorColumns = MD.doubleVectorColumns;
+		unknownColumns = MD.unknownColumns;
+		objectCount = MD.objectCount;
 
-		objects.resize(MD.objects.size());
 		label2offset = MD.label2offset;
 		unknownLabelPosition2Offset = MD.unknownLabelPosition2Offset;
 		unknownLabelNames = MD.unknownLabelNames;
 		current_objectID = 0;
-		doubleLabels = MD.doubleLabels;
-		intLabels = MD.intLabels;
-		boolLabels = MD.boolLabels;
-		stringLabels = MD.stringLabels;
-        intVectorLabels = MD.intVectorLabels;
-        doubleVectorLabels = MD.doubleVectorLabels;
-		unknownLabels = MD.unknownLabels;
 
 		isList = MD.isList;
 		name = MD.name;
@@ -115,12 +111,6 @@ MetaDataTable& MetaDataTable::operator = (const MetaDataTable &MD)
 		version = MD.version;
 
 		activeLabels = MD.activeLabels;
-
-		for (long int idx = 0; idx < MD.objects.size(); idx++)
-		{
-			objects[idx] = new MetaDataContainer(this, MD.objects[idx]);
-			objects[idx]->table = this;
-		}
 	}
 
 	return *this;
@@ -133,41 +123,34 @@ void MetaDataTable::setIsList(bool is_list)
 
 MetaDataTable::~MetaDataTable()
 {
-	for (long i = 0; i < objects.size(); i++)
-	{
-		delete objects[i];
-	}
 }
 
 bool MetaDataTable::isEmpty() const
 {
-	return (objects.size()==0);
+	return (objectCount == 0);
 }
 
 size_t MetaDataTable::numberOfObjects() const
 {
-	return objects.size();
+	return objectCount;
 }
 
 void MetaDataTable::clear()
 {
-	for (long i = 0; i < objects.size(); i++)
-	{
-		delete objects[i];
-	}
-	objects.clear();
+	doubleColumns.clear();
+	intColumns.clear();
+	boolColumns.clear();
+	stringColumns.clear();
+	intVectorColumns.clear();
+	doubleVectorColumns.clear();
+	unknownColumns.clear();
+	objectCount = 0;
 
 	label2offset = std::vector<long>(EMDL_LAST_LABEL, -1);
 	current_objectID = 0;
 	unknownLabelPosition2Offset.clear();
 	unknownLabelNames.clear();
 
-	doubleLabels = 0;
-	intLabels = 0;
-	boolLabels = 0;
-	stringLabels = 0;
-	unknownLabels = 0;
-
 	isList = false;
 	name = "";
 	comment = "";
@@ -216,6 +199,22 @@ int MetaDataTable::getCurrentVersion()
 	return CURRENT_MDT_VERSION;
 }
 
+namespace
+{
+	// Set by MetaDataTable::setNrThreads; 0 means omp_get_max_threads()
+	int star_nr_threads = 0;
+}
+
+void MetaDataTable::setNrThreads(int nr_threads)
+{
+	star_nr_threads = nr_threads;
+}
+
+int MetaDataTable::getNrThreads()
+{
+	return (star_nr_threads > 0)? star_nr_threads : omp_get_max_threads();
+}
+
 std::string MetaDataTable::getUnknownLabelNameAt(int i) const
 {
 	if (activeLabels[i] != EMDL_UNKNOWN_LABEL)
@@ -224,6 +223,90 @@ std::string MetaDataTable::getUnknownLabelNameAt(int i) const
 	return unknownLabelNames[unknownLabelPosition2Offset[i]];
 }
 
+// Right-justify the characters in [begin, end) in a field of 12 and truncate them to 12 characters,
+// as snprintf(buffer, 13, "%12...") does; returns the length
+static inline int justifyStarNumber(const char* begin, const char* end, char* buffer)
+{
+	const int len = end - begin;
+	const int pad = (len < 12)? 12 - len : 0;
+	for (int i = 0; i < pad; i++) buffer[i] = ' ';
+	const int n = (len + pad > 12)? 12 - pad : len;
+	memcpy(buffer + pad, begin, n);
+	buffer[pad + n] = '\0';
+	return pad + n;
+}
+
+// Write the decimal digits of v, ending at 'end'; returns the position of the first digit
+static inline char* writeStarDigits(unsigned long long v, char* end, int min_digits = 1)
+{
+	char* pos = end;
+	do
+	{
+		*(--pos) = '0' + (v % 10);
+		v /= 10;
+		min_digits--;
+	}
+	while (v != 0 || min_digits > 0);
+	return pos;
+}
+
+/* Format a double the way it is written in STAR files (see getValueToString)
+ * into buffer (at least 13 characters); returns the length.
+ *
+ * Values written in fixed-point notation (the vast majority) are converted without snprintf.
+ * This is only done when the rounding of v to 5 or 6 decimals is unambiguous, so that the result
+ * is always identical to snprintf's. */
+static int formatStarDouble(double v, char* buffer)
+{
+	const double a = ABS(v);
+
+	if ((a > 0. && a < 0.001) || a > 100000.)
+	{
+		snprintf(buffer, 13, (v < 0.)? "%12.5e" : "%12.6e", v);
+		return strlen(buffer);
+	}
+
+	const bool negative = std::signbit(v);
+	const int decimals = (v < 0.)? 5 : 6;
+	const unsigned long long scale = (v < 0.)? 100000 : 1000000;
+
+	// a <= 100000, so x < 2^37 and its rounding error is far below the margin around .5 below
+	const double x = a * scale;
+	double r = floor(x);
+	const double frac = x - r;
+
+	if (!(x == x) || ABS(frac - 0.5) < 1e-4)
+	{
+		snprintf(buffer, 13, (v < 0.)? "%12.5f" : "%12.6f", v);
+		return strlen(buffer);
+	}
+
+	if (frac > 0.5) r += 1.;
+
+	const unsigned long long n = (unsigned long long)r;
+
+	char tmp[32];
+	char* end = tmp + sizeof(tmp);
+	char* pos = writeStarDigits(n % scale, end, decimals);
+	*(--pos) = '.';
+	pos = writeStarDigits(n / scale, pos);
+	if (negative) *(--pos) = '-';
+
+	return justifyStarNumber(pos, end, buffer);
+}
+
+// Format an integer as snprintf(buffer, 13, "%12ld", v) would; returns the length
+static int formatStarLong(long v, char* buffer)
+{
+	char tmp[32];
+	char* end = tmp + sizeof(tmp);
+	const unsigned long long magnitude = (v < 0)? -(unsigned long long)v : v;
+	char* pos = writeStarDigits(magnitude, end);
+	if (v < 0) *(--pos) = '-';
+
+	return justifyStarNumber(pos, end, buffer);
+}
+
 bool MetaDataTable::getValueToString(EMDLabel label, std::string &value, long objectID, bool escape) const
 {
 	// SHWS 18jul2018: this function previously had a stringstream, but it greatly slowed down
@@ -253,34 +336,13 @@ bool MetaDataTable::getValueToString(EMDLabel label, std::string &value, long ob
 			double v;
 			if(!getValue(label, v, objectID)) return false;
 
-			if ((ABS(v) > 0. && ABS(v) < 0.001) || ABS(v) > 100000.)
-			{
-				if (v < 0.)
-				{
-					snprintf(buffer,13, "%12.5e", v);
-				}
-				else
-				{
-					snprintf(buffer,13, "%12.6e", v);
-				}
-			}
-			else
-			{
-				if (v < 0.)
-				{
-					snprintf(buffer,13, "%12.5f", v);
-				}
-				else
-				{
-					snprintf(buffer,13, "%12.6f", v);
-				}
-			}
+			formatStarDouble(v, buffer);
 		}
 		else if (EMDL::isInt(label))
 		{
 			long v;
 			if (!getValue(label, v, objectID)) return false;
-			snprintf(buffer,13, "%12ld", v);
+			formatStarLong(v, buffer);
 		}
 		else if (EMDL::isBool(label))
 		{
@@ -414,7 +476,7 @@ bool MetaDataTable::setUnknownValue(int labelPosition, const std::string &value)
 
 	if (offset > -1)
 	{
-		objects[current_objectID]->unknowns[offset] = value;
+		unknownColumns[offset][current_objectID] = value;
 		return true;
 	}
 	else
@@ -506,68 +568,68 @@ bool MetaDataTable::setValueFromString(
 	return false;
 }
 
-// comparators used for sorting
+// comparators used for sorting: they compare row indices by the values in one column
 
 struct MdDoubleComparator
 {
-	MdDoubleComparator(long index) : index(index) {}
+	MdDoubleComparator(const std::vector<double> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		return lh->doubles[index] < rh->doubles[index];
+		return column[lh] < column[rh];
 	}
 
-	long index;
+	const std::vector<double> &column;
 };
 
 struct MdIntComparator
 {
-	MdIntComparator(long index) : index(index) {}
+	MdIntComparator(const std::vector<long> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		return lh->ints[index] < rh->ints[index];
+		return column[lh] < column[rh];
 	}
 
-	long index;
+	const std::vector<long> &column;
 };
 
 struct MdStringComparator
 {
-	MdStringComparator(long index) : index(index) {}
+	MdStringComparator(const std::vector<std::string> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		return lh->strings[index] < rh->strings[index];
+		return column[lh] < column[rh];
 	}
 
-	long index;
+	const std::vector<std::string> &column;
 };
 
 struct MdStringAfterAtComparator
 {
-	MdStringAfterAtComparator(long index) : index(index) {}
+	MdStringAfterAtComparator(const std::vector<std::string> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		std::string slh = lh->strings[index];
-		std::string srh = rh->strings[index];
+		std::string slh = column[lh];
+		std::string srh = column[rh];
 		slh = slh.substr(slh.find("@")+1);
 		srh = srh.substr(srh.find("@")+1);
 		return slh < srh;
 	}
 
-	long index;
+	const std::vector<std::string> &column;
 };
 
 struct MdStringBeforeAtComparator
 {
-	MdStringBeforeAtComparator(long index) : index(index) {}
+	MdStringBeforeAtComparator(const std::vector<std::string> &column) : column(column) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		std::string slh = lh->strings[index];
-		std::string srh = rh->strings[index];
+		std::string slh = column[lh];
+		std::string srh = column[rh];
 		slh = slh.substr(0, slh.find("@"));
 		srh = srh.substr(0, srh.find("@"));
 		std::stringstream stslh, stsrh;
@@ -580,7 +642,7 @@ struct MdStringBeforeAtComparator
 		return ilh < irh;
 	}
 
-	long index;
+	const std::vector<std::string> &column;
 };
 
 void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bool do_random)
@@ -595,9 +657,8 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 	}
 
 	std::vector<std::pair<double,long int> > vp;
-	vp.reserve(objects.size());
+	vp.reserve(objectCount);
 	long int i = 0;
-
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(*this)
 	{
 		double dval;
@@ -635,14 +696,14 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 	else
 	{
 		// Change the actual order in the MetaDataTable
-		std::vector<MetaDataContainer*> objs(objects.size());
+		std::vector<long> order(vp.size());
 
 		for (long j = 0; j < vp.size(); j++)
 		{
-			objs[j] = objects[vp[j].second];
+			order[j] = vp[j].second;
 		}
 
-		objects = objs;
+		permuteObjects(order);
 	}
 	// reset pointer to the beginning of the table
 	firstObject();
@@ -650,30 +711,38 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 
 void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at, bool do_sort_before_at)
 {
+	std::vector<long> order(objectCount);
+	for (long i = 0; i < objectCount; i++)
+	{
+		order[i] = i;
+	}
+
+	const long off = label2offset[label];
+
 	if (EMDL::isString(label))
 	{
 		if (do_sort_after_at)
 		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringAfterAtComparator(label2offset[label]));
+			std::stable_sort(order.begin(), order.end(),
+							 MdStringAfterAtComparator(stringColumns[off]));
 		}
 		else if (do_sort_before_at)
 		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringBeforeAtComparator(label2offset[label]));
+			std::stable_sort(order.begin(), order.end(),
+							 MdStringBeforeAtComparator(stringColumns[off]));
 		}
 		else
 		{
-			std::stable_sort(objects.begin(), objects.end(), MdStringComparator(label2offset[label]));
+			std::stable_sort(order.begin(), order.end(), MdStringComparator(stringColumns[off]));
 		}
 	}
 	else if (EMDL::isDouble(label))
 	{
-		std::stable_sort(objects.begin(), objects.end(), MdDoubleComparator(label2offset[label]));
+		std::stable_sort(order.begin(), order.end(), MdDoubleComparator(doubleColumns[off]));
 	}
 	else if (EMDL::isInt(label))
 	{
-		std::stable_sort(objects.begin(), objects.end(), MdIntComparator(label2offset[label]));
+		std::stable_sort(order.begin(), order.end(), MdIntComparator(intColumns[off]));
 	}
 	else
 	{
@@ -682,8 +751,10 @@ void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_
 
 	if (do_reverse)
 	{
-		std::reverse(objects.begin(), objects.end());
+		std::reverse(order.begin(), order.end());
 	}
+
+	permuteObjects(order);
 }
 
 // Will be removed in 3.2
@@ -738,81 +809,39 @@ void MetaDataTable::addLabel(EMDLabel label, std::string unknownLabel)
 
 		if (EMDL::isDouble(label))
 		{
-			id = doubleLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->doubles.push_back(0);
-			}
-
-			doubleLabels++;
+			id = doubleColumns.size();
+			doubleColumns.push_back(std::vector<double>(objectCount, 0.));
 		}
 		else if (EMDL::isInt(label))
 		{
-			id = intLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->ints.push_back(0);
-			}
-
-			intLabels++;
+			id = intColumns.size();
+			intColumns.push_back(std::vector<long>(objectCount, 0));
 		}
 		else if (EMDL::isBool(label))
 		{
-			id = boolLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->bools.push_back(false);
-			}
-
-			boolLabels++;
+			id = boolColumns.size();
+			boolColumns.push_back(std::vector<char>(objectCount, false));
 		}
 		else if (EMDL::isString(label))
 		{
-			id = stringLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->strings.push_back("empty");
-			}
-
-			stringLabels++;
+			id = stringColumns.size();
+			stringColumns.push_back(std::vector<std::string>(objectCount, "empty"));
 		}
 		else if (EMDL::isIntVector(label))
 		{
-			id = intVectorLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->intVectors.push_back(std::vector<int>());
-			}
-
-			intVectorLabels++;
+			id = intVectorColumns.size();
+			intVectorColumns.push_back(std::vector<std::vector<int> >(objectCount));
 		}
 		else if (EMDL::isDoubleVector(label))
 		{
-			id = doubleVectorLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->doubleVectors.push_back(std::vector<double>());
-			}
-
-			doubleVectorLabels++;
+			id = doubleVectorColumns.size();
+			doubleVectorColumns.push_back(std::vector<std::vector<double> >(objectCount));
 		}
 		else if (EMDL::isUnknown(label))
 		{
-			id = unknownLabels;
-
-			for (long i = 0; i < objects.size(); i++)
-			{
-				objects[i]->unknowns.push_back("empty");
-			}
-
+			id = unknownColumns.size();
+			unknownColumns.push_back(std::vector<std::string>(objectCount, "empty"));
 			unknownLabelNames.push_back(unknownLabel);
-			unknownLabels++;
 		}
 
 		activeLabels.push_back(label);
@@ -855,14 +884,58 @@ void MetaDataTable::append(const MetaDataTable& mdt)
 			REPORT_ERROR("ERROR in appending metadata tables with not the same columns!");
 	}
 
-	// Now append
-	objects.reserve(objects.size() + mdt.numberOfObjects());
-	for (long i = 0; i < mdt.objects.size(); i++)
+	// Now append, one column at a time
+	const long offset = objectCount;
+	const long n = mdt.objectCount;
+	resizeObjects(objectCount + n);
+
+	for (long i = 0; i < mdt.activeLabels.size(); i++)
 	{
-		objects.push_back(new MetaDataContainer(
-			this, doubleLabels, intLabels, boolLabels, stringLabels, intVectorLabels, doubleVectorLabels, unknownLabels));
+		EMDLabel label = mdt.activeLabels[i];
+		long srcOff, myOff;
+
+		if (label == EMDL_UNKNOWN_LABEL)
+		{
+			srcOff = mdt.unknownLabelPosition2Offset[i];
+			myOff = -1;
+			for (int j = 0; j < unknownLabelNames.size(); j++)
+			{
+				if (unknownLabelNames[j] == mdt.unknownLabelNames[srcOff])
+				{
+					myOff = j;
+					break;
+				}
+			}
+		}
+		else
+		{
+			srcOff = mdt.label2offset[label];
+			myOff = label2offset[label];
+		}
 
-		setObjectUnsafe(mdt.getObject(i), objects.size() - 1);
+		if (myOff < 0) continue;
+
+		if (label == EMDL_UNKNOWN_LABEL)
+			std::copy(mdt.unknownColumns[srcOff].begin(), mdt.unknownColumns[srcOff].begin() + n,
+			          unknownColumns[myOff].begin() + offset);
+		else if (EMDL::isDouble(label))
+			std::copy(mdt.doubleColumns[srcOff].begin(), mdt.doubleColumns[srcOff].begin() + n,
+			          doubleColumns[myOff].begin() + offset);
+		else if (EMDL::isInt(label))
+			std::copy(mdt.intColumns[srcOff].begin(), mdt.intColumns[srcOff].begin() + n,
+			          intColumns[myOff].begin() + offset);
+		else if (EMDL::isBool(label))
+			std::copy(mdt.boolColumns[srcOff].begin(), mdt.boolColumns[srcOff].begin() + n,
+			          boolColumns[myOff].begin() + offset);
+		else if (EMDL::isString(label))
+			std::copy(mdt.stringColumns[srcOff].begin(), mdt.stringColumns[srcOff].begin() + n,
+			          stringColumns[myOff].begin() + offset);
+		else if (EMDL::isIntVector(label))
+			std::copy(mdt.intVectorColumns[srcOff].begin(), mdt.intVectorColumns[srcOff].begin() + n,
+			          intVectorColumns[myOff].begin() + offset);
+		else if (EMDL::isDoubleVector(label))
+			std::copy(mdt.doubleVectorColumns[srcOff].begin(), mdt.doubleVectorColumns[srcOff].begin() + n,
+			          doubleVectorColumns[myOff].begin() + offset);
 	}
 
 	// reset pointer to the beginning of the table
@@ -870,26 +943,26 @@ void MetaDataTable::append(const MetaDataTable& mdt)
 }
 
 
-MetaDataContainer* MetaDataTable::getObject(long objectID) const
+MetaDataContainer MetaDataTable::getObject(long objectID) const
 {
 	if (objectID < 0) objectID = current_objectID;
 
 	checkObjectID(objectID,  "MetaDataTable::getObject");
 
-	return objects[objectID];
+	return MetaDataContainer(this, objectID);
 }
 
-void MetaDataTable::setObject(MetaDataContainer* data, long objectID)
+void MetaDataTable::setObject(const MetaDataContainer &data, long objectID)
 {
 	if (objectID < 0) objectID = current_objectID;
 
 	checkObjectID(objectID,  "MetaDataTable::setObject");
-	addMissingLabels(data->table);
+	addMissingLabels(data.table);
 
 	setObjectUnsafe(data, objectID);
 }
 
-void MetaDataTable::setValuesOfDefinedLabels(MetaDataContainer* data, long objectID)
+void MetaDataTable::setValuesOfDefinedLabels(const MetaDataContainer &data, long objectID)
 {
 	if (objectID < 0) objectID = current_objectID;
 
@@ -900,53 +973,101 @@ void MetaDataTable::setValuesOfDefinedLabels(MetaDataContainer* data, long objec
 
 void MetaDataTable::reserve(size_t capacity)
 {
-	objects.reserve(capacity);
+	for (long i = 0; i < doubleColumns.size(); i++) doubleColumns[i].reserve(capacity);
+	for (long i = 0; i < intColumns.size(); i++) intColumns[i].reserve(capacity);
+	for (long i = 0; i < boolColumns.size(); i++) boolColumns[i].reserve(capacity);
+	for (long i = 0; i < stringColumns.size(); i++) stringColumns[i].reserve(capacity);
+	for (long i = 0; i < intVectorColumns.size(); i++) intVectorColumns[i].reserve(capacity);
+	for (long i = 0; i < doubleVectorColumns.size(); i++) doubleVectorColumns[i].reserve(capacity);
+	for (long i = 0; i < unknownColumns.size(); i++) unknownColumns[i].reserve(capacity);
+}
+
+void MetaDataTable::resizeObjects(long n)
+{
+	// New objects get the same default values as in addObject()
+	for (long i = 0; i < doubleColumns.size(); i++) doubleColumns[i].resize(n, 0.);
+	for (long i = 0; i < intColumns.size(); i++) intColumns[i].resize(n, 0);
+	for (long i = 0; i < boolColumns.size(); i++) boolColumns[i].resize(n, false);
+	for (long i = 0; i < stringColumns.size(); i++) stringColumns[i].resize(n, "");
+	for (long i = 0; i < intVectorColumns.size(); i++) intVectorColumns[i].resize(n);
+	for (long i = 0; i < doubleVectorColumns.size(); i++) doubleVectorColumns[i].resize(n);
+	for (long i = 0; i < unknownColumns.size(); i++) unknownColumns[i].resize(n, "");
+
+	objectCount = n;
+}
+
+template<class T>
+static void permuteColumn(std::vector<T> &column, const std::vector<long> &order)
+{
+	std::vector<T> permuted(order.size());
+
+	for (long i = 0; i < order.size(); i++)
+	{
+		std::swap(permuted[i], column[order[i]]);
+	}
+
+	column.swap(permuted);
+}
+
+void MetaDataTable::permuteObjects(const std::vector<long> &order)
+{
+	if (order.size() != objectCount)
+		REPORT_ERROR("MetaDataTable::permuteObjects: BUG: the new order does not contain all objects.");
+
+	for (long i = 0; i < doubleColumns.size(); i++) permuteColumn(doubleColumns[i], order);
+	for (long i = 0; i < intColumns.size(); i++) permuteColumn(intColumns[i], order);
+	for (long i = 0; i < boolColumns.size(); i++) permuteColumn(boolColumns[i], order);
+	for (long i = 0; i < stringColumns.size(); i++) permuteColumn(stringColumns[i], order);
+	for (long i = 0; i < intVectorColumns.size(); i++) permuteColumn(intVectorColumns[i], order);
+	for (long i = 0; i < doubleVectorColumns.size(); i++) permuteColumn(doubleVectorColumns[i], order);
+	for (long i = 0; i < unknownColumns.size(); i++) permuteColumn(unknownColumns[i], order);
 }
 
-void MetaDataTable::setObjectUnsafe(MetaDataContainer* data, long objectID)
+void MetaDataTable::setObjectUnsafe(const MetaDataContainer &data, long objectID)
 {
-	MetaDataContainer* obj = objects[objectID];
+	const MetaDataTable* src = data.table;
+	const long srcRow = data.row;
 
-	for (long i = 0; i < data->table->activeLabels.size(); i++)
+	for (long i = 0; i < src->activeLabels.size(); i++)
 	{
-		EMDLabel label = data->table->activeLabels[i];
+		EMDLabel label = src->activeLabels[i];
 
 		if (label != EMDL_UNKNOWN_LABEL)
 		{
 			long myOff = label2offset[label];
-			long srcOff = data->table->label2offset[label];
+			long srcOff = src->label2offset[label];
 
 			if (myOff < 0) continue;
 
 			if (EMDL::isDouble(label))
 			{
-				obj->doubles[myOff] = data->doubles[srcOff];
+				doubleColumns[myOff][objectID] = src->doubleColumns[srcOff][srcRow];
 			}
 			else if (EMDL::isInt(label))
 			{
-				obj->ints[myOff] = data->ints[srcOff];
+				intColumns[myOff][objectID] = src->intColumns[srcOff][srcRow];
 			}
 			else if (EMDL::isBool(label))
 			{
-				obj->bools[myOff] = data->bools[srcOff];
+				boolColumns[myOff][objectID] = src->boolColumns[srcOff][srcRow];
 			}
 			else if (EMDL::isString(label))
 			{
-				obj->strings[myOff] = data->strings[srcOff];
+				stringColumns[myOff][objectID] = src->stringColumns[srcOff][srcRow];
 			}
             else if (EMDL::isIntVector(label))
             {
-                obj->intVectors[myOff] = data->intVectors[srcOff];
+                intVectorColumns[myOff][objectID] = src->intVectorColumns[srcOff][srcRow];
             }
 			else if (EMDL::isDoubleVector(label))
 			{
-				obj->doubleVectors[myOff] = data->doubleVectors[srcOff];
+				doubleVectorColumns[myOff][objectID] = src->doubleVectorColumns[srcOff][srcRow];
 			}
 		}
 		else
 		{
-			std::string unknownLabel = data->table->getUnknownLabelNameAt(i);
-			long srcOff = data->table->unknownLabelPosition2Offset[i];
+			std::string unknownLabel = src->getUnknownLabelNameAt(i);
+			long srcOff = src->unknownLabelPosition2Offset[i];
 			long myOff = -1;
 
 			for (int j = 0; j < unknownLabelNames.size(); j++)
@@ -961,35 +1082,38 @@ void MetaDataTable::setObjectUnsafe(MetaDataContainer* data, long objectID)
 			if (myOff < 0)
 				REPORT_ERROR("MetaDataTable::setObjectUnsafe: logic error. cannot find srcOff.");
 
-			obj->unknowns[myOff] = data->unknowns[srcOff];
+			unknownColumns[myOff][objectID] = src->unknownColumns[srcOff][srcRow];
 		}
 	}
 }
 
 void MetaDataTable::addObject()
 {
-	objects.push_back(new MetaDataContainer(
-		this, doubleLabels, intLabels, boolLabels, stringLabels, intVectorLabels, doubleVectorLabels, unknownLabels));
+	resizeObjects(objectCount + 1);
 
-	current_objectID = objects.size()-1;
+	current_objectID = objectCount-1;
 }
 
-void MetaDataTable::addObject(MetaDataContainer* data)
+void MetaDataTable::addObject(const MetaDataContainer &data)
 {
-	objects.push_back(new MetaDataContainer(
-		this, doubleLabels, intLabels, boolLabels, stringLabels, intVectorLabels, doubleVectorLabels, unknownLabels));
+	resizeObjects(objectCount + 1);
 
-	setObject(data, objects.size()-1);
-	current_objectID = objects.size()-1;
+	setObject(data, objectCount-1);
+	current_objectID = objectCount-1;
 }
 
-void MetaDataTable::addValuesOfDefinedLabels(MetaDataContainer* data)
+void MetaDataTable::addValuesOfDefinedLabels(const MetaDataContainer &data)
 {
-	objects.push_back(new MetaDataContainer(
-		this, doubleLabels, intLabels, boolLabels, stringLabels, intVectorLabels, doubleVectorLabels, unknownLabels));
+	resizeObjects(objectCount + 1);
+
+	setValuesOfDefinedLabels(data, objectCount-1);
+	current_objectID = objectCount-1;
+}
 
-	setValuesOfDefinedLabels(data, objects.size()-1);
-	current_objectID = objects.size()-1;
+template<class T>
+static void eraseFromColumn(std::vector<T> &column, long i)
+{
+	column.erase(column.begin() + i);
 }
 
 void MetaDataTable::removeObject(long objectID)
@@ -998,10 +1122,16 @@ void MetaDataTable::removeObject(long objectID)
 
 	checkObjectID(i, "MetaDataTable::removeObject");
 
-	delete objects[i];
-	objects.erase(objects.begin() + i);
+	for (long c = 0; c < doubleColumns.size(); c++) eraseFromColumn(doubleColumns[c], i);
+	for (long c = 0; c < intColumns.size(); c++) eraseFromColumn(intColumns[c], i);
+	for (long c = 0; c < boolColumns.size(); c++) eraseFromColumn(boolColumns[c], i);
+	for (long c = 0; c < stringColumns.size(); c++) eraseFromColumn(stringColumns[c], i);
+	for (long c = 0; c < intVectorColumns.size(); c++) eraseFromColumn(intVectorColumns[c], i);
+	for (long c = 0; c < doubleVectorColumns.size(); c++) eraseFromColumn(doubleVectorColumns[c], i);
+	for (long c = 0; c < unknownColumns.size(); c++) eraseFromColumn(unknownColumns[c], i);
+	objectCount--;
 
-	current_objectID = objects.size() - 1;
+	current_objectID = objectCount - 1;
 }
 
 long int MetaDataTable::firstObject()
@@ -1014,7 +1144,7 @@ long int MetaDataTable::nextObject()
 {
 	current_objectID++;
 
-	if (current_objectID >= objects.size())
+	if (current_objectID >= objectCount)
 	{
 		return NO_MORE_OBJECTS;
 	}
@@ -1032,268 +1162,1283 @@ long int MetaDataTable::goToObject(long int objectID)
 	return current_objectID;
 }
 
-long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
+// Size and modification time of a file: a binary cache is only valid for the STAR file with the same stamp
+static std::string starFileStamp(const struct stat &info)
 {
-	setIsList(false);
-
-	//Read column labels
-	int labelPosition = 0;
-	std::string line, token;
+	long long values[3] = {(long long)info.st_size, (long long)info.st_mtim.tv_sec, (long long)info.st_mtim.tv_nsec};
+	return std::string((const char*)values, sizeof(values));
+}
 
-	// First read all the column labels
-	while (getline(in, line, '\n'))
-	{
-		line = simplify(line);
-		// TODO: handle comments...
-		if (line[0] == '#' || line[0] == '\0' || line[0] == ';')
-			continue;
+// A whole STAR file in memory: memory-mapped read-only if possible, otherwise read into a string
+class StarFileBuffer
+{
+	public:
 
-		if (line[0] == '_') // label definition line
+		StarFileBuffer(const std::string &fn)
+		:	data(NULL), size(0), is_mapped(false), is_open(false)
 		{
-			//Only take string from "_" until "#"
-			size_t pos0 = line.find("_");
-			size_t pos1 = line.find("#");
-
-			token = line.substr(pos0 + 1, pos1 - pos0 - 2);
-
-			EMDLabel label = EMDL::str2Label(token);
+			int fd = open(fn.c_str(), O_RDONLY);
+			if (fd < 0) return;
 
-			if (label == EMDL_UNDEFINED)
+			struct stat info;
+			if (fstat(fd, &info) == 0)
 			{
-				std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << token << std::endl;
-				label = EMDL_UNKNOWN_LABEL;
+				is_open = true;
+				size = info.st_size;
+				stamp = starFileStamp(info);
+
+				if (size > 0)
+				{
+					void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+					if (map != MAP_FAILED)
+					{
+						madvise(map, size, MADV_SEQUENTIAL);
+						data = (const char*)map;
+						is_mapped = true;
+					}
+					else
+					{
+						// Some file systems do not support mmap: just read the file
+						contents.resize(size);
+						size_t nread = 0;
+						while (nread < size)
+						{
+							ssize_t n = ::read(fd, &contents[nread], size - nread);
+							if (n <= 0) break;
+							nread += n;
+						}
+						contents.resize(nread);
+						data = contents.data();
+						size = nread;
+					}
+				}
 			}
 
-			addLabel(label, token);
+			close(fd);
 
-			labelPosition++;
+			// Compressed STAR files (see write) start with the gzip magic number
+			if (size >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b)
+				decompress(fn);
 		}
-		else // found first data line
+
+		~StarFileBuffer()
 		{
-			break;
+			if (is_mapped) munmap((void*)data, size);
 		}
-	}
 
-	// Then fill the table (dont read another line until the one from above has been handled)
-	bool is_first = true;
-	long int nr_objects = 0;
-	const int num_labels = activeLabels.size();
+		bool isOpen() const { return is_open; }
+		const char* begin() const { return data; }
+		const char* end() const { return data + size; }
 
-	while (is_first || getline(in, line, '\n'))
-	{
-		is_first = false;
+		// Identifies the version of the file that was read (see starFileStamp)
+		const std::string& getStamp() const { return stamp; }
 
-		line = simplify(line);
-		// Stop at empty line
-		if (line[0] == '\0')
-			break;
+	private:
+
+		const char* data;
+		size_t size;
+		bool is_mapped, is_open;
+		std::string contents, stamp;
 
-		nr_objects++;
-		if (!do_only_count)
+		void decompress(const std::string &fn)
 		{
-			// Add a new line to the table
-			addObject();
+#ifdef HAVE_ZLIB
+			gzFile gz = gzopen(fn.c_str(), "rb");
+			if (gz == NULL)
+				REPORT_ERROR("MetaDataTable: cannot open compressed file " + fn);
 
-			// Parse data values
-			int pos = 0;
-			std::string value;
-			labelPosition = 0;
-			while (nextTokenInSTAR(line, pos, value))
-			{
-				if (labelPosition >= num_labels)
-				{
-					std::cerr << "Error in line: " << line << std::endl;
-					REPORT_ERROR("A line in the STAR file contains more columns than the number of labels.");
-				}
-				// Check whether this is an unknown label
-				if (activeLabels[labelPosition] == EMDL_UNKNOWN_LABEL)
-				{
-					setUnknownValue(labelPosition, value);
-				}
-				else
-				{
-					setValueFromString(activeLabels[labelPosition], value);
-				}
-				labelPosition++;
-			}
-			if (labelPosition < num_labels && num_labels > 2)
+			gzbuffer(gz, 1 << 20);
+
+			std::string text;
+			int n;
+			do
 			{
-				// For backward-compatibility for cases like "fn_mtf <empty>", don't die if num_labels == 2.
-				std::cerr << "Error in line: " << line << std::endl;
-				REPORT_ERROR("A line in the STAR file contains fewer columns than the number of labels. Expected = " + integerToString(num_labels) + " Found = " +  integerToString(labelPosition));
+				const size_t old_size = text.size();
+				text.resize(old_size + (1 << 20));
+				n = gzread(gz, &text[old_size], 1 << 20);
+				text.resize(old_size + ((n > 0)? n : 0));
 			}
-		}
-	}
+			while (n > 0);
 
-	return nr_objects;
-}
+			gzclose(gz);
 
-bool MetaDataTable::readStarList(std::ifstream& in)
-{
-	setIsList(true);
-	addObject();
-	long int objectID = objects.size() - 1;
+			if (n < 0)
+				REPORT_ERROR("MetaDataTable: error while decompressing " + fn);
 
-	std::string line, firstword, value;
+			if (is_mapped) munmap((void*)data, size);
+			is_mapped = false;
 
-	bool also_has_loop = false;
+			contents.swap(text);
+			data = contents.data();
+			size = contents.size();
+#else
+			REPORT_ERROR("MetaDataTable: " + fn + " is compressed, but RELION was compiled without zlib.");
+#endif
+		}
+};
 
-	// Read data and fill structures accordingly
-	int labelPosition = 0;
-	int lastGoodPos = in.tellg();
+#ifdef HAVE_ZLIB
+// Stream buffer that writes compressed STAR files (see write)
+// Characters are collected in a put area, which is compressed whenever it is full
+class GzipStreamBuffer : public std::streambuf
+{
+	public:
 
-	while (getline(in, line, '\n'))
-	{
-		int pos = 0;
-		// Ignore empty lines
-		if (!nextTokenInSTAR(line, pos, firstword))
-			continue;
+		GzipStreamBuffer(const std::string &fn)
+		:	buffer(1 << 16)
+		{
+			// Fastest compression: the point is to write large files quickly
+			file = gzopen(fn.c_str(), "wb1");
+			if (file != NULL) gzbuffer(file, 1 << 20);
+			setp(buffer.data(), buffer.data() + buffer.size());
+		}
 
-		// Get label-value pairs
-		if (firstword[0] == '_')
+		~GzipStreamBuffer()
 		{
-			std::string token = firstword.substr(1); // get rid of leading underscore
-			EMDLabel label = EMDL::str2Label(token);
-			if (!nextTokenInSTAR(line, pos, value))
-				REPORT_ERROR("MetaDataTable::readStarList: did not encounter a single word after "+firstword);
+			close();
+		}
 
-			if (label == EMDL_UNDEFINED)
-			{
-				label = EMDL_UNKNOWN_LABEL;
-				addLabel(label, token);
-				setUnknownValue(labelPosition, value);
-				std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << token << std::endl;
-			}
-			else
-			{
-				addLabel(label);
-				setValueFromString(label, value, objectID);
-			}
-			labelPosition++;
+		bool isOpen() const { return file != NULL; }
 
-			lastGoodPos = in.tellg();
+		bool close()
+		{
+			if (file == NULL) return true;
+			const bool ok = flushBuffer() && (gzclose(file) == Z_OK);
+			file = NULL;
+			return ok;
 		}
-		// Check whether there is a comment or an empty line
-		else if (firstword[0] == '#' || firstword[0] == ';')
+
+	protected:
+
+		int overflow(int c)
 		{
-			// TODO: handle comments?
-			continue;
+			if (!flushBuffer()) return EOF;
+			if (c == EOF) return 0;
+			*pptr() = c;
+			pbump(1);
+			return c;
 		}
-		// Check whether a loop structure comes after this list
-		else if (firstword.find("loop_") == 0)
+
+		int sync()
 		{
-			also_has_loop = true;
-			return also_has_loop;
+			return flushBuffer()? 0 : -1;
 		}
-		// Check whether this data blocks ends (because a next one is there)
-		else if (firstword.find("data_") == 0)
+
+		std::streamsize xsputn(const char* s, std::streamsize n)
 		{
-			// Should I reverse the pointer one line?
-			// - Yes, please!!   -- JZ
+			// Small pieces are only copied into the put area
+			if (n < epptr() - pptr())
+			{
+				memcpy(pptr(), s, n);
+				pbump(n);
+				return n;
+			}
 
-			in.seekg(lastGoodPos);
-			return also_has_loop;
+			// Large ones are compressed directly
+			if (!flushBuffer()) return 0;
+			return gzwriteAll(s, n);
 		}
-	}
-	// Reached the end of the file
-	return also_has_loop;
-}
 
-long int MetaDataTable::readStar(std::ifstream& in, const std::string &name, bool do_only_count)
-{
-	std::string line, token, value;
-	clear();
-	bool also_has_loop;
+	private:
 
-	// Start reading the ifstream at the top
-	in.seekg(0);
+		gzFile file;
+		std::vector<char> buffer;
 
-	// Set the version to 30000 by default, in case there is no version tag
-	// (version tags were introduced in version 31000)
-	version = 30000;
+		std::streamsize gzwriteAll(const char* s, std::streamsize n)
+		{
+			std::streamsize written = 0;
+			while (written < n)
+			{
+				const unsigned int len = std::min(n - written, (std::streamsize)(1 << 30));
+				const int w = gzwrite(file, s + written, len);
+				if (w <= 0) break;
+				written += w;
+			}
+			return written;
+		}
+
+		// Compress the contents of the put area and empty it
+		bool flushBuffer()
+		{
+			if (file == NULL) return false;
+			const std::streamsize n = pptr() - pbase();
+			const bool ok = (gzwriteAll(pbase(), n) == n);
+			setp(buffer.data(), buffer.data() + buffer.size());
+			return ok;
+		}
+};
+#endif
+
+// Characters that separate tokens on a line of a STAR file (cf. simplify())
+static inline bool isStarWhiteSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f' || c == '\b' || c == '\a';
+}
+
+// Position of the '\n' that ends the line starting at 'begin', or 'end'
+static inline const char* endOfStarLine(const char* begin, const char* end)
+{
+	const char* eol = (const char*)memchr(begin, '\n', end - begin);
+	return (eol == NULL)? end : eol;
+}
+
+// Start of the line after the one that contains 'pos'
+static inline const char* nextStarLine(const char* pos, const char* end)
+{
+	const char* eol = endOfStarLine(pos, end);
+	return (eol == end)? end : eol + 1;
+}
+
+static inline bool isBlankStarLine(const char* begin, const char* eol)
+{
+	for (const char* c = begin; c < eol; c++)
+	{
+		if (!isStarWhiteSpace(*c)) return false;
+	}
+
+	return true;
+}
+
+/* Next token on the line [pos, eol), following the same rules as nextTokenInSTAR():
+ * returns false at the end of the line or at a comment. Unquoted tokens are returned as a
+ * range inside the buffer, quoted tokens are unescaped into 'unquoted' and the range points there.
+ * This is called from parallel regions, so a missing closing quote is reported through 'bad_quote'. */
+static bool nextTokenInStarLine(const char* &pos, const char* eol,
+		const char* &token_begin, const char* &token_end, std::string &unquoted, bool &bad_quote)
+{
+	while (pos < eol && isStarWhiteSpace(*pos)) pos++;
+
+	if (pos == eol || *pos == '#')
+		return false;
+
+	if (*pos == '\'' || *pos == '"') // quoted string
+	{
+		const char quote = *pos;
+		const char* start = pos + 1;
+		unquoted.clear();
+
+		for (const char* c = start; c < eol; c++)
+		{
+			if (*c == quote && *(c - 1) != '\a' && (c + 1 == eol || isStarWhiteSpace(*(c + 1))))
+			{
+				pos = c + 1;
+				token_begin = unquoted.data();
+				token_end = token_begin + unquoted.size();
+				return true;
+			}
+
+			if (*c != '\a') unquoted += *c;
+		}
+
+		bad_quote = true;
+		return false;
+	}
+
+	token_begin = pos;
+	while (pos < eol && !isStarWhiteSpace(*pos)) pos++;
+	token_end = pos;
+
+	return true;
+}
+
+// Numbers are copied to a terminated buffer first, since the token may end at the end of the file
+static inline double parseStarDouble(const char* begin, const char* end)
+{
+	char buf[64];
+	const size_t n = end - begin;
+	if (n >= sizeof(buf)) return strtod(std::string(begin, end).c_str(), NULL);
+	memcpy(buf, begin, n);
+	buf[n] = '\0';
+	return strtod(buf, NULL);
+}
+
+static inline long parseStarLong(const char* begin, const char* end)
+{
+	char buf[64];
+	const size_t n = end - begin;
+	if (n >= sizeof(buf)) return strtol(std::string(begin, end).c_str(), NULL, 10);
+	memcpy(buf, begin, n);
+	buf[n] = '\0';
+	return strtol(buf, NULL, 10);
+}
+
+// Vectors are written as [1,2,3]
+template<class T>
+static void parseStarVector(const char* begin, const char* end, std::vector<T> &dest)
+{
+	dest.clear();
+	const char* c = begin;
+
+	while (c < end)
+	{
+		while (c < end && (*c == '[' || *c == ',' || *c == ']')) c++;
+		const char* e = c;
+		while (e < end && *e != '[' && *e != ',' && *e != ']') e++;
+		if (e > c) dest.push_back((T)parseStarDouble(c, e));
+		c = e;
+	}
+}
+
+// A range of whole lines of a STAR loop that is parsed by one thread
+struct StarLoopChunk
+{
+	const char *begin, *end;
+	long first_object, nr_objects;
+	std::string error, error_line;
+};
+
+long int MetaDataTable::readStarLoop(const char* &begin, const char* end, bool do_only_count)
+{
+	setIsList(false);
+
+	// First read all the column labels
+	const char* line = begin;
+	while (line < end)
+	{
+		const char* eol = endOfStarLine(line, end);
+		const char* c = line;
+		while (c < eol && isStarWhiteSpace(*c)) c++;
+
+		// TODO: handle comments...
+		if (c == eol || *c == '#' || *c == ';')
+		{
+			line = (eol == end)? end : eol + 1;
+			continue;
+		}
+
+		if (*c == '_') // label definition line
+		{
+			//Only take string from "_" until "#"
+			const char* hash = (const char*)memchr(c, '#', eol - c);
+			const char* e = (hash == NULL)? eol : hash;
+			while (e > c + 1 && isStarWhiteSpace(*(e - 1))) e--;
+
+			std::string token(c + 1, e);
+			EMDLabel label = EMDL::str2Label(token);
+
+			if (label == EMDL_UNDEFINED)
+			{
+				std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << token << std::endl;
+				label = EMDL_UNKNOWN_LABEL;
+			}
+
+			addLabel(label, token);
+
+			line = (eol == end)? end : eol + 1;
+		}
+		else // found first data line
+		{
+			break;
+		}
+	}
+
+	/* Then find all data lines: the loop ends at the first empty line.
+	 * The first megabyte is scanned serially, so that small tables are not
+	 * slowed down by a parallel scan of the rest of the file. */
+	const long serial_size = 1 << 20;
+	const char* block_end = NULL;
+	std::vector<StarLoopChunk> chunks(1);
+
+	chunks[0].begin = line;
+	chunks[0].nr_objects = 0;
+
+	const char* serial_end = (end - line > serial_size)? line + serial_size : end;
+	while (line < serial_end)
+	{
+		const char* eol = endOfStarLine(line, end);
+		if (isBlankStarLine(line, eol))
+		{
+			block_end = line;
+			break;
+		}
+
+		chunks[0].nr_objects++;
+		line = (eol == end)? end : eol + 1;
+	}
+
+	chunks[0].end = line;
+
+	if (block_end == NULL && line < end)
+	{
+		const int nr_threads = getNrThreads();
+		std::vector<StarLoopChunk> pieces(nr_threads);
+		std::vector<const char*> blanks(nr_threads, (const char*)NULL);
+
+		const long piece_size = (end - line) / nr_threads;
+		pieces[0].begin = line;
+		for (int t = 1; t < nr_threads; t++)
+		{
+			const char* b = nextStarLine(line + t * piece_size, end);
+			pieces[t].begin = (b > pieces[t-1].begin)? b : pieces[t-1].begin;
+			pieces[t-1].end = pieces[t].begin;
+		}
+		pieces[nr_threads-1].end = end;
+
+		#pragma omp parallel for num_threads(nr_threads)
+		for (int t = 0; t < nr_threads; t++)
+		{
+			pieces[t].nr_objects = 0;
+			const char* l = pieces[t].begin;
+
+			while (l < pieces[t].end)
+			{
+				const char* eol = endOfStarLine(l, end);
+				if (isBlankStarLine(l, eol))
+				{
+					blanks[t] = l;
+					break;
+				}
+
+				pieces[t].nr_objects++;
+				l = (eol == end)? end : eol + 1;
+			}
+		}
+
+		for (int t = 0; t < nr_threads; t++)
+		{
+			if (pieces[t].begin == pieces[t].end) continue;
+
+			if (blanks[t] != NULL)
+			{
+				pieces[t].end = blanks[t];
+				block_end = blanks[t];
+			}
+
+			chunks.push_back(pieces[t]);
+
+			if (block_end != NULL) break;
+		}
+	}
+
+	// The rest of the file starts after the empty line that ends the loop
+	begin = (block_end == NULL)? end : nextStarLine(block_end, end);
+
+	long int nr_objects = 0;
+	for (int c = 0; c < chunks.size(); c++)
+	{
+		chunks[c].first_object = objectCount + nr_objects;
+		nr_objects += chunks[c].nr_objects;
+	}
+
+	if (do_only_count || nr_objects == 0)
+		return nr_objects;
+
+	// Where to put the values of each column
+	const int num_labels = activeLabels.size();
+	std::vector<EMDLabelType> columnTypes(num_labels);
+	std::vector<long> columnOffsets(num_labels);
+
+	for (int i = 0; i < num_labels; i++)
+	{
+		const EMDLabel label = activeLabels[i];
+
+		if (label == EMDL_UNKNOWN_LABEL)
+		{
+			columnTypes[i] = EMDL_UNKNOWN;
+			columnOffsets[i] = unknownLabelPosition2Offset[i];
+			continue;
+		}
+
+		if (EMDL::isDouble(label)) columnTypes[i] = EMDL_DOUBLE;
+		else if (EMDL::isInt(label)) columnTypes[i] = EMDL_INT;
+		else if (EMDL::isBool(label)) columnTypes[i] = EMDL_BOOL;
+		else if (EMDL::isString(label)) columnTypes[i] = EMDL_STRING;
+		else if (EMDL::isIntVector(label)) columnTypes[i] = EMDL_INT_VECTOR;
+		else columnTypes[i] = EMDL_DOUBLE_VECTOR;
+
+		columnOffsets[i] = label2offset[label];
+	}
+
+	resizeObjects(objectCount + nr_objects);
+
+	// Parse the data lines: each chunk writes into its own range of rows
+	#pragma omp parallel for schedule(dynamic) num_threads(getNrThreads())
+	for (int c = 0; c < chunks.size(); c++)
+	{
+		StarLoopChunk &chunk = chunks[c];
+		std::string unquoted;
+		long objectID = chunk.first_object;
+
+		for (const char* l = chunk.begin; l < chunk.end; objectID++)
+		{
+			const char* eol = endOfStarLine(l, end);
+			const char* pos = l;
+			const char *token_begin, *token_end;
+			int labelPosition = 0;
+			bool bad_quote = false;
+
+			while (nextTokenInStarLine(pos, eol, token_begin, token_end, unquoted, bad_quote))
+			{
+				if (labelPosition >= num_labels)
+				{
+					chunk.error = "A line in the STAR file contains more columns than the number of labels.";
+					break;
+				}
+
+				const long off = columnOffsets[labelPosition];
+
+				switch (columnTypes[labelPosition])
+				{
+					case EMDL_DOUBLE:
+						doubleColumns[off][objectID] = parseStarDouble(token_begin, token_end);
+						break;
+					case EMDL_INT:
+						intColumns[off][objectID] = parseStarLong(token_begin, token_end);
+						break;
+					case EMDL_BOOL:
+						boolColumns[off][objectID] = (parseStarLong(token_begin, token_end) != 0);
+						break;
+					case EMDL_STRING:
+						// Empty strings are stored as "" (see setColumnValue)
+						if (token_begin == token_end) stringColumns[off][objectID] = "\"\"";
+						else stringColumns[off][objectID].assign(token_begin, token_end);
+						break;
+					case EMDL_INT_VECTOR:
+						parseStarVector(token_begin, token_end, intVectorColumns[off][objectID]);
+						break;
+					case EMDL_DOUBLE_VECTOR:
+						parseStarVector(token_begin, token_end, doubleVectorColumns[off][objectID]);
+						break;
+					default:
+						unknownColumns[off][objectID].assign(token_begin, token_end);
+				}
+
+				labelPosition++;
+			}
+
+			if (bad_quote)
+			{
+				chunk.error = "Could not find closing quote in a STAR file.";
+			}
+			else if (chunk.error == "" && labelPosition < num_labels && num_labels > 2)
+			{
+				// For backward-compatibility for cases like "fn_mtf <empty>", don't die if num_labels == 2.
+				chunk.error = "A line in the STAR file contains fewer columns than the number of labels. Expected = "
+					+ integerToString(num_labels) + " Found = " +  integerToString(labelPosition);
+			}
+
+			if (chunk.error != "")
+			{
+				chunk.error_line = std::string(l, eol);
+				break;
+			}
+
+			l = (eol == end)? end : eol + 1;
+		}
+	}
+
+	for (int c = 0; c < chunks.size(); c++)
+	{
+		if (chunks[c].error != "")
+		{
+			std::cerr << "Error in line: " << chunks[c].error_line << std::endl;
+			REPORT_ERROR(chunks[c].error);
+		}
+	}
+
+	// As if the objects had been added one by one
+	current_objectID = objectCount - 1;
+
+	return nr_objects;
+}
+
+bool MetaDataTable::readStarList(const char* &begin, const char* end)
+{
+	setIsList(true);
+	addObject();
+	long int objectID = objectCount - 1;
+
+	std::string line, firstword, value;
+
+	bool also_has_loop = false;
+
+	// Read data and fill structures accordingly
+	int labelPosition = 0;
+	const char* lastGoodPos = begin;
+
+	while (begin < end)
+	{
+		const char* eol = endOfStarLine(begin, end);
+		line.assign(begin, eol);
+		begin = (eol == end)? end : eol + 1;
+
+		int pos = 0;
+		// Ignore empty lines
+		if (!nextTokenInSTAR(line, pos, firstword))
+			continue;
+
+		// Get label-value pairs
+		if (firstword[0] == '_')
+		{
+			std::string token = firstword.substr(1); // get rid of leading underscore
+			EMDLabel label = EMDL::str2Label(token);
+			if (!nextTokenInSTAR(line, pos, value))
+				REPORT_ERROR("MetaDataTable::readStarList: did not encounter a single word after "+firstword);
+
+			if (label == EMDL_UNDEFINED)
+			{
+				label = EMDL_UNKNOWN_LABEL;
+				addLabel(label, token);
+				setUnknownValue(labelPosition, value);
+				std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << token << std::endl;
+			}
+			else
+			{
+				addLabel(label);
+				setValueFromString(label, value, objectID);
+			}
+			labelPosition++;
+
+			lastGoodPos = begin;
+		}
+		// Check whether there is a comment or an empty line
+		else if (firstword[0] == '#' || firstword[0] == ';')
+		{
+			// TODO: handle comments?
+			continue;
+		}
+		// Check whether a loop structure comes after this list
+		else if (firstword.find("loop_") == 0)
+		{
+			also_has_loop = true;
+			return also_has_loop;
+		}
+		// Check whether this data blocks ends (because a next one is there)
+		else if (firstword.find("data_") == 0)
+		{
+			// Should I reverse the pointer one line?
+			// - Yes, please!!   -- JZ
+
+			begin = lastGoodPos;
+			return also_has_loop;
+		}
+	}
+	// Reached the end of the file
+	return also_has_loop;
+}
+
+/* Copy data block "name" (or the first block if name is empty) into memory, starting from
+ * the current position of the stream. The last version line before the block is copied as well,
+ * and the stream is left at the start of the next block (or of its version line). Returns false if the block was not found.
+ */
+static bool copyStarBlock(std::ifstream& in, const std::string &name, std::string &block)
+{
+	std::string line, trimmed, version_line;
+	block.clear();
+
+	while (getline(in, line, '\n'))
+	{
+		trimmed = line;
+		trim(trimmed);
+
+		if (trimmed.find("# version ") != std::string::npos)
+			version_line = line;
+
+		if (trimmed.find("data_") != std::string::npos &&
+		    (name == "" || name == trimmed.substr(trimmed.find("data_") + 5)))
+		{
+			block = version_line + "\n" + line + "\n";
+
+			// Copy all lines up to the next data_ block
+			std::streampos line_start = in.tellg();
+			while (getline(in, line, '\n'))
+			{
+				trimmed = line;
+				trim(trimmed);
+				if (trimmed.compare(0, 5, "data_") == 0 || trimmed.find("# version ") != std::string::npos)
+				{
+					in.seekg(line_start);
+					break;
+				}
+
+				block += line;
+				block += '\n';
+				line_start = in.tellg();
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+long int MetaDataTable::readStar(std::ifstream& in, const std::string &name, bool do_only_count)
+{
+	/* Only the requested block is copied into memory, and parsed from there.
+	 * Blocks are usually read in the order in which they are in the file, so look for
+	 * a named block from the current position first, and only then from the top.
+	 */
+	std::string block;
+	in.clear();
+	// Without a name, the first block is read, which is always at the top
+	if (name == "")
+		in.seekg(0);
+	if (!copyStarBlock(in, name, block) && name != "")
+	{
+		in.clear();
+		in.seekg(0);
+		copyStarBlock(in, name, block);
+	}
+
+	const long int ret = readStar(block.data(), block.data() + block.size(), name, do_only_count);
+
+	// Clear the eofbit so we can perform more actions on the stream.
+	in.clear();
+
+	return ret;
+}
+
+long int MetaDataTable::readStar(const char* begin, const char* end, const std::string &name, bool do_only_count)
+{
+	std::string line, token;
+	clear();
+	bool also_has_loop;
+
+	// Set the version to 30000 by default, in case there is no version tag
+	// (version tags were introduced in version 31000)
+	version = 30000;
+
+	// Proceed until the next data_ or _loop statement
+	// The loop statement may be necessary for data blocks that have a list AND a table inside them
+	const char* pos = begin;
+	while (pos < end)
+	{
+		const char* eol = endOfStarLine(pos, end);
+		line.assign(pos, eol);
+		pos = (eol == end)? end : eol + 1;
+
+		if (line.size() >= 2 && line[line.size() - 1] == '\r')
+		{
+			if (name != "") std::cerr << " table name= " << name << std::endl;
+			std::cerr << " line= " << line << std::endl;
+			REPORT_ERROR("RELION does not support CR+LF as a new line code. Didn't you edit a STAR file in Windows? Convert it to the UNIX style (LF only) by for example `dos2unix` command.");
+		}
+
+		trim(line);
+		if (line.find("# version ") != std::string::npos)
+		{
+			token = line.substr(line.find("# version ") + std::string("# version ").length());
+
+			std::istringstream sts(token);
+			sts >> version;
+		}
+
+		// Find data_ lines
+		if (line.find("data_") != std::string::npos)
+		{
+			token = line.substr(line.find("data_") + 5);
+			// If a name has been given, only read data_thatname
+			// Otherwise, just read the first data_ block
+			if (name == "" || name == token)
+			{
+				setName(token);
+				// Get the next item that starts with "_somelabel" or with "loop_"
+				const char* current_pos = pos;
+				while (pos < end)
+				{
+					eol = endOfStarLine(pos, end);
+					line.assign(pos, eol);
+					pos = (eol == end)? end : eol + 1;
+
+					if (line.find("loop_") != std::string::npos)
+					{
+						return readStarLoop(pos, end, do_only_count);
+					}
+					else if (line[0] == '_')
+					{
+						// go back to the start of the block
+						pos = current_pos;
+						also_has_loop = readStarList(pos, end);
+						return (also_has_loop) ? 0 : 1;
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Binary sidecar cache of STAR files
+ *
+ * Parsing text is by far the slowest part of reading a large STAR file. When the
+ * environment variable RELION_STAR_CACHE is set (to anything but 0), reading a STAR file
+ * of at least STAR_CACHE_MIN_SIZE bytes also writes all its data blocks in binary form
+ * to <file>.bin. Later reads of the same file take the tables from there, for as long as
+ * the size and modification time of the STAR file match the ones stored in the cache.
+ * Labels are stored by name, so the cache remains valid if label ids change.
+ */
+static const size_t STAR_CACHE_MIN_SIZE = 1 << 20;
+static const char STAR_CACHE_MAGIC[8] = {'R', 'L', 'N', 'S', 'T', 'A', 'R', 'B'};
+static const int STAR_CACHE_FORMAT = 1;
+static const int STAR_CACHE_ENDIANNESS = 0x01020304;
+
+static bool useStarCache()
+{
+	const char* env = getenv("RELION_STAR_CACHE");
+	return env != NULL && env[0] != '\0' && strcmp(env, "0") != 0;
+}
+
+static std::string starCacheName(const FileName &fn_star)
+{
+	return fn_star + ".bin";
+}
+
+template <typename T>
+static inline void writeBinaryValue(std::ostream &out, const T &value)
+{
+	out.write((const char*)&value, sizeof(T));
+}
+
+static inline void writeBinaryString(std::ostream &out, const std::string &value)
+{
+	writeBinaryValue(out, (unsigned int)value.size());
+	out.write(value.data(), value.size());
+}
+
+// Reads values from a memory range without running past its end
+class BinaryCursor
+{
+	public:
+
+		BinaryCursor(const char* begin, const char* end)
+		:	pos(begin), end(end)
+		{}
+
+		bool get(void* dest, size_t bytes)
+		{
+			if (bytes > (size_t)(end - pos)) return false;
+			memcpy(dest, pos, bytes);
+			pos += bytes;
+			return true;
+		}
+
+		template <typename T>
+		bool get(T &value)
+		{
+			return get(&value, sizeof(T));
+		}
+
+		bool get(std::string &value)
+		{
+			unsigned int size;
+			if (!get(size) || size > (size_t)(end - pos)) return false;
+			value.assign(pos, size);
+			pos += size;
+			return true;
+		}
+
+		template <typename T>
+		bool get(std::vector<T> &value)
+		{
+			unsigned int size;
+			if (!get(size) || size > (size_t)(end - pos) / sizeof(T)) return false;
+			value.resize(size);
+			return get(value.data(), size * sizeof(T));
+		}
+
+		const char* pos;
+		const char* end;
+};
+
+// The blocks in the cache of a STAR file, if that cache is valid
+class StarCacheBuffer
+{
+	public:
+
+		StarCacheBuffer(const FileName &fn_star)
+		:	buffer(starCacheName(fn_star)), cursor(buffer.begin(), buffer.end()), is_valid(false)
+		{
+			struct stat info;
+			if (!buffer.isOpen() || stat(fn_star.c_str(), &info) != 0) return;
+
+			const std::string stamp = starFileStamp(info);
+			char magic[sizeof(STAR_CACHE_MAGIC)];
+			int format, endianness;
+			std::string cached_stamp;
+
+			is_valid = cursor.get(magic, sizeof(magic)) && memcmp(magic, STAR_CACHE_MAGIC, sizeof(magic)) == 0 &&
+			           cursor.get(format) && format == STAR_CACHE_FORMAT &&
+			           cursor.get(endianness) && endianness == STAR_CACHE_ENDIANNESS &&
+			           cursor.get(cached_stamp) && cached_stamp == stamp;
+		}
+
+		bool isValid() const { return is_valid; }
+
+		// Get the name and the extent of the next block
+		bool nextBlock(std::string &name, const char* &block_begin, const char* &block_end)
+		{
+			unsigned long long size;
+			if (!is_valid || !cursor.get(size) || size > (size_t)(cursor.end - cursor.pos)) return false;
+
+			block_begin = cursor.pos;
+			block_end = cursor.pos + size;
+			cursor.pos = block_end;
+
+			BinaryCursor header(block_begin, block_end);
+			return header.get(name);
+		}
+
+		// Whether all blocks have been read
+		bool atEnd() const { return cursor.pos == cursor.end; }
+
+	private:
+
+		StarFileBuffer buffer;
+		BinaryCursor cursor;
+		bool is_valid;
+};
+
+static EMDLabelType labelType(EMDLabel label)
+{
+	if (label == EMDL_UNKNOWN_LABEL) return EMDL_UNKNOWN;
+	else if (EMDL::isDouble(label)) return EMDL_DOUBLE;
+	else if (EMDL::isInt(label)) return EMDL_INT;
+	else if (EMDL::isBool(label)) return EMDL_BOOL;
+	else if (EMDL::isString(label)) return EMDL_STRING;
+	else if (EMDL::isIntVector(label)) return EMDL_INT_VECTOR;
+	else if (EMDL::isDoubleVector(label)) return EMDL_DOUBLE_VECTOR;
+	else return EMDL_UNKNOWN;
+}
+
+void MetaDataTable::writeBinary(std::ostream &out, int text_version, bool followed_by_loop) const
+{
+	writeBinaryString(out, name);
+	writeBinaryString(out, comment);
+	writeBinaryValue(out, text_version);
+	writeBinaryValue(out, (char)isList);
+	writeBinaryValue(out, (char)followed_by_loop);
+	writeBinaryValue(out, (long long)objectCount);
+	writeBinaryValue(out, (long long)activeLabels.size());
+
+	for (long i = 0; i < activeLabels.size(); i++)
+	{
+		const EMDLabel label = activeLabels[i];
+		writeBinaryString(out, (label == EMDL_UNKNOWN_LABEL)? getUnknownLabelNameAt(i) : EMDL::label2Str(label));
+		writeBinaryValue(out, (int)labelType(label));
+	}
+
+	for (long i = 0; i < activeLabels.size(); i++)
+	{
+		const EMDLabel label = activeLabels[i];
+
+		if (label == EMDL_UNKNOWN_LABEL)
+		{
+			const std::vector<std::string> &column = unknownColumns[unknownLabelPosition2Offset[i]];
+			for (long j = 0; j < objectCount; j++) writeBinaryString(out, column[j]);
+			continue;
+		}
+
+		const long off = label2offset[label];
+
+		switch (labelType(label))
+		{
+			case EMDL_DOUBLE:
+				out.write((const char*)doubleColumns[off].data(), objectCount * sizeof(double));
+				break;
+			case EMDL_INT:
+				out.write((const char*)intColumns[off].data(), objectCount * sizeof(long));
+				break;
+			case EMDL_BOOL:
+				out.write((const char*)boolColumns[off].data(), objectCount * sizeof(char));
+				break;
+			case EMDL_STRING:
+				for (long j = 0; j < objectCount; j++) writeBinaryString(out, stringColumns[off][j]);
+				break;
+			case EMDL_INT_VECTOR:
+				for (long j = 0; j < objectCount; j++)
+				{
+					const std::vector<int> &v = intVectorColumns[off][j];
+					writeBinaryValue(out, (unsigned int)v.size());
+					out.write((const char*)v.data(), v.size() * sizeof(int));
+				}
+				break;
+			case EMDL_DOUBLE_VECTOR:
+				for (long j = 0; j < objectCount; j++)
+				{
+					const std::vector<double> &v = doubleVectorColumns[off][j];
+					writeBinaryValue(out, (unsigned int)v.size());
+					out.write((const char*)v.data(), v.size() * sizeof(double));
+				}
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+bool MetaDataTable::readBinary(const char* begin, const char* end, int &text_version, bool &followed_by_loop)
+{
+	clear();
+
+	BinaryCursor in(begin, end);
+	std::string block_name, block_comment;
+	char is_list, has_loop;
+	long long nr_objects, nr_labels;
 
-	// Proceed until the next data_ or _loop statement
-	// The loop statement may be necessary for data blocks that have a list AND a table inside them
-	while (getline(in, line, '\n'))
+	if (!in.get(block_name) || !in.get(block_comment) || !in.get(text_version) ||
+	    !in.get(is_list) || !in.get(has_loop) || !in.get(nr_objects) || !in.get(nr_labels))
+		return false;
+
+	setName(block_name);
+	setComment(block_comment);
+	setIsList(is_list);
+	followed_by_loop = has_loop;
+
+	for (long long i = 0; i < nr_labels; i++)
 	{
-		if (line.size() >= 2 && line[line.size() - 1] == '\r')
+		std::string label_name;
+		int type;
+		if (!in.get(label_name) || !in.get(type)) return false;
+
+		if (type == EMDL_UNKNOWN)
 		{
-			if (name != "") std::cerr << " table name= " << name << std::endl;
-			std::cerr << " line= " << line << std::endl;
-			REPORT_ERROR("RELION does not support CR+LF as a new line code. Didn't you edit a STAR file in Windows? Convert it to the UNIX style (LF only) by for example `dos2unix` command.");
+			addLabel(EMDL_UNKNOWN_LABEL, label_name);
+		}
+		else
+		{
+			// The definition of a label may have changed since the cache was written
+			const EMDLabel label = EMDL::str2Label(label_name);
+			if (label == EMDL_UNDEFINED || labelType(label) != type) return false;
+			addLabel(label);
 		}
+	}
 
-		trim(line);
-		if (line.find("# version ") != std::string::npos)
+	if (activeLabels.size() != nr_labels) return false;
+
+	resizeObjects(nr_objects);
+
+	for (long i = 0; i < activeLabels.size(); i++)
+	{
+		const EMDLabel label = activeLabels[i];
+
+		if (label == EMDL_UNKNOWN_LABEL)
 		{
-			token = line.substr(line.find("# version ") + std::string("# version ").length());
+			std::vector<std::string> &column = unknownColumns[unknownLabelPosition2Offset[i]];
+			for (long j = 0; j < objectCount; j++)
+				if (!in.get(column[j])) return false;
+			continue;
+		}
 
-			std::istringstream sts(token);
-			sts >> version;
+		const long off = label2offset[label];
+		bool ok = true;
+
+		switch (labelType(label))
+		{
+			case EMDL_DOUBLE:
+				ok = in.get(doubleColumns[off].data(), objectCount * sizeof(double));
+				break;
+			case EMDL_INT:
+				ok = in.get(intColumns[off].data(), objectCount * sizeof(long));
+				break;
+			case EMDL_BOOL:
+				ok = in.get(boolColumns[off].data(), objectCount * sizeof(char));
+				break;
+			case EMDL_STRING:
+				for (long j = 0; ok && j < objectCount; j++) ok = in.get(stringColumns[off][j]);
+				break;
+			case EMDL_INT_VECTOR:
+				for (long j = 0; ok && j < objectCount; j++) ok = in.get(intVectorColumns[off][j]);
+				break;
+			case EMDL_DOUBLE_VECTOR:
+				for (long j = 0; ok && j < objectCount; j++) ok = in.get(doubleVectorColumns[off][j]);
+				break;
+			default:
+				break;
 		}
 
-		// Find data_ lines
-		if (line.find("data_") != std::string::npos)
+		if (!ok) return false;
+	}
+
+	// As if the objects had been added one by one
+	current_objectID = objectCount - 1;
+
+	return in.pos == end;
+}
+
+bool MetaDataTable::readBinaryCache(const FileName &fn_star, const std::string &name, long int &ret)
+{
+	StarCacheBuffer cache(fn_star);
+	if (!cache.isValid()) return false;
+
+	std::string block_name;
+	const char *block_begin, *block_end;
+
+	while (cache.nextBlock(block_name, block_begin, block_end))
+	{
+		if (name == "" || name == block_name)
 		{
-			token = line.substr(line.find("data_") + 5);
-			// If a name has been given, only read data_thatname
-			// Otherwise, just read the first data_ block
-			if (name == "" || name == token)
+			int text_version;
+			bool followed_by_loop;
+
+			if (!readBinary(block_begin, block_end, text_version, followed_by_loop))
 			{
-				setName(token);
-				// Get the next item that starts with "_somelabel" or with "loop_"
-				int current_pos = in.tellg();
-				while (getline(in, line, '\n'))
-				{
-					if (line.find("loop_") != std::string::npos)
-					{
-						return readStarLoop(in, do_only_count);
-					}
-					else if (line[0] == '_')
-					{
-						// go back one line in the ifstream
-						in.seekg(current_pos);
-						also_has_loop = readStarList(in);
-						return (also_has_loop) ? 0 : 1;
-					}
-				}
+				clear();
+				return false;
 			}
+
+			version = text_version;
+
+			// Same return values as readStar
+			if (isList) ret = (followed_by_loop)? 0 : 1;
+			else ret = objectCount;
+
+			return true;
 		}
 	}
 
-	// Clear the eofbit so we can perform more actions on the stream.
-	in.clear();
+	if (!cache.atEnd()) return false;
 
-	return 0;
+	// No such data block in the file
+	clear();
+	version = 30000;
+	ret = 0;
+
+	return true;
+}
+
+bool MetaDataTable::readAllBinaryCache(const FileName &fn_star, std::vector<MetaDataTable> &out)
+{
+	StarCacheBuffer cache(fn_star);
+	if (!cache.isValid()) return false;
+
+	std::string block_name;
+	std::vector<const char*> block_begins, block_ends;
+	const char *block_begin, *block_end;
+
+	while (cache.nextBlock(block_name, block_begin, block_end))
+	{
+		block_begins.push_back(block_begin);
+		block_ends.push_back(block_end);
+	}
+
+	if (!cache.atEnd()) return false;
+
+	out.clear();
+	out.resize(block_begins.size());
+
+	int text_version;
+	bool followed_by_loop;
+
+	for (int i = 0; i < out.size(); i++)
+	{
+		// readAll does not set the version of the tables
+		if (!out[i].readBinary(block_begins[i], block_ends[i], text_version, followed_by_loop))
+			return false;
+	}
+
+	return true;
+}
+
+void MetaDataTable::writeBinaryCache(const FileName &fn_star, const std::string &stamp,
+		const std::vector<MetaDataTable> &tables, const std::vector<int> &versions,
+		const std::vector<bool> &followed_by_loop)
+{
+	// Write to a temporary file and move it into place, so that other processes reading
+	// the same STAR file never see an incomplete cache.
+	// The cache is optional: if it cannot be written (e.g. in a read-only directory), do without.
+	const std::string fn_cache = starCacheName(fn_star);
+	const std::string fn_tmp = fn_cache + ".tmp" + integerToString(getpid());
+
+	std::ofstream fh(fn_tmp.c_str(), std::ios::out | std::ios::binary);
+	if (!fh) return;
+
+	fh.write(STAR_CACHE_MAGIC, sizeof(STAR_CACHE_MAGIC));
+	writeBinaryValue(fh, STAR_CACHE_FORMAT);
+	writeBinaryValue(fh, STAR_CACHE_ENDIANNESS);
+	writeBinaryString(fh, stamp);
+
+	for (int i = 0; i < tables.size(); i++)
+	{
+		// Each block is preceded by its size, so that readers can skip it
+		const std::streampos size_pos = fh.tellp();
+		writeBinaryValue(fh, (unsigned long long)0);
+
+		tables[i].writeBinary(fh, versions[i], followed_by_loop[i]);
+
+		const std::streampos end_pos = fh.tellp();
+		fh.seekp(size_pos);
+		writeBinaryValue(fh, (unsigned long long)(end_pos - size_pos - sizeof(unsigned long long)));
+		fh.seekp(end_pos);
+	}
+
+	fh.close();
+
+	if (!fh || std::rename(fn_tmp.c_str(), fn_cache.c_str()) != 0)
+		std::remove(fn_tmp.c_str());
 }
 
 std::vector<MetaDataTable> MetaDataTable::readAll(const std::string &in, int expectedNumber, bool do_only_count)
 {
-	std::ifstream ifs(in);
-	return readAll(ifs, expectedNumber, do_only_count);
+	const bool use_cache = !do_only_count && useStarCache();
+	std::vector<MetaDataTable> out;
+
+	if (use_cache && readAllBinaryCache(in, out))
+		return out;
+
+	StarFileBuffer buffer(in);
+
+	if (!use_cache || buffer.end() - buffer.begin() < STAR_CACHE_MIN_SIZE)
+		return readAll(buffer.begin(), buffer.end(), expectedNumber, do_only_count);
+
+	std::vector<int> versions;
+	std::vector<bool> followed_by_loop;
+	out = readAll(buffer.begin(), buffer.end(), expectedNumber, do_only_count, &versions, &followed_by_loop);
+	writeBinaryCache(in, buffer.getStamp(), out, versions, followed_by_loop);
+
+	return out;
 }
 
 std::vector<MetaDataTable> MetaDataTable::readAll(
 		std::ifstream &in,
 		int expectedNumber,
 		bool do_only_count)
+{
+	// Read the whole stream into memory and parse it from there
+	in.clear();
+	in.seekg(0, std::ios::end);
+	const std::streamoff size = in.tellg();
+	in.seekg(0);
+
+	std::string contents;
+	if (size > 0)
+	{
+		contents.resize(size);
+		in.read(&contents[0], size);
+		contents.resize(in.gcount());
+	}
+
+	in.clear();
+
+	return readAll(contents.data(), contents.data() + contents.size(), expectedNumber, do_only_count);
+}
+
+std::vector<MetaDataTable> MetaDataTable::readAll(
+		const char* begin, const char* end,
+		int expectedNumber,
+		bool do_only_count,
+		std::vector<int> *versions,
+		std::vector<bool> *followed_by_loop)
 {
 	std::vector<MetaDataTable> out(0);
 	out.reserve(expectedNumber);
 
 	std::string line;
 
-	// Start reading the ifstream at the top
-	in.seekg(0);
-
 	// Set the version to 30000 by default, in case there is no version tag
 	// (version tags were introduced in version 31000)
 	int version = 30000;
 
 	// Proceed until the next data_ or _loop statement
 	// The loop statement may be necessary for data blocks that have a list AND a table inside them
-	while (getline(in, line, '\n'))
+	const char* pos = begin;
+	while (pos < end)
 	{
+		const char* eol = endOfStarLine(pos, end);
+		line.assign(pos, eol);
+		pos = (eol == end)? end : eol + 1;
+
 		trim(line);
 
 		if (line.find("# version ") != std::string::npos)
@@ -1314,20 +2459,28 @@ std::vector<MetaDataTable> MetaDataTable::readAll(
 
 			mdt.setName(nameStr);
 
-			int current_pos = in.tellg();
+			if (versions != NULL) versions->push_back(version);
+			if (followed_by_loop != NULL) followed_by_loop->push_back(false);
 
-			while (getline(in, line, '\n'))
+			const char* current_pos = pos;
+
+			while (pos < end)
 			{
+				eol = endOfStarLine(pos, end);
+				line.assign(pos, eol);
+				pos = (eol == end)? end : eol + 1;
+
 				if (line.find("loop_") != std::string::npos)
 				{
-					mdt.readStarLoop(in, do_only_count);
+					mdt.readStarLoop(pos, end, do_only_count);
 					break;
 				}
 				else if (line[0] == '_')
 				{
-					// go back one line in the ifstream
-					in.seekg(current_pos);
-					bool also_has_loop = mdt.readStarList(in);
+					// go back to the start of the block
+					pos = current_pos;
+					bool also_has_loop = mdt.readStarList(pos, end);
+					if (followed_by_loop != NULL) followed_by_loop->back() = also_has_loop;
 					break;
 				}
 			}
@@ -1336,6 +2489,7 @@ std::vector<MetaDataTable> MetaDataTable::readAll(
 
 	return out;
 }
+
 long int MetaDataTable::read(const FileName &filename, const std::string &name, bool do_only_count)
 {
 
@@ -1345,16 +2499,32 @@ long int MetaDataTable::read(const FileName &filename, const std::string &name,
 	// Check for an :star extension
 	FileName fn_read = filename.removeFileFormat();
 
-	std::ifstream in(fn_read.data(), std::ios_base::in);
+	const bool use_cache = !do_only_count && useStarCache();
+	long int ret;
+
+	if (use_cache && readBinaryCache(fn_read, name, ret))
+	{
+		firstObject();
+		return ret;
+	}
+
+	StarFileBuffer buffer(fn_read);
 
-	if (in.fail())
+	if (!buffer.isOpen())
 	{
 		REPORT_ERROR( (std::string) "MetaDataTable::read: File " + fn_read + " does not exist" );
 	}
 
-	const long int ret = readStar(in, name, do_only_count);
+	ret = readStar(buffer.begin(), buffer.end(), name, do_only_count);
 
-	in.close();
+	if (use_cache && buffer.end() - buffer.begin() >= STAR_CACHE_MIN_SIZE)
+	{
+		// The cache holds all data blocks, not only the one that was asked for
+		std::vector<int> versions;
+		std::vector<bool> followed_by_loop;
+		std::vector<MetaDataTable> tables = readAll(buffer.begin(), buffer.end(), 0, false, &versions, &followed_by_loop);
+		writeBinaryCache(fn_read, buffer.getStamp(), tables, versions, followed_by_loop);
+	}
 
 	// Go to the first object
 	firstObject();
@@ -1362,6 +2532,79 @@ long int MetaDataTable::read(const FileName &filename, const std::string &name,
 	return ret;
 }
 
+// Append a value to a row of a STAR file, as 'out.width(10); out << value << " "' would
+static inline void appendStarValue(std::string &text, const char* value, int len)
+{
+	if (len < 10) text.append(10 - len, ' ');
+	text.append(value, len);
+	text += ' ';
+}
+
+void MetaDataTable::writeStarRows(std::string &text, long first, long last) const
+{
+	char buffer[14];
+	std::string val;
+
+	for (long idx = first; idx < last; idx++)
+	{
+		std::string entryComment = "";
+
+		for (long i = 0; i < activeLabels.size(); i++)
+		{
+			const EMDLabel l = activeLabels[i];
+
+			if (l == EMDL_UNKNOWN_LABEL)
+			{
+				val = unknownColumns[unknownLabelPosition2Offset[i]][idx];
+				escapeStringForSTAR(val);
+				appendStarValue(text, val.data(), val.size());
+			}
+			else if (l == EMDL_COMMENT)
+			{
+				getColumnValue(label2offset[l], idx, entryComment);
+			}
+			else if (l == EMDL_SORTED_IDX)
+			{
+				continue;
+			}
+			else if (EMDL::isDouble(l))
+			{
+				const int len = formatStarDouble(doubleColumns[label2offset[l]][idx], buffer);
+				appendStarValue(text, buffer, len);
+			}
+			else if (EMDL::isInt(l))
+			{
+				const int len = formatStarLong(intColumns[label2offset[l]][idx], buffer);
+				appendStarValue(text, buffer, len);
+			}
+			else if (EMDL::isBool(l))
+			{
+				const int len = formatStarLong(boolColumns[label2offset[l]][idx] != 0, buffer);
+				appendStarValue(text, buffer, len);
+			}
+			else if (EMDL::isString(l))
+			{
+				getColumnValue(label2offset[l], idx, val);
+				escapeStringForSTAR(val);
+				appendStarValue(text, val.data(), val.size());
+			}
+			else
+			{
+				getValueToString(l, val, idx, true); // escape=true
+				appendStarValue(text, val.data(), val.size());
+			}
+		}
+
+		if (entryComment != std::string(""))
+		{
+			text += "# ";
+			text += entryComment;
+		}
+
+		text += '\n';
+	}
+}
+
 void MetaDataTable::write(std::ostream& out) const
 {
 	// Only write tables that have something in them
@@ -1404,42 +2647,64 @@ void MetaDataTable::write(std::ostream& out) const
 			}
 		}
 
-		// Write actual data block
-		for (long int idx = 0; idx < objects.size(); idx++)
+		// Write actual data block:
+		// ranges of rows are formatted in parallel and written in order
+		const long rows_per_chunk = 4096;
+		const long nr_chunks = (objectCount + rows_per_chunk - 1) / rows_per_chunk;
+
+		// Errors cannot leave the parallel region: the first one is thrown after it
+		RelionError *thread_error = NULL;
+		#pragma omp parallel for ordered schedule(dynamic, 1) num_threads(getNrThreads())
+		for (long c = 0; c < nr_chunks; c++)
 		{
-			std::string entryComment = "";
+			const long first = c * rows_per_chunk;
+			const long last = std::min(first + rows_per_chunk, objectCount);
 
-			for (long i = 0; i < activeLabels.size(); i++)
+			std::string text;
+			if (thread_error == NULL)
 			{
-				EMDLabel l = activeLabels[i];
-
-				if (l == EMDL_UNKNOWN_LABEL)
+				try
 				{
-					out.width(10);
-					std::string token, val;
-					long offset = unknownLabelPosition2Offset[i];
-					val = objects[idx]->unknowns[offset];
-					escapeStringForSTAR(val);
-					out << val << " ";
+					text.reserve((last - first) * 16 * activeLabels.size());
+					writeStarRows(text, first, last);
 				}
-				else if (l != EMDL_COMMENT && l != EMDL_SORTED_IDX)
+				catch (RelionError XE)
 				{
-					out.width(10);
-					std::string val;
-					getValueToString(l, val, idx, true); // escape=true
-					out << val << " ";
-				}
-				if (l == EMDL_COMMENT)
-				{
-					getValue(EMDL_COMMENT, entryComment, idx);
+					#pragma omp critical(MetaDataTable_thread_error)
+					{
+						if (thread_error == NULL)
+							thread_error = new RelionError(XE);
+					}
 				}
 			}
-			if (entryComment != std::string(""))
+
+			#pragma omp ordered
 			{
-				out << "# " << entryComment;
+				if (thread_error == NULL)
+				{
+					try
+					{
+						out.write(text.data(), text.size());
+					}
+					catch (RelionError XE)
+					{
+						#pragma omp critical(MetaDataTable_thread_error)
+						{
+							if (thread_error == NULL)
+								thread_error = new RelionError(XE);
+						}
+					}
+				}
 			}
-			out << "\n";
 		}
+
+		if (thread_error != NULL)
+		{
+			RelionError XE(*thread_error);
+			delete thread_error;
+			throw XE;
+		}
+
 		// Finish table with a white-line
 		out << " \n";
 
@@ -1478,7 +2743,7 @@ void MetaDataTable::write(std::ostream& out) const
 			{
 				std::string labelName = getUnknownLabelNameAt(i);
 				int w = labelName.length();
-				out << "_" << labelName << std::setw(12 + maxWidth - w) << " " << objects[0]->unknowns[unknownLabelPosition2Offset[i]] << "\n";
+				out << "_" << labelName << std::setw(12 + maxWidth - w) << " " << unknownColumns[unknownLabelPosition2Offset[i]][0] << "\n";
 			}
 			else if (l != EMDL_COMMENT)
 			{
@@ -1502,17 +2767,37 @@ void MetaDataTable::write(std::ostream& out) const
 
 void MetaDataTable::write(const FileName &fn_out) const
 {
-	std::ofstream  fh;
 	FileName fn_tmp = fn_out + ".tmp";
-	fh.open((fn_tmp).c_str(), std::ios::out);
-	if (!fh)
-		REPORT_ERROR( (std::string)"MetaDataTable::write: cannot write to file: " + fn_out);
-//	fh << "# RELION; version " << g_RELION_VERSION << std::endl;
-	write(fh);
-	fh.close();
+
+	if (fn_out.getExtension() == "gz")
+	{
+		// Compressed output (read() recognises compressed files automatically)
+#ifdef HAVE_ZLIB
+		GzipStreamBuffer buffer(fn_tmp);
+		if (!buffer.isOpen())
+			REPORT_ERROR( (std::string)"MetaDataTable::write: cannot write to file: " + fn_out);
+		std::ostream fh(&buffer);
+		write(fh);
+		fh.flush();
+		if (!fh || !buffer.close())
+			REPORT_ERROR( (std::string)"MetaDataTable::write: error while writing to file: " + fn_out);
+#else
+		REPORT_ERROR( (std::string)"MetaDataTable::write: cannot write compressed file " + fn_out + ": RELION was compiled without zlib.");
+#endif
+	}
+	else
+	{
+		std::ofstream  fh;
+		fh.open((fn_tmp).c_str(), std::ios::out);
+		if (!fh)
+			REPORT_ERROR( (std::string)"MetaDataTable::write: cannot write to file: " + fn_out);
+//		fh << "# RELION; version " << g_RELION_VERSION << std::endl;
+		write(fh);
+		fh.close();
+	}
+
 	// Rename to prevent errors with programs in pipeliner reading in incomplete STAR files
 	std::rename(fn_tmp.c_str(), fn_out.c_str());
-
 }
 
 void MetaDataTable::columnHistogram(EMDLabel label, std::vector<RFLOAT> &histX, std::vector<RFLOAT> &histY,
@@ -1693,7 +2978,7 @@ void MetaDataTable::addToCPlot2D(CPlot2D *plot2D, EMDLabel xaxis, EMDLabel yaxis
 	double mydbl;
 	long int myint;
 	double xval, yval;
-	for (long int idx = 0; idx < objects.size(); idx++)
+	for (long int idx = 0; idx < objectCount; idx++)
 	{
 		const long offx = label2offset[xaxis];
 		if (offx < 0)
@@ -1705,12 +2990,12 @@ void MetaDataTable::addToCPlot2D(CPlot2D *plot2D, EMDLabel xaxis, EMDLabel yaxis
 		}
 		else if (EMDL::isDouble(xaxis))
 		{
-			objects[idx]->getValue(offx, mydbl);
+			getColumnValue(offx, idx, mydbl);
 			xval = mydbl;
 		}
 		else if (EMDL::isInt(xaxis))
 		{
-			objects[idx]->getValue(offx, myint);
+			getColumnValue(offx, idx, myint);
 			xval = myint;
 		}
 		else
@@ -1722,12 +3007,12 @@ void MetaDataTable::addToCPlot2D(CPlot2D *plot2D, EMDLabel xaxis, EMDLabel yaxis
 
 		if (EMDL::isDouble(yaxis))
 		{
-			objects[idx]->getValue(offy, mydbl);
+			getColumnValue(offy, idx, mydbl);
 			yval = mydbl;
 		}
 		else if (EMDL::isInt(yaxis))
 		{
-			objects[idx]->getValue(offy, myint);
+			getColumnValue(offy, idx, myint);
 			yval = myint;
 		}
 		else
@@ -1756,21 +3041,123 @@ void MetaDataTable::printLabels(std::ostream &ost)
 
 void MetaDataTable::randomiseOrder()
 {
-	std::random_shuffle(objects.begin(), objects.end());
+	std::vector<long> order(objectCount);
+	for (long i = 0; i < objectCount; i++)
+	{
+		order[i] = i;
+	}
+
+	std::random_shuffle(order.begin(), order.end());
+	permuteObjects(order);
 }
 
 void MetaDataTable::checkObjectID(long id, std::string caller) const
 {
-	if (id >= objects.size() || id < 0)
+	if (id >= objectCount || id < 0)
 	{
 		std::stringstream sts0, sts1;
 		sts0 << id;
-		sts1 << objects.size();
+		sts1 << objectCount;
 		REPORT_ERROR(caller+": object " + sts0.str()
 					 + " out of bounds! (" + sts1.str() + " objects present)");
 	}
 }
 
+void MetaDataTable::getColumnValue(long offset, long row, double& dest) const
+{
+	dest = doubleColumns[offset][row];
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, float& dest) const
+{
+	dest = (float)doubleColumns[offset][row];
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, int& dest) const
+{
+	dest = (int)intColumns[offset][row];
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, long& dest) const
+{
+	dest = intColumns[offset][row];
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, bool& dest) const
+{
+	dest = boolColumns[offset][row];
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, std::vector<int>& dest) const
+{
+	dest = intVectorColumns[offset][row];
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, std::vector<double>& dest) const
+{
+	dest = doubleVectorColumns[offset][row];
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, std::vector<float>& dest) const
+{
+	const std::vector<double> &src = doubleVectorColumns[offset][row];
+	dest.resize(src.size());
+	std::copy(src.begin(), src.end(), dest.begin());
+}
+
+void MetaDataTable::getColumnValue(long offset, long row, std::string& dest) const
+{
+	const std::string &src = stringColumns[offset][row];
+	dest = (src == "\"\"") ? "" : src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const double& src)
+{
+	doubleColumns[offset][row] = src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const float& src)
+{
+	doubleColumns[offset][row] = src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const int& src)
+{
+	intColumns[offset][row] = src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const long& src)
+{
+	intColumns[offset][row] = src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const bool& src)
+{
+	boolColumns[offset][row] = src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const std::string& src)
+{
+	stringColumns[offset][row] = (src.length() == 0) ? "\"\"" : src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const std::vector<int>& src)
+{
+	intVectorColumns[offset][row] = src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const std::vector<double>& src)
+{
+	doubleVectorColumns[offset][row] = src;
+}
+
+void MetaDataTable::setColumnValue(long offset, long row, const std::vector<float>& src)
+{
+	std::vector<double> &dest = doubleVectorColumns[offset][row];
+	dest.resize(src.size());
+	std::copy(src.begin(), src.end(), dest.begin());
+}
+
 //FIXME: does not support unknownLabels but this function is only used by relion_star_handler
 //       so I will leave this for future...
 void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
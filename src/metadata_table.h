@@ -75,15 +75,17 @@
  *	- each row represents a data point
  *	- the rows are stored in per-type contiguous blocks of memory
  *
- *	2020/Nov/12:
- *	  This class is organized as an array (`objects`) of structures (`MetaDataContainer`).
+ *	  This class is organized as a structure of arrays: every label is stored as one
+ *	  contiguous, typed column (`doubleColumns`, `intColumns`, etc). A `MetaDataContainer`
+ *	  is only a (table, row) handle that is used to copy rows between tables.
+ *	  STAR files are read through a memory map and the rows of a loop are parsed in parallel.
  *
  *        `activeLabels` contains all valid labels.
- *        Even when a label is `deactivateLabel`-ed, the values remain in `MetaDataContainer`s.
+ *        Even when a label is `deactivateLabel`-ed, the values remain in its column.
  *        The label is only removed from `activeLabels`.
  *
- *        Each data type (int, double, etc) contains its own storage array inside `MetaDataContainer`.
- *        Thus, values in `label2offsets` are NOT unique. Accessing columns via a wrong type is
+ *        Each data type (int, double, etc) has its own set of columns.
+ *        Thus, values in `label2offset` are NOT unique. Accessing columns via a wrong type is
  *        very DANGEROUS. Use `cmake -DMDT_TYPE_CHECK=ON` to enable runtime checks.
  *
  *        Handling of labels unknown to RELION needs care.
@@ -95,20 +97,30 @@
  *        Whenever `activeLabels` is modified, `unknownLabelPosition2Offset` MUST be updated accordingly.
  *        When the label for a column is EMD_UNKNOWN_LABEL, the corresponding element in
  *        `unknownLabelPosition2Offset` must store the offset in `unknownLabelNames` and
- *        `MetaDataContainer->unknowns`. Otherwise, the value does not matter.
+ *        `unknownColumns`. Otherwise, the value does not matter.
  */
 class MetaDataTable
 {
-	// Effectively stores all metadata
-	std::vector<MetaDataContainer*> objects;
-
-	// Maps labels to corresponding indices in the vectors in MetaDataContainer.
+	// Effectively stores all metadata: one column per label and data type.
+	// Booleans are stored as char, so that different rows can be set concurrently.
+	std::vector<std::vector<double> > doubleColumns;
+	std::vector<std::vector<long> > intColumns;
+	std::vector<std::vector<char> > boolColumns;
+	std::vector<std::vector<std::string> > stringColumns;
+	std::vector<std::vector<std::vector<int> > > intVectorColumns;
+	std::vector<std::vector<std::vector<double> > > doubleVectorColumns;
+	std::vector<std::vector<std::string> > unknownColumns;
+
+	// Number of objects (rows) in every column
+	long objectCount;
+
+	// Maps labels to corresponding indices in the column vectors.
 	// The length of label2offset is always equal to the number of defined labels (~320)
 	// e.g.:
 	// the value of "defocus-U" for row r is stored in:
-	//	 objects[r]->doubles[label2offset[EMDL_CTF_DEFOCUSU]]
+	//	 doubleColumns[label2offset[EMDL_CTF_DEFOCUSU]][r]
 	// the value of "image name" is stored in:
-	//	 objects[r]->strings[label2offset[EMDL_IMAGE_NAME]]
+	//	 stringColumns[label2offset[EMDL_IMAGE_NAME]][r]
 	std::vector<long> label2offset;
 
 	/** What labels have been read from a docfile/metadata file
@@ -123,9 +135,6 @@ class MetaDataTable
 	// Current object id
 	long current_objectID;
 
-	// Number of labels of each type
-	long doubleLabels, intLabels, boolLabels, stringLabels, intVectorLabels, doubleVectorLabels, unknownLabels;
-
 	// Is this a 2D table or a 1D list?
 	bool isList;
 
@@ -171,6 +180,13 @@ public:
 	int getVersion() const;
 	static int getCurrentVersion();
 
+	/* Number of threads used to parse and write STAR loops
+	 * By default, this is omp_get_max_threads(); programs with a --j option should set it,
+	 * so that several MPI processes on one node do not oversubscribe it.
+	 */
+	static void setNrThreads(int nr_threads);
+	static int getNrThreads();
+
 	// getValue: returns true if the label exists
 	// objectID is 0-indexed.
 	template<class T>
@@ -231,8 +247,8 @@ public:
 	// insert all missing labels
 	void append(const MetaDataTable& app);
 
-	// Get metadatacontainer for objectID (current_objectID if objectID < 0)
-	MetaDataContainer* getObject(long objectID = -1) const;
+	// Get a handle to row objectID (current_objectID if objectID < 0)
+	MetaDataContainer getObject(long objectID = -1) const;
 
 	/* setObject(data, objectID)
 	 *  copies values from 'data' to object 'objectID'.
@@ -241,7 +257,7 @@ public:
 	 *  Undefined labels are inserted.
 	 *
 	 *  Use addObject() to set an object that does not yet exist */
-	void setObject(MetaDataContainer* data, long objectID = -1);
+	void setObject(const MetaDataContainer &data, long objectID = -1);
 
 	/* setValuesOfDefinedLabels(data, objectID)
 	 * copies values from 'data' to object 'objectID'.
@@ -250,7 +266,7 @@ public:
 	 * Only already defined labels are considered.
 	 *
 	 * Use addValuesOfDefinedLabels() to add an object that does not yet exist */
-	void setValuesOfDefinedLabels(MetaDataContainer* data, long objectID = -1);
+	void setValuesOfDefinedLabels(const MetaDataContainer &data, long objectID = -1);
 
 	// reserve memory for this many lines
 	void reserve(size_t capacity);
@@ -264,13 +280,13 @@ public:
 	 *  Adds a new object and sets its values to those from 'data'.
 	 *  The set of labels for the table is extended as necessary.
 	 *  Afterwards, 'current_objectID' points to the newly added object.*/
-	void addObject(MetaDataContainer* data);
+	void addObject(const MetaDataContainer &data);
 
 	/* addValuesOfDefinedLabels(data)
 	 *  Adds a new object and sets the already defined values to those from 'data'.
 	 *  Labels from 'data' that are not already defined are ignored.
 	 *  Afterwards, 'current_objectID' points to the newly added object.*/
-	void addValuesOfDefinedLabels(MetaDataContainer* data);
+	void addValuesOfDefinedLabels(const MetaDataContainer &data);
 
 	/* removeObject(objectID)
 	 *  If objectID is not given, 'current_objectID' will be removed.
@@ -286,13 +302,6 @@ public:
 
 	long goToObject(long objectID);
 
-	// Read a STAR loop structure
-	long int readStarLoop(std::ifstream& in, bool do_only_count = false);
-
-	/* Read a STAR list
-	 * The function returns true if the list is followed by a loop, false otherwise */
-	bool readStarList(std::ifstream& in);
-
 	/* Read a MetaDataTable from a STAR-format data block
 	 *
 	 * If the data block contains a list and a table, the function will return 2,
@@ -372,7 +381,75 @@ private:
 
 	/* setObjectUnsafe(data)
 	 *  Same as setObject, but assumes that all labels are present. */
-	void setObjectUnsafe(MetaDataContainer* data, long objId);
+	void setObjectUnsafe(const MetaDataContainer &data, long objId);
+
+	// Resize all columns to n objects, filling new rows with default values
+	void resizeObjects(long n);
+
+	// Reorder all columns so that new row i is old row order[i]
+	void permuteObjects(const std::vector<long> &order);
+
+	// Read a STAR loop structure from [begin, end); returns the number of objects.
+	// 'begin' is advanced to the first line after the loop.
+	long int readStarLoop(const char* &begin, const char* end, bool do_only_count = false);
+
+	/* Read a STAR list from [begin, end)
+	 * The function returns true if the list is followed by a loop, false otherwise.
+	 * 'begin' is advanced past the list (and past the loop_ statement, if any). */
+	bool readStarList(const char* &begin, const char* end);
+
+	// Read a data block from a STAR file that is held in memory (see readStar)
+	long int readStar(const char* begin, const char* end, const std::string &name, bool do_only_count);
+
+	/* Read all data blocks from a STAR file that is held in memory (see readAll)
+	 * Optionally, also return for each block the version tag that preceded it
+	 * and whether it is a list that is followed by a loop (as readStar needs to know). */
+	static std::vector<MetaDataTable> readAll(const char* begin, const char* end,
+			int expectedNumber, bool do_only_count,
+			std::vector<int> *versions = NULL, std::vector<bool> *followed_by_loop = NULL);
+
+	/* Binary sidecar cache of all data blocks in a STAR file (see RELION_STAR_CACHE)
+	 *
+	 * writeBinary/readBinary (de)serialise a single table, including the version tag of
+	 * the STAR file and whether a list was followed by a loop, so that read() can return
+	 * exactly what readStar would have returned. */
+	void writeBinary(std::ostream &out, int text_version, bool followed_by_loop) const;
+	bool readBinary(const char* begin, const char* end, int &text_version, bool &followed_by_loop);
+
+	// Read data block 'name' (or the first one) from the cache of fn_star; false if there is no valid cache
+	bool readBinaryCache(const FileName &fn_star, const std::string &name, long int &ret);
+
+	// Read all data blocks from the cache of fn_star; false if there is no valid cache
+	static bool readAllBinaryCache(const FileName &fn_star, std::vector<MetaDataTable> &out);
+
+	// Write the cache for a STAR file held in memory; 'stamp' identifies the version of the file
+	static void writeBinaryCache(const FileName &fn_star, const std::string &stamp,
+			const std::vector<MetaDataTable> &tables, const std::vector<int> &versions,
+			const std::vector<bool> &followed_by_loop);
+
+	// Append rows [first, last) of a loop in STAR format to text (see write)
+	void writeStarRows(std::string &text, long first, long last) const;
+
+	// Typed access to the columns
+	void getColumnValue(long offset, long row, double& dest) const;
+	void getColumnValue(long offset, long row, float& dest) const;
+	void getColumnValue(long offset, long row, int& dest) const;
+	void getColumnValue(long offset, long row, long& dest) const;
+	void getColumnValue(long offset, long row, bool& dest) const;
+	void getColumnValue(long offset, long row, std::string& dest) const;
+	void getColumnValue(long offset, long row, std::vector<int>& dest) const;
+	void getColumnValue(long offset, long row, std::vector<double>& dest) const;
+	void getColumnValue(long offset, long row, std::vector<float>& dest) const;
+
+	void setColumnValue(long offset, long row, const double& src);
+	void setColumnValue(long offset, long row, const float& src);
+	void setColumnValue(long offset, long row, const int& src);
+	void setColumnValue(long offset, long row, const long& src);
+	void setColumnValue(long offset, long row, const bool& src);
+	void setColumnValue(long offset, long row, const std::string& src);
+	void setColumnValue(long offset, long row, const std::vector<int>& src);
+	void setColumnValue(long offset, long row, const std::vector<double>& src);
+	void setColumnValue(long offset, long row, const std::vector<float>& src);
 
 };
 
@@ -450,7 +527,7 @@ bool MetaDataTable::getValue(EMDLabel label, T& value, long objectID) const
 			checkObjectID(objectID,  "MetaDataTable::getValue");
 		}
 
-		objects[objectID]->getValue(off, value);
+		getColumnValue(off, objectID, value);
 		return true;
 	}
 	else
@@ -496,7 +573,7 @@ bool MetaDataTable::setValue(EMDLabel label, const T &value, long int objectID)
 
 	if (off > -1)
 	{
-		objects[objectID]->setValue(off, value);
+		setColumnValue(off, objectID, value);
 		return true;
 	}
 	else
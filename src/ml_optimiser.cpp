@@ -63,6 +63,7 @@
     #define TBB_PREVIEW_GLOBAL_CONTROL 1
     #include <tbb/global_control.h>
     #include "src/acc/cpu/cpu_ml_optimiser.h"
+    #include "src/acc/cpu/cpu_kernels/diff2.h"
 #endif
 
 #define NR_CLASS_MUTEXES 5
@@ -71,6 +72,22 @@
 static omp_lock_t global_mutex2[NR_CLASS_MUTEXES] = {};
 static omp_lock_t global_mutex;
 
+static PrereadCompression textToPrereadCompression(const std::string &text)
+{
+    if (text == "float32")
+        return PREREAD_FLOAT32;
+    if (text == "float16")
+        return PREREAD_FLOAT16;
+    if (text == "float16_lz")
+    {
+#ifndef HAVE_ZLIB
+        REPORT_ERROR("--preread_compression float16_lz: RELION was compiled without zlib; use float16 instead");
+#endif
+        return PREREAD_FLOAT16_LZ;
+    }
+    REPORT_ERROR("Unknown value for --preread_compression: " + text + " (use float32, float16 or float16_lz)");
+}
+
 /** ========================== Threaded parallelization of expectation === */
 
 void globalThreadExpectationSomeParticles(void *self, int thread_id)
@@ -459,10 +476,16 @@ void MlOptimiser::parseContinue(int argc, char **argv)
 
     x_pool = textToInteger(parser.getOption("--pool", "Number of images to pool for each thread task", "1"));
     nr_threads = textToInteger(parser.getOption("--j", "Number of threads to run in parallel (only useful on multi-core machines)", "1"));
+    MetaDataTable::setNrThreads(nr_threads);
+    nr_prefetch_threads = textToInteger(parser.getOption("--prefetch_threads", "Number of extra threads that read particle images from disc while the others process them (0: read all images of a pool before processing them)", "0"));
+    private_bp_mem_Gb = textToFloat(parser.getOption("--private_bp_mem", "Memory (in Gb) for thread-private copies of the backprojectors, so that threads do not wait for each other to backproject (0: all threads share them)", "2"));
+    projector_precision = textToProjectorPrecision(parser.getOption("--projector_precision", "Precision of the references in the CPU expectation step: double (or float in single-precision builds), float or half (float16). Lower precision saves memory", "double"));
+    do_trace = parser.checkOption("--trace", "Write a trace of how much time each thread spends in each step to _itXXX_trace.json for every iteration (for chrome://tracing or ui.perfetto.dev)");
     do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
     combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
     do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
     do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
+    mydata.preread_compression = textToPrereadCompression(parser.getOption("--preread_compression", "How to store the images of --preread_images in memory: float32, float16 (half the RAM) or float16_lz (half precision, compressed)", "float32"));
     fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
     keep_free_scratch_Gb = textToFloat(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
     do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data. This works only when ALL particles have already been cached.");
@@ -894,10 +917,16 @@ void MlOptimiser::parseInitial(int argc, char **argv)
     int computation_section = parser.addSection("Computation");
     x_pool = textToInteger(parser.getOption("--pool", "Number of images to pool for each thread task", "1"));
     nr_threads = textToInteger(parser.getOption("--j", "Number of threads to run in parallel (only useful on multi-core machines)", "1"));
+    MetaDataTable::setNrThreads(nr_threads);
+    nr_prefetch_threads = textToInteger(parser.getOption("--prefetch_threads", "Number of extra threads that read particle images from disc while the others process them (0: read all images of a pool before processing them)", "0"));
+    private_bp_mem_Gb = textToFloat(parser.getOption("--private_bp_mem", "Memory (in Gb) for thread-private copies of the backprojectors, so that threads do not wait for each other to backproject (0: all threads share them)", "2"));
+    projector_precision = textToProjectorPrecision(parser.getOption("--projector_precision", "Precision of the references in the CPU expectation step: double (or float in single-precision builds), float or half (float16). Lower precision saves memory", "double"));
+    do_trace = parser.checkOption("--trace", "Write a trace of how much time each thread spends in each step to _itXXX_trace.json for every iteration (for chrome://tracing or ui.perfetto.dev)");
     combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
     do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
     do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
     do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
+    mydata.preread_compression = textToPrereadCompression(parser.getOption("--preread_compression", "How to store the images of --preread_images in memory: float32, float16 (half the RAM) or float16_lz (half precision, compressed)", "float32"));
     fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
     keep_free_scratch_Gb = textToFloat(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
     do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data.");
@@ -1559,6 +1588,11 @@ void MlOptimiser::initialise()
     std::cerr<<"MlOptimiser::initialise Entering"<<std::endl;
 #endif
 
+#ifdef ALTCPU
+    if (do_cpu && verb > 0)
+        std::cout << " Using the " << CpuKernels::diff2_coarse_tile_isa() << " kernel for the coarse search on the CPU" << std::endl;
+#endif
+
     if (do_gpu)
     {
 #if defined _CUDA_ENABLED || defined _HIP_ENABLED
@@ -2799,11 +2833,7 @@ void MlOptimiser::calculateSumOfPowerSpectraAndAverageImage(MultidimArray<RFLOAT
         Image<RFLOAT> img;
         if (do_preread_images && do_parallel_disc_io)
         {
-            img().reshape(mydata.particles[part_id].img);
-            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].img)
-            {
-                DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].img, n);
-            }
+            mydata.getPrereadImage(part_id, img());
         }
         else
         {
@@ -3215,6 +3245,9 @@ void MlOptimiser::iterateSetup()
     omp_init_lock(&global_mutex);
     for (int i = 0; i < NR_CLASS_MUTEXES; i++)
         omp_init_lock(global_mutex2 + i);
+
+    if (do_trace)
+        PerformanceTrace::enable();
 }
 void MlOptimiser::iterateWrapUp()
 {
@@ -3280,6 +3313,7 @@ void MlOptimiser::iterate()
 #ifdef TIMING
         timer.tic(TIMING_EXP);
 #endif
+        const int trace_iter = iter;
 
         if (gradient_refine && iter < 10) {
             nr_iter_wo_resol_gain = 0;
@@ -3355,7 +3389,11 @@ void MlOptimiser::iterate()
         //if (grad_pseudo_halfsets)
         //	std::cerr << "DEBUG: doing pseudo gold standard" << std::endl;
 
+        PerformanceTrace::begin("expectation");
         expectation();
+        PerformanceTrace::end();
+        if (PerformanceTrace::enabled() && PerformanceTrace::nrOpenSpans() > 0)
+            REPORT_ERROR("BUG: " + integerToString(PerformanceTrace::nrOpenSpans()) + " spans of the performance trace are still open after the expectation step");
 
 
         // Sjors & Shaoda Apr 2015
@@ -3392,10 +3430,13 @@ void MlOptimiser::iterate()
                 write(DO_WRITE_SAMPLING, DO_WRITE_DATA, DO_WRITE_OPTIMISER, DO_WRITE_MODEL, 0);
             else // Only write data.star file and break from the iteration loop
                 write(DONT_WRITE_SAMPLING, DO_WRITE_DATA, DONT_WRITE_OPTIMISER, DONT_WRITE_MODEL, 0);
+            writePerformanceTrace(trace_iter);
             break;
         }
 
+        PerformanceTrace::begin("maximization");
         maximization();
+        PerformanceTrace::end();
 
 #ifdef TIMING
         timer.toc(TIMING_MAX);
@@ -3471,6 +3512,7 @@ void MlOptimiser::iterate()
 #ifdef TIMING
         timer.toc(TIMING_ITER_WRITE);
 #endif
+        writePerformanceTrace(trace_iter);
 
 #ifdef TIMING
         if (verb > 0)
@@ -3490,6 +3532,29 @@ void MlOptimiser::iterate()
 
 }
 
+void MlOptimiser::compactReferences()
+{
+    // The accelerated code paths keep their own copies of the references
+    if (do_gpu || do_sycl || do_cpu || projector_precision == PROJECTOR_FULL_PRECISION)
+        return;
+
+    #pragma omp parallel for num_threads(nr_threads)
+    for (int i = 0; i < mymodel.PPref.size(); i++)
+        mymodel.PPref[i].compactData(projector_precision);
+}
+
+void MlOptimiser::writePerformanceTrace(int iteration, int rank)
+{
+    if (!do_trace)
+        return;
+
+    FileName fn_trace;
+    fn_trace.compose(fn_out + "_it", iteration, "", 3);
+    if (rank >= 0)
+        fn_trace += "_rank" + integerToString(rank, 3);
+    PerformanceTrace::write(fn_trace + "_trace.json");
+}
+
 void MlOptimiser::expectation()
 {
 
@@ -3689,6 +3754,8 @@ void MlOptimiser::expectation()
     fftw_plan_with_nthreads(1);
 #endif
 
+    compactReferences();
+
     // Now perform real expectation over all particles
     // Use local parameters here, as also done in the same overloaded function in MlOptimiserMpi
 
@@ -3781,6 +3848,9 @@ void MlOptimiser::expectation()
     if (verb > 0)
         progress_bar(my_nr_particles);
 
+    // Add the thread-private backprojections of the non-accelerated code to wsum_model
+    mergePrivateBackprojectors();
+
 #if defined _CUDA_ENABLED || defined _HIP_ENABLED
     if (do_gpu)
     {
@@ -3951,7 +4021,10 @@ void MlOptimiser::expectation()
 
     // Clean up some memory
     for (int iclass = 0; iclass < mymodel.nr_classes; iclass++)
+    {
         mymodel.PPref[iclass].data.clear();
+        mymodel.PPref[iclass].clearCompactData();
+    }
 
 #ifdef DEBUG_EXP
     std::cerr << "Expectation: done " << std::endl;
@@ -4066,7 +4139,13 @@ void MlOptimiser::expectationSetupCheckMemory(int myverb)
         RFLOAT Gb = sizeof(RFLOAT) / (1024. * 1024. * 1024.);
         // A. Calculate approximate size of the reference maps
         // Forward projector has complex data, backprojector has complex data and real weight
-        RFLOAT mem_references = Gb * mymodel.nr_classes * (2 * MULTIDIM_SIZE((mymodel.PPref[0]).data) + 3 * MULTIDIM_SIZE((wsum_model.BPref[0]).data));
+        // The forward projector may only be kept in --projector_precision during the expectation step
+        RFLOAT projector_scale = 1.;
+        if (!do_gpu && !do_sycl && !do_cpu && projector_precision == PROJECTOR_FLOAT)
+            projector_scale = sizeof(float) / (RFLOAT)sizeof(RFLOAT);
+        else if (!do_gpu && !do_sycl && !do_cpu && projector_precision == PROJECTOR_HALF)
+            projector_scale = sizeof(float16) / (RFLOAT)sizeof(RFLOAT);
+        RFLOAT mem_references = Gb * mymodel.nr_classes * (2 * projector_scale * MULTIDIM_SIZE((mymodel.PPref[0]).data) + 3 * MULTIDIM_SIZE((wsum_model.BPref[0]).data));
         // B. Weight vectors
         RFLOAT mem_pool = Gb * mymodel.nr_classes * sampling.NrSamplingPoints(adaptive_oversampling,
                 &pointer_dir_nonzeroprior, &pointer_psi_nonzeroprior);
@@ -4087,6 +4166,14 @@ void MlOptimiser::expectationSetupCheckMemory(int myverb)
             mem_rest += Gb * nr_pix * sampling.NrTranslationalSamplings(adaptive_oversampling);
         }
 
+        // F. Thread-private copies of the backprojectors
+        if (!do_gpu && !do_sycl && !do_cpu && nr_threads > 1)
+        {
+            RFLOAT mem_bp_copy = Gb * 3 * wsum_model.BPref.size() * MULTIDIM_SIZE((wsum_model.BPref[0]).data);
+            if (mem_bp_copy > 0.)
+                mem_rest += mem_bp_copy * XMIPP_MIN(nr_threads, (int)(private_bp_mem_Gb / mem_bp_copy));
+        }
+
         RFLOAT total_mem_Gb_exp = mem_references + nr_pool * mem_pool + mem_rest;
         // Each reconstruction has to store 1 extra complex array (Fconv) and 4 extra RFLOAT arrays (Fweight, Fnewweight. vol_out and Mconv in convoluteBlobRealSpace),
         // in adddition to the RFLOAT weight-array and the complex data-array of the BPref
@@ -4146,6 +4233,11 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
     long int dump;
     FileName fn_img, fn_stack, fn_open_stack="";
 
+    // With prefetch threads, the images are read in the background while the particles are being processed
+    // Multi-body refinement asks for the image of a particle once for every body, so then all images are read beforehand
+    exp_do_prefetch = (nr_prefetch_threads > 0 && do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3 && mymodel.nr_bodies == 1);
+    std::vector<FileName> fn_prefetch;
+
     // Store total number of particle images in this bunch of SomeParticles, and set translations and orientations for skip_align/rotate
     exp_imgs.clear();
     int metadata_offset = 0;
@@ -4228,6 +4320,12 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
                 }
             }
 
+            if (exp_do_prefetch)
+            {
+                fn_prefetch.push_back(fn_img);
+                continue;
+            }
+
             // Only open again a new stackname
             fn_img.decompose(dump, fn_stack);
             if (fn_stack != fn_open_stack)
@@ -4239,7 +4337,10 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 #ifdef DEBUG_BODIES
             std::cerr << " fn_img= " << fn_img << " part_id= " << part_id << std::endl;
 #endif
-            img.readFromOpenFile(fn_img, hFile, -1, false);
+            {
+                TraceSpan trace_span("read image");
+                img.readFromOpenFile(fn_img, hFile, -1, false);
+            }
             img().setXmippOrigin();
             exp_imgs.push_back(img());
 
@@ -4251,15 +4352,41 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 #ifdef DEBUG_EXPSOME
     std::cerr << " exp_my_first_part_id= " << exp_my_first_part_id << " exp_my_last_part_id= " << exp_my_last_part_id << std::endl;
 #endif
+    // Processing threads take the images from a ring of buffers that is a few images ahead of them
+    if (exp_do_prefetch)
+        exp_prefetcher.reset(fn_prefetch, 2 * (nr_threads + nr_prefetch_threads), (do_cpu) ? 1 : nr_threads);
+
+    if (!do_gpu && !do_sycl && !do_cpu && !do_skip_maximization)
+        setupPrivateBackprojectors();
+
     if (!do_cpu)
     {
         // GPU and traditional CPU case - use RELION's built-in task manager to
         // process multiple particles at once
         exp_ipart_ThreadTaskDistributor->resize(my_last_part_id - my_first_part_id + 1, 1);
         exp_ipart_ThreadTaskDistributor->reset();
-        #pragma omp parallel for num_threads(nr_threads)
-        for (int thread_id = 0; thread_id < nr_threads; thread_id++)
-            globalThreadExpectationSomeParticles(this, thread_id);
+        if (exp_do_prefetch)
+        {
+            #pragma omp parallel num_threads(nr_threads + nr_prefetch_threads)
+            {
+                int thread_id = omp_get_thread_num();
+                if (thread_id < nr_threads)
+                {
+                    globalThreadExpectationSomeParticles(this, thread_id);
+                    exp_prefetcher.finished();
+                }
+                else
+                {
+                    exp_prefetcher.readImages();
+                }
+            }
+        }
+        else
+        {
+            #pragma omp parallel for num_threads(nr_threads)
+            for (int thread_id = 0; thread_id < nr_threads; thread_id++)
+                globalThreadExpectationSomeParticles(this, thread_id);
+        }
     }
 #ifdef ALTCPU
     else
@@ -4273,21 +4400,50 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
         // Set the size of the TBB thread pool for these particles
         tbb::global_control gc(tbb::global_control::max_allowed_parallelism, nr_threads);
         // process all passed particles in parallel
-        //for(unsigned long i=my_first_part_id; i<=my_last_part_id; i++) {
-        tbb::parallel_for(my_first_part_id, my_last_part_id+1, [&](long int i) {
-            CpuOptimiserType::reference ref = tbbCpuOptimiser.local();
-            MlOptimiserCpu *cpuOptimiser = (MlOptimiserCpu *)ref;
-            if(cpuOptimiser == NULL) {
-                cpuOptimiser = new MlOptimiserCpu(this, (MlDataBundle*)accDataBundles[0], "cpu_optimiser");
-                cpuOptimiser->resetData();
-                ref = cpuOptimiser;
-
-                cpuOptimiser->thread_id = tCount.fetch_add(1);
-            }  // cpuOptimiser == NULL
-
-            cpuOptimiser->expectationOneParticle(i, cpuOptimiser->thread_id);
-        });
-        //}
+        auto processParticles = [&]() {
+            tbb::parallel_for(my_first_part_id, my_last_part_id+1, [&](long int i) {
+                CpuOptimiserType::reference ref = tbbCpuOptimiser.local();
+                MlOptimiserCpu *cpuOptimiser = (MlOptimiserCpu *)ref;
+                if(cpuOptimiser == NULL) {
+                    cpuOptimiser = new MlOptimiserCpu(this, (MlDataBundle*)accDataBundles[0], "cpu_optimiser");
+                    cpuOptimiser->resetData();
+                    ref = cpuOptimiser;
+
+                    cpuOptimiser->thread_id = tCount.fetch_add(1);
+                }  // cpuOptimiser == NULL
+
+                cpuOptimiser->expectationOneParticle(i, cpuOptimiser->thread_id);
+            });
+        };
+
+        if (exp_do_prefetch)
+        {
+            // The TBB threads process the particles, the other OpenMP threads read their images
+            #pragma omp parallel num_threads(1 + nr_prefetch_threads)
+            {
+                if (omp_get_thread_num() == 0)
+                {
+                    try
+                    {
+                        processParticles();
+                    }
+                    catch (RelionError XE)
+                    {
+                        threadException = new RelionError(XE.msg, XE.file, XE.line);
+                        threadException->msg = XE.msg;
+                    }
+                    exp_prefetcher.finished();
+                }
+                else
+                {
+                    exp_prefetcher.readImages();
+                }
+            }
+        }
+        else
+        {
+            processParticles();
+        }
     }  // do_cpu
 #endif  // ifdef ALTCPU
 
@@ -4302,6 +4458,76 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 }
 
 
+void MlOptimiser::setupPrivateBackprojectors()
+{
+    // Already done in this expectation step?
+    if (exp_private_BPref.size() > 0 || nr_threads < 2 || private_bp_mem_Gb <= 0.)
+        return;
+
+    // Memory for one copy of all backprojectors
+    RFLOAT Gb_per_copy = 0.;
+    for (int ibp = 0; ibp < wsum_model.BPref.size(); ibp++)
+        Gb_per_copy += (MULTIDIM_SIZE(wsum_model.BPref[ibp].data) * sizeof(Complex) +
+                        MULTIDIM_SIZE(wsum_model.BPref[ibp].weight) * sizeof(RFLOAT)) / (1024. * 1024. * 1024.);
+    if (Gb_per_copy <= 0.)
+        return;
+
+    // If not all threads get a copy, the others backproject into wsum_model.BPref inside the class mutexes
+    int nr_copies = XMIPP_MIN(nr_threads, (int)(private_bp_mem_Gb / Gb_per_copy));
+    if (nr_copies < 1)
+        return;
+
+    exp_private_BPref.resize(nr_copies);
+    #pragma omp parallel for num_threads(nr_threads)
+    for (int icopy = 0; icopy < nr_copies; icopy++)
+    {
+        exp_private_BPref[icopy].resize(wsum_model.BPref.size());
+        for (int ibp = 0; ibp < wsum_model.BPref.size(); ibp++)
+        {
+            BackProjector &BP = exp_private_BPref[icopy][ibp];
+            BP = wsum_model.BPref[ibp];
+            BP.data.initZeros();
+            BP.weight.initZeros();
+        }
+    }
+}
+
+void MlOptimiser::mergePrivateBackprojectors()
+{
+    if (exp_private_BPref.size() == 0)
+        return;
+
+    for (int ibp = 0; ibp < wsum_model.BPref.size(); ibp++)
+    {
+        MultidimArray<Complex> &data = wsum_model.BPref[ibp].data;
+        MultidimArray<RFLOAT> &weight = wsum_model.BPref[ibp].weight;
+        if (XSIZE(data) == 0)
+            continue;
+
+        // Each thread adds up the same rows of all copies
+        long int nr_rows = MULTIDIM_SIZE(data) / XSIZE(data);
+        #pragma omp parallel for num_threads(nr_threads)
+        for (long int irow = 0; irow < nr_rows; irow++)
+        {
+            long int n0 = irow * XSIZE(data), n1 = n0 + XSIZE(data);
+            for (int icopy = 0; icopy < exp_private_BPref.size(); icopy++)
+            {
+                const BackProjector &BP = exp_private_BPref[icopy][ibp];
+                for (long int n = n0; n < n1; n++)
+                {
+                    DIRECT_MULTIDIM_ELEM(data, n) += DIRECT_MULTIDIM_ELEM(BP.data, n);
+                    DIRECT_MULTIDIM_ELEM(weight, n) += DIRECT_MULTIDIM_ELEM(BP.weight, n);
+                }
+            }
+        }
+
+        for (int icopy = 0; icopy < exp_private_BPref.size(); icopy++)
+            exp_private_BPref[icopy][ibp].clear();
+    }
+
+    exp_private_BPref.clear();
+}
+
 void MlOptimiser::doThreadExpectationSomeParticles(int thread_id)
 {
 
@@ -4428,7 +4654,7 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
         int exp_current_image_size, exp_current_oversampling;
         std::vector<RFLOAT> exp_highres_Xi2_img;
         MultidimArray<RFLOAT> exp_Mweight, exp_STMulti, exp_local_Minvsigma2;
-        MultidimArray<bool> exp_Mcoarse_significant;
+        SignificantSamples exp_significant_samples;
         // And from storeWeightedSums
         RFLOAT exp_min_diff2, exp_sum_weight, exp_significant_weight, exp_max_weight;
         Matrix1D<RFLOAT> exp_old_offset, exp_prior;
@@ -4460,10 +4686,12 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
             timer.tic(TIMING_ESP_FT);
         }
 #endif
+        PerformanceTrace::begin("FT/CTF prep");
         getFourierTransformsAndCtfs(part_id, ibody, metadata_offset, exp_Fimg, exp_Fimg_nomask, exp_Fctf,
                 exp_old_offset, exp_prior, exp_power_imgs, exp_highres_Xi2_img,
                 exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior,
                 exp_directions_prior, exp_psi_prior, exp_STMulti);
+        PerformanceTrace::end();
 
 #ifdef TIMING
         if (part_id_sorted == exp_my_first_part_id)
@@ -4538,12 +4766,14 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
 #endif
 
             // Calculate the squared difference terms inside the Gaussian kernel for all hidden variables
+            PerformanceTrace::begin((exp_ipass == 0) ? "coarse diff2" : "fine diff2");
             getAllSquaredDifferences(part_id, ibody, exp_ipass, exp_current_oversampling,
                     metadata_offset, exp_idir_min, exp_idir_max, exp_ipsi_min, exp_ipsi_max,
                     exp_itrans_min, exp_itrans_max, exp_iclass_min, exp_iclass_max, exp_min_diff2, exp_highres_Xi2_img,
-                    exp_Fimg, exp_Fctf, exp_old_offset, exp_Mweight, exp_Mcoarse_significant,
+                    exp_Fimg, exp_Fctf, exp_old_offset, exp_Mweight, exp_significant_samples,
                     exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior, exp_directions_prior, exp_psi_prior,
                     exp_local_Fimgs_shifted, exp_local_Minvsigma2, exp_local_Fctf, exp_local_sqrtXi2, exp_STMulti);
+            PerformanceTrace::end();
 
 
 #ifdef DEBUG_ESP_MEM
@@ -4558,12 +4788,14 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
 
             // Now convert the squared difference terms to weights,
             // also calculate exp_sum_weight, and in case of adaptive oversampling also exp_significant_weight
+            PerformanceTrace::begin("weights");
             convertAllSquaredDifferencesToWeights(part_id, ibody, exp_ipass, exp_current_oversampling, metadata_offset,
                     exp_idir_min, exp_idir_max, exp_ipsi_min, exp_ipsi_max,
                     exp_itrans_min, exp_itrans_max, exp_iclass_min, exp_iclass_max,
-                    exp_Mweight, exp_Mcoarse_significant, exp_significant_weight,
+                    exp_Mweight, exp_significant_samples, exp_significant_weight,
                     exp_sum_weight, exp_old_offset, exp_prior, exp_min_diff2,
                     exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior, exp_directions_prior, exp_psi_prior);
+            PerformanceTrace::end();
 
 #ifdef DEBUG_ESP_MEM
         if (thread_id==0)
@@ -4646,15 +4878,17 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
         #pragma omp barrier
 #endif
 
+        PerformanceTrace::begin("storeWeightedSums");
         storeWeightedSums(part_id, ibody, exp_current_oversampling, metadata_offset,
                 exp_idir_min, exp_idir_max, exp_ipsi_min, exp_ipsi_max,
                 exp_itrans_min, exp_itrans_max, exp_iclass_min, exp_iclass_max,
                 exp_min_diff2, exp_highres_Xi2_img, exp_Fimg, exp_Fimg_nomask, exp_Fctf,
-                exp_power_imgs, exp_old_offset, exp_prior, exp_Mweight, exp_Mcoarse_significant,
+                exp_power_imgs, exp_old_offset, exp_prior, exp_Mweight, exp_significant_samples,
                 exp_significant_weight, exp_sum_weight, exp_max_weight,
                 exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior, exp_directions_prior, exp_psi_prior,
                 exp_local_Fimgs_shifted, exp_local_Fimgs_shifted_nomask, exp_local_Minvsigma2, exp_local_Fctf,
                 exp_local_sqrtXi2, exp_STMulti);
+        PerformanceTrace::end();
 
 #ifdef RELION_TESTING
 //		std::string mode;
@@ -5817,6 +6051,14 @@ void MlOptimiser::updateImageSizeAndResolutionPointers()
 }
 
 
+void MlOptimiser::getPooledImage(int metadata_offset, MultidimArray<RFLOAT> &img)
+{
+    if (exp_do_prefetch)
+        exp_prefetcher.getImage(metadata_offset, img);
+    else
+        img = exp_imgs[metadata_offset];
+}
+
 void MlOptimiser::getFourierTransformsAndCtfs(
         long int part_id, int ibody, int metadata_offset,
         std::vector<MultidimArray<Complex > > &exp_Fimg,
@@ -6128,12 +6370,7 @@ void MlOptimiser::getFourierTransformsAndCtfs(
         // If all followers had preread images into RAM: get those now
         if (do_preread_images)
         {
-            img().reshape(mydata.particles[part_id].img);
-
-            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].img)
-            {
-                DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].img, n);
-            }
+            mydata.getPrereadImage(part_id, img());
         }
         else
         {
@@ -6154,7 +6391,7 @@ void MlOptimiser::getFourierTransformsAndCtfs(
             }
             else
             {
-                img() = exp_imgs[metadata_offset];
+                getPooledImage(metadata_offset, img());
             }
 
         }
@@ -7084,7 +7321,7 @@ void MlOptimiser::getAllSquaredDifferences(long int part_id, int ibody,
         std::vector<MultidimArray<RFLOAT> > &exp_Fctf,
         Matrix1D<RFLOAT> &exp_old_offset,
         MultidimArray<RFLOAT> &exp_Mweight,
-        MultidimArray<bool> &exp_Mcoarse_significant,
+        SignificantSamples &exp_significant_samples,
         std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
         std::vector<RFLOAT> &exp_directions_prior, std::vector<RFLOAT> &exp_psi_prior,
         std::vector<std::vector<MultidimArray<Complex > > > &exp_local_Fimgs_shifted,
@@ -7124,10 +7361,12 @@ void MlOptimiser::getAllSquaredDifferences(long int part_id, int ibody,
     RFLOAT my_pixel_size = mydata.getImagePixelSize(part_id);
     int optics_group = mydata.getOpticsGroup(part_id);
 
-    exp_Mweight.resize(mymodel.nr_classes * exp_nr_dir * exp_nr_psi * exp_nr_trans * exp_nr_oversampled_rot * exp_nr_oversampled_trans);
+    // In the second pass, only the (oversampled) weights of the significant samples of the first pass are stored
+    long int exp_nr_samples = (exp_ipass == 0) ? mymodel.nr_classes * exp_nr_dir * exp_nr_psi * exp_nr_trans : exp_significant_samples.size();
+    exp_Mweight.resize(exp_nr_samples * exp_nr_oversampled_rot * exp_nr_oversampled_trans);
     exp_Mweight.initConstant(-999.);
     if (exp_ipass==0)
-        exp_Mcoarse_significant.clear();
+        exp_significant_samples.clear();
 
     exp_min_diff2 = LARGE_NUMBER;
 
@@ -7201,8 +7440,7 @@ void MlOptimiser::getAllSquaredDifferences(long int part_id, int ibody,
                     // In the first pass, always proceed
                     // In the second pass, check whether one of the translations for this orientation had a significant weight in the first pass
                     // if so, proceed with projecting the reference in that direction
-                    bool do_proceed = (exp_ipass==0) ? true :
-                        isSignificantAnyImageAnyTranslation(iorientclass, exp_itrans_min, exp_itrans_max, exp_Mcoarse_significant);
+                    bool do_proceed = (exp_ipass==0) ? true : exp_significant_samples.isSignificant(iorientclass);
 
                     if (do_proceed && pdf_orientation > 0.)
                     {
@@ -7278,389 +7516,381 @@ void MlOptimiser::getAllSquaredDifferences(long int part_id, int ibody,
                                     }
                                 }
 
-                                long int ihidden = iorientclass * exp_nr_trans;
-                                for (long int itrans = exp_itrans_min; itrans <= exp_itrans_max; itrans++, ihidden++)
+                                // In the first pass, loop over all translations
+                                // In the second pass, only over the translations that had a significant weight (for this orientation) in the first pass
+                                long int isample_start = (exp_ipass == 0) ? iorientclass * exp_nr_trans : exp_significant_samples.first(iorientclass);
+                                long int isample_end = (exp_ipass == 0) ? isample_start + exp_nr_trans : exp_significant_samples.first(iorientclass + 1);
+                                for (long int ihidden = isample_start; ihidden < isample_end; ihidden++)
                                 {
-#ifdef DEBUG_CHECKSIZES
-                                    if (exp_ipass > 0 && ihidden >= XSIZE(exp_Mcoarse_significant))
-                                    {
-                                        std::cerr<< "ihidden= "<<ihidden<<" XSIZE(exp_Mcoarse_significant)= "<< XSIZE(exp_Mcoarse_significant) <<std::endl;
-                                        REPORT_ERROR("ihidden >= XSIZE(exp_Mcoarse_significant)");
-                                    }
-#endif
-                                    // In the first pass, always proceed
-                                    // In the second pass, check whether this translations (&orientation) had a significant weight in the first pass
-                                    bool do_proceed = (exp_ipass == 0) ? true : DIRECT_A1D_ELEM(exp_Mcoarse_significant, ihidden);
-                                    if (do_proceed)
+                                    long int itrans = exp_itrans_min + ((exp_ipass == 0) ? ihidden - isample_start : exp_significant_samples.translation(ihidden));
+
+                                    // Jun01,2015 - Shaoda & Sjors, Helical refinement
+                                    sampling.getTranslationsInPixel(itrans, exp_current_oversampling, my_pixel_size, oversampled_translations_x, oversampled_translations_y, oversampled_translations_z,
+                                            (do_helical_refine) && (!ignore_helical_symmetry));
+                                    for (long int iover_trans = 0; iover_trans < exp_nr_oversampled_trans; iover_trans++)
                                     {
-                                        // Jun01,2015 - Shaoda & Sjors, Helical refinement
-                                        sampling.getTranslationsInPixel(itrans, exp_current_oversampling, my_pixel_size, oversampled_translations_x, oversampled_translations_y, oversampled_translations_z,
-                                                (do_helical_refine) && (!ignore_helical_symmetry));
-                                        for (long int iover_trans = 0; iover_trans < exp_nr_oversampled_trans; iover_trans++)
-                                        {
 #ifdef TIMING
-                                            // Only time one thread, as I also only time one MPI process
-                                            if (part_id == mydata.sorted_idx[exp_my_first_part_id])
-                                                timer.tic(TIMING_DIFF2_GETSHIFT);
-#endif
-                                            long int ihidden_over = sampling.getPositionOversampledSamplingPoint(ihidden, exp_current_oversampling,
-                                                                                                                 iover_rot, iover_trans);
-                                            /// Now get the shifted image
-                                            // Use a pointer to avoid copying the entire array again in this highly expensive loop
-                                            Complex *Fimg_shift;
-                                            if (!do_shifts_onthefly)
-                                            {
-                                                long int ishift = (do_skip_align) ? 0 : (itrans - exp_itrans_min) * exp_nr_oversampled_trans + iover_trans;
+                                        // Only time one thread, as I also only time one MPI process
+                                        if (part_id == mydata.sorted_idx[exp_my_first_part_id])
+                                            timer.tic(TIMING_DIFF2_GETSHIFT);
+#endif
+                                        long int ihidden_over = sampling.getPositionOversampledSamplingPoint(ihidden, exp_current_oversampling,
+                                                                                                             iover_rot, iover_trans);
+                                        /// Now get the shifted image
+                                        // Use a pointer to avoid copying the entire array again in this highly expensive loop
+                                        Complex *Fimg_shift;
+                                        if (!do_shifts_onthefly)
+                                        {
+                                            long int ishift = (do_skip_align) ? 0 : (itrans - exp_itrans_min) * exp_nr_oversampled_trans + iover_trans;
 #ifdef DEBUG_CHECKSIZES
-                                                if (ishift >= exp_local_Fimgs_shifted.size())
-                                                {
-                                                    std::cerr<< "ishift= "<<ishift<<" exp_local_Fimgs_shifted.size()= "<< exp_local_Fimgs_shifted.size() <<std::endl;
-                                                    std::cerr << " itrans= " << itrans << std::endl;
-                                                    std::cerr << " img_id= " << img_id << std::endl;
-                                                    std::cerr << " exp_nr_oversampled_trans= " << exp_nr_oversampled_trans << " exp_nr_trans= " << exp_nr_trans << " iover_trans= " << iover_trans << std::endl;
-                                                    REPORT_ERROR("ishift >= exp_local_Fimgs_shifted.size()");
-                                                }
-#endif
-                                                Fimg_shift = exp_local_Fimgs_shifted[img_id][ishift].data;
-                                            }
-                                            else
+                                            if (ishift >= exp_local_Fimgs_shifted.size())
                                             {
-                                                // Calculate shifted image on-the-fly to save replicating memory in multi-threaded jobs.
-                                                // Feb01,2017 - Shaoda, on-the-fly shifts in helical reconstuctions (2D and 3D)
-                                                bool use_coarse_size = ((exp_current_oversampling == 0) && (YSIZE(Frefctf) == image_coarse_size[optics_group]))
-                                                        || ((exp_current_oversampling > 0) && (strict_highres_exp > 0.));
-
-                                                RFLOAT zshift = 0.;
-                                                RFLOAT xshift = (exp_current_oversampling == 0) ? (oversampled_translations_x[0]) : (oversampled_translations_x[iover_trans]);
-                                                RFLOAT yshift = (exp_current_oversampling == 0) ? (oversampled_translations_y[0]) : (oversampled_translations_y[iover_trans]);
-                                                if (mymodel.data_dim == 3 || mydata.is_tomo)
-                                                    zshift = (exp_current_oversampling == 0) ? (oversampled_translations_z[0]) : (oversampled_translations_z[iover_trans]);
+                                                std::cerr<< "ishift= "<<ishift<<" exp_local_Fimgs_shifted.size()= "<< exp_local_Fimgs_shifted.size() <<std::endl;
+                                                std::cerr << " itrans= " << itrans << std::endl;
+                                                std::cerr << " img_id= " << img_id << std::endl;
+                                                std::cerr << " exp_nr_oversampled_trans= " << exp_nr_oversampled_trans << " exp_nr_trans= " << exp_nr_trans << " iover_trans= " << iover_trans << std::endl;
+                                                REPORT_ERROR("ishift >= exp_local_Fimgs_shifted.size()");
+                                            }
+#endif
+                                            Fimg_shift = exp_local_Fimgs_shifted[img_id][ishift].data;
+                                        }
+                                        else
+                                        {
+                                            // Calculate shifted image on-the-fly to save replicating memory in multi-threaded jobs.
+                                            // Feb01,2017 - Shaoda, on-the-fly shifts in helical reconstuctions (2D and 3D)
+                                            bool use_coarse_size = ((exp_current_oversampling == 0) && (YSIZE(Frefctf) == image_coarse_size[optics_group]))
+                                                    || ((exp_current_oversampling > 0) && (strict_highres_exp > 0.));
+
+                                            RFLOAT zshift = 0.;
+                                            RFLOAT xshift = (exp_current_oversampling == 0) ? (oversampled_translations_x[0]) : (oversampled_translations_x[iover_trans]);
+                                            RFLOAT yshift = (exp_current_oversampling == 0) ? (oversampled_translations_y[0]) : (oversampled_translations_y[iover_trans]);
+                                            if (mymodel.data_dim == 3 || mydata.is_tomo)
+                                                zshift = (exp_current_oversampling == 0) ? (oversampled_translations_z[0]) : (oversampled_translations_z[iover_trans]);
 
-                                                // For subtomo: convert 3D shifts in the tomogram to 2D shifts in the tilt series images
-                                                if (mydata.is_tomo)
-                                                {
-                                                    // exp_old_offset was not yet applied for subtomos!
-                                                    // For helices: op.old_offset is in HELICAL COORDS, not CART_COORDS!
-                                                    xshift += XX(exp_old_offset);
-                                                    yshift += YY(exp_old_offset);
-                                                    zshift += ZZ(exp_old_offset);
-                                                }
+                                            // For subtomo: convert 3D shifts in the tomogram to 2D shifts in the tilt series images
+                                            if (mydata.is_tomo)
+                                            {
+                                                // exp_old_offset was not yet applied for subtomos!
+                                                // For helices: op.old_offset is in HELICAL COORDS, not CART_COORDS!
+                                                xshift += XX(exp_old_offset);
+                                                yshift += YY(exp_old_offset);
+                                                zshift += ZZ(exp_old_offset);
+                                            }
 
-                                                if ((do_helical_refine) && (!ignore_helical_symmetry))
-                                                {
-                                                    RFLOAT rot_deg = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_ROT);
-                                                    RFLOAT tilt_deg = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_TILT);
-                                                    RFLOAT psi_deg = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_PSI);
-                                                    transformCartesianAndHelicalCoords(
-                                                                xshift, yshift, zshift,
-                                                                xshift, yshift, zshift,
-                                                                rot_deg, tilt_deg, psi_deg,
-                                                                mymodel.data_dim,
-                                                                HELICAL_TO_CART_COORDS);
-                                                }
+                                            if ((do_helical_refine) && (!ignore_helical_symmetry))
+                                            {
+                                                RFLOAT rot_deg = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_ROT);
+                                                RFLOAT tilt_deg = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_TILT);
+                                                RFLOAT psi_deg = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_PSI);
+                                                transformCartesianAndHelicalCoords(
+                                                            xshift, yshift, zshift,
+                                                            xshift, yshift, zshift,
+                                                            rot_deg, tilt_deg, psi_deg,
+                                                            mymodel.data_dim,
+                                                            HELICAL_TO_CART_COORDS);
+                                            }
 
-                                                // For subtomo: convert 3D shifts in the tomogram to 2D shifts in the tilt series images
-                                                if (mydata.is_tomo)
-                                                {
-                                                    mydata.getTranslationInTiltSeries(part_id, img_id,
-                                                                                      xshift, yshift, zshift,
-                                                                                      xshift, yshift, zshift);
-                                                }
+                                            // For subtomo: convert 3D shifts in the tomogram to 2D shifts in the tilt series images
+                                            if (mydata.is_tomo)
+                                            {
+                                                mydata.getTranslationInTiltSeries(part_id, img_id,
+                                                                                  xshift, yshift, zshift,
+                                                                                  xshift, yshift, zshift);
+                                            }
 
-                                                shiftImageInFourierTransformWithTabSincos(
-                                                        exp_local_Fimgs_shifted[img_id][0],
-                                                        Fimg_otfshift,
-                                                        (RFLOAT)mymodel.ori_size,
-                                                        (use_coarse_size) ? (image_coarse_size[optics_group]) : (image_current_size[optics_group]),
-                                                        tab_sin, tab_cos,
-                                                        xshift, yshift, zshift);
+                                            shiftImageInFourierTransformWithTabSincos(
+                                                    exp_local_Fimgs_shifted[img_id][0],
+                                                    Fimg_otfshift,
+                                                    (RFLOAT)mymodel.ori_size,
+                                                    (use_coarse_size) ? (image_coarse_size[optics_group]) : (image_current_size[optics_group]),
+                                                    tab_sin, tab_cos,
+                                                    xshift, yshift, zshift);
 
-                                                Fimg_shift = Fimg_otfshift.data;
-                                            }
+                                            Fimg_shift = Fimg_otfshift.data;
+                                        }
 #ifdef TIMING
-                                            // Only time one thread, as I also only time one MPI process
-                                            if (part_id == mydata.sorted_idx[exp_my_first_part_id])
-                                                timer.toc(TIMING_DIFF2_GETSHIFT);
+                                        // Only time one thread, as I also only time one MPI process
+                                        if (part_id == mydata.sorted_idx[exp_my_first_part_id])
+                                            timer.toc(TIMING_DIFF2_GETSHIFT);
 #endif
 
 #ifdef TIMING
-                                            // Only time one thread, as I also only time one MPI process
-                                            if (part_id == mydata.sorted_idx[exp_my_first_part_id])
-                                                timer.tic(TIMING_DIFF_DIFF2);
+                                        // Only time one thread, as I also only time one MPI process
+                                        if (part_id == mydata.sorted_idx[exp_my_first_part_id])
+                                            timer.tic(TIMING_DIFF_DIFF2);
 #endif
 
-                                            RFLOAT diff2;
-                                            if ((iter == 1 && do_firstiter_cc) || do_always_cc)
+                                        RFLOAT diff2;
+                                        if ((iter == 1 && do_firstiter_cc) || do_always_cc)
+                                        {
+                                            // Do not calculate squared-differences, but signal product
+                                            // Negative values because smaller is worse in this case
+                                            diff2 = 0.;
+                                            RFLOAT suma2 = 0.;
+                                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Frefctf)
                                             {
-                                                // Do not calculate squared-differences, but signal product
-                                                // Negative values because smaller is worse in this case
-                                                diff2 = 0.;
-                                                RFLOAT suma2 = 0.;
-                                                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Frefctf)
-                                                {
-                                                    diff2 -= (DIRECT_MULTIDIM_ELEM(Frefctf, n)).real * (*(Fimg_shift + n)).real;
-                                                    diff2 -= (DIRECT_MULTIDIM_ELEM(Frefctf, n)).imag * (*(Fimg_shift + n)).imag;
-                                                    suma2 += norm(DIRECT_MULTIDIM_ELEM(Frefctf, n));
-                                                }
-                                                // Normalised cross-correlation coefficient: divide by power of reference (power of image is a constant)
-                                                // For multi-images, also divide by nr_images to calculate average CCF over all images
-                                                diff2 /= sqrt(suma2) * exp_local_sqrtXi2[img_id];
+                                                diff2 -= (DIRECT_MULTIDIM_ELEM(Frefctf, n)).real * (*(Fimg_shift + n)).real;
+                                                diff2 -= (DIRECT_MULTIDIM_ELEM(Frefctf, n)).imag * (*(Fimg_shift + n)).imag;
+                                                suma2 += norm(DIRECT_MULTIDIM_ELEM(Frefctf, n));
                                             }
-                                            else
+                                            // Normalised cross-correlation coefficient: divide by power of reference (power of image is a constant)
+                                            // For multi-images, also divide by nr_images to calculate average CCF over all images
+                                            diff2 /= sqrt(suma2) * exp_local_sqrtXi2[img_id];
+                                        }
+                                        else
+                                        {
+                                            // Calculate the actual squared difference term of the Gaussian probability function
+                                            // If current_size < mymodel.ori_size diff2 is initialised to the sum of
+                                            // all |Xij|2 terms that lie between current_size and ori_size
+                                            // Factor two because of factor 2 in division below, NOT because of 2-dimensionality of the complex plane!
+                                            diff2 = exp_highres_Xi2_img[img_id] / 2.;
+                                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Frefctf)
                                             {
-                                                // Calculate the actual squared difference term of the Gaussian probability function
-                                                // If current_size < mymodel.ori_size diff2 is initialised to the sum of
-                                                // all |Xij|2 terms that lie between current_size and ori_size
-                                                // Factor two because of factor 2 in division below, NOT because of 2-dimensionality of the complex plane!
-                                                diff2 = exp_highres_Xi2_img[img_id] / 2.;
-                                                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Frefctf)
-                                                {
-                                                    RFLOAT diff_real = (DIRECT_MULTIDIM_ELEM(Frefctf, n)).real - (*(Fimg_shift + n)).real;
-                                                    RFLOAT diff_imag = (DIRECT_MULTIDIM_ELEM(Frefctf, n)).imag - (*(Fimg_shift + n)).imag;
-                                                    diff2 += (diff_real * diff_real + diff_imag * diff_imag) * 0.5 * (*(Minvsigma2 + n));
-                                                }
+                                                RFLOAT diff_real = (DIRECT_MULTIDIM_ELEM(Frefctf, n)).real - (*(Fimg_shift + n)).real;
+                                                RFLOAT diff_imag = (DIRECT_MULTIDIM_ELEM(Frefctf, n)).imag - (*(Fimg_shift + n)).imag;
+                                                diff2 += (diff_real * diff_real + diff_imag * diff_imag) * 0.5 * (*(Minvsigma2 + n));
                                             }
+                                        }
 
 #ifdef TIMING
-                                            // Only time one thread, as I also only time one MPI process
-                                            if (part_id == mydata.sorted_idx[exp_my_first_part_id])
-                                                timer.toc(TIMING_DIFF_DIFF2);
+                                        // Only time one thread, as I also only time one MPI process
+                                        if (part_id == mydata.sorted_idx[exp_my_first_part_id])
+                                            timer.toc(TIMING_DIFF_DIFF2);
 #endif
 
 //#define DEBUG_GETALLDIFF2
 #ifdef DEBUG_GETALLDIFF2
-                                            omp_set_lock(&global_mutex);
-                                            if (itrans == exp_itrans_min && iover_trans == 0 && ipsi == exp_ipsi_min)
-                                            //if (ibody==1 && part_id == 0 && exp_ipass==0 && ihidden_over == 40217)
+                                        omp_set_lock(&global_mutex);
+                                        if (itrans == exp_itrans_min && iover_trans == 0 && ipsi == exp_ipsi_min)
+                                        //if (ibody==1 && part_id == 0 && exp_ipass==0 && ihidden_over == 40217)
+                                        {
+                                            //std::cerr << " iover_rot= "<<iover_rot << "exp_nr_oversampled_rot= " << exp_nr_oversampled_rot << " oversampled_rot[iover_rot]= " << oversampled_rot[iover_rot]
+                                            //		  << " oversampled_tilt[iover_rot]= " << oversampled_tilt[iover_rot]
+                                            //	      << " oversampled_psi[iover_rot]= " <<  oversampled_psi[iover_rot];
+                                            RFLOAT rrot,ttilt,ppsi;
+                                            Euler_matrix2angles(A, rrot,ttilt,ppsi);
+                                            std::cerr << " ihidden_over= " << ihidden_over << " diff2= " << diff2
+                                                    << " sumdiff2= " << DIRECT_A1D_ELEM(exp_Mweight, ihidden_over)
+                                                    << " rot= " << rrot
+                                                    << " tilt= " << ttilt
+                                                    << " psi= " << ppsi
+                                                    // non-oversampling correct only!!
+                                                    << " x= " << oversampled_translations_x[0] << " y=" << oversampled_translations_y[0];
+                                            if (mydata.is_tomo)
+                                                std::cerr << " z= " <<  oversampled_translations_z[0];
+                                            //std::cerr << " A= " << A << std::endl;
+                                            //Euler_matrix2angles(Abody, rrot,ttilt,ppsi);
+                                            //std::cerr << " Brot= " << rrot
+                                            //		<< " Btilt= " << ttilt
+                                            //		<< " Bpsi= " << ppsi << std::endl;
+
+                                            FourierTransformer transformer;
+                                            MultidimArray<Complex> Fish;
+                                            Fish.resize(exp_local_Minvsigma2);
+                                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fish)
                                             {
-                                                //std::cerr << " iover_rot= "<<iover_rot << "exp_nr_oversampled_rot= " << exp_nr_oversampled_rot << " oversampled_rot[iover_rot]= " << oversampled_rot[iover_rot]
-                                                //		  << " oversampled_tilt[iover_rot]= " << oversampled_tilt[iover_rot]
-                                                //	      << " oversampled_psi[iover_rot]= " <<  oversampled_psi[iover_rot];
-                                                RFLOAT rrot,ttilt,ppsi;
-                                                Euler_matrix2angles(A, rrot,ttilt,ppsi);
-                                                std::cerr << " ihidden_over= " << ihidden_over << " diff2= " << diff2
-                                                        << " sumdiff2= " << DIRECT_A1D_ELEM(exp_Mweight, ihidden_over)
-                                                        << " rot= " << rrot
-                                                        << " tilt= " << ttilt
-                                                        << " psi= " << ppsi
-                                                        // non-oversampling correct only!!
-                                                        << " x= " << oversampled_translations_x[0] << " y=" << oversampled_translations_y[0];
-                                                if (mydata.is_tomo)
-                                                    std::cerr << " z= " <<  oversampled_translations_z[0];
-                                                //std::cerr << " A= " << A << std::endl;
-                                                //Euler_matrix2angles(Abody, rrot,ttilt,ppsi);
-                                                //std::cerr << " Brot= " << rrot
-                                                //		<< " Btilt= " << ttilt
-                                                //		<< " Bpsi= " << ppsi << std::endl;
-
-                                                FourierTransformer transformer;
-                                                MultidimArray<Complex> Fish;
-                                                Fish.resize(exp_local_Minvsigma2);
-                                                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fish)
-                                                {
-                                                    DIRECT_MULTIDIM_ELEM(Fish, n) = *(Fimg_shift + n);
-                                                }
-                                                Image<RFLOAT> tt;
-                                                int exp_current_image_size;
-                                                if (strict_highres_exp > 0.)
-                                                    // Use smaller images in both passes and keep a maximum on coarse_size, just like in FREALIGN
-                                                    exp_current_image_size = image_coarse_size[optics_group];
-                                                else if (adaptive_oversampling > 0)
-                                                    // Use smaller images in the first pass, larger ones in the second pass
-                                                    exp_current_image_size = (exp_current_oversampling == 0) ? image_coarse_size[optics_group] : image_current_size[optics_group];
-                                                else
-                                                    exp_current_image_size = image_current_size[optics_group];
-                                                if (mymodel.data_dim == 3)
-                                                    tt().resize(exp_current_image_size, exp_current_image_size, exp_current_image_size);
-                                                else
-                                                    tt().resize(exp_current_image_size, exp_current_image_size);
-                                                transformer.inverseFourierTransform(Fish, tt());
-                                                CenterFFT(tt(),false);
-                                                FileName fnt = "Fimg.spi";
-                                                //fnt.compose("Fimg_shift1_i", ihidden_over, "spi");
-                                                tt.write(fnt);
-
-                                                transformer.inverseFourierTransform(Frefctf, tt());
-                                                CenterFFT(tt(),false);
-                                                fnt="Fref.spi";
-                                                //fnt.compose("Fref1_i", ihidden_over, "spi");
-                                                tt.write(fnt);
-
-                                                tt().resize(exp_local_Fctf[img_id]);
-                                                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(exp_local_Fctf[img_id])
-                                                {
-                                                    DIRECT_MULTIDIM_ELEM(tt(), n) = DIRECT_MULTIDIM_ELEM(exp_local_Fctf[img_id], n);
-                                                }
-                                                tt.write("ctf.spi");
-
-                                                //for (int i = 0; i< mymodel.scale_correction.size(); i++)
-                                                //	std::cerr << i << " scale="<<mymodel.scale_correction[i]<<std::endl;
-                                                int group_id = mydata.getGroupId(part_id);
-                                                RFLOAT myscale = mymodel.scale_correction[group_id];
-                                                //std::cerr << " oversampled_rot[iover_rot]= " << oversampled_rot[iover_rot] << " oversampled_tilt[iover_rot]= " << oversampled_tilt[iover_rot] << " oversampled_psi[iover_rot]= " << oversampled_psi[iover_rot] << std::endl;
-                                                //std::cerr << " group_id= " << group_id << " myscale= " << myscale <<std::endl;
-                                                std::cerr << " itrans= " << itrans << " itrans * exp_nr_oversampled_trans +  iover_trans= " << itrans * exp_nr_oversampled_trans +  iover_trans << " ihidden= " << ihidden << std::endl;
-                                                std::cerr <<" img_id= "<<img_id<<" name= "<< mydata.particles[part_id].name << std::endl;
-
-                                                //std::cerr << " myrank= "<< myrank<<std::endl;
-                                                //std::cerr << "Written Fimg_shift.spi and Fref.spi. Press any key to continue... part_id= " << part_id<< std::endl;
-                                                char c;
-                                                //std::cin >> c;
-                                                //exit(0);
+                                                DIRECT_MULTIDIM_ELEM(Fish, n) = *(Fimg_shift + n);
                                             }
-                                            omp_unset_lock(&global_mutex);
+                                            Image<RFLOAT> tt;
+                                            int exp_current_image_size;
+                                            if (strict_highres_exp > 0.)
+                                                // Use smaller images in both passes and keep a maximum on coarse_size, just like in FREALIGN
+                                                exp_current_image_size = image_coarse_size[optics_group];
+                                            else if (adaptive_oversampling > 0)
+                                                // Use smaller images in the first pass, larger ones in the second pass
+                                                exp_current_image_size = (exp_current_oversampling == 0) ? image_coarse_size[optics_group] : image_current_size[optics_group];
+                                            else
+                                                exp_current_image_size = image_current_size[optics_group];
+                                            if (mymodel.data_dim == 3)
+                                                tt().resize(exp_current_image_size, exp_current_image_size, exp_current_image_size);
+                                            else
+                                                tt().resize(exp_current_image_size, exp_current_image_size);
+                                            transformer.inverseFourierTransform(Fish, tt());
+                                            CenterFFT(tt(),false);
+                                            FileName fnt = "Fimg.spi";
+                                            //fnt.compose("Fimg_shift1_i", ihidden_over, "spi");
+                                            tt.write(fnt);
+
+                                            transformer.inverseFourierTransform(Frefctf, tt());
+                                            CenterFFT(tt(),false);
+                                            fnt="Fref.spi";
+                                            //fnt.compose("Fref1_i", ihidden_over, "spi");
+                                            tt.write(fnt);
+
+                                            tt().resize(exp_local_Fctf[img_id]);
+                                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(exp_local_Fctf[img_id])
+                                            {
+                                                DIRECT_MULTIDIM_ELEM(tt(), n) = DIRECT_MULTIDIM_ELEM(exp_local_Fctf[img_id], n);
+                                            }
+                                            tt.write("ctf.spi");
+
+                                            //for (int i = 0; i< mymodel.scale_correction.size(); i++)
+                                            //	std::cerr << i << " scale="<<mymodel.scale_correction[i]<<std::endl;
+                                            int group_id = mydata.getGroupId(part_id);
+                                            RFLOAT myscale = mymodel.scale_correction[group_id];
+                                            //std::cerr << " oversampled_rot[iover_rot]= " << oversampled_rot[iover_rot] << " oversampled_tilt[iover_rot]= " << oversampled_tilt[iover_rot] << " oversampled_psi[iover_rot]= " << oversampled_psi[iover_rot] << std::endl;
+                                            //std::cerr << " group_id= " << group_id << " myscale= " << myscale <<std::endl;
+                                            std::cerr << " itrans= " << itrans << " itrans * exp_nr_oversampled_trans +  iover_trans= " << itrans * exp_nr_oversampled_trans +  iover_trans << " ihidden= " << ihidden << std::endl;
+                                            std::cerr <<" img_id= "<<img_id<<" name= "<< mydata.particles[part_id].name << std::endl;
+
+                                            //std::cerr << " myrank= "<< myrank<<std::endl;
+                                            //std::cerr << "Written Fimg_shift.spi and Fref.spi. Press any key to continue... part_id= " << part_id<< std::endl;
+                                            char c;
+                                            //std::cin >> c;
+                                            //exit(0);
+                                        }
+                                        omp_unset_lock(&global_mutex);
 
 #endif
 //#define DEBUG_DIFF2_ISNAN
 #ifdef DEBUG_DIFF2_ISNAN
-                                            if (std::isnan(diff2))
+                                        if (std::isnan(diff2))
+                                        {
+                                            omp_set_lock(&global_mutex);
+                                            std::cerr <<" img_id= "<<img_id<<" name= "<< mydata.particles[part_id].images[img_id].name << std::endl;
+                                            std::cerr << " exp_iclass= " << exp_iclass << std::endl;
+                                            std::cerr << " diff2= " << diff2 << std::endl;
+                                            std::cerr << " exp_highres_Xi2_img[img_id]= " << exp_highres_Xi2_img[img_id] << std::endl;
+                                            std::cerr<< " exp_nr_oversampled_trans="<<exp_nr_oversampled_trans<<std::endl;
+                                            std::cerr<< " exp_nr_oversampled_rot="<<exp_nr_oversampled_rot<<std::endl;
+                                            std::cerr << " iover_rot= " << iover_rot << " iover_trans= " << iover_trans << " ihidden= " << ihidden << std::endl;
+                                            std::cerr << " exp_current_oversampling= " << exp_current_oversampling << std::endl;
+                                            std::cerr << " ihidden_over= " << ihidden_over << " XSIZE(Mweight)= " << XSIZE(exp_Mweight) << std::endl;
+                                            std::cerr << " (mymodel.PPref[exp_iclass]).ori_size= " << (mymodel.PPref[exp_iclass]).ori_size << " (mymodel.PPref[exp_iclass]).r_max= " << (mymodel.PPref[exp_iclass]).r_max << std::endl;
+                                            int group_id = mydata.getGroupId(part_id);
+                                            std::cerr << " mymodel.scale_correction[group_id]= " << mymodel.scale_correction[group_id] << std::endl;
+                                            if (std::isnan(mymodel.scale_correction[group_id]))
                                             {
-                                                omp_set_lock(&global_mutex);
-                                                std::cerr <<" img_id= "<<img_id<<" name= "<< mydata.particles[part_id].images[img_id].name << std::endl;
-                                                std::cerr << " exp_iclass= " << exp_iclass << std::endl;
-                                                std::cerr << " diff2= " << diff2 << std::endl;
-                                                std::cerr << " exp_highres_Xi2_img[img_id]= " << exp_highres_Xi2_img[img_id] << std::endl;
-                                                std::cerr<< " exp_nr_oversampled_trans="<<exp_nr_oversampled_trans<<std::endl;
-                                                std::cerr<< " exp_nr_oversampled_rot="<<exp_nr_oversampled_rot<<std::endl;
-                                                std::cerr << " iover_rot= " << iover_rot << " iover_trans= " << iover_trans << " ihidden= " << ihidden << std::endl;
-                                                std::cerr << " exp_current_oversampling= " << exp_current_oversampling << std::endl;
-                                                std::cerr << " ihidden_over= " << ihidden_over << " XSIZE(Mweight)= " << XSIZE(exp_Mweight) << std::endl;
-                                                std::cerr << " (mymodel.PPref[exp_iclass]).ori_size= " << (mymodel.PPref[exp_iclass]).ori_size << " (mymodel.PPref[exp_iclass]).r_max= " << (mymodel.PPref[exp_iclass]).r_max << std::endl;
-                                                int group_id = mydata.getGroupId(part_id);
-                                                std::cerr << " mymodel.scale_correction[group_id]= " << mymodel.scale_correction[group_id] << std::endl;
-                                                if (std::isnan(mymodel.scale_correction[group_id]))
-                                                {
-                                                    for (int i=0; i < mymodel.scale_correction.size(); i++)
-                                                        std::cerr << " i= " << i << " mymodel.scale_correction[i]= " << mymodel.scale_correction[i] << std::endl;
-                                                }
-                                                std::cerr << " group_id= " << group_id << std::endl;
-                                                Image<RFLOAT> It;
-                                                std::cerr << "Frefctf shape= "; Frefctf.printShape(std::cerr);
-                                                MultidimArray<Complex> Fish;
-                                                Fish.resize(exp_local_Minvsigma2);
-                                                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fish)
-                                                {
-                                                    DIRECT_MULTIDIM_ELEM(Fish, n) = *(Fimg_shift + n);
-                                                }
-                                                std::cerr << "Fimg_shift shape= "; (Fish).printShape(std::cerr);
-                                                It()=exp_local_Fctf[img_id];
-                                                It.write("exp_local_Fctf.spi");
-                                                std::cerr << "written exp_local_Fctf.spi" << std::endl;
-                                                FourierTransformer transformer;
-                                                Image<RFLOAT> tt;
-                                                int exp_current_image_size;
-                                                if (strict_highres_exp > 0.)
-                                                    // Use smaller images in both passes and keep a maximum on coarse_size, just like in FREALIGN
-                                                    exp_current_image_size = image_coarse_size[optics_group];
-                                                else if (adaptive_oversampling > 0)
-                                                    // Use smaller images in the first pass, larger ones in the second pass
-                                                    exp_current_image_size = (exp_current_oversampling == 0) ? image_coarse_size[optics_group] : image_current_size[optics_group];
-                                                else
-                                                    exp_current_image_size = image_current_size[optics_group];
-                                                tt().resize(exp_current_image_size, exp_current_image_size);
-                                                transformer.inverseFourierTransform(Fish, tt());
-                                                CenterFFT(tt(),false);
-                                                tt.write("Fimg_shift.spi");
-                                                std::cerr << "written Fimg_shift.spi" << std::endl;
-                                                FourierTransformer transformer2;
-                                                tt().initZeros();
-                                                transformer2.inverseFourierTransform(Frefctf, tt());
-                                                CenterFFT(tt(),false);
-                                                tt.write("Frefctf.spi");
-                                                std::cerr << "written Frefctf.spi" << std::endl;
-                                                FourierTransformer transformer3;
-                                                tt().initZeros();
-                                                transformer3.inverseFourierTransform(Fref, tt());
-                                                CenterFFT(tt(),false);
-                                                tt.write("Fref.spi");
-                                                std::cerr << "written Fref.spi" << std::endl;
-                                                std::cerr << " A= " << A << std::endl;
-                                                std::cerr << "written Frefctf.spi" << std::endl;
-
-                                                std::cerr << " exp_iclass= " << exp_iclass << std::endl;
-                                                Fref.resize(exp_local_Minvsigma2);
-                                                (mymodel.PPref[exp_iclass]).get2DFourierTransform(Fref, A);
-                                                transformer3.inverseFourierTransform(Fref, tt());
-                                                CenterFFT(tt(),false);
-                                                tt.write("Fref2.spi");
-                                                std::cerr << "written Fref2.spi" << std::endl;
-                                                Image<RFLOAT> Itt;
-                                                Itt().resize(ZSIZE(mymodel.PPref[exp_iclass].data), YSIZE(mymodel.PPref[exp_iclass].data), XSIZE(mymodel.PPref[exp_iclass].data));
-                                                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Itt())
-                                                {
-                                                    DIRECT_MULTIDIM_ELEM(Itt(), n) = abs(DIRECT_MULTIDIM_ELEM(mymodel.PPref[exp_iclass].data, n));
-                                                }
-                                                Itt.write("PPref_data.spi");
-                                                REPORT_ERROR("diff2 is not a number");
-                                                omp_unset_lock(&global_mutex);
-                                                exit(0);
+                                                for (int i=0; i < mymodel.scale_correction.size(); i++)
+                                                    std::cerr << " i= " << i << " mymodel.scale_correction[i]= " << mymodel.scale_correction[i] << std::endl;
+                                            }
+                                            std::cerr << " group_id= " << group_id << std::endl;
+                                            Image<RFLOAT> It;
+                                            std::cerr << "Frefctf shape= "; Frefctf.printShape(std::cerr);
+                                            MultidimArray<Complex> Fish;
+                                            Fish.resize(exp_local_Minvsigma2);
+                                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fish)
+                                            {
+                                                DIRECT_MULTIDIM_ELEM(Fish, n) = *(Fimg_shift + n);
                                             }
+                                            std::cerr << "Fimg_shift shape= "; (Fish).printShape(std::cerr);
+                                            It()=exp_local_Fctf[img_id];
+                                            It.write("exp_local_Fctf.spi");
+                                            std::cerr << "written exp_local_Fctf.spi" << std::endl;
+                                            FourierTransformer transformer;
+                                            Image<RFLOAT> tt;
+                                            int exp_current_image_size;
+                                            if (strict_highres_exp > 0.)
+                                                // Use smaller images in both passes and keep a maximum on coarse_size, just like in FREALIGN
+                                                exp_current_image_size = image_coarse_size[optics_group];
+                                            else if (adaptive_oversampling > 0)
+                                                // Use smaller images in the first pass, larger ones in the second pass
+                                                exp_current_image_size = (exp_current_oversampling == 0) ? image_coarse_size[optics_group] : image_current_size[optics_group];
+                                            else
+                                                exp_current_image_size = image_current_size[optics_group];
+                                            tt().resize(exp_current_image_size, exp_current_image_size);
+                                            transformer.inverseFourierTransform(Fish, tt());
+                                            CenterFFT(tt(),false);
+                                            tt.write("Fimg_shift.spi");
+                                            std::cerr << "written Fimg_shift.spi" << std::endl;
+                                            FourierTransformer transformer2;
+                                            tt().initZeros();
+                                            transformer2.inverseFourierTransform(Frefctf, tt());
+                                            CenterFFT(tt(),false);
+                                            tt.write("Frefctf.spi");
+                                            std::cerr << "written Frefctf.spi" << std::endl;
+                                            FourierTransformer transformer3;
+                                            tt().initZeros();
+                                            transformer3.inverseFourierTransform(Fref, tt());
+                                            CenterFFT(tt(),false);
+                                            tt.write("Fref.spi");
+                                            std::cerr << "written Fref.spi" << std::endl;
+                                            std::cerr << " A= " << A << std::endl;
+                                            std::cerr << "written Frefctf.spi" << std::endl;
+
+                                            std::cerr << " exp_iclass= " << exp_iclass << std::endl;
+                                            Fref.resize(exp_local_Minvsigma2);
+                                            (mymodel.PPref[exp_iclass]).get2DFourierTransform(Fref, A);
+                                            transformer3.inverseFourierTransform(Fref, tt());
+                                            CenterFFT(tt(),false);
+                                            tt.write("Fref2.spi");
+                                            std::cerr << "written Fref2.spi" << std::endl;
+                                            Image<RFLOAT> Itt;
+                                            Itt().resize(ZSIZE(mymodel.PPref[exp_iclass].data), YSIZE(mymodel.PPref[exp_iclass].data), XSIZE(mymodel.PPref[exp_iclass].data));
+                                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Itt())
+                                            {
+                                                DIRECT_MULTIDIM_ELEM(Itt(), n) = abs(DIRECT_MULTIDIM_ELEM(mymodel.PPref[exp_iclass].data, n));
+                                            }
+                                            Itt.write("PPref_data.spi");
+                                            REPORT_ERROR("diff2 is not a number");
+                                            omp_unset_lock(&global_mutex);
+                                            exit(0);
+                                        }
 #endif
 //#define DEBUG_VERBOSE
 #ifdef DEBUG_VERBOSE
-                                            omp_set_lock(&global_mutex);
-                                            std::cout <<" name= "<< mydata.particles[part_id].images[img_id].name << " rot= " << oversampled_rot[iover_rot] << " tilt= "<< oversampled_tilt[iover_rot] << " psi= " << oversampled_psi[iover_rot] << std::endl;
-                                            std::cout <<" name= "<< mydata.particles[part_id].images[img_id].name << " ihidden_over= " << ihidden_over << " diff2= " << diff2 << " exp_min_diff2= " << exp_min_diff2 << std::endl;
-                                            omp_unset_lock(&global_mutex);
+                                        omp_set_lock(&global_mutex);
+                                        std::cout <<" name= "<< mydata.particles[part_id].images[img_id].name << " rot= " << oversampled_rot[iover_rot] << " tilt= "<< oversampled_tilt[iover_rot] << " psi= " << oversampled_psi[iover_rot] << std::endl;
+                                        std::cout <<" name= "<< mydata.particles[part_id].images[img_id].name << " ihidden_over= " << ihidden_over << " diff2= " << diff2 << " exp_min_diff2= " << exp_min_diff2 << std::endl;
+                                        omp_unset_lock(&global_mutex);
 #endif
 #ifdef DEBUG_CHECKSIZES
-                                            if (ihidden_over >= XSIZE(exp_Mweight) )
-                                            {
-                                                std::cerr<< " exp_nr_oversampled_trans="<<exp_nr_oversampled_trans<<std::endl;
-                                                std::cerr<< " exp_nr_oversampled_rot="<<exp_nr_oversampled_rot<<std::endl;
-                                                std::cerr << " iover_rot= " << iover_rot << " iover_trans= " << iover_trans << " ihidden= " << ihidden << std::endl;
-                                                std::cerr << " exp_current_oversampling= " << exp_current_oversampling << std::endl;
-                                                std::cerr << " exp_itrans_min= " << exp_itrans_min <<" exp_nr_trans= " << exp_nr_trans << std::endl;
-                                                std::cerr << " exp_itrans_max= " << exp_itrans_max << " iorientclass= " << iorientclass << " itrans= " << itrans << std::endl;
-                                                std::cerr << " exp_nr_dir= " << exp_nr_dir << " exp_idir_min= " << exp_idir_min << " exp_idir_max= " << exp_idir_max << std::endl;
-                                                std::cerr << " exp_nr_psi= " << exp_nr_psi << " exp_ipsi_min= " << exp_ipsi_min << " exp_ipsi_max= " << exp_ipsi_max << std::endl;
-                                                std::cerr << " exp_iclass= " << exp_iclass << std::endl;
-                                                std::cerr << " iorient= " << iorient << std::endl;
-                                                std::cerr << " ihidden_over= " << ihidden_over << " XSIZE(Mweight)= " << XSIZE(exp_Mweight) << std::endl;
-                                                REPORT_ERROR("ihidden_over >= XSIZE(Mweight)");
-                                            }
+                                        if (ihidden_over >= XSIZE(exp_Mweight) )
+                                        {
+                                            std::cerr<< " exp_nr_oversampled_trans="<<exp_nr_oversampled_trans<<std::endl;
+                                            std::cerr<< " exp_nr_oversampled_rot="<<exp_nr_oversampled_rot<<std::endl;
+                                            std::cerr << " iover_rot= " << iover_rot << " iover_trans= " << iover_trans << " ihidden= " << ihidden << std::endl;
+                                            std::cerr << " exp_current_oversampling= " << exp_current_oversampling << std::endl;
+                                            std::cerr << " exp_itrans_min= " << exp_itrans_min <<" exp_nr_trans= " << exp_nr_trans << std::endl;
+                                            std::cerr << " exp_itrans_max= " << exp_itrans_max << " iorientclass= " << iorientclass << " itrans= " << itrans << std::endl;
+                                            std::cerr << " exp_nr_dir= " << exp_nr_dir << " exp_idir_min= " << exp_idir_min << " exp_idir_max= " << exp_idir_max << std::endl;
+                                            std::cerr << " exp_nr_psi= " << exp_nr_psi << " exp_ipsi_min= " << exp_ipsi_min << " exp_ipsi_max= " << exp_ipsi_max << std::endl;
+                                            std::cerr << " exp_iclass= " << exp_iclass << std::endl;
+                                            std::cerr << " iorient= " << iorient << std::endl;
+                                            std::cerr << " ihidden_over= " << ihidden_over << " XSIZE(Mweight)= " << XSIZE(exp_Mweight) << std::endl;
+                                            REPORT_ERROR("ihidden_over >= XSIZE(Mweight)");
+                                        }
 #endif
 
-                                            //if (ihidden_over == 0 )
-                                            //{
-                                            //    std::cerr << "img_id= " << img_id << " Xi2= " << exp_local_sqrtXi2[img_id] << " diff2= " << diff2 << " exp_Mweight= " << DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) << std::endl;
-                                            //}
+                                        //if (ihidden_over == 0 )
+                                        //{
+                                        //    std::cerr << "img_id= " << img_id << " Xi2= " << exp_local_sqrtXi2[img_id] << " diff2= " << diff2 << " exp_Mweight= " << DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) << std::endl;
+                                        //}
 
-                                            // Store all diff2 in exp_Mweight
-                                            // SHWS 6July2022: += instead of =, as summing over all imag_id....
-                                            if (fabs(DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) + 999.) < 0.001 )
-                                                DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) = diff2;
-                                            else
-                                                DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) += diff2;
+                                        // Store all diff2 in exp_Mweight
+                                        // SHWS 6July2022: += instead of =, as summing over all imag_id....
+                                        if (fabs(DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) + 999.) < 0.001 )
+                                            DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) = diff2;
+                                        else
+                                            DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) += diff2;
 
-                                            // Keep track of minimum of all diff2, only for the last image in this series
-                                            if (img_id == exp_nr_images-1 && DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) < exp_min_diff2)
-                                            {
-                                                exp_min_diff2 = DIRECT_A1D_ELEM(exp_Mweight, ihidden_over);
+                                        // Keep track of minimum of all diff2, only for the last image in this series
+                                        if (img_id == exp_nr_images-1 && DIRECT_A1D_ELEM(exp_Mweight, ihidden_over) < exp_min_diff2)
+                                        {
+                                            exp_min_diff2 = DIRECT_A1D_ELEM(exp_Mweight, ihidden_over);
 #ifdef DEBUG_GETALLDIFF2
-                                                    std::cerr << " part_id= " << part_id << " ihidden_over= " << ihidden_over << " exp_min_diff2= " << exp_min_diff2
-                                                    << " x= " << oversampled_translations_x[iover_trans] << " y=" <<oversampled_translations_y[iover_trans]
-                                                    << " z= " << oversampled_translations_z[iover_trans]
-                                                    << std::endl;
+                                                std::cerr << " part_id= " << part_id << " ihidden_over= " << ihidden_over << " exp_min_diff2= " << exp_min_diff2
+                                                << " x= " << oversampled_translations_x[iover_trans] << " y=" <<oversampled_translations_y[iover_trans]
+                                                << " z= " << oversampled_translations_z[iover_trans]
+                                                << std::endl;
 #endif
 
-                                            }
+                                        }
 
-                                            /*
-                                            if (part_id == 0 && img_id == exp_nr_images-1)
-                                            {
-                                                std::cout << " ihidden_over= " << ihidden_over
-                                                << " exp_min_diff2= " << exp_min_diff2 << " diff2= " << DIRECT_A1D_ELEM(exp_Mweight, ihidden_over)
-                                                << " x= " << oversampled_translations_x[iover_trans] << " y= " <<oversampled_translations_y[iover_trans]
-                                                << " z= " << oversampled_translations_z[iover_trans]
-                                                << " rot= " << oversampled_rot[iover_rot] << " tilt= " <<  oversampled_tilt[iover_rot]
-                                                << " psi= " << oversampled_psi[iover_rot]
-                                                << std::endl;
-                                            }
-                                            */
+                                        /*
+                                        if (part_id == 0 && img_id == exp_nr_images-1)
+                                        {
+                                            std::cout << " ihidden_over= " << ihidden_over
+                                            << " exp_min_diff2= " << exp_min_diff2 << " diff2= " << DIRECT_A1D_ELEM(exp_Mweight, ihidden_over)
+                                            << " x= " << oversampled_translations_x[iover_trans] << " y= " <<oversampled_translations_y[iover_trans]
+                                            << " z= " << oversampled_translations_z[iover_trans]
+                                            << " rot= " << oversampled_rot[iover_rot] << " tilt= " <<  oversampled_tilt[iover_rot]
+                                            << " psi= " << oversampled_psi[iover_rot]
+                                            << std::endl;
+                                        }
+                                        */
 
-                                        } // end loop iover_trans
-                                    } // end if do_proceed translations
+                                    } // end loop iover_trans
                                 } // end loop itrans
                             } // end loop img_id
                         }// end loop iover_rot
@@ -7684,7 +7914,7 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int part_id, int ib
         int exp_current_oversampling, int metadata_offset,
         int exp_idir_min, int exp_idir_max, int exp_ipsi_min, int exp_ipsi_max,
         int exp_itrans_min, int exp_itrans_max, int exp_iclass_min, int exp_iclass_max,
-        MultidimArray<RFLOAT> &exp_Mweight, MultidimArray<bool> &exp_Mcoarse_significant,
+        MultidimArray<RFLOAT> &exp_Mweight, SignificantSamples &exp_significant_samples,
         RFLOAT &exp_significant_weight, RFLOAT &exp_sum_weight,
         Matrix1D<RFLOAT> &exp_old_offset, Matrix1D<RFLOAT> &exp_prior, RFLOAT &exp_min_diff2,
         std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
@@ -7900,10 +8130,13 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int part_id, int ib
                     if (pdf_orientation_mean != 0.)
                         pdf_orientation /= pdf_orientation_mean;
 
-                    // Loop over all translations
-                    long int ihidden = iorientclass * exp_nr_trans;
-                    for (long int itrans = exp_itrans_min; itrans <= exp_itrans_max; itrans++, ihidden++)
+                    // Loop over all translations (in the second pass: only over those that were significant in the first pass)
+                    long int isample_start = (exp_ipass == 0) ? iorientclass * exp_nr_trans : exp_significant_samples.first(iorientclass);
+                    long int isample_end = (exp_ipass == 0) ? isample_start + exp_nr_trans : exp_significant_samples.first(iorientclass + 1);
+                    for (long int ihidden = isample_start; ihidden < isample_end; ihidden++)
                     {
+                        long int itrans = exp_itrans_min + ((exp_ipass == 0) ? ihidden - isample_start : exp_significant_samples.translation(ihidden));
+
                         // May18,2015 - Shaoda & Sjors - Helical refinement (translational searches)
                         // Calculate the vector length of myprior
                         RFLOAT mypriors_len2 = myprior_x * myprior_x + myprior_y * myprior_y;
@@ -8038,18 +8271,7 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int part_id, int ib
         It.write("Mweight.spi");
         //It() = DEBUGGING_COPY_exp_Mweight;
         //It.write("Mweight_copy.spi");
-        It().resize(exp_Mcoarse_significant);
-        if (MULTIDIM_SIZE(It()) > 0)
-        {
-            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(It())
-            {
-                if (DIRECT_MULTIDIM_ELEM(exp_Mcoarse_significant, n))
-                    DIRECT_MULTIDIM_ELEM(It(), n) = 1.;
-                else
-                    DIRECT_MULTIDIM_ELEM(It(), n) = 0.;
-            }
-            It.write("Mcoarse_significant.spi");
-        }
+        std::cerr << " nr significant coarse samples= " << exp_significant_samples.size() << std::endl;
         std::cerr << " part_id= " << part_id << std::endl;
         /*
         MultidimArray<Complex> Faux;
@@ -8083,10 +8305,6 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int part_id, int ib
     }
 #endif
 
-    // Initialise exp_Mcoarse_significant
-    if (exp_ipass==0)
-        exp_Mcoarse_significant.resize(XSIZE(exp_Mweight));
-
     // Now, for each image,  find the exp_significant_weight that encompasses adaptive_fraction of exp_sum_weight
     exp_significant_weight = 0.;
 
@@ -8195,15 +8413,8 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int part_id, int ib
         if (mymodel.nr_bodies == 1)
             DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_NR_SIGN) = (RFLOAT)my_nr_significant_coarse_samples;
 
-        // Keep track of which coarse samplings were significant were significant for this particle
-        for (int ihidden = 0; ihidden < XSIZE(exp_Mcoarse_significant); ihidden++)
-        {
-            if (DIRECT_A1D_ELEM(exp_Mweight, ihidden) >= my_significant_weight)
-                DIRECT_A1D_ELEM(exp_Mcoarse_significant, ihidden) = true;
-            else
-                DIRECT_A1D_ELEM(exp_Mcoarse_significant, ihidden) = false;
-        }
-
+        // Keep track of which coarse samplings were significant for this particle
+        exp_significant_samples.build(exp_Mweight, my_significant_weight, exp_nr_trans);
     }
     exp_significant_weight = my_significant_weight;
 
@@ -8230,7 +8441,7 @@ void MlOptimiser::storeWeightedSums(long int part_id, int ibody,
         Matrix1D<RFLOAT> &exp_old_offset,
         Matrix1D<RFLOAT> &exp_prior,
         MultidimArray<RFLOAT> &exp_Mweight,
-        MultidimArray<bool> &exp_Mcoarse_significant,
+        SignificantSamples &exp_significant_samples,
         RFLOAT &exp_significant_weight,
         RFLOAT &exp_sum_weight,
         RFLOAT &exp_max_weight,
@@ -8356,7 +8567,7 @@ void MlOptimiser::storeWeightedSums(long int part_id, int ibody,
                 long int iorientclass = exp_iclass * exp_nr_dir * exp_nr_psi + iorient;
 
                 // Only proceed if there was a significant coarsely sampled translation
-                if (isSignificantAnyImageAnyTranslation(iorientclass, exp_itrans_min, exp_itrans_max, exp_Mcoarse_significant))
+                if (exp_significant_samples.isSignificant(iorientclass))
                 {
 
                     // Now get the oversampled (rot, tilt, psi) triplets
@@ -8495,15 +8706,21 @@ void MlOptimiser::storeWeightedSums(long int part_id, int ibody,
                                 }
                             } // end if !do_skip_maximization
 
-                            long int ihidden = iorientclass * exp_nr_trans;
-                            for (long int itrans = exp_itrans_min, iitrans = 0; itrans <= exp_itrans_max; itrans++, ihidden++)
+                            // Only loop over the translations that were significant in the first pass
+                            // In the second pass, exp_Mweight only holds the (oversampled) weights of those samples
+                            for (long int isample = exp_significant_samples.first(iorientclass); isample < exp_significant_samples.first(iorientclass + 1); isample++)
                             {
+                                long int itrans = exp_itrans_min + exp_significant_samples.translation(isample);
+                                long int ihidden = (exp_current_oversampling == 0) ? iorientclass * exp_nr_trans + itrans - exp_itrans_min : isample;
+
                                 // Jun01,2015 - Shaoda & Sjors, Helical refinement
                                 sampling.getTranslationsInPixel(itrans, exp_current_oversampling, my_pixel_size, oversampled_translations_x, oversampled_translations_y, oversampled_translations_z,
                                         (do_helical_refine) && (!ignore_helical_symmetry));
 
-                                for (long int iover_trans = 0; iover_trans < exp_nr_oversampled_trans; iover_trans++, iitrans++)
+                                for (long int iover_trans = 0; iover_trans < exp_nr_oversampled_trans; iover_trans++)
                                 {
+                                    long int iitrans = (itrans - exp_itrans_min) * exp_nr_oversampled_trans + iover_trans;
+
                                     // Only deal with this sampling point if its weight was significant
                                     long int ihidden_over = ihidden * exp_nr_oversampled_trans * exp_nr_oversampled_rot +
                                             iover_rot * exp_nr_oversampled_trans + iover_trans;
@@ -8932,14 +9149,22 @@ void MlOptimiser::storeWeightedSums(long int part_id, int ibody,
                                     // Backproject every other particle into separate volumes
                                     iproj_offset = (part_id % 2) * mymodel.nr_classes;
 
-                                // Perform this inside a mutex
-                                int my_mutex = exp_iclass % NR_CLASS_MUTEXES;
-                                omp_set_lock(&global_mutex2[my_mutex]);
-                                if (mymodel.nr_bodies > 1)
-                                    (wsum_model.BPref[ibody + iproj_offset]).set2DFourierTransform(Fimg, Abody, &Fweight);
+                                int ibp = (mymodel.nr_bodies > 1) ? ibody + iproj_offset : exp_iclass + iproj_offset;
+                                Matrix2D<RFLOAT> &Abp = (mymodel.nr_bodies > 1) ? Abody : A;
+                                int my_thread = omp_get_thread_num();
+                                if (my_thread < exp_private_BPref.size())
+                                {
+                                    // This thread has its own copy of the backprojectors
+                                    exp_private_BPref[my_thread][ibp].set2DFourierTransform(Fimg, Abp, &Fweight);
+                                }
                                 else
-                                    (wsum_model.BPref[exp_iclass + iproj_offset]).set2DFourierTransform(Fimg, A, &Fweight);
-                                omp_unset_lock(&global_mutex2[my_mutex]);
+                                {
+                                    // Perform this inside a mutex
+                                    int my_mutex = exp_iclass % NR_CLASS_MUTEXES;
+                                    omp_set_lock(&global_mutex2[my_mutex]);
+                                    (wsum_model.BPref[ibp]).set2DFourierTransform(Fimg, Abp, &Fweight);
+                                    omp_unset_lock(&global_mutex2[my_mutex]);
+                                }
     #ifdef TIMING
                                 // Only time one thread, as I also only time one MPI process
                                 if (part_id == mydata.sorted_idx[exp_my_first_part_id])
@@ -10337,11 +10562,7 @@ void MlOptimiser::getMetaAndImageDataSubset(long int first_part_id, long int las
             Image<RFLOAT> img, rec_img;
             if (do_preread_images)
             {
-                img().reshape(mydata.particles[part_id].img);
-                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].img)
-                {
-                    DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].img, n);
-                }
+                mydata.getPrereadImage(part_id, img());
             }
             else
             {
@@ -35,6 +35,9 @@
 #include <iterator>
 #include "src/ml_model.h"
 #include "src/parallel.h"
+#include "src/image_prefetcher.h"
+#include "src/performance_trace.h"
+#include "src/significant_samples.h"
 #include "src/exp_model.h"
 #include "src/ctf.h"
 #include "src/time.h"
@@ -692,6 +695,18 @@ public:
 	int x_pool;
 	int nr_threads;
 
+	// Number of threads that read particle images ahead of the threads that process them
+	int nr_prefetch_threads;
+
+	// Memory (in Gb) for thread-private copies of the backprojectors in the expectation step
+	RFLOAT private_bp_mem_Gb;
+
+	// Write a PerformanceTrace for every iteration
+	bool do_trace;
+
+	// Precision of the references for projections in the CPU expectation step (PROJECTOR_FULL_PRECISION, PROJECTOR_FLOAT or PROJECTOR_HALF)
+	int projector_precision;
+
 	//for catching exceptions in threads
 	RelionError * threadException;
 
@@ -699,8 +714,14 @@ public:
 	MultidimArray<RFLOAT> exp_metadata, exp_imagedata;
 	std::string exp_fn_img, exp_fn_ctf, exp_fn_recimg;
 	std::vector<MultidimArray<RFLOAT> > exp_imgs;
+	ImagePrefetcher exp_prefetcher;
+	bool exp_do_prefetch;
 	std::vector<int> exp_random_class_some_particles;
 
+	// Thread-private copies of wsum_model.BPref: thread i < exp_private_BPref.size() backprojects into
+	// exp_private_BPref[i] without locking, the other threads backproject into wsum_model.BPref
+	std::vector<std::vector<BackProjector> > exp_private_BPref;
+
 	// Calculate translated images on-the-fly
 	bool do_shifts_onthefly;
 	std::vector< std::vector<MultidimArray<Complex> > > global_fftshifts_ab_coarse, global_fftshifts_ab_current, global_fftshifts_ab2_coarse, global_fftshifts_ab2_current;
@@ -807,6 +828,11 @@ public:
             my_first_particle_id(0),
             x_pool(1),
             nr_threads(0),
+            nr_prefetch_threads(0),
+            private_bp_mem_Gb(0),
+            do_trace(false),
+            projector_precision(PROJECTOR_FULL_PRECISION),
+            exp_do_prefetch(false),
             do_shifts_onthefly(0),
             exp_ipart_ThreadTaskDistributor(0),
             do_parallel_disc_io(0),
@@ -997,6 +1023,16 @@ public:
 	/* Delete threads and task distributors */
 	void iterateWrapUp();
 
+	/* Keep the references for the CPU expectation step in --projector_precision only
+	 * This should be called once the references have been set up for the expectation step.
+	 */
+	void compactReferences();
+
+	/* Write the PerformanceTrace of this iteration to fn_out_itXXX_trace.json (_itXXX_rankXXX_trace.json for rank >= 0)
+	 * Does nothing without --trace.
+	 */
+	void writePerformanceTrace(int iteration, int rank = -1);
+
 	/* Perform expectation-maximization iterations */
 	void iterate();
 
@@ -1020,6 +1056,14 @@ public:
 	 */
 	void expectationSomeParticles(long int my_first_particle, long int my_last_particle);
 
+	/* Make thread-private copies of the backprojectors for as many threads as fit into private_bp_mem_Gb
+	 * (once per expectation step, only for the non-accelerated code path)
+	 */
+	void setupPrivateBackprojectors();
+
+	/* Add the thread-private backprojectors to wsum_model.BPref and free them */
+	void mergePrivateBackprojectors();
+
 	/* Perform expectation step for some particles using threads */
 	void doThreadExpectationSomeParticles(int thread_id);
 
@@ -1088,6 +1132,11 @@ public:
 	 */
 	void updateImageSizeAndResolutionPointers();
 
+	/* Get the 2D image of one of the pooled particles, as read from disc in expectationSomeParticles
+	 * (either all at once beforehand, or in the background by the prefetch threads)
+	 */
+	void getPooledImage(int metadata_offset, MultidimArray<RFLOAT> &img);
+
 	/* Read image and its metadata from disc (threaded over all pooled particles)
 	 */
 	void getFourierTransformsAndCtfs(long int part_id, int ibody, int metadata_offset,
@@ -1137,7 +1186,7 @@ public:
 			std::vector<MultidimArray<RFLOAT> > &exp_Fctf,
             Matrix1D<RFLOAT> &exp_old_offset,
 			MultidimArray<RFLOAT> &exp_Mweight,
-			MultidimArray<bool> &exp_Mcoarse_significant,
+			SignificantSamples &exp_significant_samples,
 			std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
 			std::vector<RFLOAT> &exp_directions_prior, std::vector<RFLOAT> &exp_psi_prior,
 			std::vector<std::vector<MultidimArray<Complex > > > &exp_local_Fimgs_shifted,
@@ -1148,11 +1197,12 @@ public:
 
 	// Convert all squared difference terms to weights.
 	// Also calculates exp_sum_weight and, for adaptive approach, also exp_significant_weight
+	// In the first pass, this sets up exp_significant_samples, for which the second pass stores its (oversampled) weights
 	void convertAllSquaredDifferencesToWeights(long int part_id, int ibody, int exp_ipass,
 			int exp_current_oversampling, int metadata_offset,
 			int exp_idir_min, int exp_idir_max, int exp_ipsi_min, int exp_ipsi_max,
 			int exp_itrans_min, int exp_itrans_max, int my_iclass_min, int my_iclass_max,
-			MultidimArray<RFLOAT> &exp_Mweight, MultidimArray<bool> &exp_Mcoarse_significant,
+			MultidimArray<RFLOAT> &exp_Mweight, SignificantSamples &exp_significant_samples,
 			RFLOAT &exp_significant_weight, RFLOAT &exp_sum_weight,
 			Matrix1D<RFLOAT> &exp_old_offset, Matrix1D<RFLOAT> &exp_prior, RFLOAT &exp_min_diff2,
 			std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
@@ -1172,7 +1222,7 @@ public:
 			Matrix1D<RFLOAT> &exp_old_offset,
 			Matrix1D<RFLOAT> &exp_prior,
 			MultidimArray<RFLOAT> &exp_Mweight,
-			MultidimArray<bool> &exp_Mcoarse_significant,
+			SignificantSamples &exp_significant_samples,
 			RFLOAT &exp_significant_weight,
 			RFLOAT &exp_sum_weight,
 			RFLOAT &exp_max_weight,
@@ -50,6 +50,16 @@
     	#define RCTOC(timer,label)
 #endif
 
+// The leader sends the jobs to the followers without blocking, from one of these buffers per follower
+struct FollowerJobReply
+{
+	MultidimArray<long int> first_last_nr_images;
+	MultidimArray<RFLOAT> metadata, imagedata;
+	std::string fn_img, fn_ctf, fn_recimg;
+	int image_size;
+	std::vector<MPI_Request> requests;
+};
+
 void MlOptimiserMpi::read(int argc, char **argv)
 {
 #ifdef DEBUG
@@ -68,6 +78,28 @@ void MlOptimiserMpi::read(int argc, char **argv)
     int mpi_section = parser.addSection("MPI options");
     halt_all_followers_except_this = textToInteger(parser.getOption("--halt_all_followers_except", "For debugging: keep all followers except this one waiting", "-1"));
     do_keep_debug_reconstruct_files  = parser.checkOption("--keep_debug_reconstruct_files", "For debugging: keep temporary data and weight files for debug-reconstructions.");
+#ifdef USE_MPI_COLLECTIVE
+    wsum_reduction = parser.getOption("--wsum_reduction", "How to sum the weighted sums over the MPI followers: allreduce (MPI_Allreduce) or tree (in log2(N) steps)", "allreduce");
+    if (wsum_reduction != "allreduce" && wsum_reduction != "tree")
+#else
+    wsum_reduction = parser.getOption("--wsum_reduction", "How to sum the weighted sums over the MPI followers: tree (in log2(N) steps) or chain (in N steps)", "tree");
+    if (wsum_reduction != "tree" && wsum_reduction != "chain")
+#endif
+        REPORT_ERROR("Unknown value for --wsum_reduction: " + wsum_reduction);
+    do_fixed_job_size = parser.checkOption("--fixed_job_size", "Give the followers jobs of --pool particles in order, instead of sizing the jobs on the followers' speed and keeping particles from the same stacks on the same follower");
+    do_job_lookahead = !parser.checkOption("--no_job_lookahead", "Followers only ask the leader for their next job after finishing the previous one");
+    do_wsum_float_transport = parser.checkOption("--wsum_float_transport", "Send the weighted sums between the MPI followers in single precision in the tree reduction (half the traffic)");
+    if (do_wsum_float_transport && wsum_reduction != "tree")
+        REPORT_ERROR("--wsum_float_transport only works with --wsum_reduction tree, not with --wsum_reduction " + wsum_reduction);
+    do_shared_references = parser.checkOption("--shared_references", "Followers on the same node keep one copy of the references in MPI-3 shared memory, instead of one copy each");
+#if MPI_VERSION < 3
+    if (do_shared_references)
+        REPORT_ERROR("--shared_references requires an MPI library that supports MPI-3");
+#endif
+    sharedC = MPI_COMM_NULL;
+    shared_leadersC = MPI_COMM_NULL;
+    shared_rank = -1;
+    have_shared_references = false;
 
     // Don't put any output to screen for mpi followers
     ori_verb = verb;
@@ -1031,6 +1063,12 @@ void MlOptimiserMpi::expectation()
 	timer.toc(TIMING_EXP_1a);
 #endif
 
+	if (do_shared_references && !node->isLeader())
+	{
+		TraceSpan trace_span("share references");
+		shareReferences();
+	}
+
 	if(!do_split_random_halves)
 	{
 		if (!node->isLeader())
@@ -1048,8 +1086,10 @@ void MlOptimiserMpi::expectation()
 					std::cout << "relion_MPI_Bcast debug: rank = " << node->rank << " i = " << i << " MULTIDIM_SIZE(mymodel.PPref[i].data) = " << MULTIDIM_SIZE(mymodel.PPref[i].data) << " sender = " << sender << " followerC = " << node->followerC << std::endl;
 #endif
 					// Communicating over all followers means we don't have to allocate on the leader.
-					node->relion_MPI_Bcast(MULTIDIM_ARRAY(mymodel.PPref[i].data),
-					                       MULTIDIM_SIZE(mymodel.PPref[0].data), MY_MPI_COMPLEX, sender, node->followerC);
+					// Shared references have already been broadcast between the nodes
+					if (!have_shared_references)
+						node->relion_MPI_Bcast(MULTIDIM_ARRAY(mymodel.PPref[i].data),
+						                       MULTIDIM_SIZE(mymodel.PPref[0].data), MY_MPI_COMPLEX, sender, node->followerC);
 					// For multibody refinement with overlapping bodies, there may be more PPrefs than bodies!
 					if (i < mymodel.nr_classes * mymodel.nr_bodies)
 						node->relion_MPI_Bcast(MULTIDIM_ARRAY(mymodel.tau2_class[i]),
@@ -1342,10 +1382,51 @@ void MlOptimiserMpi::expectation()
 	fftw_plan_with_nthreads(1);
 #endif
 
+	// Shared references are already kept only once per node
+	if (!node->isLeader() && !have_shared_references)
+		compactReferences();
+
 #ifdef TIMING
 	timer.toc(TIMING_EXP_4);
 #endif
 	long int my_nr_particles = (subset_size > 0) ? subset_size : mydata.numberOfParticles();
+	long int my_first_particle = 0.;
+	long int my_last_particle = my_nr_particles - 1;
+	long int my_first_particle_halfset1 = 0;
+	long int my_last_particle_halfset1 = mydata.numberOfParticles(1) - 1;
+	long int my_first_particle_halfset2 = mydata.numberOfParticles(1);
+	long int my_last_particle_halfset2 = mydata.numberOfParticles() - 1;
+
+	if (subset_size > 0)
+	{
+		my_last_particle_halfset1 = my_nr_particles;
+		my_last_particle_halfset2 = mydata.numberOfParticles(1) + my_nr_particles;
+
+	}
+
+	// Each follower starts on its own block of particles, as given by the ParticleJobScheduler.
+	// All nodes sort the particles inside these blocks on their stacks in the same way,
+	// so that each follower reads its stacks one after the other.
+	std::vector<int> followers_halfset1, followers_halfset2, followers_all;
+	for (int rank = 1; rank < node->size; rank++)
+	{
+		followers_all.push_back(rank);
+		if (rank % 2 == 1)
+			followers_halfset1.push_back(rank);
+		else
+			followers_halfset2.push_back(rank);
+	}
+	if (!do_fixed_job_size)
+	{
+		if (do_split_random_halves)
+		{
+			mydata.groupParticlesByStack(my_first_particle_halfset1, my_last_particle_halfset1, followers_halfset1.size());
+			mydata.groupParticlesByStack(my_first_particle_halfset2, my_last_particle_halfset2, followers_halfset2.size());
+		}
+		else
+			mydata.groupParticlesByStack(my_first_particle, my_last_particle, followers_all.size());
+	}
+
 	if (node->isLeader())
 	{
 #ifdef TIMING
@@ -1355,19 +1436,18 @@ void MlOptimiserMpi::expectation()
 		{
 			long int progress_bar_step_size = XMIPP_MAX(1, my_nr_particles / 60);
 			long int prev_barstep = 0;
-			long int my_first_particle = 0.;
-			long int my_last_particle = my_nr_particles - 1;
-			long int my_first_particle_halfset1 = 0;
-			long int my_last_particle_halfset1 = mydata.numberOfParticles(1) - 1;
-			long int my_first_particle_halfset2 = mydata.numberOfParticles(1);
-			long int my_last_particle_halfset2 = mydata.numberOfParticles() - 1;
-
-			if (subset_size > 0)
-			{
-				my_last_particle_halfset1 = my_nr_particles;
-				my_last_particle_halfset2 = mydata.numberOfParticles(1) + my_nr_particles;
 
+			ParticleJobScheduler job_scheduler;
+			job_scheduler.max_job_size = nr_pool;
+			if (do_split_random_halves)
+			{
+				if (followers_halfset1.size() > 0)
+					job_scheduler.addParticles(my_first_particle_halfset1, my_last_particle_halfset1, followers_halfset1);
+				if (followers_halfset2.size() > 0)
+					job_scheduler.addParticles(my_first_particle_halfset2, my_last_particle_halfset2, followers_halfset2);
 			}
+			else
+				job_scheduler.addParticles(my_first_particle, my_last_particle, followers_all);
 
 			if (verb > 0)
 			{
@@ -1393,6 +1473,11 @@ void MlOptimiserMpi::expectation()
 			}
 
 			// Leader distributes all packages of SomeParticles
+			// Followers may ask for their next job while they are still processing the previous one,
+			// so the leader sends its replies without blocking, alternating between two buffers per follower,
+			// and only considers a follower done once it has no more particles and has returned all its jobs
+			std::vector<FollowerJobReply> replies(2 * node->size);
+			std::vector<int> nr_jobs_out(node->size, 0), nr_replies_sent(node->size, 0);
 			int nr_followers_done = 0;
 			int random_halfset = 0;
 			long int nr_particles_todo, nr_particles_done = 0;
@@ -1426,6 +1511,7 @@ void MlOptimiserMpi::expectation()
 				// Otherwise, the leader needs to receive and handle the updated metadata from the followers
 				if (JOB_NIMG > 0)
 				{
+					nr_jobs_out[this_follower]--;
 					exp_metadata.resize(JOB_NIMG, METADATA_LINE_LENGTH_BEFORE_BODIES + (mymodel.nr_bodies) * METADATA_NR_BODY_PARAMS);
 					node->relion_MPI_Recv(MULTIDIM_ARRAY(exp_metadata), MULTIDIM_SIZE(exp_metadata), MY_MPI_DOUBLE, this_follower, MPITAG_METADATA, MPI_COMM_WORLD, status);
 
@@ -1434,6 +1520,7 @@ void MlOptimiserMpi::expectation()
 
 					// The leader then updates the mydata.MDimg table
 					MlOptimiser::setMetaDataSubset(JOB_FIRST, JOB_LAST);
+					job_scheduler.finishedJob(this_follower, JOB_NPAR);
 					if (verb > 0 && nr_particles_done - prev_barstep> progress_bar_step_size)
 					{
 						prev_barstep = nr_particles_done;
@@ -1445,7 +1532,15 @@ void MlOptimiserMpi::expectation()
 				}
 
 				// See which random_halfset this follower belongs to, and keep track of the number of particles that have been processed already
-				if (do_split_random_halves)
+				bool has_job;
+				if (!do_fixed_job_size)
+				{
+					long int first, last;
+					has_job = job_scheduler.getJob(this_follower, first, last);
+					JOB_FIRST = first;
+					JOB_LAST = last;
+				}
+				else if (do_split_random_halves)
 				{
 					random_halfset = (this_follower % 2 == 1) ? 1 : 2;
 					if (random_halfset == 1)
@@ -1471,15 +1566,18 @@ void MlOptimiserMpi::expectation()
 					JOB_FIRST = nr_particles_done;
 					JOB_LAST  = XMIPP_MIN(my_last_particle, JOB_FIRST + nr_pool - 1);
 				}
+				if (do_fixed_job_size)
+					has_job = (my_nr_particles_done < nr_particles_todo);
 
 				// Now send out a new job
-				if (my_nr_particles_done < nr_particles_todo)
+				if (has_job)
 				{
 					MlOptimiser::getMetaAndImageDataSubset(JOB_FIRST, JOB_LAST, !do_parallel_disc_io);
 					JOB_NIMG = YSIZE(exp_metadata);
 					JOB_LEN_FN_IMG = exp_fn_img.length() + 1; // +1 to include \0 at the end of the string
 					JOB_LEN_FN_CTF = exp_fn_ctf.length() + 1;
 					JOB_LEN_FN_RECIMG = exp_fn_recimg.length() + 1;
+					nr_jobs_out[this_follower]++;
 				}
 				else
 				{
@@ -1493,8 +1591,9 @@ void MlOptimiserMpi::expectation()
 					exp_metadata.clear();
 					exp_imagedata.clear();
 
-					// No more particles, this follower is done now
-					nr_followers_done++;
+					// No more particles, this follower is done now (once it has sent back all its jobs)
+					if (nr_jobs_out[this_follower] == 0)
+						nr_followers_done++;
 				}
 
 				//std::cerr << "subset= " << subset << " half-set= " << random_halfset
@@ -1505,35 +1604,46 @@ void MlOptimiserMpi::expectation()
 				std::cerr << " MASTER SENDING to follower= " << this_follower<< " JOB_FIRST= " << JOB_FIRST << " JOB_LAST= " << JOB_LAST
 								<< " JOB_NIMG= "<<JOB_NIMG<< " JOB_NPAR= "<<JOB_NPAR<< std::endl;
 #endif
-				node->relion_MPI_Send(MULTIDIM_ARRAY(first_last_nr_images), MULTIDIM_SIZE(first_last_nr_images), MPI_LONG, this_follower, MPITAG_JOB_REPLY, MPI_COMM_WORLD);
+				// Wait until the follower has received the reply that was sent from the same buffer before
+				FollowerJobReply &reply = replies[2 * this_follower + nr_replies_sent[this_follower] % 2];
+				nr_replies_sent[this_follower]++;
+				node->relion_MPI_Waitall(reply.requests);
+
+				reply.first_last_nr_images = first_last_nr_images;
+				node->relion_MPI_Isend(MULTIDIM_ARRAY(reply.first_last_nr_images), MULTIDIM_SIZE(reply.first_last_nr_images), MPI_LONG, this_follower, MPITAG_JOB_REPLY, MPI_COMM_WORLD, reply.requests);
 
 				//806 Leader also sends the required metadata and imagedata for this job
 				if (JOB_NIMG > 0)
 				{
-					node->relion_MPI_Send(MULTIDIM_ARRAY(exp_metadata), MULTIDIM_SIZE(exp_metadata), MY_MPI_DOUBLE, this_follower, MPITAG_METADATA, MPI_COMM_WORLD);
+					reply.metadata = exp_metadata;
+					node->relion_MPI_Isend(MULTIDIM_ARRAY(reply.metadata), MULTIDIM_SIZE(reply.metadata), MY_MPI_DOUBLE, this_follower, MPITAG_METADATA, MPI_COMM_WORLD, reply.requests);
 					if (do_parallel_disc_io)
 					{
-						node->relion_MPI_Send((void*)exp_fn_img.c_str(), JOB_LEN_FN_IMG, MPI_CHAR, this_follower, MPITAG_METADATA, MPI_COMM_WORLD);
+						reply.fn_img = exp_fn_img;
+						reply.fn_ctf = exp_fn_ctf;
+						reply.fn_recimg = exp_fn_recimg;
+						node->relion_MPI_Isend((void*)reply.fn_img.c_str(), JOB_LEN_FN_IMG, MPI_CHAR, this_follower, MPITAG_METADATA, MPI_COMM_WORLD, reply.requests);
 						// Send filenames of images to the followers
 						if (JOB_LEN_FN_CTF > 1)
-							node->relion_MPI_Send((void*)exp_fn_ctf.c_str(), JOB_LEN_FN_CTF, MPI_CHAR, this_follower, MPITAG_METADATA, MPI_COMM_WORLD);
+							node->relion_MPI_Isend((void*)reply.fn_ctf.c_str(), JOB_LEN_FN_CTF, MPI_CHAR, this_follower, MPITAG_METADATA, MPI_COMM_WORLD, reply.requests);
 						if (JOB_LEN_FN_RECIMG > 1)
-							node->relion_MPI_Send((void*)exp_fn_recimg.c_str(), JOB_LEN_FN_RECIMG, MPI_CHAR, this_follower, MPITAG_METADATA, MPI_COMM_WORLD);
+							node->relion_MPI_Isend((void*)reply.fn_recimg.c_str(), JOB_LEN_FN_RECIMG, MPI_CHAR, this_follower, MPITAG_METADATA, MPI_COMM_WORLD, reply.requests);
 					}
 					else
 					{
 						// new in 3.1: first send the image_size of these particles (as no longer necessarily the same as mymodel.ori_size...)
-						int my_image_size = mydata.getOpticsImageSize(mydata.getOpticsGroup(JOB_FIRST));
-						node->relion_MPI_Send(&my_image_size, 1, MPI_INT, this_follower, MPITAG_IMAGE_SIZE, MPI_COMM_WORLD);
+						reply.image_size = mydata.getOpticsImageSize(mydata.getOpticsGroup(JOB_FIRST));
+						node->relion_MPI_Isend(&reply.image_size, 1, MPI_INT, this_follower, MPITAG_IMAGE_SIZE, MPI_COMM_WORLD, reply.requests);
 
 						// Send imagedata to the followers
-						node->relion_MPI_Send(MULTIDIM_ARRAY(exp_imagedata), MULTIDIM_SIZE(exp_imagedata), MY_MPI_DOUBLE, this_follower, MPITAG_IMAGE, MPI_COMM_WORLD);
+						reply.imagedata = exp_imagedata;
+						node->relion_MPI_Isend(MULTIDIM_ARRAY(reply.imagedata), MULTIDIM_SIZE(reply.imagedata), MY_MPI_DOUBLE, this_follower, MPITAG_IMAGE, MPI_COMM_WORLD, reply.requests);
 					}
 				}
 
 				// Update the total number of particles that has been done already
 				nr_particles_done += JOB_NPAR;
-				if (do_split_random_halves)
+				if (do_fixed_job_size && do_split_random_halves)
 				{
 					// Also update the number of particles that has been done for each subset
 					if (random_halfset == 1)
@@ -1546,6 +1656,10 @@ void MlOptimiserMpi::expectation()
 					}
 				}
 			}
+
+			// Make sure all replies have arrived before their buffers go
+			for (int i = 0; i < replies.size(); i++)
+				node->relion_MPI_Waitall(replies[i].requests);
 		}
 		catch (RelionError XE)
 		{
@@ -1580,6 +1694,8 @@ void MlOptimiserMpi::expectation()
 			JOB_LEN_FN_CTF = 0;
 			JOB_LEN_FN_RECIMG = 0;
 			node->relion_MPI_Send(MULTIDIM_ARRAY(first_last_nr_images), MULTIDIM_SIZE(first_last_nr_images), MPI_LONG, 0, MPITAG_JOB_REQUEST, MPI_COMM_WORLD);
+			// Every request (empty, or with the results of a job) gets exactly one reply
+			int nr_requests_out = 1;
 
 			while (true)
 			{
@@ -1587,7 +1703,10 @@ void MlOptimiserMpi::expectation()
 				timer.tic(TIMING_MPISLAVEWAIT1);
 #endif
 				//Receive a new bunch of particles
+				PerformanceTrace::begin("wait for job");
 				node->relion_MPI_Recv(MULTIDIM_ARRAY(first_last_nr_images), MULTIDIM_SIZE(first_last_nr_images), MPI_LONG, 0, MPITAG_JOB_REPLY, MPI_COMM_WORLD, status);
+				PerformanceTrace::end();
+				nr_requests_out--;
 #ifdef TIMING
 				timer.toc(TIMING_MPISLAVEWAIT1);
 #endif
@@ -1598,6 +1717,11 @@ void MlOptimiserMpi::expectation()
 #ifdef DEBUG
 					std::cerr <<" follower "<< node->rank << " has finished expectation.."<<std::endl;
 #endif
+					// The replies to my other requests can only be empty as well
+					MultidimArray<long int> empty_reply(6);
+					for (; nr_requests_out > 0; nr_requests_out--)
+						node->relion_MPI_Recv(MULTIDIM_ARRAY(empty_reply), MULTIDIM_SIZE(empty_reply), MPI_LONG, 0, MPITAG_JOB_REPLY, MPI_COMM_WORLD, status);
+
 					exp_imagedata.clear();
 					exp_metadata.clear();
 					break;
@@ -1669,6 +1793,16 @@ void MlOptimiserMpi::expectation()
 						node->relion_MPI_Recv(MULTIDIM_ARRAY(exp_imagedata), MULTIDIM_SIZE(exp_imagedata), MY_MPI_DOUBLE, 0, MPITAG_IMAGE, MPI_COMM_WORLD, status);
 					}
 
+					// Ask for the next job already, so that the leader prepares and sends it while I process this one
+					if (do_job_lookahead && nr_requests_out == 0)
+					{
+						MultidimArray<long int> empty_request(6);
+						empty_request.initZeros();
+						empty_request(1) = -1;
+						node->relion_MPI_Send(MULTIDIM_ARRAY(empty_request), MULTIDIM_SIZE(empty_request), MPI_LONG, 0, MPITAG_JOB_REQUEST, MPI_COMM_WORLD);
+						nr_requests_out++;
+					}
+
 					// Now process these images
 #ifdef DEBUG_MPIEXP
 					std::cerr << " SLAVE EXECUTING node->rank= " << node->rank << " JOB_FIRST= " << JOB_FIRST << " JOB_LAST= " << JOB_LAST << std::endl;
@@ -1687,6 +1821,7 @@ void MlOptimiserMpi::expectation()
 					node->relion_MPI_Send(MULTIDIM_ARRAY(first_last_nr_images), MULTIDIM_SIZE(first_last_nr_images), MPI_LONG, 0, MPITAG_JOB_REQUEST, MPI_COMM_WORLD);
 					// Also send the metadata belonging to those
 					node->relion_MPI_Send(MULTIDIM_ARRAY(exp_metadata), MULTIDIM_SIZE(exp_metadata), MY_MPI_DOUBLE, 0, MPITAG_METADATA, MPI_COMM_WORLD);
+					nr_requests_out++;
 
 #ifdef TIMING
 					timer.toc(TIMING_MPISLAVEWAIT3);
@@ -1695,6 +1830,9 @@ void MlOptimiserMpi::expectation()
 			}
 //		TODO: define MPI_COMM_SLAVES!!!!	MPI_Barrier(node->MPI_COMM_SLAVES);
 
+			// Add the thread-private backprojections of the non-accelerated code to wsum_model
+			mergePrivateBackprojectors();
+
 #if defined _CUDA_ENABLED || defined _HIP_ENABLED
 			if (do_gpu)
 			{
@@ -1911,6 +2049,9 @@ void MlOptimiserMpi::expectation()
 	// All followers reset the size of their projector to zero to save memory
 	if (!node->isLeader())
 	{
+		if (have_shared_references)
+			releaseSharedReferences();
+
 		for (int iclass = 0; iclass < mymodel.nr_classes; iclass++)
 			mymodel.PPref[iclass].initialiseData(0);
 	}
@@ -1921,6 +2062,107 @@ void MlOptimiserMpi::expectation()
 #endif
 }
 
+void MlOptimiserMpi::setupSharedReferences()
+{
+#if MPI_VERSION >= 3
+	// Only followers with the same references can share them
+	MPI_Comm halfC;
+	int color = (do_split_random_halves) ? node->myRandomSubset() : 0;
+	MPI_Comm_split(node->followerC, color, node->followerRank, &halfC);
+	MPI_Comm_split_type(halfC, MPI_COMM_TYPE_SHARED, node->followerRank, MPI_INFO_NULL, &sharedC);
+	MPI_Comm_free(&halfC);
+	MPI_Comm_rank(sharedC, &shared_rank);
+
+	// The first followers of all nodes broadcast the references between the nodes
+	MPI_Comm_split(node->followerC, (shared_rank == 0) ? 0 : MPI_UNDEFINED, node->followerRank, &shared_leadersC);
+	int my_leader = -1;
+	if (shared_rank == 0)
+		MPI_Comm_rank(shared_leadersC, &my_leader);
+	MPI_Bcast(&my_leader, 1, MPI_INT, 0, sharedC);
+
+	shared_leader_of_follower.resize(node->size - 1);
+	MPI_Allgather(&my_leader, 1, MPI_INT, &shared_leader_of_follower[0], 1, MPI_INT, node->followerC);
+#else
+	REPORT_ERROR("MlOptimiserMpi::setupSharedReferences: BUG: MPI-3 is not available");
+#endif
+}
+
+void MlOptimiserMpi::shareReferences()
+{
+#if MPI_VERSION >= 3
+	if (sharedC == MPI_COMM_NULL)
+		setupSharedReferences();
+
+	std::vector<long int> offset(mymodel.PPref.size() + 1, 0);
+	for (int i = 0; i < mymodel.PPref.size(); i++)
+		offset[i + 1] = offset[i] + MULTIDIM_SIZE(mymodel.PPref[i].data);
+
+	Complex *shared_data;
+	MPI_Aint my_size = (shared_rank == 0) ? offset.back() * sizeof(Complex) : 0;
+	int error = MPI_Win_allocate_shared(my_size, sizeof(Complex), MPI_INFO_NULL, sharedC, &shared_data, &shared_references_win);
+	if (error != MPI_SUCCESS)
+		node->report_MPI_ERROR(error);
+
+	MPI_Aint size;
+	int disp_unit;
+	MPI_Win_shared_query(shared_references_win, 0, &size, &disp_unit, &shared_data);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, shared_references_win);
+
+	// Fill the windows from the followers that calculated the references
+	for (int i = 0; i < mymodel.PPref.size(); i++)
+	{
+		bool is_source = (do_split_random_halves) ? shared_rank == 0 : (i % (node->size - 1)) == node->followerRank;
+		if (is_source && offset[i + 1] > offset[i])
+			memcpy(shared_data + offset[i], MULTIDIM_ARRAY(mymodel.PPref[i].data), (offset[i + 1] - offset[i]) * sizeof(Complex));
+	}
+	MPI_Win_sync(shared_references_win);
+	MPI_Barrier(sharedC);
+	MPI_Win_sync(shared_references_win);
+
+	// Then broadcast each reference from the node where it was calculated to all other nodes
+	if (!do_split_random_halves && shared_rank == 0)
+	{
+		for (int i = 0; i < mymodel.PPref.size(); i++)
+		{
+			int sender = shared_leader_of_follower[i % (node->size - 1)];
+			node->relion_MPI_Bcast(shared_data + offset[i], offset[i + 1] - offset[i], MY_MPI_COMPLEX, sender, shared_leadersC);
+		}
+	}
+	MPI_Win_sync(shared_references_win);
+	MPI_Barrier(sharedC);
+	MPI_Win_sync(shared_references_win);
+
+	// Replace the private copies by the shared ones (the shape of the arrays is kept)
+	for (int i = 0; i < mymodel.PPref.size(); i++)
+	{
+		MultidimArray<Complex> &data = mymodel.PPref[i].data;
+		if (offset[i + 1] > offset[i])
+		{
+			data.coreDeallocate();
+			data.data = shared_data + offset[i];
+			data.destroyData = false;
+		}
+	}
+
+	have_shared_references = true;
+#else
+	REPORT_ERROR("MlOptimiserMpi::shareReferences: BUG: MPI-3 is not available");
+#endif
+}
+
+void MlOptimiserMpi::releaseSharedReferences()
+{
+#if MPI_VERSION >= 3
+	// This does not free the data, as the arrays do not own it
+	for (int i = 0; i < mymodel.PPref.size(); i++)
+		mymodel.PPref[i].data.clear();
+
+	MPI_Win_unlock_all(shared_references_win);
+	MPI_Win_free(&shared_references_win);
+	have_shared_references = false;
+#endif
+}
+
 void MlOptimiserMpi::combineAllWeightedSumsViaFile()
 {
 
@@ -2043,7 +2285,30 @@ void MlOptimiserMpi::combineAllWeightedSums()
 	std::cerr << " starting combineAllWeightedSums..." << std::endl;
 #endif
 	// Only combine weighted sums if there are more than one followers per subset!
-	if ((node->size - 1)/nr_halfsets > 1)
+	if ((node->size - 1)/nr_halfsets > 1 && wsum_reduction == "tree")
+	{
+		if (!node->isLeader())
+		{
+			// The followers of my subset, in the same order on all of them
+			std::vector<int> subset_ranks;
+			for (int follower = (do_split_random_halves) ? node->myRandomSubset() : 1; follower < node->size; follower += nr_halfsets)
+				subset_ranks.push_back(follower);
+
+			// Loop over possibly multiple instances of Mpack of maximum size
+			int piece = 0;
+			int nr_pieces = 1;
+			while (piece < nr_pieces)
+			{
+				wsum_model.pack(Mpack, piece, nr_pieces);
+				node->relion_MPI_AllreduceSum(MULTIDIM_ARRAY(Mpack), MULTIDIM_SIZE(Mpack), subset_ranks, do_wsum_float_transport);
+				// Subtract 1 from piece because it was incremented already...
+				wsum_model.unpack(Mpack, piece - 1);
+			}
+		}
+
+		MPI_Barrier(MPI_COMM_WORLD);
+	}
+	else if ((node->size - 1)/nr_halfsets > 1)
 	{
 #ifdef USE_MPI_COLLECTIVE
 		if (!node->isLeader())
@@ -3861,6 +4126,8 @@ void MlOptimiserMpi::iterate()
 
 	// Launch threads etc.
 	MlOptimiser::iterateSetup();
+	if (do_trace)
+		PerformanceTrace::enable(node->rank);
 
 	// Initialize the current resolution
 	updateCurrentResolution();
@@ -3870,6 +4137,7 @@ void MlOptimiserMpi::iterate()
 #ifdef TIMING
 		timer.tic(TIMING_EXP);
 #endif
+		const int trace_iter = iter;
 
 		// Nobody can start the next iteration until everyone has finished
 		MPI_Barrier(MPI_COMM_WORLD);
@@ -3922,12 +4190,18 @@ void MlOptimiserMpi::iterate()
 			std::cerr << " WARNING: skipping randomisation of particle order because random_seed equals zero..." << std::endl;
 		}
 
+		PerformanceTrace::begin("expectation");
 		expectation();
+		PerformanceTrace::end();
+		if (PerformanceTrace::enabled() && PerformanceTrace::nrOpenSpans() > 0)
+			REPORT_ERROR("BUG: " + integerToString(PerformanceTrace::nrOpenSpans()) + " spans of the performance trace are still open after the expectation step");
 #ifdef DEBUG
 		std::cerr << " finished expectation..." << std::endl;
 #endif
 
+		PerformanceTrace::begin("MPI wait");
 		MPI_Barrier(MPI_COMM_WORLD);
+		PerformanceTrace::end();
 
 		if (do_skip_maximization)
 		{
@@ -3940,6 +4214,7 @@ void MlOptimiserMpi::iterate()
 				if (verb > 0)
 					std::cout << " Auto-refine: Skipping maximization step, so stopping now... " << std::endl;
 			}
+			writePerformanceTrace(trace_iter, node->rank);
 			break;
 		}
 
@@ -3948,10 +4223,12 @@ void MlOptimiserMpi::iterate()
 #ifdef DEBUG
 		std::cerr << " before combineAllWeightedSums..." << std::endl;
 #endif
+		PerformanceTrace::begin("MPI combine");
 		if (combine_weights_thru_disc)
 			combineAllWeightedSumsViaFile();
 		else
 			combineAllWeightedSums();
+		PerformanceTrace::end();
 #ifdef DEBUG
 		std::cerr << " after combineAllWeightedSums..." << std::endl;
 #endif
@@ -4088,7 +4365,9 @@ void MlOptimiserMpi::iterate()
 		timer.tic(TIMING_MAX);
 #endif
 
+		PerformanceTrace::begin("maximization");
 		maximization();
+		PerformanceTrace::end();
 
 		// Make sure all nodes have the same resolution, set the data_vs_prior array from half1 also for half2
 		// Because there is an if-statement on ave_Pmax to set the image size, also make sure this one is the same for both halves
@@ -4194,6 +4473,7 @@ void MlOptimiserMpi::iterate()
 #ifdef TIMING
 		timer.toc(TIMING_ITER_WRITE);
 #endif
+		writePerformanceTrace(trace_iter, node->rank);
 
 		if (do_auto_refine && has_converged)
 		{
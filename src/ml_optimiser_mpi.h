@@ -22,6 +22,7 @@
 #define ML_OPTIMISER_MPI_H_
 #include "src/mpi.h"
 #include "src/ml_optimiser.h"
+#include "src/particle_job_scheduler.h"
 
 // definition of MPITAG has been moved to header mpi.h
 
@@ -42,6 +43,30 @@ public:
     // For debugging: halt all followers except this one
     int halt_all_followers_except_this;
 
+    // How the followers sum their weighted sums in combineAllWeightedSums: "tree" or "chain" ("tree" or "allreduce" with USE_MPI_COLLECTIVE)
+    std::string wsum_reduction;
+
+    // Followers ask for their next job in the expectation step before processing the current one
+    bool do_job_lookahead;
+
+    // Hand out jobs of nr_pool particles in the sorted order, instead of using the ParticleJobScheduler
+    bool do_fixed_job_size;
+
+    // Send the weighted sums in single precision in the tree reduction
+    bool do_wsum_float_transport;
+
+    // Followers on the same node (and in the same random half) keep one copy of the references in an MPI-3 shared-memory window
+    bool do_shared_references;
+
+    // Followers that share a window, the first follower of each of these groups, and the rank in shared_leadersC of the first follower in the group of each follower
+    MPI_Comm sharedC, shared_leadersC;
+    int shared_rank;
+    std::vector<int> shared_leader_of_follower;
+
+    // Window with the data of all mymodel.PPref while the references are shared
+    MPI_Win shared_references_win;
+    bool have_shared_references;
+
     // Original verb
     int ori_verb;
 
@@ -73,6 +98,25 @@ public:
      */
     void expectation();
 
+    /** Set up the communicators for --shared_references
+     * Must be called by all followers.
+     */
+    void setupSharedReferences();
+
+    /** Move the data of mymodel.PPref into a shared-memory window
+     * The first follower on each node holds the window, and the other followers on that node map it.
+     * Without split random halves, each reference is copied into the window of the node of the follower that calculated it,
+     * and then broadcast between the first followers of all nodes. With split random halves, all followers have calculated
+     * all references of their half, and the window is filled from the first follower of each half on each node.
+     * Must be called by all followers.
+     */
+    void shareReferences();
+
+    /** Forget the shared references and free the window
+     * Must be called by all followers.
+     */
+    void releaseSharedReferences();
+
     /** After expectation combine all weighted sum arrays across all nodes
      *  Use read/write to temporary files instead of MPI
      */
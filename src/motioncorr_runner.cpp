@@ -136,6 +136,9 @@ void MotioncorrRunner::read(int argc, char **argv, int rank)
 	early_binning = !parser.checkOption("--no_early_binning", "Disable --early_binning");
 	if (fabs(bin_factor - 1) < 0.01)
 		early_binning = false;
+	do_streaming = parser.checkOption("--streaming", "Read the movie a few frames at a time, and again for the final sums, instead of holding all frames in memory. This needs much less memory per process.");
+	if (do_streaming && !do_own)
+		REPORT_ERROR("--streaming is valid only with --use_own");
 
 	if ((!do_motioncor2 && !do_own) || (do_motioncor2 && do_own))
 		REPORT_ERROR("You have to choose either UCSF MotionCor2 or RELION's own implementation.");
@@ -1203,44 +1206,94 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	}
 	RCTOC(TIMING_READ_GAIN);
 
-	// Read images
-	RCTIC(TIMING_READ_MOVIE);
-	#pragma omp parallel for num_threads(isCompressedMRC ? 1 : n_io_threads)
-	for (int iframe = 0; iframe < n_frames; iframe++) {
+	// With fewer (EER) frames than threads, let each frame use all threads for its hardware frames
+	const int n_render_threads = (isEER && n_frames < n_io_threads) ? n_io_threads : 1;
+	const int n_read_threads = (isCompressedMRC || n_render_threads > 1) ? 1 : n_io_threads;
+
+	// In streaming mode, only this many frames are in memory at any time
+	const int chunk_size = do_streaming ? XMIPP_MIN(n_io_threads, n_frames) : n_frames;
+	if (do_streaming)
+		logfile << "Streaming: reading " << chunk_size << " frame(s) at a time." << std::endl;
+
+	auto readFrame = [&](int iframe, Image<float> &Iframe) {
 		if (isEER)
-			renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe]());
+			renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframe(), n_render_threads);
 		else if (isCompressedMRC)
-			compressedMRCreader.readFrameInto(Iframes[iframe], frames[iframe]);
+			compressedMRCreader.readFrameInto(Iframe, frames[iframe]);
 		else
-			Iframes[iframe].read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
-	}
-	RCTOC(TIMING_READ_MOVIE);
+			Iframe.read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
 
-	// Apply gain
-	RCTIC(TIMING_APPLY_GAIN);
-	if (fn_gain_reference != "") {
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iframe = 0; iframe < n_frames; iframe++) {
+		if (fn_gain_reference != "") {
 			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain()) {
-				DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n) *= DIRECT_MULTIDIM_ELEM(Igain(), n);
+				DIRECT_MULTIDIM_ELEM(Iframe(), n) *= DIRECT_MULTIDIM_ELEM(Igain(), n);
 			}
 		}
-	}
-	RCTOC(TIMING_APPLY_GAIN);
+	};
 
 	MultidimArray<float> Isum(ny, nx);
 	Isum.initZeros();
-	// First sum unaligned frames
-	RCTIC(TIMING_INITIAL_SUM);
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		#pragma omp parallel for num_threads(n_threads)
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
-			DIRECT_MULTIDIM_ELEM(Isum, n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
+
+	if (!do_streaming) {
+		// Read images
+		RCTIC(TIMING_READ_MOVIE);
+		#pragma omp parallel for num_threads(n_read_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			if (isEER)
+				renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe](), n_render_threads);
+			else if (isCompressedMRC)
+				compressedMRCreader.readFrameInto(Iframes[iframe], frames[iframe]);
+			else
+				Iframes[iframe].read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
+		}
+		RCTOC(TIMING_READ_MOVIE);
+
+		// Apply gain
+		RCTIC(TIMING_APPLY_GAIN);
+		if (fn_gain_reference != "") {
+			#pragma omp parallel for num_threads(n_threads)
+			for (int iframe = 0; iframe < n_frames; iframe++) {
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain()) {
+					DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n) *= DIRECT_MULTIDIM_ELEM(Igain(), n);
+				}
+			}
+		}
+		RCTOC(TIMING_APPLY_GAIN);
+
+		// First sum unaligned frames
+		RCTIC(TIMING_INITIAL_SUM);
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			#pragma omp parallel for num_threads(n_threads)
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+				DIRECT_MULTIDIM_ELEM(Isum, n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
+			}
+		}
+		RCTOC(TIMING_INITIAL_SUM);
+	} else if (!skip_defect) {
+		// The unaligned sum is only needed for hot pixel detection
+		RCTIC(TIMING_INITIAL_SUM);
+		std::vector<Image<float> > Ichunk(chunk_size);
+		for (int chunk_start = 0; chunk_start < n_frames; chunk_start += chunk_size) {
+			const int chunk_end = XMIPP_MIN(chunk_start + chunk_size, n_frames);
+
+			#pragma omp parallel for num_threads(n_read_threads)
+			for (int iframe = chunk_start; iframe < chunk_end; iframe++)
+				readFrame(iframe, Ichunk[iframe - chunk_start]);
+
+			for (int iframe = chunk_start; iframe < chunk_end; iframe++) {
+				#pragma omp parallel for num_threads(n_threads)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+					DIRECT_MULTIDIM_ELEM(Isum, n) += DIRECT_MULTIDIM_ELEM(Ichunk[iframe - chunk_start](), n);
+				}
+			}
 		}
+		RCTOC(TIMING_INITIAL_SUM);
 	}
-	RCTOC(TIMING_INITIAL_SUM);
 
-	// Hot pixel
+	// Hot pixels; in streaming mode, they are fixed in each frame as it is read again
+	MultidimArray<bool> bBad;
+	std::vector<long int> bad_pixels;
+	RFLOAT frame_mean = 0, frame_std = 0;
+	const int D_MAX = isEER ? 4 : 2;
 	if (!skip_defect)
 	{
 		RCTIC(TIMING_DETECT_HOT);
@@ -1259,7 +1312,7 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		const RFLOAT threshold = mean + hotpixel_sigma * std;
 		logfile << "In unaligned sum, Mean = " << mean << " Std = " << std << " Hotpixel threshold = " << threshold << std::endl;
 
-		MultidimArray<bool> bBad(ny, nx);
+		bBad.resize(ny, nx);
 		bBad.initZeros();
 		if (fn_defect != "")
 		{
@@ -1297,13 +1350,19 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		RCTOC(TIMING_DETECT_HOT);
 
 		RCTIC(TIMING_FIX_DEFECT);
-		const RFLOAT frame_mean = mean / n_frames;
-		const RFLOAT frame_std = std / n_frames;
+		frame_mean = mean / n_frames;
+		frame_std = std / n_frames;
 
 		const int NUM_MIN_OK = 6;
-		const int D_MAX = isEER ? 4 : 2;
 		const int PBUF_SIZE = 100;
-		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(bBad)
+		if (do_streaming)
+		{
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(bBad)
+			{
+				if (DIRECT_MULTIDIM_ELEM(bBad, n)) bad_pixels.push_back(n);
+			}
+		}
+		else FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(bBad)
 		{
 			if (!DIRECT_A2D_ELEM(bBad, i, j)) continue;
 //			std::cout << "Hot pixel at (" << i << ", " << j << ")" << std::endl;
@@ -1338,7 +1397,8 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 			}
 		}
 		RCTOC(TIMING_FIX_DEFECT);
-		logfile << "Fixed hot pixels." << std::endl;
+		if (!do_streaming)
+			logfile << "Fixed hot pixels." << std::endl;
 	} // !skip_defect
 
 //#define WRITE_FRAMES
@@ -1361,19 +1421,87 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		logfile << "Image size after binning: X = " << nx << " Y = " << ny << std::endl;
 	}
 
+	// Read frames again (streaming mode), fix hot pixels and Fourier transform them, binned if early_binning
+	auto readAndTransformFrames = [&](std::vector<int> &iframes, std::vector<Image<float> > &Ichunk, std::vector<MultidimArray<fComplex> > &Fchunk) {
+		RCTIC(TIMING_READ_MOVIE);
+		#pragma omp parallel for num_threads(n_read_threads)
+		for (int i = 0; i < iframes.size(); i++)
+			readFrame(iframes[i], Ichunk[i]);
+		RCTOC(TIMING_READ_MOVIE);
+
+		#pragma omp parallel for num_threads(n_threads)
+		for (int i = 0; i < iframes.size(); i++) {
+			if (!skip_defect)
+				fixHotPixels(Ichunk[i](), bBad, bad_pixels, frame_mean, frame_std, D_MAX);
+
+			if (!early_binning) {
+				NewFFT::FourierTransform(Ichunk[i](), Fchunk[i]);
+			} else {
+				MultidimArray<fComplex> Fframe;
+				NewFFT::FourierTransform(Ichunk[i](), Fframe);
+				Fchunk[i].reshape(ny, nx / 2 + 1);
+				cropInFourierSpace(Fframe, Fchunk[i]);
+			}
+		}
+	};
+
+	// NOTE: Image(X, Y) has MultidimArray(Y, X)!! X is the fast axis.
+	Image<float> PS_sum;
+	if (grouping_for_ps > 0) {
+		PS_sum().initZeros(ny, nx);
+		PS_sum().setXmippOrigin();
+	}
+
 	// FFT
 	RCTIC(TIMING_GLOBAL_FFT);
-	#pragma omp parallel for num_threads(n_threads)
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		if (!early_binning) {
-			NewFFT::FourierTransform(Iframes[iframe](), Fframes[iframe]);
-		} else {
-			MultidimArray<fComplex> Fframe;
-			NewFFT::FourierTransform(Iframes[iframe](), Fframe);
-			Fframes[iframe].reshape(ny, nx / 2 + 1);
-			cropInFourierSpace(Fframe, Fframes[iframe]);
+	if (!do_streaming) {
+		#pragma omp parallel for num_threads(n_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			if (!early_binning) {
+				NewFFT::FourierTransform(Iframes[iframe](), Fframes[iframe]);
+			} else {
+				MultidimArray<fComplex> Fframe;
+				NewFFT::FourierTransform(Iframes[iframe](), Fframe);
+				Fframes[iframe].reshape(ny, nx / 2 + 1);
+				cropInFourierSpace(Fframe, Fframes[iframe]);
+			}
+			Iframes[iframe].clear(); // save some memory (global alignment use the most memory)
+		}
+	} else {
+		// Keep only the part of the Fourier transforms used by the global alignment;
+		// power spectra are summed as the frames come in.
+		std::vector<Image<float> > Ichunk(chunk_size);
+		std::vector<MultidimArray<fComplex> > Fchunk(chunk_size);
+		MultidimArray<fComplex> F_sum;
+		for (int chunk_start = 0; chunk_start < n_frames; chunk_start += chunk_size) {
+			std::vector<int> iframes;
+			for (int iframe = chunk_start; iframe < chunk_start + chunk_size && iframe < n_frames; iframe++)
+				iframes.push_back(iframe);
+			readAndTransformFrames(iframes, Ichunk, Fchunk);
+
+			#pragma omp parallel for num_threads(n_threads)
+			for (int i = 0; i < iframes.size(); i++)
+				cropForAlignment(Fchunk[i], Fframes[iframes[i]], nx, ny, bfactor / (prescaling * prescaling));
+
+			if (grouping_for_ps <= 0) continue;
+			RCTIC(TIMING_POWER_SPECTRUM_SUM);
+			for (int i = 0; i < iframes.size(); i++) {
+				const int iframe = iframes[i];
+				if (iframe % grouping_for_ps == 0) {
+					F_sum = Fchunk[i];
+				} else {
+					#pragma omp parallel for num_threads(n_threads)
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(F_sum)
+						DIRECT_MULTIDIM_ELEM(F_sum, n) += DIRECT_MULTIDIM_ELEM(Fchunk[i], n);
+				}
+
+				if ((iframe + 1) % grouping_for_ps == 0 || iframe == n_frames - 1)
+					addToPowerSpectrum(PS_sum(), F_sum);
+			}
+			RCTOC(TIMING_POWER_SPECTRUM_SUM);
 		}
-		Iframes[iframe].clear(); // save some memory (global alignment use the most memory)
+		if (!skip_defect)
+			logfile << "Fixed hot pixels." << std::endl;
 	}
 	RCTOC(TIMING_GLOBAL_FFT);
 
@@ -1383,15 +1511,11 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	{
 		const RFLOAT target_pixel_size = 1.4; // value from CTFFIND 4.1
 
-		// NOTE: Image(X, Y) has MultidimArray(Y, X)!! X is the fast axis.
-		RCTIC(TIMING_POWER_SPECTRUM_SUM);
-		Image<float> PS_sum(nx, ny);
 		MultidimArray<fComplex> F_ps, F_ps_small;
 
-		// 0. Group and sum
-		PS_sum().initZeros();
-		PS_sum().setXmippOrigin();
-		for (int iframe = 0; iframe < n_frames; iframe += grouping_for_ps)
+		// 0. Group and sum (already done in streaming mode)
+		RCTIC(TIMING_POWER_SPECTRUM_SUM);
+		for (int iframe = 0; iframe < n_frames && !do_streaming; iframe += grouping_for_ps)
 		{
 			MultidimArray<fComplex> F_sum(Fframes[iframe]);
 			for (int j = 1; j < grouping_for_ps && j + iframe < n_frames; j++)
@@ -1401,15 +1525,7 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 					DIRECT_MULTIDIM_ELEM(F_sum, n) += DIRECT_MULTIDIM_ELEM(Fframes[j + iframe], n);
 			}
 
-			#pragma omp parallel for num_threads(n_threads)
-			FOR_ALL_ELEMENTS_IN_ARRAY2D(PS_sum()) // logical 2D access, i = logical_y, j = logical_x
-			{
-				// F(i, j) = conj(F(-i, -j))
-				if (j > 0)
-					A2D_ELEM(PS_sum(), i, j) += abs(FFTW2D_ELEM(F_sum, i, j)); // accessor is (Y, X)
-				else
-					A2D_ELEM(PS_sum(), i, j) += abs(FFTW2D_ELEM(F_sum, -i, -j));
-			}
+			addToPowerSpectrum(PS_sum(), F_sum);
 		}
 //#define DEBUG_PS
 #ifdef DEBUG_PS
@@ -1493,14 +1609,32 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	Iref_odd().reshape(ny, nx);
 	Iref().initZeros();
 	RCTIC(TIMING_GLOBAL_IFFT);
-	#pragma omp parallel for num_threads(n_threads)
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		Iframes[iframe]().reshape(ny, nx);
-		NewFFT::inverseFourierTransform(Fframes[iframe], Iframes[iframe]());
-		// Unfortunately, we cannot deallocate Fframes here because of dose-weighting
+	if (!do_streaming) {
+		#pragma omp parallel for num_threads(n_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			Iframes[iframe]().reshape(ny, nx);
+			NewFFT::inverseFourierTransform(Fframes[iframe], Iframes[iframe]());
+			// Unfortunately, we cannot deallocate Fframes here because of dose-weighting
+		}
+	} else {
+		Fframes.clear(); // frames are read again and shifted by the global shifts
 	}
 	RCTOC(TIMING_GLOBAL_IFFT);
 
+	// Read frames again, shift them by the global shifts and go back to real space
+	auto readAlignedFrames = [&](std::vector<int> &iframes, std::vector<Image<float> > &Ichunk, std::vector<MultidimArray<fComplex> > &Fchunk) {
+		readAndTransformFrames(iframes, Ichunk, Fchunk);
+
+		RCTIC(TIMING_GLOBAL_IFFT);
+		#pragma omp parallel for num_threads(n_threads)
+		for (int i = 0; i < iframes.size(); i++) {
+			shiftNonSquareImageInFourierTransform(Fchunk[i], -xshifts[iframes[i]] / nx, -yshifts[iframes[i]] / ny);
+			Ichunk[i]().reshape(ny, nx);
+			NewFFT::inverseFourierTransform(Fchunk[i], Ichunk[i]());
+		}
+		RCTOC(TIMING_GLOBAL_IFFT);
+	};
+
 	// Patch based alignment
 	logfile << std::endl << "Local alignments:" << std::endl;
 	logfile << "Patches: X = " << patch_x << " Y = " << patch_y << std::endl;
@@ -1514,22 +1648,63 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		std::vector<RFLOAT> patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys;
 		std::vector<MultidimArray<fComplex> > Fpatches(n_groups);
 
+		auto getPatchRange = [&](int ix, int iy, int &x_start, int &x_end, int &y_start, int &y_end) {
+			x_start = ix * patch_nx; y_start = iy * patch_ny; // Inclusive
+			x_end = x_start + patch_nx; y_end = y_start + patch_ny; // Exclusive
+			if (x_end > nx) x_end = nx;
+			if (y_end > ny) y_end = ny;
+			// make patch size even
+			if ((x_end - x_start) % 2 == 1) {
+				if (x_end == nx) x_start++;
+				else x_end--;
+			}
+			if ((y_end - y_start) % 2 == 1) {
+				if (y_end == ny) y_start++;
+				else y_end--;
+			}
+		};
+
+		// In streaming mode, read the frames that are clipped into patches (the last one of each group) again
+		// and keep only the part of the Fourier transforms of the patches that is used in the alignment.
+		std::vector<std::vector<MultidimArray<fComplex> > > Fpatches_all;
+		if (do_streaming) {
+			RCTIC(TIMING_PREP_PATCH);
+			Fpatches_all.resize(n_patches, std::vector<MultidimArray<fComplex> >(n_groups));
+			std::vector<Image<float> > Ichunk(chunk_size);
+			std::vector<MultidimArray<fComplex> > Fchunk(chunk_size);
+			for (int chunk_start = 0; chunk_start < n_groups; chunk_start += chunk_size) {
+				std::vector<int> iframes, igroups;
+				for (int igroup = chunk_start; igroup < chunk_start + chunk_size && igroup < n_groups; igroup++) {
+					igroups.push_back(igroup);
+					iframes.push_back(group_start[igroup] + group_size[igroup] - 1);
+				}
+				readAlignedFrames(iframes, Ichunk, Fchunk);
+
+				#pragma omp parallel for num_threads(n_threads)
+				for (int k = 0; k < igroups.size() * n_patches; k++) {
+					const int i = k / n_patches, ipatch = k % n_patches;
+					int x_start, x_end, y_start, y_end;
+					getPatchRange(ipatch % patch_x, ipatch / patch_x, x_start, x_end, y_start, y_end);
+
+					MultidimArray<float> Ipatch(y_end - y_start, x_end - x_start);
+					MultidimArray<fComplex> Fpatch;
+					for (int ipy = y_start; ipy < y_end; ipy++) {
+						for (int ipx = x_start; ipx < x_end; ipx++) {
+							DIRECT_A2D_ELEM(Ipatch, ipy - y_start, ipx - x_start) = DIRECT_A2D_ELEM(Ichunk[i](), ipy, ipx);
+						}
+					}
+					NewFFT::FourierTransform(Ipatch, Fpatch);
+					cropForAlignment(Fpatch, Fpatches_all[ipatch][igroups[i]], x_end - x_start, y_end - y_start, bfactor / (prescaling * prescaling));
+				}
+			}
+			RCTOC(TIMING_PREP_PATCH);
+		}
+
 		int ipatch = 1;
 		for (int iy = 0; iy < patch_y; iy++) {
 			for (int ix = 0; ix < patch_x; ix++) {
-				int x_start = ix * patch_nx, y_start = iy * patch_ny; // Inclusive
-				int x_end = x_start + patch_nx, y_end = y_start + patch_ny; // Exclusive
-				if (x_end > nx) x_end = nx;
-				if (y_end > ny) y_end = ny;
-				// make patch size even
-				if ((x_end - x_start) % 2 == 1) {
-					if (x_end == nx) x_start++;
-					else x_end--;
-				}
-				if ((y_end - y_start) % 2 == 1) {
-					if (y_end == ny) y_start++;
-					else y_end--;
-				}
+				int x_start, x_end, y_start, y_end;
+				getPatchRange(ix, iy, x_start, x_end, y_start, y_end);
 
 				int x_center = (x_start + x_end - 1) / 2, y_center = (y_start + y_end - 1) / 2;
 				logfile << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch << " / " << patch_x * patch_y;
@@ -1540,8 +1715,11 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 				std::vector<RFLOAT> local_xshifts(n_groups), local_yshifts(n_groups);
 				RCTIC(TIMING_PREP_PATCH);
 				std::vector<MultidimArray<float> >Ipatches(n_threads);
+				if (do_streaming)
+					Fpatches.swap(Fpatches_all[iy * patch_x + ix]);
+				const int n_groups_to_clip = do_streaming ? 0 : n_groups; // already done in streaming mode
 				#pragma omp parallel for num_threads(n_threads)
-				for (int igroup = 0; igroup < n_groups; igroup++) {
+				for (int igroup = 0; igroup < n_groups_to_clip; igroup++) {
 					const int tid = omp_get_thread_num();
 					Ipatches[tid].reshape(y_end - y_start, x_end - x_start); // end is not included
 					RCTIC(TIMING_CLIP_PATCH);
@@ -1707,7 +1885,128 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	}
 
 skip_fitting:
-	if (!do_dose_weighting || save_noDW) {
+	std::vector <RFLOAT> doses(n_frames);
+	if (do_dose_weighting) {
+		if (std::abs(voltage - 300) > 2 && std::abs(voltage - 200) > 2 && std::abs(voltage - 100) > 2) {
+			REPORT_ERROR("Sorry, dose weighting is supported only for 300, 200 or 100 kV");
+		}
+
+        logfile << "Pre-exposure: = " << pre_exposure << std::endl;
+
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			// dose AFTER each frame.
+			doses[iframe] = mic.pre_exposure + dose_per_frame * (frames[iframe] + 1);
+			if (std::abs(voltage - 200) <= 2) {
+				doses[iframe] /= 0.8; // 200 kV electron is more damaging.
+			} else if (std::abs(voltage - 100) <= 2) {
+				doses[iframe] /= 0.64; // 100 kV electron is much more damaging.
+			}
+		}
+	}
+
+	if (do_streaming) {
+		// Read the movie for the last time and sum the frames one by one
+		const bool do_noDW = !do_dose_weighting || save_noDW;
+		Image<float> Iref_DW;
+		MultidimArray<RFLOAT> dw_Ne, dw_norm;
+		MultidimArray<float> Ialigned;
+
+		if (do_noDW) {
+			Iref().initZeros(ny, nx);
+			if (even_odd_split) {
+				Iref_even().initZeros(ny, nx);
+				Iref_odd().initZeros(ny, nx);
+			}
+		}
+		if (do_dose_weighting) {
+			Iref_DW().initZeros(ny, nx);
+			RCTIC(TIMING_DW_WEIGHT);
+			prepareDoseWeighting(ny, nx / 2 + 1, doses, angpix * prescaling, dw_Ne, dw_norm);
+			RCTOC(TIMING_DW_WEIGHT);
+		}
+
+		logfile << "Summing frames: ";
+		std::vector<Image<float> > Ichunk(chunk_size);
+		std::vector<MultidimArray<fComplex> > Fchunk(chunk_size);
+		for (int chunk_start = 0; chunk_start < n_frames; chunk_start += chunk_size) {
+			std::vector<int> iframes;
+			for (int iframe = chunk_start; iframe < chunk_start + chunk_size && iframe < n_frames; iframe++)
+				iframes.push_back(iframe);
+			readAlignedFrames(iframes, Ichunk, Fchunk);
+
+			RCTIC(TIMING_REAL_SPACE_INTERPOLATION);
+			for (int i = 0; i < iframes.size() && do_noDW; i++) {
+				if (!even_odd_split) {
+					realSpaceInterpolateFrame(Iref(), Ichunk[i](), iframes[i], mic.model);
+					continue;
+				}
+
+				Ialigned.initZeros(ny, nx);
+				realSpaceInterpolateFrame(Ialigned, Ichunk[i](), iframes[i], mic.model);
+				Iref() += Ialigned;
+				if (iframes[i] % 2 == 0)
+					Iref_even() += Ialigned;
+				else
+					Iref_odd() += Ialigned;
+			}
+			RCTOC(TIMING_REAL_SPACE_INTERPOLATION);
+
+			if (do_dose_weighting) {
+				RCTIC(TIMING_DOSE_WEIGHTING);
+				#pragma omp parallel for num_threads(n_threads)
+				for (int i = 0; i < iframes.size(); i++) {
+					doseWeightFrame(Fchunk[i], doses[iframes[i]], dw_Ne, dw_norm);
+					NewFFT::inverseFourierTransform(Fchunk[i], Ichunk[i]());
+				}
+				RCTOC(TIMING_DOSE_WEIGHTING);
+
+				RCTIC(TIMING_REAL_SPACE_INTERPOLATION);
+				for (int i = 0; i < iframes.size(); i++)
+					realSpaceInterpolateFrame(Iref_DW(), Ichunk[i](), iframes[i], mic.model);
+				RCTOC(TIMING_REAL_SPACE_INTERPOLATION);
+			}
+			logfile << "." << std::flush;
+		}
+		logfile << " done" << std::endl;
+
+		// Apply binning
+		RCTIC(TIMING_BINNING);
+		if (!early_binning && bin_factor != 1) {
+			if (do_noDW) {
+				binNonSquareImage(Iref, bin_factor);
+				if (even_odd_split) {
+					binNonSquareImage(Iref_even, bin_factor);
+					binNonSquareImage(Iref_odd, bin_factor);
+				}
+			}
+			if (do_dose_weighting)
+				binNonSquareImage(Iref_DW, bin_factor);
+		}
+		RCTOC(TIMING_BINNING);
+
+		// Final output
+		if (do_noDW) {
+			Iref.setSamplingRateInHeader(output_angpix, output_angpix);
+			Iref.write(!do_dose_weighting ? fn_avg : fn_avg_noDW, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+			logfile << "Written aligned but non-dose weighted sum to " << (!do_dose_weighting ? fn_avg : fn_avg_noDW) << std::endl;
+			if (even_odd_split)
+			{
+				Iref_odd.setSamplingRateInHeader(output_angpix, output_angpix);
+				Iref_even.setSamplingRateInHeader(output_angpix, output_angpix);
+				Iref_odd.write(fn_avg.withoutExtension() + "_ODD.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+				Iref_even.write(fn_avg.withoutExtension() + "_EVN.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+				logfile << "Written aligned but non-dose weighted sum of odd frames to " << (fn_avg.withoutExtension() + "_ODD.mrc") << std::endl;
+				logfile << "Written aligned but non-dose weighted sum of even frames to " << (fn_avg.withoutExtension() + "_EVN.mrc") << std::endl;
+			}
+		}
+		if (do_dose_weighting) {
+			Iref_DW.setSamplingRateInHeader(output_angpix, output_angpix);
+			Iref_DW.write(fn_avg, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+			logfile << "Written aligned and dose-weighted sum to " << fn_avg << std::endl;
+		}
+	}
+
+	if (!do_streaming && (!do_dose_weighting || save_noDW)) {
 		Iref().initZeros(Iframes[0]());
 		Iref_odd().initZeros(Iframes[0]());
 		Iref_even().initZeros(Iframes[0]());
@@ -1774,25 +2073,8 @@ skip_fitting:
 	}
 
 	// Dose weighting
-	if (do_dose_weighting) {
+	if (!do_streaming && do_dose_weighting) {
 		RCTIC(TIMING_DOSE_WEIGHTING);
-		if (std::abs(voltage - 300) > 2 && std::abs(voltage - 200) > 2 && std::abs(voltage - 100) > 2) {
-			REPORT_ERROR("Sorry, dose weighting is supported only for 300, 200 or 100 kV");
-		}
-
-        logfile << "Pre-exposure: = " << pre_exposure << std::endl;
-
-		std::vector <RFLOAT> doses(n_frames);
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			// dose AFTER each frame.
-			doses[iframe] = mic.pre_exposure + dose_per_frame * (frames[iframe] + 1);
-			if (std::abs(voltage - 200) <= 2) {
-				doses[iframe] /= 0.8; // 200 kV electron is more damaging.
-			} else if (std::abs(voltage - 100) <= 2) {
-				doses[iframe] /= 0.64; // 100 kV electron is much more damaging.
-			}
-		}
-
 		RCTIC(TIMING_DW_WEIGHT);
 		doseWeighting(Fframes, doses, angpix * prescaling);
 		RCTOC(TIMING_DW_WEIGHT);
@@ -2210,6 +2492,79 @@ void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial(Image <float>
 	}
 }
 
+void MotioncorrRunner::realSpaceInterpolateFrame(MultidimArray<float> &Isum, MultidimArray<float> &Iframe, const int z, MotionModel *model) {
+	int model_version = MOTION_MODEL_NULL;
+	if (model != NULL) {
+		model_version = model->getModelVersion();
+	}
+
+	if (model_version == MOTION_MODEL_NULL) {
+		#pragma omp parallel for num_threads(n_threads)
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+			DIRECT_MULTIDIM_ELEM(Isum, n) += DIRECT_MULTIDIM_ELEM(Iframe, n);
+		}
+		return;
+	}
+
+	const int nx = XSIZE(Iframe), ny = YSIZE(Iframe);
+	const bool is_polynomial = (model_version == MOTION_MODEL_THIRD_ORDER_POLYNOMIAL);
+	RFLOAT x_C[6], y_C[6];
+	if (is_polynomial) {
+		// Common terms, as in realSpaceInterpolation_ThirdOrderPolynomial
+		const ThirdOrderPolynomialModel *polynomial_model = (ThirdOrderPolynomialModel*)model;
+		const RFLOAT z2 = z * z, z3 = z2 * z;
+		for (int i = 0; i < 6; i++) {
+			x_C[i] = polynomial_model->coeffX(3 * i) * z + polynomial_model->coeffX(3 * i + 1) * z2 + polynomial_model->coeffX(3 * i + 2) * z3;
+			y_C[i] = polynomial_model->coeffY(3 * i) * z + polynomial_model->coeffY(3 * i + 1) * z2 + polynomial_model->coeffY(3 * i + 2) * z3;
+		}
+	}
+
+	#pragma omp parallel for num_threads(n_threads)
+	for (int iy = 0; iy < ny; iy++) {
+		const RFLOAT y = (RFLOAT)iy / ny - 0.5;
+		for (int ix = 0; ix < nx; ix++) {
+			const RFLOAT x = (RFLOAT)ix / nx - 0.5;
+
+			RFLOAT x_fitted, y_fitted;
+			if (is_polynomial) {
+				x_fitted = x_C[0] + (x_C[1] + x_C[2] * x) * x + (x_C[3] + x_C[4] * y + x_C[5] * x) * y;
+				y_fitted = y_C[0] + (y_C[1] + y_C[2] * x) * x + (y_C[3] + y_C[4] * y + y_C[5] * x) * y;
+			} else {
+				model->getShiftAt(z, x, y, x_fitted, y_fitted);
+			}
+			x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
+
+			bool valid = true;
+			int x0 = FLOOR(x_fitted);
+			int y0 = FLOOR(y_fitted);
+			const int x1 = x0 + 1;
+			const int y1 = y0 + 1;
+
+			// some conditions might seem redundant but necessary when overflow happened
+			if (x0 < 0 || x1 < 0) {x0 = 0; valid = false;}
+			if (y0 < 0 || y1 < 0) {y0 = 0; valid = false;}
+			if (x1 >= nx || x0 >= nx - 1) {x0 = nx - 1; valid = false;}
+			if (y1 >= ny || y0 >= ny - 1) {y0 = ny - 1; valid = false;}
+			if (!valid) {
+				DIRECT_A2D_ELEM(Isum, iy, ix) += DIRECT_A2D_ELEM(Iframe, y0, x0);
+				continue;
+			}
+
+			const RFLOAT fx = x_fitted - x0;
+			const RFLOAT fy = y_fitted - y0;
+
+			const RFLOAT d00 = DIRECT_A2D_ELEM(Iframe, y0, x0);
+			const RFLOAT d01 = DIRECT_A2D_ELEM(Iframe, y0, x1);
+			const RFLOAT d10 = DIRECT_A2D_ELEM(Iframe, y1, x0);
+			const RFLOAT d11 = DIRECT_A2D_ELEM(Iframe, y1, x1);
+
+			const RFLOAT dx0 = LIN_INTERP(fx, d00, d01);
+			const RFLOAT dx1 = LIN_INTERP(fx, d10, d11);
+			DIRECT_A2D_ELEM(Isum, iy, ix) += LIN_INTERP(fy, dx0, dx1);
+		}
+	}
+}
+
 bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile) {
 	std::vector<Image<float> > Iccs(n_threads);
 	MultidimArray<fComplex> Fref;
@@ -2233,15 +2588,8 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	}
 
 	// Calculate the size of down-sampled CCF
-	float ccf_requested_scale = ccf_downsample;
-	if (ccf_downsample <= 0) {
-		ccf_requested_scale = sqrt(-log(1E-8) / (2 * scaled_B)); // exp(-2 B max_dist^2) = 1E-8
-	}
-	int ccf_nx = findGoodSize(int(pnx * ccf_requested_scale)), ccf_ny = findGoodSize(int(pny * ccf_requested_scale));
-	if (ccf_nx > pnx) ccf_nx = pnx;
-	if (ccf_ny > pny) ccf_ny = pny;
-	if (ccf_nx % 2 == 1) ccf_nx++;
-	if (ccf_ny % 2 == 1) ccf_ny++;
+	int ccf_nx, ccf_ny;
+	getCCFSize(pnx, pny, scaled_B, ccf_nx, ccf_ny);
 	const int ccf_nfx = ccf_nx / 2 + 1, ccf_nfy = ccf_ny;
 	const int ccf_nfy_half = ccf_ny / 2;
 	const RFLOAT ccf_scale_x = (RFLOAT)pnx / ccf_nx;
@@ -2250,8 +2598,9 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	if (search_range * 2 + 1 > ccf_nx) search_range = ccf_nx / 2 - 1;
 	if (search_range * 2 + 1 > ccf_ny) search_range = ccf_ny / 2 - 1;
 
-	const int nfx = XSIZE(Fframes[0]), nfy = YSIZE(Fframes[0]);
-	const int nfy_half = nfy / 2;
+	// Fframes may have been cropped by cropForAlignment: the B factor is relative to the full size
+	const int nfx = pnx / 2 + 1, nfy = pny;
+	const int stored_nfy = YSIZE(Fframes[0]);
 
 	Fref.reshape(ccf_nfy, ccf_nfx);
 	for (int i = 0; i < n_threads; i++) {
@@ -2289,7 +2638,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 
 		#pragma omp parallel for num_threads(n_threads)
 		for (int y = 0; y < ccf_nfy; y++) {
-			const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + nfy) : y;
+			const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + stored_nfy) : y;
 			for (int x = 0; x < ccf_nfx; x++) {
 				for (int iframe = 0; iframe < n_frames; iframe++) {
 					DIRECT_A2D_ELEM(Fref, y, x) += DIRECT_A2D_ELEM(Fframes[iframe], ly, x);
@@ -2304,7 +2653,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 
 			RCTIC(TIMING_CCF_CALC);
 			for (int y = 0; y < ccf_nfy; y++) {
-				const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + nfy) : y;
+				const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + stored_nfy) : y;
 				for (int x = 0; x < ccf_nfx; x++) {
 					DIRECT_A2D_ELEM(Fccs[tid], y, x) = (DIRECT_A2D_ELEM(Fref, y, x) - DIRECT_A2D_ELEM(Fframes[iframe], ly, x)) *
 					                                    DIRECT_A2D_ELEM(Fframes[iframe], ly, x).conj() * DIRECT_A2D_ELEM(weight, y, x);
@@ -2410,6 +2759,32 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	return converged;
 }
 
+void MotioncorrRunner::getCCFSize(const int pnx, const int pny, const RFLOAT scaled_B, int &ccf_nx, int &ccf_ny) {
+	float ccf_requested_scale = ccf_downsample;
+	if (ccf_downsample <= 0) {
+		ccf_requested_scale = sqrt(-log(1E-8) / (2 * scaled_B)); // exp(-2 B max_dist^2) = 1E-8
+	}
+	ccf_nx = findGoodSize(int(pnx * ccf_requested_scale));
+	ccf_ny = findGoodSize(int(pny * ccf_requested_scale));
+	if (ccf_nx > pnx) ccf_nx = pnx;
+	if (ccf_ny > pny) ccf_ny = pny;
+	if (ccf_nx % 2 == 1) ccf_nx++;
+	if (ccf_ny % 2 == 1) ccf_ny++;
+}
+
+void MotioncorrRunner::cropForAlignment(MultidimArray<fComplex> &Fframe, MultidimArray<fComplex> &Fcropped, const int pnx, const int pny, const RFLOAT scaled_B) {
+	int ccf_nx, ccf_ny;
+	getCCFSize(pnx, pny, scaled_B, ccf_nx, ccf_ny);
+
+	// alignPatch takes the row ccf_ny / 2 from the positive frequencies, while cropInFourierSpace
+	// takes the middle row from the negative frequencies: keep two more rows so that both are there.
+	int keep_ny = ccf_ny + 2;
+	if (keep_ny > pny) keep_ny = pny;
+
+	Fcropped.reshape(keep_ny, ccf_nx / 2 + 1);
+	cropInFourierSpace(Fframe, Fcropped);
+}
+
 int MotioncorrRunner::findGoodSize(int request) {
 	// numbers that do not contain large prime numbers
 	const int good_numbers[] = {192, 216, 256, 288, 324,
@@ -2473,6 +2848,45 @@ void MotioncorrRunner::doseWeighting(std::vector<MultidimArray<fComplex> > &Ffra
 	}
 }
 
+void MotioncorrRunner::prepareDoseWeighting(const int nfy, const int nfx, std::vector<RFLOAT> &doses, RFLOAT apix, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm) {
+	const int nfy_half = nfy / 2;
+	const RFLOAT nfy2 = (RFLOAT)nfy * nfy;
+	const RFLOAT nfx2 = (RFLOAT)(nfx - 1) * (nfx - 1) * 4; // assuming nx is even
+	const int n_frames = doses.size();
+	const RFLOAT A = 0.245, B = -1.665, C = 2.81;
+
+	Ne.reshape(nfy, nfx);
+	norm.reshape(nfy, nfx);
+
+	#pragma omp parallel for num_threads(n_threads)
+	for (int y = 0; y < nfy; y++) {
+		int ly = y;
+		if (y > nfy_half) ly = y - nfy;
+
+		const RFLOAT ly2 = (RFLOAT)ly * ly / nfy2;
+		for (int x = 0; x < nfx; x++) {
+			const RFLOAT dinv2 = ly2 + (RFLOAT)x * x / nfx2;
+			const RFLOAT dinv = std::sqrt(dinv2) / apix;
+			const RFLOAT this_Ne = (A * std::pow(dinv, B) + C) * 2; // see doseWeighting
+			RFLOAT sum_weight_sq = 0;
+
+			for (int iframe = 0; iframe < n_frames; iframe++) {
+				const RFLOAT weight = std::exp(- doses[iframe] / this_Ne);
+				sum_weight_sq += weight * weight;
+			}
+
+			DIRECT_A2D_ELEM(Ne, y, x) = this_Ne;
+			DIRECT_A2D_ELEM(norm, y, x) = std::sqrt(sum_weight_sq);
+		}
+	}
+}
+
+void MotioncorrRunner::doseWeightFrame(MultidimArray<fComplex> &Fframe, RFLOAT dose, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm) {
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fframe) {
+		DIRECT_MULTIDIM_ELEM(Fframe, n) *= std::exp(- dose / DIRECT_MULTIDIM_ELEM(Ne, n)) / DIRECT_MULTIDIM_ELEM(norm, n);
+	}
+}
+
 // shiftx, shifty is relative to the (real space) image size
 void MotioncorrRunner::shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty) {
 	const int nfx = XSIZE(frame), nfy = YSIZE(frame);
@@ -2552,6 +2966,45 @@ void MotioncorrRunner::binNonSquareImage(Image<float> &Iwork, RFLOAT bin_factor)
 	NewFFT::inverseFourierTransform(Fbinned, Iwork());
 }
 
+void MotioncorrRunner::addToPowerSpectrum(MultidimArray<float> &PS_sum, MultidimArray<fComplex> &F_sum) {
+	#pragma omp parallel for num_threads(n_threads)
+	FOR_ALL_ELEMENTS_IN_ARRAY2D(PS_sum) // logical 2D access, i = logical_y, j = logical_x
+	{
+		// F(i, j) = conj(F(-i, -j))
+		if (j > 0)
+			A2D_ELEM(PS_sum, i, j) += abs(FFTW2D_ELEM(F_sum, i, j)); // accessor is (Y, X)
+		else
+			A2D_ELEM(PS_sum, i, j) += abs(FFTW2D_ELEM(F_sum, -i, -j));
+	}
+}
+
+void MotioncorrRunner::fixHotPixels(MultidimArray<float> &Iframe, MultidimArray<bool> &bBad, std::vector<long int> &bad_pixels, RFLOAT frame_mean, RFLOAT frame_std, const int d_max) {
+	const int NUM_MIN_OK = 6;
+	const int PBUF_SIZE = 100;
+	const int nx = XSIZE(Iframe), ny = YSIZE(Iframe);
+
+	for (long int ibad = 0; ibad < bad_pixels.size(); ibad++) {
+		const int i = bad_pixels[ibad] / nx, j = bad_pixels[ibad] % nx;
+		RFLOAT pbuf[PBUF_SIZE];
+		int n_ok = 0;
+		for (int dy = -d_max; dy <= d_max; dy++) {
+			int y = i + dy;
+			if (y < 0 || y >= ny) continue;
+			for (int dx = -d_max; dx <= d_max; dx++) {
+				int x = j + dx;
+				if (x < 0 || x >= nx) continue;
+				if (DIRECT_A2D_ELEM(bBad, y, x)) continue;
+				pbuf[n_ok] = DIRECT_A2D_ELEM(Iframe, y, x);
+				n_ok++;
+			}
+		}
+		if (n_ok > NUM_MIN_OK)
+			DIRECT_A2D_ELEM(Iframe, i, j) = pbuf[rand() % n_ok];
+		else
+			DIRECT_A2D_ELEM(Iframe, i, j) = rnd_gaus(frame_mean, frame_std);
+	}
+}
+
 bool MotioncorrRunner::detectSerialEMDefectText(FileName fn_defect)
 {
 	std::ifstream f_defect(fn_defect);
@@ -153,6 +153,9 @@ public:
 	
 	// Save sums of movies from even and odd frames for denoising
 	bool even_odd_split;
+
+	// Read the movie a few frames at a time (and again for the final sums) instead of holding it in memory
+	bool do_streaming;
 	
 	// EER parameters
 	int eer_upsampling, eer_grouping;
@@ -215,12 +218,32 @@ private:
 
 	bool alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile);
 
+	// Size of the cross-correlation maps in alignPatch. Only this central part of the Fourier transforms is used.
+	void getCCFSize(const int pnx, const int pny, const RFLOAT scaled_B, int &ccf_nx, int &ccf_ny);
+
+	// Crop a Fourier transform of a pnx x pny image to what alignPatch needs, keeping the frequency indices
+	void cropForAlignment(MultidimArray<fComplex> &Fframe, MultidimArray<fComplex> &Fcropped, const int pnx, const int pny, const RFLOAT scaled_B);
+
 	void binNonSquareImage(Image<float> &Iwork, RFLOAT bin_factor);
 
 	int findGoodSize(int request);
 
 	void doseWeighting(std::vector<MultidimArray<fComplex> > &Fframes, std::vector<RFLOAT> doses, RFLOAT apix);
 
+	// Same weights as doseWeighting, for one frame at a time: Ne is the critical exposure and norm the
+	// square root of the sum of the squared weights over all frames, for each Fourier component
+	void prepareDoseWeighting(const int nfy, const int nfx, std::vector<RFLOAT> &doses, RFLOAT apix, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm);
+	void doseWeightFrame(MultidimArray<fComplex> &Fframe, RFLOAT dose, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm);
+
+	// Add power spectrum of F_sum to PS_sum (real space size, with its origin in the centre)
+	void addToPowerSpectrum(MultidimArray<float> &PS_sum, MultidimArray<fComplex> &F_sum);
+
+	// Replace hot pixels (bad_pixels are indices into bBad) by a random good neighbour or by noise
+	void fixHotPixels(MultidimArray<float> &Iframe, MultidimArray<bool> &bBad, std::vector<long int> &bad_pixels, RFLOAT frame_mean, RFLOAT frame_std, const int d_max);
+
+	// Add frame number z, corrected for the motion in model, to Isum
+	void realSpaceInterpolateFrame(MultidimArray<float> &Isum, MultidimArray<float> &Iframe, const int z, MotionModel *model);
+
 	void realSpaceInterpolation(Image <float> &Isum, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile);
 
 	void realSpaceInterpolation_ThirdOrderPolynomial(Image <float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile);
@@ -283,6 +283,54 @@ int MpiNode::relion_MPI_Send(void *buf, std::ptrdiff_t count, MPI_Datatype datat
 	return result;
 }
 
+int MpiNode::relion_MPI_Isend(void *buf, std::ptrdiff_t count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, std::vector<MPI_Request> &requests)
+{
+	int result(0);
+	MPI_Request request;
+
+	// Split into the same blocks as relion_MPI_Send, so that relion_MPI_Recv gets the same messages
+	int unitsize(0);
+	MPI_Type_size(datatype, &unitsize);
+#ifdef USE_MPI_COLLECTIVE
+	const std::ptrdiff_t blocksize(p2p_blocksize);
+#else
+	const std::ptrdiff_t blocksize(RELION_MPI_MAX_SIZE);
+#endif
+	const std::ptrdiff_t totalsize(count * unitsize);
+	if (totalsize <= blocksize)
+	{
+		result = MPI_Isend(buf, count, datatype, dest, tag, comm, &request);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+		requests.push_back(request);
+	}
+	else
+	{
+		char* const buffer(reinterpret_cast<char*>(buf));
+		for (std::ptrdiff_t offset = 0; offset < totalsize; offset += blocksize)
+		{
+			const std::ptrdiff_t size = XMIPP_MIN(blocksize, totalsize - offset);
+			result = MPI_Isend(buffer + offset, size, MPI_CHAR, dest, tag, comm, &request);
+			if (result != MPI_SUCCESS)
+				report_MPI_ERROR(result);
+			requests.push_back(request);
+		}
+	}
+
+	return result;
+}
+
+void MpiNode::relion_MPI_Waitall(std::vector<MPI_Request> &requests)
+{
+	if (requests.size() > 0)
+	{
+		int result = MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+	requests.clear();
+}
+
 int MpiNode::relion_MPI_Recv(void *buf, std::ptrdiff_t count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status &status) {
 	int result;
 	MPI_Request request;
@@ -481,6 +529,178 @@ int MpiNode::relion_MPI_Allreduce(void *sendB, void *recvB, std::ptrdiff_t count
 }
 #endif
 
+void MpiNode::exchangeChunks(RFLOAT *data, std::ptrdiff_t send_first, std::ptrdiff_t send_last,
+                             std::ptrdiff_t recv_first, std::ptrdiff_t recv_last, int partner,
+                             bool do_add, bool float_transport, std::ptrdiff_t chunk_size)
+{
+	const bool use_float = float_transport && sizeof(RFLOAT) != sizeof(float);
+	const MPI_Datatype datatype = (use_float) ? MPI_FLOAT : MY_MPI_DOUBLE;
+	const std::ptrdiff_t unitsize = (use_float) ? sizeof(float) : sizeof(RFLOAT);
+	const std::ptrdiff_t nr_send = send_last - send_first;
+	const std::ptrdiff_t nr_recv = recv_last - recv_first;
+	const std::ptrdiff_t nr_send_chunks = (nr_send + chunk_size - 1) / chunk_size;
+	const std::ptrdiff_t nr_recv_chunks = (nr_recv + chunk_size - 1) / chunk_size;
+
+	// Without single-precision transport or summation, receive straight into data
+	std::vector<float> fsend, frecv;
+	std::vector<RFLOAT> recv_buffer;
+	char *send_buf = reinterpret_cast<char*>(data + send_first);
+	char *recv_buf = reinterpret_cast<char*>(data + recv_first);
+	if (use_float)
+	{
+		fsend.resize(nr_send);
+		for (std::ptrdiff_t i = 0; i < nr_send; i++)
+			fsend[i] = (float)data[send_first + i];
+		frecv.resize(nr_recv);
+		send_buf = reinterpret_cast<char*>(fsend.data());
+		recv_buf = reinterpret_cast<char*>(frecv.data());
+	}
+	else if (do_add)
+	{
+		recv_buffer.resize(nr_recv);
+		recv_buf = reinterpret_cast<char*>(recv_buffer.data());
+	}
+
+	std::vector<MPI_Request> recv_requests(nr_recv_chunks), send_requests(nr_send_chunks);
+	int result;
+	for (std::ptrdiff_t c = 0; c < nr_recv_chunks; c++)
+	{
+		const std::ptrdiff_t n = XMIPP_MIN(chunk_size, nr_recv - c * chunk_size);
+		result = MPI_Irecv(recv_buf + c * chunk_size * unitsize, static_cast<int>(n), datatype, partner, MPITAG_PACK, MPI_COMM_WORLD, &recv_requests[c]);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+	for (std::ptrdiff_t c = 0; c < nr_send_chunks; c++)
+	{
+		const std::ptrdiff_t n = XMIPP_MIN(chunk_size, nr_send - c * chunk_size);
+		result = MPI_Isend(send_buf + c * chunk_size * unitsize, static_cast<int>(n), datatype, partner, MPITAG_PACK, MPI_COMM_WORLD, &send_requests[c]);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+
+	// Add (or copy) each chunk as soon as it has arrived, while the next ones are still in transit
+	for (std::ptrdiff_t c = 0; c < nr_recv_chunks; c++)
+	{
+		result = MPI_Wait(&recv_requests[c], MPI_STATUS_IGNORE);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+
+		const std::ptrdiff_t i0 = c * chunk_size, i1 = XMIPP_MIN(i0 + chunk_size, nr_recv);
+		RFLOAT *dest = data + recv_first;
+		if (use_float && do_add)
+			for (std::ptrdiff_t i = i0; i < i1; i++) dest[i] += frecv[i];
+		else if (use_float)
+			for (std::ptrdiff_t i = i0; i < i1; i++) dest[i] = frecv[i];
+		else if (do_add)
+			for (std::ptrdiff_t i = i0; i < i1; i++) dest[i] += recv_buffer[i];
+	}
+
+	if (nr_send_chunks > 0)
+	{
+		result = MPI_Waitall(nr_send_chunks, send_requests.data(), MPI_STATUSES_IGNORE);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+}
+
+void MpiNode::relion_MPI_AllreduceSum(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks,
+                                      bool float_transport, std::ptrdiff_t chunk_size)
+{
+	const int nr_ranks = ranks.size();
+	int me = -1;
+	for (int i = 0; i < nr_ranks; i++)
+		if (ranks[i] == rank)
+			me = i;
+	if (me < 0)
+		REPORT_ERROR("MpiNode::relion_MPI_AllreduceSum BUG: this rank is not in the group");
+	if (nr_ranks < 2 || count <= 0)
+		return;
+
+	chunk_size = XMIPP_MAX(1, XMIPP_MIN(chunk_size, (std::ptrdiff_t)RELION_MPI_MAX_SIZE / (std::ptrdiff_t)sizeof(RFLOAT)));
+	const bool use_float = float_transport && sizeof(RFLOAT) != sizeof(float);
+
+	// The largest power of two that fits; the rem ranks beyond it are folded into their neighbours
+	int pof2 = 1;
+	while (2 * pof2 <= nr_ranks)
+		pof2 *= 2;
+	const int rem = nr_ranks - pof2;
+
+	// A. Even ranks among the first 2*rem give their data to the next (odd) one and wait for the result
+	int newrank;
+	if (me < 2 * rem)
+	{
+		if (me % 2 == 0)
+		{
+			exchangeChunks(data, 0, count, 0, 0, ranks[me + 1], false, float_transport, chunk_size);
+			newrank = -1;
+		}
+		else
+		{
+			exchangeChunks(data, 0, 0, 0, count, ranks[me - 1], true, float_transport, chunk_size);
+			newrank = me / 2;
+		}
+	}
+	else
+		newrank = me - rem;
+
+	if (newrank >= 0)
+	{
+		// Rank in MPI_COMM_WORLD of the participant with the given newrank
+		auto worldRank = [&](int r) { return ranks[(r < rem) ? 2 * r + 1 : r + rem]; };
+
+		// B. Reduce-scatter by recursive halving: in the end, this rank has the sum of data[first, last)
+		std::ptrdiff_t first = 0, last = count;
+		std::vector<std::ptrdiff_t> parent_first, parent_last;
+		for (int mask = pof2 / 2; mask >= 1; mask /= 2)
+		{
+			const int partner = worldRank(newrank ^ mask);
+			const std::ptrdiff_t mid = first + (last - first) / 2;
+			parent_first.push_back(first);
+			parent_last.push_back(last);
+			if ((newrank & mask) == 0)
+			{
+				exchangeChunks(data, mid, last, first, mid, partner, true, float_transport, chunk_size);
+				last = mid;
+			}
+			else
+			{
+				exchangeChunks(data, first, mid, mid, last, partner, true, float_transport, chunk_size);
+				first = mid;
+			}
+		}
+
+		// The other ranks will receive this part in single precision: round it here as well,
+		// so that all ranks have exactly the same sum
+		if (use_float)
+			for (std::ptrdiff_t n = first; n < last; n++)
+				data[n] = (float)data[n];
+
+		// C. Allgather by recursive doubling: exchange the halves in the reverse order
+		for (int mask = 1; mask < pof2; mask *= 2)
+		{
+			const int partner = worldRank(newrank ^ mask);
+			const std::ptrdiff_t pfirst = parent_first.back(), plast = parent_last.back();
+			parent_first.pop_back();
+			parent_last.pop_back();
+			if ((newrank & mask) == 0)
+				exchangeChunks(data, first, last, last, plast, partner, false, float_transport, chunk_size);
+			else
+				exchangeChunks(data, first, last, pfirst, first, partner, false, float_transport, chunk_size);
+			first = pfirst;
+			last = plast;
+		}
+	}
+
+	// D. Give the sum to the ranks that were folded in A
+	if (me < 2 * rem)
+	{
+		if (me % 2 == 0)
+			exchangeChunks(data, 0, 0, 0, count, ranks[me + 1], false, float_transport, chunk_size);
+		else
+			exchangeChunks(data, 0, count, 0, 0, ranks[me - 1], false, float_transport, chunk_size);
+	}
+}
+
 void MpiNode::report_MPI_ERROR(int error_code)
 {
 	char error_string[200];
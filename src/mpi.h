@@ -49,6 +49,7 @@
 #include <cstdlib>
 #include <cstdio>
 #include <unistd.h>
+#include <vector>
 #include "src/error.h"
 #include "src/macros.h"
 
@@ -111,18 +112,44 @@ public:
 
 	int relion_MPI_Recv(void *buf, std::ptrdiff_t count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status &status);
 
+	/** Non-blocking version of relion_MPI_Send, which can be received with relion_MPI_Recv.
+	 * The requests of all blocks are added to requests; buf must not change until they have completed.
+	 */
+	int relion_MPI_Isend(void *buf, std::ptrdiff_t count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, std::vector<MPI_Request> &requests);
+
+	/** Wait until all requests have completed, and clear them */
+	void relion_MPI_Waitall(std::vector<MPI_Request> &requests);
+
 	int relion_MPI_Bcast(void *buffer, std::ptrdiff_t count, MPI_Datatype datatype, int root, MPI_Comm comm);
 
+	/** Sum an array over a group of ranks of MPI_COMM_WORLD (given in the same order on all of them), in place.
+	 * This is a reduce-scatter by recursive halving followed by an allgather by recursive doubling,
+	 * so that the time grows with log(nr_ranks) instead of nr_ranks. The data exchanged in each step
+	 * are sent in pieces of chunk_size elements, which are added while the next pieces are still in transit.
+	 * With float_transport, the data are sent in single precision: all ranks still end up with the same sum.
+	 */
+	void relion_MPI_AllreduceSum(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks,
+	                             bool float_transport = false, std::ptrdiff_t chunk_size = 4 * 1024 * 1024);
+
 	/* Better error handling of MPI error messages */
 	void report_MPI_ERROR(int error_code);
 
 #ifdef USE_MPI_COLLECTIVE
 	int relion_MPI_Allreduce(void *sendB, void *recvB, std::ptrdiff_t count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+#endif
 
 private:
+#ifdef USE_MPI_COLLECTIVE
 	std::ptrdiff_t p2p_blocksize, coll_blocksize;	// Block size for point-to-point and collective MPI communiucation
 #endif
 
+	/* Send data[send_first, send_last) to partner while receiving its data[recv_first, recv_last),
+	 * which is either added to or copied into data, one chunk at a time
+	 */
+	void exchangeChunks(RFLOAT *data, std::ptrdiff_t send_first, std::ptrdiff_t send_last,
+	                    std::ptrdiff_t recv_first, std::ptrdiff_t recv_last, int partner,
+	                    bool do_add, bool float_transport, std::ptrdiff_t chunk_size);
+
 };
 
 // General function to print machinenames on all MPI nodes
@@ -0,0 +1,149 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include "src/particle_job_scheduler.h"
+#include "src/error.h"
+
+ParticleJobScheduler::ParticleJobScheduler()
+:	max_job_size(1), guided_factor(2.)
+{}
+
+void ParticleJobScheduler::clear()
+{
+	groups.clear();
+	follower_block.clear();
+	throughput.clear();
+	last_time.clear();
+}
+
+long int ParticleJobScheduler::blockStart(long int first, long int last, int iblock, int nr_blocks)
+{
+	return first + ((last - first + 1) * iblock) / nr_blocks;
+}
+
+void ParticleJobScheduler::addParticles(long int first, long int last, const std::vector<int> &followers)
+{
+	if (followers.size() == 0)
+		REPORT_ERROR("ParticleJobScheduler::addParticles: no followers to process the particles");
+
+	Group group;
+	group.followers = followers;
+	group.blocks.resize(followers.size());
+	for (int i = 0; i < followers.size(); i++)
+	{
+		group.blocks[i].next = blockStart(first, last, i, followers.size());
+		group.blocks[i].end = blockStart(first, last, i + 1, followers.size());
+
+		if (follower_block.find(followers[i]) != follower_block.end())
+			REPORT_ERROR("ParticleJobScheduler::addParticles: BUG: follower is already in another group");
+		follower_block[followers[i]] = std::make_pair((int)groups.size(), i);
+	}
+
+	groups.push_back(group);
+}
+
+bool ParticleJobScheduler::getJob(int follower, long int &first, long int &last)
+{
+	std::map<int, std::pair<int, int> >::iterator it = follower_block.find(follower);
+	if (it == follower_block.end())
+		return false;
+
+	Group &group = groups[it->second.first];
+	Block &own = group.blocks[it->second.second];
+
+	long int nr_left = 0;
+	int ilargest = 0;
+	for (int i = 0; i < group.blocks.size(); i++)
+	{
+		long int nr_block = group.blocks[i].end - group.blocks[i].next;
+		nr_left += nr_block;
+		if (nr_block > group.blocks[ilargest].end - group.blocks[ilargest].next)
+			ilargest = i;
+	}
+
+	if (nr_left <= 0)
+		return false;
+
+	// Followers without a measurement yet count as average
+	double sum_known = 0.;
+	int nr_known = 0;
+	for (int i = 0; i < group.followers.size(); i++)
+	{
+		std::map<int, double>::iterator t = throughput.find(group.followers[i]);
+		if (t != throughput.end())
+		{
+			sum_known += t->second;
+			nr_known++;
+		}
+	}
+	double average = (nr_known > 0) ? sum_known / nr_known : 1.;
+	double sum_throughput = sum_known + (group.followers.size() - nr_known) * average;
+	std::map<int, double>::iterator t = throughput.find(follower);
+	double my_throughput = (t != throughput.end()) ? t->second : average;
+
+	long int size = (long int)ceil(nr_left * my_throughput / (sum_throughput * guided_factor));
+	if (size > max_job_size) size = max_job_size;
+	if (size < 1) size = 1;
+
+	if (own.next < own.end)
+	{
+		first = own.next;
+		last = std::min(own.end, own.next + size) - 1;
+		own.next = last + 1;
+	}
+	else
+	{
+		// Leave at least half of the block to its own follower, which continues from the front
+		Block &other = group.blocks[ilargest];
+		size = std::min(size, (other.end - other.next + 1) / 2);
+		last = other.end - 1;
+		first = other.end - size;
+		other.end = first;
+	}
+
+	if (last_time.find(follower) == last_time.end())
+		last_time[follower] = now();
+
+	return true;
+}
+
+void ParticleJobScheduler::finishedJob(int follower, long int nr_particles)
+{
+	double t = now();
+	std::map<int, double>::iterator prev = last_time.find(follower);
+	if (prev != last_time.end() && t > prev->second)
+	{
+		// Smooth over the last few jobs
+		double measured = nr_particles / (t - prev->second);
+		std::map<int, double>::iterator it = throughput.find(follower);
+		if (it == throughput.end())
+			throughput[follower] = measured;
+		else
+			it->second = 0.5 * (it->second + measured);
+	}
+	last_time[follower] = t;
+}
+
+double ParticleJobScheduler::now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
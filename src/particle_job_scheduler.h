@@ -0,0 +1,97 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PARTICLE_JOB_SCHEDULER_H
+#define PARTICLE_JOB_SCHEDULER_H
+
+#include <vector>
+#include <map>
+
+/* Hands out ranges of particles (in the sorted order of the Experiment) to MPI followers.
+ *
+ * A range of particles is divided into one contiguous block per follower that works on it,
+ * and each follower works its way through its own block from the front. A follower that has
+ * finished its block takes particles from the end of the block with most particles left.
+ *
+ * The size of each job is a share of the particles that are left (guided self-scheduling),
+ * in proportion to the throughput that has been measured for the follower, so that jobs become
+ * smaller towards the end and all followers finish at about the same time. Jobs are never
+ * larger than max_job_size.
+ */
+class ParticleJobScheduler
+{
+public:
+
+	ParticleJobScheduler();
+
+	// Forget all particles and measured throughputs
+	void clear();
+
+	/* The particles first..last are to be processed by these followers
+	 * Each follower should be in only one such group.
+	 */
+	void addParticles(long int first, long int last, const std::vector<int> &followers);
+
+	/* Get the next job for this follower
+	 * Returns false if there are no particles left in its group.
+	 */
+	bool getJob(int follower, long int &first, long int &last);
+
+	// This follower has returned the results of a job of nr_particles
+	void finishedJob(int follower, long int nr_particles);
+
+	/* First particle of block iblock when first..last is divided into nr_blocks blocks
+	 * (block iblock ends just before the start of block iblock+1)
+	 */
+	static long int blockStart(long int first, long int last, int iblock, int nr_blocks);
+
+	// Maximum number of particles in one job
+	long int max_job_size;
+
+	/* Each job gets 1/guided_factor of the particles that are left in proportion to the follower's throughput,
+	 * i.e. with equal throughputs, 1/(guided_factor * nr_followers) of the particles that are left
+	 */
+	double guided_factor;
+
+private:
+
+	// Particles next..end-1 are still to be handed out
+	struct Block
+	{
+		long int next, end;
+	};
+
+	struct Group
+	{
+		std::vector<Block> blocks;
+		std::vector<int> followers;
+	};
+
+	std::vector<Group> groups;
+
+	// Group and block of each follower
+	std::map<int, std::pair<int, int> > follower_block;
+
+	// Measured number of particles per second and the time at which the last job was handed out or returned
+	std::map<int, double> throughput, last_time;
+
+	static double now();
+};
+
+#endif
@@ -32,6 +32,8 @@ void ParticleSubtractor::read(int argc, char **argv)
 	fn_revert = parser.getOption("--revert", "Name of particle STAR file to revert. When this is provided, all other options are ignored.", "");
 	do_ssnr = parser.checkOption("--ssnr", "Don't subtract, only calculate average spectral SNR in the images");
 	write_float16  = parser.checkOption("--float16", "Write in half-precision 16 bit floating point numbers (MRC mode 12), instead of 32 bit (MRC mode 0).");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to subtract the particles with", "1"));
+	batch_size = textToInteger(parser.getOption("--batch_size", "Number of particles that are subtracted in parallel before they are written out together", "512"));
 
 	int center_section = parser.addSection("Centering options");
 	do_recenter_on_mask = parser.checkOption("--recenter_on_mask", "Use this flag to center the subtracted particles on projections of the centre-of-mass of the input mask");
@@ -109,6 +111,13 @@ void ParticleSubtractor::initialise(int _rank, int _size)
 
 	divideLabour(rank, size, my_first_part_id, my_last_part_id);
 
+	// Process the particles of each stack together, so that their images are read from one file after the other.
+	// The output STAR file is sorted back into the original order in combineStarFile.
+	opt.mydata.groupParticlesByStack(my_first_part_id, my_last_part_id, 1);
+
+	if (nr_threads < 1) nr_threads = 1;
+	if (batch_size < nr_threads) batch_size = nr_threads;
+
 	Image<RFLOAT> Imask;
 	if (fn_msk != "" && !do_ssnr)
 	{
@@ -303,7 +312,6 @@ void ParticleSubtractor::run()
 {
 
 	long int nr_parts = my_last_part_id - my_first_part_id + 1;
-	long int barstep = XMIPP_MAX(1, nr_parts/120);
 	if (verb > 0)
 	{
 		if (do_ssnr) std::cout << " + Calculating SNR for all particles ..." << std::endl;
@@ -313,21 +321,71 @@ void ParticleSubtractor::run()
 	}
 
 	MDimg_out.clear();
-	//for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
-	for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
+
+	// Subtract batches of particles in parallel, and write out each batch in the order of the particles
+	std::vector<SubtractedParticle> results(XMIPP_MIN(batch_size, nr_parts));
+	for (long int cc = 0; cc < nr_parts; cc += batch_size)
 	{
+		if (pipeline_control_check_abort_job())
+			exit(RELION_EXIT_ABORTED);
+
+		long int nr_batch = XMIPP_MIN(batch_size, nr_parts - cc);
+		RelionError *thread_error = NULL;
+
+		#pragma omp parallel num_threads(nr_threads)
+		{
+			FourierTransformer transformer;
+			MultidimArray<RFLOAT> thr_sum_S2, thr_sum_N2, thr_sum_count;
+			if (do_ssnr)
+			{
+				thr_sum_S2.initZeros(sum_S2);
+				thr_sum_N2.initZeros(sum_N2);
+				thr_sum_count.initZeros(sum_count);
+			}
+
+			#pragma omp for schedule(dynamic)
+			for (long int i = 0; i < nr_batch; i++)
+			{
+				if (thread_error != NULL)
+					continue;
+
+				try
+				{
+					long int part_id = opt.mydata.sorted_idx[my_first_part_id + cc + i];
+					subtractOneParticle(part_id, results[i], transformer, thr_sum_S2, thr_sum_N2, thr_sum_count);
+				}
+				catch (RelionError XE)
+				{
+					#pragma omp critical(ParticleSubtractor_thread_error)
+					{
+						if (thread_error == NULL)
+							thread_error = new RelionError(XE);
+					}
+				}
+			}
+
+			if (do_ssnr)
+			{
+				#pragma omp critical(ParticleSubtractor_sum_ssnr)
+				{
+					sum_S2 += thr_sum_S2;
+					sum_N2 += thr_sum_N2;
+					sum_count += thr_sum_count;
+				}
+			}
+		}
 
-		//long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		if (cc % barstep == 0)
+		if (thread_error != NULL)
 		{
-			if (pipeline_control_check_abort_job())
-				exit(RELION_EXIT_ABORTED);
+			RelionError XE(*thread_error);
+			delete thread_error;
+			throw XE;
 		}
 
-		long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		subtractOneParticle(part_id, 0, cc);
+		if (!do_ssnr)
+			writeSubtractedParticles(results, nr_batch, cc);
 
-		if (cc % barstep == 0 && verb > 0) progress_bar(cc);
+		if (verb > 0) progress_bar(cc + nr_batch);
 	}
 
 	if (verb > 0) progress_bar(nr_parts);
@@ -462,10 +520,15 @@ FileName ParticleSubtractor::getParticleName(long int imgno, int myrank, int opt
 	return fn_img;
 }
 
-void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, long int counter)
+void ParticleSubtractor::subtractOneParticle(long int part_id, SubtractedParticle &result, FourierTransformer &transformer,
+		MultidimArray<RFLOAT> &thr_sum_S2, MultidimArray<RFLOAT> &thr_sum_N2, MultidimArray<RFLOAT> &thr_sum_count)
 {
+	result.part_id = part_id;
+	result.has_new_orientation = result.has_new_offset = false;
+
 	// Read the particle image
-	Image<RFLOAT> img;
+	Image<RFLOAT> &img = result.img;
+	img.clear();
 	int optics_group = opt.mydata.getOpticsGroup(part_id);
 	img.read(opt.mydata.particles[part_id].name);
 	img().setXmippOrigin();
@@ -530,7 +593,6 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 	// Now that the particle is centered (for multibody), get the FourierTransform of the particle
 	MultidimArray<Complex> Faux, Fimg;
 	MultidimArray<RFLOAT> Fctf;
-	FourierTransformer transformer;
 	transformer.FourierTransform(img(), Fimg);
 	CenterFFTbySign(Fimg);
 	Fctf.resize(Fimg);
@@ -683,10 +745,11 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		Abody = Aori * (opt.mymodel.orient_bodies[subtract_body]).transpose() * A_rot90 * Aresi_subtract * opt.mymodel.orient_bodies[subtract_body];
 		Euler_matrix2angles(Abody, rot, tilt, psi);
 
-		// Store the optimal orientations in the MDimg table
-		opt.mydata.MDimg.setValue(EMDL_ORIENT_ROT, rot, part_id);
-		opt.mydata.MDimg.setValue(EMDL_ORIENT_TILT, tilt, part_id);
-		opt.mydata.MDimg.setValue(EMDL_ORIENT_PSI, psi, part_id);
+		// Store the optimal orientations, for the MDimg table
+		result.has_new_orientation = true;
+		result.rot = rot;
+		result.tilt = tilt;
+		result.psi = psi;
 
 		// Also get refined offset for this body
 		opt.mydata.MDbodies[subtract_body].getValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, XX(my_refined_ibody_offset), part_id);
@@ -766,9 +829,9 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 				RFLOAT N2 = norm( dAkij(Fimg, k, i, j) );
 				// division by two keeps the numbers similar to tau2 and sigma2_noise,
 				// which are per real/imaginary component
-				sum_S2(idx_remapped) += S2 / 2.;
-				sum_N2(idx_remapped) += N2 / 2.;
-				sum_count(idx_remapped) += 1.;
+				thr_sum_S2(idx_remapped) += S2 / 2.;
+				thr_sum_N2(idx_remapped) += N2 / 2.;
+				thr_sum_count(idx_remapped) += 1.;
 			}
 		}
 	}
@@ -787,12 +850,8 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 			selfTranslate(img(), centering_offset, WRAP);
 
 			// Set the non-integer difference between the rounded centering offset and the actual offsets in the STAR file
-			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, my_pixel_size * XX(my_residual_offset), part_id);
-			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Y_ANGSTROM, my_pixel_size * YY(my_residual_offset), part_id);
-			if (opt.mymodel.data_dim == 3)
-			{
-				opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Z_ANGSTROM, my_pixel_size * ZZ(my_residual_offset), part_id);
-			}
+			result.has_new_offset = true;
+			result.offset = my_pixel_size * my_residual_offset;
 		}
 
 		// Rebox the image
@@ -810,8 +869,39 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 			}
 		}
 
-		// Now write out the image & set filenames in output metadatatable
-		FileName fn_img = getParticleName(counter, rank, optics_group);
+		img.setSamplingRateInHeader(my_pixel_size);
+	}
+}
+
+void ParticleSubtractor::writeSubtractedParticles(std::vector<SubtractedParticle> &results, long int nr_results, long int counter)
+{
+	// Indices in results of the 2D particles for each optics group
+	std::map<int, std::vector<long int> > group_results;
+
+	for (long int i = 0; i < nr_results; i++)
+	{
+		long int part_id = results[i].part_id;
+		int optics_group = opt.mydata.getOpticsGroup(part_id);
+
+		if (results[i].has_new_orientation)
+		{
+			opt.mydata.MDimg.setValue(EMDL_ORIENT_ROT, results[i].rot, part_id);
+			opt.mydata.MDimg.setValue(EMDL_ORIENT_TILT, results[i].tilt, part_id);
+			opt.mydata.MDimg.setValue(EMDL_ORIENT_PSI, results[i].psi, part_id);
+		}
+
+		if (results[i].has_new_offset)
+		{
+			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, XX(results[i].offset), part_id);
+			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Y_ANGSTROM, YY(results[i].offset), part_id);
+			if (opt.mymodel.data_dim == 3)
+			{
+				opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Z_ANGSTROM, ZZ(results[i].offset), part_id);
+			}
+		}
+
+		// Set filenames in output metadatatable
+		FileName fn_img = getParticleName(counter + i, rank, optics_group);
 		opt.mydata.MDimg.setValue(EMDL_IMAGE_NAME, fn_img, part_id);
 		opt.mydata.MDimg.setValue(EMDL_IMAGE_ORI_NAME, opt.mydata.particles[part_id].name, part_id);
 		//Also set the original order in the input STAR file for later combination
@@ -819,18 +909,33 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		MDimg_out.addObject();
 		MDimg_out.setObject(opt.mydata.MDimg.getObject(part_id));
 
-		//printf("Writing: fn_orig = %s counter = %ld rank = %d optics_group = %d fn_img = %s SIZE = %d nr_particles_in_optics_group[optics_group] = %d\n", fn_orig.c_str(), counter, rank, optics_group+1, fn_img.c_str(), XSIZE(img()), nr_particles_in_optics_group[optics_group]);
-		img.setSamplingRateInHeader(my_pixel_size);
 		if (opt.mymodel.data_dim == 3)
-		{
-			img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		}
+			results[i].img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
 		else
+			group_results[optics_group].push_back(i);
+	}
+
+	// Append the 2D particles of each optics group to its stack at once
+	for (std::map<int, std::vector<long int> >::iterator it = group_results.begin(); it != group_results.end(); it++)
+	{
+		const std::vector<long int> &idx = it->second;
+		const Image<RFLOAT> &first = results[idx[0]].img;
+		Image<float> Istack(XSIZE(first()), YSIZE(first()), 1, idx.size());
+		for (long int j = 0; j < idx.size(); j++)
 		{
-			if (nr_particles_in_optics_group[optics_group] == 0)
-				img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-			else
-				img.write(fn_img, -1, false, WRITE_APPEND, write_float16 ? Float16: Float);
+			const MultidimArray<RFLOAT> &Mimg = results[idx[j]].img();
+			if (XSIZE(Mimg) != XSIZE(first()) || YSIZE(Mimg) != YSIZE(first()))
+				REPORT_ERROR("ParticleSubtractor::writeSubtractedParticles ERROR: particles in the same optics group have different sizes");
+
+			float *dest = &DIRECT_NZYX_ELEM(Istack(), j, 0, 0, 0);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mimg)
+				dest[n] = (float)DIRECT_MULTIDIM_ELEM(Mimg, n);
 		}
+		Istack.MDMainHeader = first.MDMainHeader;
+
+		long int dummy;
+		FileName fn_stack;
+		getParticleName(counter + idx[0], rank).decompose(dummy, fn_stack);
+		Istack.write(fn_stack, -1, true, WRITE_APPEND, write_float16 ? Float16: Float);
 	}
 }
@@ -58,6 +58,24 @@ public:
 	// verbosity
 	int verb;
 
+	// Number of threads to subtract particles with
+	int nr_threads;
+
+	// Number of particles that are subtracted in parallel, before they are written out together
+	long int batch_size;
+
+	// One subtracted particle, and the changes to its metadata, until it is written out
+	struct SubtractedParticle
+	{
+		long int part_id;
+		Image<RFLOAT> img;
+
+		// New orientation (for multi-body) and new origin offset (in Angstrom, when re-centering)
+		bool has_new_orientation, has_new_offset;
+		RFLOAT rot, tilt, psi;
+		Matrix1D<RFLOAT> offset;
+	};
+
 public:
 	// Read command line arguments
 	void read(int argc, char **argv);
@@ -86,8 +104,18 @@ public:
 	// Get name of a single subtracted particle
 	FileName getParticleName(long int imgno, int myrank, int optics_group=-1);
 
-	// subtract one particle
-	void subtractOneParticle(long int part_id, long int imgno, long int counter);
+	/* Subtract one particle into result
+	 * This is called from multiple threads: each thread should have its own transformer and
+	 * SSNR sums. It does not change the metadata or write the particle; see writeSubtractedParticles.
+	 */
+	void subtractOneParticle(long int part_id, SubtractedParticle &result, FourierTransformer &transformer,
+			MultidimArray<RFLOAT> &thr_sum_S2, MultidimArray<RFLOAT> &thr_sum_N2, MultidimArray<RFLOAT> &thr_sum_count);
+
+	/* Set the metadata of the first nr_results subtracted particles and write them out, in this order
+	 * The first one is particle number counter of this rank. The 2D particles of each optics group
+	 * are appended to its stack with a single write.
+	 */
+	void writeSubtractedParticles(std::vector<SubtractedParticle> &results, long int nr_results, long int counter);
 
 private:
 	// Pre-calculated rotation matrix for (0,90,0) rotation, and its transpose, for multi-body orientations
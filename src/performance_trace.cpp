@@ -0,0 +1,174 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <fstream>
+#include <cstring>
+#include "src/performance_trace.h"
+#include "src/error.h"
+
+namespace
+{
+	struct TraceEvent
+	{
+		const char *name;
+		double start, duration; // in microseconds
+	};
+
+	// The spans of one thread: only that thread touches it while recording
+	struct ThreadTrace
+	{
+		int thread_id;
+		std::vector<TraceEvent> events;
+		std::vector<TraceEvent> open;
+	};
+
+	std::mutex trace_mutex;
+	std::vector<std::unique_ptr<ThreadTrace> > thread_traces;
+	int trace_process_id = 0;
+	const std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+
+	thread_local ThreadTrace *my_trace = NULL;
+
+	double microseconds()
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_start).count();
+	}
+
+	ThreadTrace *getThreadTrace()
+	{
+		if (my_trace == NULL)
+		{
+			std::lock_guard<std::mutex> lock(trace_mutex);
+			thread_traces.push_back(std::unique_ptr<ThreadTrace>(new ThreadTrace()));
+			my_trace = thread_traces.back().get();
+			my_trace->thread_id = thread_traces.size() - 1;
+		}
+
+		return my_trace;
+	}
+
+	// Span names are literals in the code, but escape them anyway
+	void writeJsonString(std::ostream &out, const char *str)
+	{
+		out << '"';
+		for (const char *c = str; *c != '\0'; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				out << '\\' << *c;
+			else if ((unsigned char)*c >= 0x20)
+				out << *c;
+		}
+		out << '"';
+	}
+}
+
+bool PerformanceTrace::is_enabled = false;
+
+void PerformanceTrace::enable(int process_id)
+{
+	trace_process_id = process_id;
+	is_enabled = true;
+}
+
+void PerformanceTrace::disable()
+{
+	is_enabled = false;
+}
+
+void PerformanceTrace::beginSpan(const char *name)
+{
+	ThreadTrace *trace = getThreadTrace();
+	TraceEvent event;
+	event.name = name;
+	event.start = microseconds();
+	event.duration = 0.;
+	trace->open.push_back(event);
+}
+
+void PerformanceTrace::endSpan(const char *name)
+{
+	ThreadTrace *trace = getThreadTrace();
+
+	if (name != NULL)
+	{
+		bool found = false;
+		for (int i = trace->open.size() - 1; i >= 0 && !found; i--)
+			found = (strcmp(trace->open[i].name, name) == 0);
+		if (!found)
+			return;
+	}
+
+	const double now = microseconds();
+	while (trace->open.size() > 0)
+	{
+		TraceEvent event = trace->open.back();
+		trace->open.pop_back();
+		event.duration = now - event.start;
+		trace->events.push_back(event);
+
+		if (name == NULL || strcmp(event.name, name) == 0)
+			break;
+	}
+}
+
+long int PerformanceTrace::nrOpenSpans()
+{
+	std::lock_guard<std::mutex> lock(trace_mutex);
+
+	long int nr_open = 0;
+	for (int t = 0; t < thread_traces.size(); t++)
+		nr_open += thread_traces[t]->open.size();
+
+	return nr_open;
+}
+
+void PerformanceTrace::write(const std::string &fn_trace)
+{
+	std::ofstream fh(fn_trace.c_str(), std::ios::out);
+	if (!fh)
+		REPORT_ERROR("PerformanceTrace::write: cannot write to file: " + fn_trace);
+
+	std::lock_guard<std::mutex> lock(trace_mutex);
+
+	fh << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	fh << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << trace_process_id
+	   << ",\"args\":{\"name\":\"rank " << trace_process_id << "\"}}";
+
+	fh.precision(3);
+	fh << std::fixed;
+	for (int t = 0; t < thread_traces.size(); t++)
+	{
+		ThreadTrace &trace = *thread_traces[t];
+		for (long int i = 0; i < trace.events.size(); i++)
+		{
+			const TraceEvent &event = trace.events[i];
+			fh << ",\n{\"name\":";
+			writeJsonString(fh, event.name);
+			fh << ",\"ph\":\"X\",\"ts\":" << event.start << ",\"dur\":" << event.duration
+			   << ",\"pid\":" << trace_process_id << ",\"tid\":" << trace.thread_id << "}";
+		}
+		trace.events.clear();
+	}
+
+	fh << "\n]}\n";
+}
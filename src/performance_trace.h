@@ -0,0 +1,104 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PERFORMANCE_TRACE_H
+#define PERFORMANCE_TRACE_H
+
+#include <string>
+
+/* Records how long each thread spends in the phases of a program, as spans with a name,
+ * a start time and a duration, and writes them as a Chrome trace (JSON), which can be
+ * viewed in chrome://tracing or https://ui.perfetto.dev
+ *
+ * Nothing is recorded until enable() has been called; until then, begin() and end()
+ * only test a flag. Names should be string literals, as only the pointers are kept.
+ * Spans of one thread should be properly nested.
+ */
+class PerformanceTrace
+{
+public:
+
+	/* Start recording
+	 * process_id is written as the pid of all spans (e.g. the MPI rank).
+	 */
+	static void enable(int process_id = 0);
+
+	// Stop recording (spans that have been recorded are kept until the next write())
+	static void disable();
+
+	static bool enabled()
+	{
+		return is_enabled;
+	}
+
+	// Start a span on the calling thread
+	static void begin(const char *name)
+	{
+		if (is_enabled) beginSpan(name);
+	}
+
+	/* End the innermost open span of the calling thread
+	 * If a name is given, spans are closed up to and including the innermost one with that name,
+	 * and nothing happens when no span with that name is open.
+	 */
+	static void end(const char *name = NULL)
+	{
+		if (is_enabled) endSpan(name);
+	}
+
+	/* Number of spans that have been started but not ended, over all threads
+	 * This should only be called when no other threads are recording.
+	 */
+	static long int nrOpenSpans();
+
+	/* Write all spans that have ended so far to a JSON file, and forget them
+	 * This should only be called when no other threads are recording.
+	 */
+	static void write(const std::string &fn_trace);
+
+private:
+
+	static bool is_enabled;
+
+	static void beginSpan(const char *name);
+	static void endSpan(const char *name);
+};
+
+// Records a span from its construction until it goes out of scope
+class TraceSpan
+{
+public:
+
+	TraceSpan(const char *name)
+	:	active(PerformanceTrace::enabled())
+	{
+		if (active) PerformanceTrace::begin(name);
+	}
+
+	~TraceSpan()
+	{
+		if (active) PerformanceTrace::end();
+	}
+
+private:
+
+	bool active;
+};
+
+#endif
@@ -60,6 +60,9 @@ void Postprocessing::read(int argc, char **argv)
 	locres_edgwidth = textToFloat(parser.getOption("--locres_edgwidth", "Width of soft edge (in A) on masks for local-resolution map (default = sampling)", "-1"));
 	locres_randomize_fsc = textToFloat(parser.getOption("--locres_randomize_at", "Randomize phases from this resolution (in A)", "25."));
 	locres_minres = textToFloat(parser.getOption("--locres_minres", "Lowest local resolution allowed (in A)", "50."));
+	do_locres_fast = parser.checkOption("--locres_fast", "Calculate local FSCs in small windows around each sampling point (much faster for large boxes)");
+	locres_window = textToInteger(parser.getOption("--locres_window", "Box size (in pixels) of the windows for --locres_fast (default = twice the diameter of the soft local mask)", "-1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads for --locres_fast", "1"));
 
 	int expert_section = parser.addSection("Expert options");
 	do_ampl_corr = parser.checkOption("--ampl_corr", "Perform amplitude correlation and DPR, also re-normalize amplitudes for non-uniform angular distributions");
@@ -982,6 +985,187 @@ void Postprocessing::writeFscDat(MetaDataTable &MDfsc)
 	}
 }
 
+void Postprocessing::localResolutionInWindows(MultidimArray<RFLOAT> &Isharp, MultidimArray<RFLOAT> &I1p, MultidimArray<RFLOAT> &I2p,
+		int maskrad_pix, int edgewidth_pix, int step_size, int rank, int size, std::ofstream &fh,
+		MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw)
+{
+	// The window should contain the entire soft mask, and by default it is padded twice
+	int mask_diameter = 2 * (maskrad_pix + edgewidth_pix);
+	int window_size = (locres_window > 0) ? locres_window : 2 * mask_diameter;
+	if (window_size < mask_diameter)
+		REPORT_ERROR("Postprocessing::localResolutionInWindows ERROR: --locres_window should be at least " + integerToString(mask_diameter) + " pixels, the diameter of the local mask and its soft edge");
+	window_size = XMIPP_MIN(window_size, XSIZE(I1()));
+	window_size -= window_size % 2;
+	int half_window = window_size / 2;
+
+	// Randomize phases from the same resolution as in the full-size maps, but in the shells of the windows
+	int randomize_at = window_size * angpix / locres_randomize_fsc;
+	if (verb > 0)
+	{
+		std::cout.width(35); std::cout << std::left << "  + window size for local FSCs: "; std::cout << window_size << " pixels" << std::endl;
+	}
+
+	// The soft spherical mask is the same for all windows
+	MultidimArray<RFLOAT> locmask(window_size, window_size, window_size);
+	raisedCosineMask(locmask, maskrad_pix, maskrad_pix + edgewidth_pix, 0, 0, 0);
+
+	// Collect the sampling points of this rank, in the same order as for the full-size maps
+	std::vector<long int> sample_k, sample_i, sample_j;
+	int myrad = XSIZE(I1())/2 - maskrad_pix;
+	long int nr_samplings = 0;
+	for (long int kk=((I1()).zinit); kk<=((I1()).zinit + (I1()).zdim - 1); kk+= step_size)
+	{
+		for (long int ii=((I1()).yinit); ii<=((I1()).yinit + (I1()).ydim - 1); ii+= step_size)
+		{
+			for (long int jj=((I1()).xinit); jj<=((I1()).xinit + (I1()).xdim - 1); jj+= step_size)
+			{
+				float rad = sqrt(kk*kk + ii*ii + jj*jj);
+				if (rad < myrad)
+				{
+					if (nr_samplings%size == rank)
+					{
+						sample_k.push_back(kk);
+						sample_i.push_back(ii);
+						sample_j.push_back(jj);
+					}
+					nr_samplings++;
+				}
+			}
+		}
+	}
+
+	Ifil.setXmippOrigin();
+	Ilocres.setXmippOrigin();
+	Isumw.setXmippOrigin();
+
+	// The windows are processed in parallel, but their results are written and summed in the order of the sampling points,
+	// so that the output does not depend on the number of threads
+	// An abort request is only recorded inside the parallel region; the program exits after it
+	RelionError *thread_error = NULL;
+	bool do_abort = false;
+	#pragma omp parallel num_threads(nr_threads)
+	{
+		MultidimArray<RFLOAT> I1w, I2w, Ifilw, my_fsc_unmasked(fsc_unmasked), my_fsc_masked, my_fsc_random_masked, my_fsc_true;
+		MultidimArray<Complex > FT;
+		FourierTransformer transformer;
+
+		#pragma omp for ordered schedule(dynamic)
+		for (long int isample = 0; isample < sample_k.size(); isample++)
+		{
+			long int kk = sample_k[isample];
+			long int ii = sample_i[isample];
+			long int jj = sample_j[isample];
+			float local_resol = 999.;
+
+			if (thread_error == NULL && !do_abort)
+			{
+				try
+				{
+					// FSC of masked windows
+					I1().window(I1w, kk - half_window, ii - half_window, jj - half_window, kk + half_window - 1, ii + half_window - 1, jj + half_window - 1);
+					I2().window(I2w, kk - half_window, ii - half_window, jj - half_window, kk + half_window - 1, ii + half_window - 1, jj + half_window - 1);
+					I1w.setXmippOrigin();
+					I2w.setXmippOrigin();
+					I1w *= locmask;
+					I2w *= locmask;
+					getFSC(I1w, I2w, my_fsc_masked);
+
+					// FSC of masked windows of the randomized-phase maps
+					I1p.window(I1w, kk - half_window, ii - half_window, jj - half_window, kk + half_window - 1, ii + half_window - 1, jj + half_window - 1);
+					I2p.window(I2w, kk - half_window, ii - half_window, jj - half_window, kk + half_window - 1, ii + half_window - 1, jj + half_window - 1);
+					I1w.setXmippOrigin();
+					I2w.setXmippOrigin();
+					I1w *= locmask;
+					I2w *= locmask;
+					getFSC(I1w, I2w, my_fsc_random_masked);
+
+					calculateFSCtrue(my_fsc_true, my_fsc_unmasked, my_fsc_masked, my_fsc_random_masked, randomize_at);
+
+					// See where corrected FSC drops below 0.143
+					FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(my_fsc_true)
+					{
+						if ( DIRECT_A1D_ELEM(my_fsc_true, i) < 0.143)
+							break;
+						local_resol = (i > 0) ? window_size*angpix/(RFLOAT)i : 999.;
+					}
+					local_resol = XMIPP_MIN(locres_minres, local_resol);
+
+					// Now low-pass filter the window of the sharpened sum to the estimated resolution
+					Isharp.window(Ifilw, kk - half_window, ii - half_window, jj - half_window, kk + half_window - 1, ii + half_window - 1, jj + half_window - 1);
+					Ifilw.setXmippOrigin();
+					transformer.FourierTransform(Ifilw, FT);
+					applyFscWeighting(FT, my_fsc_true);
+					lowPassFilterMap(FT, window_size, local_resol, angpix, filter_edge_width);
+					transformer.inverseFourierTransform(FT, Ifilw);
+				}
+				catch (RelionError XE)
+				{
+					#pragma omp critical(Postprocessing_thread_error)
+					{
+						if (thread_error == NULL)
+							thread_error = new RelionError(XE);
+					}
+				}
+			}
+
+			#pragma omp ordered
+			{
+				// Abort through the pipeline_control system
+				if (thread_error == NULL && !do_abort && pipeline_control_check_abort_job())
+					do_abort = true;
+
+				if (thread_error == NULL && !do_abort)
+				{
+					if (rank == 0)
+					{
+						MetaDataTable MDfsc;
+						FileName fn_name = "fsc_"+integerToString(kk, 5)+"_"+integerToString(ii, 5)+"_"+integerToString(jj, 5);
+						MDfsc.setName(fn_name);
+						FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(my_fsc_true)
+						{
+							MDfsc.addObject();
+							RFLOAT res = (i > 0) ? (window_size * angpix / (RFLOAT)i) : 999.;
+							MDfsc.setValue(EMDL_SPECTRAL_IDX, (int)i);
+							MDfsc.setValue(EMDL_RESOLUTION, 1./res);
+							MDfsc.setValue(EMDL_RESOLUTION_ANGSTROM, res);
+							MDfsc.setValue(EMDL_POSTPROCESS_FSC_TRUE, DIRECT_A1D_ELEM(my_fsc_true, i) );
+							MDfsc.setValue(EMDL_POSTPROCESS_FSC_MASKED, DIRECT_A1D_ELEM(my_fsc_masked, i) );
+							MDfsc.setValue(EMDL_POSTPROCESS_FSC_RANDOM_MASKED, DIRECT_A1D_ELEM(my_fsc_random_masked, i) );
+						}
+						MDfsc.write(fh);
+						fh << " kk= " << kk << " ii= " << ii << " jj= " << jj << " local resolution= " << local_resol << std::endl;
+					}
+
+					// Store weighted sum of local resolution and filtered map
+					FOR_ALL_ELEMENTS_IN_ARRAY3D(locmask)
+					{
+						RFLOAT w = A3D_ELEM(locmask, k, i, j);
+						if (w > 0. && !Ifil.outside(kk + k, ii + i, jj + j))
+						{
+							A3D_ELEM(Ifil, kk + k, ii + i, jj + j) += w * A3D_ELEM(Ifilw, k, i, j);
+							A3D_ELEM(Ilocres, kk + k, ii + i, jj + j) += w / local_resol;
+							A3D_ELEM(Isumw, kk + k, ii + i, jj + j) += w;
+						}
+					}
+
+					if (verb > 0)
+						progress_bar(XMIPP_MIN(nr_samplings, (isample + 1) * size));
+				}
+			}
+		}
+	}
+
+	if (do_abort)
+		exit(RELION_EXIT_ABORTED);
+
+	if (thread_error != NULL)
+	{
+		RelionError XE(*thread_error);
+		delete thread_error;
+		throw XE;
+	}
+}
+
 void Postprocessing::run_locres(int rank, int size)
 {
 	// Read input maps and perform some checks
@@ -1062,92 +1246,101 @@ void Postprocessing::run_locres(int rank, int size)
 		init_progress_bar(nr_samplings);
 	}
 
-	long int nn = 0;
-	for (long int kk=((I1()).zinit); kk<=((I1()).zinit + (I1()).zdim - 1); kk+= step_size)
+	if (do_locres_fast)
 	{
-		for (long int ii=((I1()).yinit); ii<=((I1()).yinit + (I1()).ydim - 1); ii+= step_size)
+		// Get the sharpened sum of the two half-maps in real space, to cut out the windows
+		transformer.inverseFourierTransform(FTsum, Isum);
+		localResolutionInWindows(Isum, I1p, I2p, maskrad_pix, edgewidth_pix, step_size, rank, size, fh, Ifil, Ilocres, Isumw);
+	}
+	else
+	{
+		long int nn = 0;
+		for (long int kk=((I1()).zinit); kk<=((I1()).zinit + (I1()).zdim - 1); kk+= step_size)
 		{
-			for (long int jj=((I1()).xinit); jj<=((I1()).xinit + (I1()).xdim - 1); jj+= step_size)
+			for (long int ii=((I1()).yinit); ii<=((I1()).yinit + (I1()).ydim - 1); ii+= step_size)
 			{
-				// Abort through the pipeline_control system, TODO: check how this goes with MPI....
-				if (pipeline_control_check_abort_job())
-					exit(RELION_EXIT_ABORTED);
-
-				// Only calculate local-resolution inside a spherical mask with radius less than half-box-size minus maskrad_pix
-				float rad = sqrt(kk*kk + ii*ii + jj*jj);
-				if (rad < myrad)
+				for (long int jj=((I1()).xinit); jj<=((I1()).xinit + (I1()).xdim - 1); jj+= step_size)
 				{
-					if (nn%size == rank)
+					// Abort through the pipeline_control system, TODO: check how this goes with MPI....
+					if (pipeline_control_check_abort_job())
+						exit(RELION_EXIT_ABORTED);
+
+					// Only calculate local-resolution inside a spherical mask with radius less than half-box-size minus maskrad_pix
+					float rad = sqrt(kk*kk + ii*ii + jj*jj);
+					if (rad < myrad)
 					{
-						// Make a spherical mask around (k,i,j), diameter is step_size pixels, soft-edge width is edgewidth_pix
-						raisedCosineMask(locmask, maskrad_pix, maskrad_pix + edgewidth_pix, kk, ii, jj);
+						if (nn%size == rank)
+						{
+							// Make a spherical mask around (k,i,j), diameter is step_size pixels, soft-edge width is edgewidth_pix
+							raisedCosineMask(locmask, maskrad_pix, maskrad_pix + edgewidth_pix, kk, ii, jj);
 
-						// FSC of masked maps
-						I1m = I1() * locmask;
-						I2m = I2() * locmask;
-						getFSC(I1m, I2m, fsc_masked);
+							// FSC of masked maps
+							I1m = I1() * locmask;
+							I2m = I2() * locmask;
+							getFSC(I1m, I2m, fsc_masked);
 
-						// FSC of masked randomized-phase map
-						I1m = I1p * locmask;
-						I2m = I2p * locmask;
-						getFSC(I1m, I2m, fsc_random_masked);
+							// FSC of masked randomized-phase map
+							I1m = I1p * locmask;
+							I2m = I2p * locmask;
+							getFSC(I1m, I2m, fsc_random_masked);
 
-						// Now that we have fsc_masked and fsc_random_masked, calculate fsc_true according to Richard's formula
-						// FSC_true = FSC_t - FSC_n / ( )
-						calculateFSCtrue(fsc_true, fsc_unmasked, fsc_masked, fsc_random_masked, randomize_at);
+							// Now that we have fsc_masked and fsc_random_masked, calculate fsc_true according to Richard's formula
+							// FSC_true = FSC_t - FSC_n / ( )
+							calculateFSCtrue(fsc_true, fsc_unmasked, fsc_masked, fsc_random_masked, randomize_at);
 
-						if (rank == 0)
-						{
-							MetaDataTable MDfsc;
-							FileName fn_name = "fsc_"+integerToString(kk, 5)+"_"+integerToString(ii, 5)+"_"+integerToString(jj, 5);
-							MDfsc.setName(fn_name);
-							FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
+							if (rank == 0)
 							{
-								MDfsc.addObject();
-								RFLOAT res = (i > 0) ? (XSIZE(I1()) * angpix / (RFLOAT)i) : 999.;
-								MDfsc.setValue(EMDL_SPECTRAL_IDX, (int)i);
-								MDfsc.setValue(EMDL_RESOLUTION, 1./res);
-								MDfsc.setValue(EMDL_RESOLUTION_ANGSTROM, res);
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_TRUE, DIRECT_A1D_ELEM(fsc_true, i) );
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_UNMASKED, DIRECT_A1D_ELEM(fsc_unmasked, i) );
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_MASKED, DIRECT_A1D_ELEM(fsc_masked, i) );
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_RANDOM_MASKED, DIRECT_A1D_ELEM(fsc_random_masked, i) );
+								MetaDataTable MDfsc;
+								FileName fn_name = "fsc_"+integerToString(kk, 5)+"_"+integerToString(ii, 5)+"_"+integerToString(jj, 5);
+								MDfsc.setName(fn_name);
+								FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
+								{
+									MDfsc.addObject();
+									RFLOAT res = (i > 0) ? (XSIZE(I1()) * angpix / (RFLOAT)i) : 999.;
+									MDfsc.setValue(EMDL_SPECTRAL_IDX, (int)i);
+									MDfsc.setValue(EMDL_RESOLUTION, 1./res);
+									MDfsc.setValue(EMDL_RESOLUTION_ANGSTROM, res);
+									MDfsc.setValue(EMDL_POSTPROCESS_FSC_TRUE, DIRECT_A1D_ELEM(fsc_true, i) );
+									MDfsc.setValue(EMDL_POSTPROCESS_FSC_UNMASKED, DIRECT_A1D_ELEM(fsc_unmasked, i) );
+									MDfsc.setValue(EMDL_POSTPROCESS_FSC_MASKED, DIRECT_A1D_ELEM(fsc_masked, i) );
+									MDfsc.setValue(EMDL_POSTPROCESS_FSC_RANDOM_MASKED, DIRECT_A1D_ELEM(fsc_random_masked, i) );
+								}
+								MDfsc.write(fh);
 							}
-							MDfsc.write(fh);
-						}
 
-						float local_resol = 999.;
-						// See where corrected FSC drops below 0.143
-						FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
-						{
-							if ( DIRECT_A1D_ELEM(fsc_true, i) < 0.143)
-								break;
-							local_resol = (i > 0) ? XSIZE(I1())*angpix/(RFLOAT)i : 999.;
-						}
-						local_resol = XMIPP_MIN(locres_minres, local_resol);
-						if (rank == 0)
-							fh << " kk= " << kk << " ii= " << ii << " jj= " << jj << " local resolution= " << local_resol << std::endl;
+							float local_resol = 999.;
+							// See where corrected FSC drops below 0.143
+							FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
+							{
+								if ( DIRECT_A1D_ELEM(fsc_true, i) < 0.143)
+									break;
+								local_resol = (i > 0) ? XSIZE(I1())*angpix/(RFLOAT)i : 999.;
+							}
+							local_resol = XMIPP_MIN(locres_minres, local_resol);
+							if (rank == 0)
+								fh << " kk= " << kk << " ii= " << ii << " jj= " << jj << " local resolution= " << local_resol << std::endl;
 
-						// Now low-pass filter Isum to the estimated resolution
-						MultidimArray<Complex > FT = FTsum;
-						applyFscWeighting(FT, fsc_true);
-						lowPassFilterMap(FT, XSIZE(I1()), local_resol, angpix, filter_edge_width);
+							// Now low-pass filter Isum to the estimated resolution
+							MultidimArray<Complex > FT = FTsum;
+							applyFscWeighting(FT, fsc_true);
+							lowPassFilterMap(FT, XSIZE(I1()), local_resol, angpix, filter_edge_width);
 
-						// Re-use I1m to save some memory
-						transformer.inverseFourierTransform(FT, I1m);
+							// Re-use I1m to save some memory
+							transformer.inverseFourierTransform(FT, I1m);
 
-						// Store weighted sum of local resolution and filtered map
-						FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(I1m)
-						{
-							DIRECT_MULTIDIM_ELEM(Ifil, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n) * DIRECT_MULTIDIM_ELEM(I1m, n);
-							DIRECT_MULTIDIM_ELEM(Ilocres, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n) / local_resol;
-							DIRECT_MULTIDIM_ELEM(Isumw, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n);
+							// Store weighted sum of local resolution and filtered map
+							FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(I1m)
+							{
+								DIRECT_MULTIDIM_ELEM(Ifil, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n) * DIRECT_MULTIDIM_ELEM(I1m, n);
+								DIRECT_MULTIDIM_ELEM(Ilocres, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n) / local_resol;
+								DIRECT_MULTIDIM_ELEM(Isumw, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n);
+							}
 						}
-					}
 
-					nn++;
-					if (verb > 0 && nn <= nr_samplings)
-						progress_bar(nn);
+						nn++;
+						if (verb > 0 && nn <= nr_samplings)
+							progress_bar(nn);
+					}
 				}
 			}
 		}
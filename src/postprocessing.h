@@ -110,6 +110,15 @@ public:
 	// Lowest resolution allowed in the locres map
 	RFLOAT locres_minres;
 
+	// Calculate the local FSCs in small windows around each sampling point, instead of on the full-size maps
+	bool do_locres_fast;
+
+	// Box size (in pixels) of the windows for fast local resolution (<= 0: twice the diameter of the soft local mask)
+	int locres_window;
+
+	// Number of threads for fast local resolution
+	int nr_threads;
+
 	//////// Sharpening
 
 	// Filename for the STAR-file with the MTF of the detector
@@ -211,6 +220,15 @@ public:
 	// Write DAT file for easier plotting in xmgrace
 	void writeFscDat(MetaDataTable &MDfsc);
 
+	/* Local resolution from windowed FSCs
+	 * Small windows around each sampling point are cut out of the half maps (I1p and I2p with randomised phases)
+	 * and the sharpened sum Isharp, and the windowed FSCs and low-pass filtered windows are calculated in parallel.
+	 * The masked sums are added to Ifil, Ilocres and Isumw, just as in run_locres.
+	 */
+	void localResolutionInWindows(MultidimArray<RFLOAT> &Isharp, MultidimArray<RFLOAT> &I1p, MultidimArray<RFLOAT> &I2p,
+			int maskrad_pix, int edgewidth_pix, int step_size, int rank, int size, std::ofstream &fh,
+			MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw);
+
 	// Local-resolution running
 	void run_locres(int rank = 0, int size = 1);
 
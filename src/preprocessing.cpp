@@ -27,11 +27,8 @@
 	int TIMING_BIAS_CORRECT = timer.setNew("biasCorrect");
 	int TIMING_EXTCT_FROM_FRAME = timer.setNew("extractParticlesFromOneFrame");
 	int TIMING_READ_IMG = timer.setNew("-readImg");
-	int TIMING_WINDOW = timer.setNew("-window");
-	int TIMING_BOUNDARY = timer.setNew("-checkBoundary");
-	int TIMING_PRE_IMG_OPS = timer.setNew("-performPerImageOperations");
-	int TIMING_NORMALIZE = timer.setNew("--normalize");
-	int TIMING_INV_CONT = timer.setNew("--invert_contrast");
+	int TIMING_PRE_IMG_OPS = timer.setNew("-extractAllParticles");
+	int TIMING_NORMALIZE = timer.setNew("--applyPerImageOperations");
 	int TIMING_COMP_STATS = timer.setNew("--computeStats");
 	int TIMING_PER_IMG_OP_WRITE = timer.setNew("--write");
 	int TIMING_REST = timer.setNew("-rest");
@@ -76,6 +73,7 @@ void Preprocessing::read(int argc, char **argv, int rank)
 	extract_bias_x  = textToInteger(parser.getOption("--extract_bias_x", "Bias in X-direction of picked particles (this value in pixels will be added to the coords)", "0"));
 	extract_bias_y  = textToInteger(parser.getOption("--extract_bias_y", "Bias in Y-direction of picked particles (this value in pixels will be added to the coords)", "0"));
 	only_extract_unfinished = parser.checkOption("--only_do_unfinished", "Extract only particles if the STAR file for that micrograph does not yet exist.");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to extract the particles of each micrograph with", "1"));
 	extract_minimum_fom = textToFloat(parser.getOption("--minimum_pick_fom", "Minimum value for rlnAutopickFigureOfMerit for particle extraction","-999."));
 
 	int perpart_section = parser.addSection("Particle operations");
@@ -830,7 +828,7 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		FileName fn_output_img_root, FileName fn_oristack, long int &my_current_nr_images, long int my_total_nr_images,
 		RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval)
 {
-	Image<RFLOAT> Ipart, Imic, Itmp;
+	Image<RFLOAT> Imic;
 
 	bool MDin_has_optics_group = MD.containsLabel(EMDL_IMAGE_OPTICS_GROUP); // i.e. re-extracting
 	bool MDin_has_beamtilt = (MD.containsLabel(EMDL_IMAGE_BEAMTILT_X) || MD.containsLabel(EMDL_IMAGE_BEAMTILT_Y));
@@ -860,31 +858,34 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		obsModelMic.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
 	}
 
-	// Now window all particles from the micrograph
-	// Now do the actual phase flipping or CTF-multiplication
-	MultidimArray<Complex> FT;
-	FourierTransformer transformer;
+	TIMING_TIC(TIMING_REST);
+
+	// First read the positions and CTFs of all particles, and fill in their metadata in the output STAR file.
+	// This reads from and writes to the metadata tables and observation models, so it is done in a single thread.
+	long int nr_particles = MD.numberOfObjects();
+	std::vector<long int> xpos(nr_particles), ypos(nr_particles), zpos(nr_particles, 0);
+	std::vector<CTF> ctfs(nr_particles);
+	std::vector<RFLOAT> angpixs(nr_particles), tilt_degs(nr_particles, 0.), psi_degs(nr_particles, 0.);
 	int ipos = 0;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
 	{
 		RFLOAT dxpos, dypos, dzpos;
-		long int xpos, ypos, zpos;
 		long int x0, xF, y0, yF, z0, zF;
 		MD.getValue(EMDL_IMAGE_COORD_X, dxpos);
 		MD.getValue(EMDL_IMAGE_COORD_Y, dypos);
-		xpos = (long int)dxpos;
-		ypos = (long int)dypos;
+		xpos[ipos] = (long int)dxpos;
+		ypos[ipos] = (long int)dypos;
 
-		x0 = xpos + FIRST_XMIPP_INDEX(my_extract_size);
-		xF = xpos + LAST_XMIPP_INDEX(my_extract_size);
-		y0 = ypos + FIRST_XMIPP_INDEX(my_extract_size);
-		yF = ypos + LAST_XMIPP_INDEX(my_extract_size);
+		x0 = xpos[ipos] + FIRST_XMIPP_INDEX(my_extract_size);
+		xF = xpos[ipos] + LAST_XMIPP_INDEX(my_extract_size);
+		y0 = ypos[ipos] + FIRST_XMIPP_INDEX(my_extract_size);
+		yF = ypos[ipos] + LAST_XMIPP_INDEX(my_extract_size);
 		if (dimensionality == 3)
 		{
 			MD.getValue(EMDL_IMAGE_COORD_Z, dzpos);
-			zpos = (long int)dzpos;
-			z0 = zpos + FIRST_XMIPP_INDEX(extract_size);
-			zF = zpos + LAST_XMIPP_INDEX(extract_size);
+			zpos[ipos] = (long int)dzpos;
+			z0 = zpos[ipos] + FIRST_XMIPP_INDEX(extract_size);
+			zF = zpos[ipos] + LAST_XMIPP_INDEX(extract_size);
 		}
 
 		// Discard particles that are completely outside the micrograph and print a warning
@@ -892,9 +893,9 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 				(dimensionality==3 && (zF < 0 || z0 >= ZSIZE(Imic())) ) )
 		{
 			std::cerr << " micrograph x,y,z,n-size= " << XSIZE(Imic()) << " , " << YSIZE(Imic()) << " , " << ZSIZE(Imic()) << " , " << NSIZE(Imic()) << std::endl;
-			std::cerr << " particle position= " << xpos << " , " << ypos;
+			std::cerr << " particle position= " << xpos[ipos] << " , " << ypos[ipos];
 			if (dimensionality == 3)
-				std::cerr << " , " << zpos;
+				std::cerr << " , " << zpos[ipos];
 			std::cerr << std::endl;
 			REPORT_ERROR("Preprocessing::extractParticlesFromOneFrame ERROR: particle" + integerToString(ipos+1) + " lies completely outside micrograph " + fn_mic);
 		}
@@ -908,121 +909,19 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 				obsModelPart.setBoxSize(optics_group, my_extract_size);
 			obsModelPart.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
 		}
+		ctfs[ipos] = ctf;
+		angpixs[ipos] = my_angpix;
 
-		TIMING_TIC(TIMING_WINDOW);
-		// extract one particle in Ipart
-		if (dimensionality == 3)
-			Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
-		else
-			Imic().window(Ipart(), y0, x0, yF, xF, mic_avg);
-		Ipart().setXmippOrigin();
-		TIMING_TOC(TIMING_WINDOW);
-
-		// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
-		if (do_phase_flip || do_premultiply_ctf)
-		{
-			transformer.FourierTransform(Ipart(), FT, false);
-
-			MultidimArray<RFLOAT> Fctf;
-			Fctf.resize(YSIZE(FT), XSIZE(FT));
-			// do_abs, phase_flip, intact_first_peak, damping, padding
-			// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
-			// The boxsize in ObsModel has been updated above.
-			// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
-			// But we are doing this after extraction, so there is not much merit...
-			ctf.getFftwImage(Fctf, my_extract_size, my_extract_size, my_angpix, false, do_phase_flip, do_ctf_intact_first_peak, true, false);
-
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
-			{
-				DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
-			}
-
-			transformer.inverseFourierTransform(FT, Ipart());
-
-			if (extract_size != premultiply_ctf_extract_size)
-			{
-				Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
-				               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
-			}
-		}
-
-		TIMING_TIC(TIMING_BOUNDARY);
-		// Check boundaries: fill pixels outside the boundary with the nearest ones inside
-		// This will create lines at the edges, rather than zeros
-		Ipart().setXmippOrigin();
-
-		// X-boundaries
-		if (x0 < 0 || xF >= XSIZE(Imic()) )
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-			{
-				if (j + xpos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
-				else if (j + xpos >= XSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
-			}
-		}
-
-		// Y-boundaries
-		if (y0 < 0 || yF >= YSIZE(Imic()))
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-			{
-				if (i + ypos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
-				else if (i + ypos >= YSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
-			}
-		}
-
-		if (dimensionality == 3)
-		{
-			// Z-boundaries
-			if (z0 < 0 || zF >= ZSIZE(Imic()))
-			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-				{
-					if (k + zpos < 0)
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
-					else if (k + zpos >= ZSIZE(Imic()))
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
-				}
-			}
-		}
-
-		// 2D projection of 3D sub-tomograms
-		if (dimensionality == 3 && do_project_3d)
-		{
-			// Project the 3D sub-tomogram into a 2D particle again
-			Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
-			Iproj().setXmippOrigin();
-			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
-			{
-				DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
-			}
-			Ipart = Iproj;
-		}
-		TIMING_TOC(TIMING_BOUNDARY);
-
-		// performPerImageOperations will also append the particle to the output stack in fn_stack
 		// Jun24,2015 - Shaoda, extract helical segments
-		RFLOAT tilt_deg, psi_deg;
-		tilt_deg = psi_deg = 0.;
 		if (do_extract_helix) // If priors do not exist, errors will occur in 'readHelicalCoordinates()'.
 		{
-			MD.getValue(EMDL_ORIENT_TILT_PRIOR, tilt_deg);
-			MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_deg);
+			MD.getValue(EMDL_ORIENT_TILT_PRIOR, tilt_degs[ipos]);
+			MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_degs[ipos]);
 		}
 
-		TIMING_TIC(TIMING_PRE_IMG_OPS);
-		performPerImageOperations(Ipart, fn_output_img_root, my_current_nr_images + ipos, my_total_nr_images,
-		                          tilt_deg, psi_deg, all_avg, all_stddev, all_minval, all_maxval);
-		TIMING_TOC(TIMING_PRE_IMG_OPS);
-
-		TIMING_TIC(TIMING_REST);
 		// Also store all the particles information in the STAR file
 		FileName fn_img;
-		if (Ipart().getDim() == 3)
+		if (dimensionality == 3 && !do_project_3d)
 			fn_img.compose(fn_output_img_root, my_current_nr_images + ipos + 1, "mrc");
 		else
 			fn_img.compose(my_current_nr_images + ipos + 1, fn_output_img_root + ".mrcs"); // start image counting in stacks at 1!
@@ -1084,10 +983,225 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			}
 		}
 
-		TIMING_TOC(TIMING_REST);
-
 		ipos++;
 	}
+
+	TIMING_TOC(TIMING_REST);
+
+	// 2D particles are all kept in memory and written out as one stack; sub-tomograms are written to their own files
+	bool write_stack = (dimensionality == 2 || do_project_3d);
+	int out_size = (do_rewindow) ? window : ((do_rescale) ? scale : extract_size);
+	Image<float> Istack;
+	if (write_stack)
+		Istack().resize(nr_particles, 1, out_size, out_size);
+	std::vector<RFLOAT> avgs(nr_particles), stddevs(nr_particles), minvals(nr_particles), maxvals(nr_particles);
+
+	TIMING_TIC(TIMING_PRE_IMG_OPS);
+
+	// Now window, CTF-correct and normalise all particles from the micrograph in parallel
+	RelionError *thread_error = NULL;
+	#pragma omp parallel num_threads(nr_threads)
+	{
+		Image<RFLOAT> Ipart;
+		MultidimArray<Complex> FT;
+		MultidimArray<RFLOAT> Fctf;
+		FourierTransformer transformer;
+
+		#pragma omp for schedule(dynamic)
+		for (long int ipart = 0; ipart < nr_particles; ipart++)
+		{
+			if (thread_error != NULL)
+				continue;
+
+			try
+			{
+				extractOneParticle(Imic, mic_avg, xpos[ipart], ypos[ipart], zpos[ipart], my_extract_size,
+				                   ctfs[ipart], angpixs[ipart], transformer, FT, Fctf, Ipart);
+
+				applyPerImageOperations(Ipart, tilt_degs[ipart], psi_degs[ipart]);
+
+				Ipart().computeStats(avgs[ipart], stddevs[ipart], minvals[ipart], maxvals[ipart]);
+
+				if (write_stack)
+				{
+					if (XSIZE(Ipart()) != out_size || YSIZE(Ipart()) != out_size)
+						REPORT_ERROR("Preprocessing::extractParticlesFromOneMicrograph BUG: unexpected size of the extracted particles");
+
+					float *dest = &DIRECT_NZYX_ELEM(Istack(), ipart, 0, 0, 0);
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Ipart())
+						dest[n] = (float)DIRECT_MULTIDIM_ELEM(Ipart(), n);
+				}
+				else
+				{
+					// Write one mrc file for every subtomogram
+					Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_MIN, minvals[ipart]);
+					Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, maxvals[ipart]);
+					Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_AVG, avgs[ipart]);
+					Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_STDDEV, stddevs[ipart]);
+					Ipart.setSamplingRateInHeader(output_angpix);
+
+					FileName fn_img;
+					fn_img.compose(fn_output_img_root, my_current_nr_images + ipart + 1, "mrc");
+					Ipart.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+				}
+			}
+			catch (RelionError XE)
+			{
+				#pragma omp critical(Preprocessing_thread_error)
+				{
+					if (thread_error == NULL)
+						thread_error = new RelionError(XE);
+				}
+			}
+		}
+	}
+
+	if (thread_error != NULL)
+	{
+		RelionError XE(*thread_error);
+		delete thread_error;
+		throw XE;
+	}
+
+	TIMING_TOC(TIMING_PRE_IMG_OPS);
+
+	if (write_stack)
+	{
+		// Keep track of overall statistics (in the order of the particles)
+		for (long int ipart = 0; ipart < nr_particles; ipart++)
+		{
+			all_minval = XMIPP_MIN(minvals[ipart], all_minval);
+			all_maxval = XMIPP_MAX(maxvals[ipart], all_maxval);
+			all_avg	+= avgs[ipart];
+			all_stddev += stddevs[ipart] * stddevs[ipart];
+		}
+
+		// The min, max, avg and stddev values of all particles go into the main header
+		if (my_current_nr_images + nr_particles == my_total_nr_images)
+		{
+			all_avg /= my_total_nr_images;
+			all_stddev = sqrt(all_stddev / my_total_nr_images);
+			Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_MIN, all_minval);
+			Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, all_maxval);
+			Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_AVG, all_avg);
+			Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_STDDEV, all_stddev);
+		}
+		Istack.setSamplingRateInHeader(output_angpix);
+
+		TIMING_TIC(TIMING_PER_IMG_OP_WRITE);
+		// Write the whole stack to disc at once: all particles of a stack are extracted in a single call
+		if (my_current_nr_images != 0)
+			REPORT_ERROR("BUG: Preprocessing::extractParticlesFromOneMicrograph cannot append to an existing stack");
+		Istack.write(fn_output_img_root+".mrcs", -1, (my_total_nr_images > 1), WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		TIMING_TOC(TIMING_PER_IMG_OP_WRITE);
+	}
+}
+
+void Preprocessing::extractOneParticle(const Image<RFLOAT> &Imic, RFLOAT mic_avg, long int xpos, long int ypos, long int zpos,
+		int my_extract_size, CTF &ctf, RFLOAT my_angpix, FourierTransformer &transformer,
+		MultidimArray<Complex> &FT, MultidimArray<RFLOAT> &Fctf, Image<RFLOAT> &Ipart)
+{
+	long int x0, xF, y0, yF, z0, zF;
+	x0 = xpos + FIRST_XMIPP_INDEX(my_extract_size);
+	xF = xpos + LAST_XMIPP_INDEX(my_extract_size);
+	y0 = ypos + FIRST_XMIPP_INDEX(my_extract_size);
+	yF = ypos + LAST_XMIPP_INDEX(my_extract_size);
+	if (dimensionality == 3)
+	{
+		z0 = zpos + FIRST_XMIPP_INDEX(extract_size);
+		zF = zpos + LAST_XMIPP_INDEX(extract_size);
+	}
+
+	// extract one particle in Ipart
+	Ipart.clear();
+	if (dimensionality == 3)
+		Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
+	else
+		Imic().window(Ipart(), y0, x0, yF, xF, mic_avg);
+	Ipart().setXmippOrigin();
+
+	// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
+	if (do_phase_flip || do_premultiply_ctf)
+	{
+		transformer.FourierTransform(Ipart(), FT, false);
+
+		Fctf.resize(YSIZE(FT), XSIZE(FT));
+		// do_abs, phase_flip, intact_first_peak, damping, padding
+		// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
+		// The boxsize in ObsModel has been updated above.
+		// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
+		// But we are doing this after extraction, so there is not much merit...
+		ctf.getFftwImage(Fctf, my_extract_size, my_extract_size, my_angpix, false, do_phase_flip, do_ctf_intact_first_peak, true, false);
+
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
+		{
+			DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+		}
+
+		transformer.inverseFourierTransform(FT, Ipart());
+
+		if (extract_size != premultiply_ctf_extract_size)
+		{
+			Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
+			               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
+		}
+	}
+
+	// Check boundaries: fill pixels outside the boundary with the nearest ones inside
+	// This will create lines at the edges, rather than zeros
+	Ipart().setXmippOrigin();
+
+	// X-boundaries
+	if (x0 < 0 || xF >= XSIZE(Imic()) )
+	{
+		FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			if (j + xpos < 0)
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
+			else if (j + xpos >= XSIZE(Imic()))
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
+		}
+	}
+
+	// Y-boundaries
+	if (y0 < 0 || yF >= YSIZE(Imic()))
+	{
+		FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			if (i + ypos < 0)
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
+			else if (i + ypos >= YSIZE(Imic()))
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
+		}
+	}
+
+	if (dimensionality == 3)
+	{
+		// Z-boundaries
+		if (z0 < 0 || zF >= ZSIZE(Imic()))
+		{
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+			{
+				if (k + zpos < 0)
+					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
+				else if (k + zpos >= ZSIZE(Imic()))
+					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
+			}
+		}
+	}
+
+	// 2D projection of 3D sub-tomograms
+	if (dimensionality == 3 && do_project_3d)
+	{
+		// Project the 3D sub-tomogram into a 2D particle again
+		Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
+		Iproj().setXmippOrigin();
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
+		}
+		Ipart = Iproj;
+	}
 }
 
 void Preprocessing::runOperateOnInputFile()
@@ -1147,31 +1261,10 @@ void Preprocessing::performPerImageOperations(
 		RFLOAT &all_minval,
 		RFLOAT &all_maxval)
 {
-
-	Ipart().setXmippOrigin();
-
-	if (do_rescale) rescale(Ipart, scale);
-
-	if (do_rewindow) rewindow(Ipart, window);
-
-	Ipart().setXmippOrigin();
-
 	TIMING_TIC(TIMING_NORMALIZE);
-	// Jun24,2015 - Shaoda, helical segments
-	if (do_normalise)
-	{
-		RFLOAT bg_helical_radius = (helical_tube_outer_diameter * 0.5) / angpix;
-		if (do_rescale)
-			bg_helical_radius *= scale / extract_size;
-		normalise(Ipart, bg_radius, white_dust_stddev, black_dust_stddev, do_ramp,
-				do_extract_helix, bg_helical_radius, tilt_deg, psi_deg);
-	}
+	applyPerImageOperations(Ipart, tilt_deg, psi_deg);
 	TIMING_TOC(TIMING_NORMALIZE);
 
-	TIMING_TIC(TIMING_INV_CONT);
-	if (do_invert_contrast) invert_contrast(Ipart);
-	TIMING_TOC(TIMING_INV_CONT);
-
 	// Calculate mean, stddev, min and max
 	RFLOAT avg, stddev, minval, maxval;
 	TIMING_TIC(TIMING_COMP_STATS);
@@ -1224,6 +1317,29 @@ void Preprocessing::performPerImageOperations(
 	}
 }
 
+void Preprocessing::applyPerImageOperations(Image<RFLOAT> &Ipart, RFLOAT tilt_deg, RFLOAT psi_deg)
+{
+	Ipart().setXmippOrigin();
+
+	if (do_rescale) rescale(Ipart, scale);
+
+	if (do_rewindow) rewindow(Ipart, window);
+
+	Ipart().setXmippOrigin();
+
+	// Jun24,2015 - Shaoda, helical segments
+	if (do_normalise)
+	{
+		RFLOAT bg_helical_radius = (helical_tube_outer_diameter * 0.5) / angpix;
+		if (do_rescale)
+			bg_helical_radius *= scale / extract_size;
+		normalise(Ipart, bg_radius, white_dust_stddev, black_dust_stddev, do_ramp,
+				do_extract_helix, bg_helical_radius, tilt_deg, psi_deg);
+	}
+
+	if (do_invert_contrast) invert_contrast(Ipart);
+}
+
 // Get the coordinate file from a given micrograph filename from MDdata
 MetaDataTable Preprocessing::getCoordinateMetaDataTable(FileName fn_mic)
 {
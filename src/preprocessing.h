@@ -73,6 +73,9 @@ public:
 	// Only extract particles when the STAR file for that micrograph doesn't exist yet
 	bool only_extract_unfinished;
 
+	// Number of threads to extract the particles of one micrograph with
+	int nr_threads;
+
 	// Skip gathering CTF information from the ctffind logfiles (e.g. when the info is already there from Gctf)?
 	bool do_skip_ctf_logfiles;
 
@@ -215,11 +218,19 @@ public:
 	bool extractParticlesFromFieldOfView(FileName fn_mic, long int imic);
 
 	// Actually extract particles. This can be from one micrgraph
+	// The particles are processed in nr_threads threads, and 2D particles are written out as one stack
 	void extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			FileName fn_mic, int ipos, FileName fn_output_img_root, FileName fn_oristack,
 			long int &my_current_nr_images, long int my_total_nr_images,
 			RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval);
 
+	// Window one particle from the micrograph into Ipart, premultiply or phase-flip it with its CTF,
+	// and fill the pixels outside the micrograph. This is called from multiple threads: each thread
+	// should have its own transformer, FT, Fctf and Ipart.
+	void extractOneParticle(const Image<RFLOAT> &Imic, RFLOAT mic_avg, long int xpos, long int ypos, long int zpos,
+			int my_extract_size, CTF &ctf, RFLOAT my_angpix, FourierTransformer &transformer,
+			MultidimArray<Complex> &FT, MultidimArray<RFLOAT> &Fctf, Image<RFLOAT> &Ipart);
+
 	// Perform per-image operations (e.g. normalise, rescaling, rewindowing and inverting contrast) on an input stack (or STAR file)
 	void runOperateOnInputFile();
 
@@ -238,6 +249,9 @@ public:
 			RFLOAT &all_maxval);
 
 
+	// Rescaling, rewindowing, normalisation and contrast inversion of one image (without writing it)
+	void applyPerImageOperations(Image<RFLOAT> &Ipart, RFLOAT tilt_deg, RFLOAT psi_deg);
+
 	// Get the coordinate metadatatable from fn_data
 	MetaDataTable getCoordinateMetaDataTable(FileName fn_mic);
 	FileName getOutputFileNameRoot(FileName fn_mic);
@@ -70,6 +70,9 @@ void Projector::initialiseData(int current_size)
 	// Set pad_size
 	pad_size = 2 * (ROUND(padding_factor * r_max) + 1) + 1;
 
+	// A new map replaces any reduced-precision copy of the previous one
+	clearCompactData();
+
 	// Short side of data array
 	switch (ref_dim)
 	{
@@ -627,6 +630,65 @@ void Projector::griddingCorrect(MultidimArray<RFLOAT> &vol_in)
 	}
 }
 
+int textToProjectorPrecision(const std::string &precision)
+{
+	if (precision == "double")
+		return PROJECTOR_FULL_PRECISION;
+	else if (precision == "float")
+		return PROJECTOR_FLOAT;
+	else if (precision == "half")
+		return PROJECTOR_HALF;
+	else
+		REPORT_ERROR("Unknown projector precision: " + precision + " (use double, float or half)");
+
+	return PROJECTOR_FULL_PRECISION;
+}
+
+void Projector::compactData(int precision)
+{
+	if (precision == PROJECTOR_FULL_PRECISION || ref_dim != 3 || data_dim != 2 || data_precision != PROJECTOR_FULL_PRECISION || NZYXSIZE(data) == 0)
+		return;
+
+	if (precision == PROJECTOR_FLOAT)
+	{
+		data_float.resize(ZSIZE(data), YSIZE(data), 2 * XSIZE(data));
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(data)
+		{
+			DIRECT_MULTIDIM_ELEM(data_float, 2 * n) = (float)DIRECT_MULTIDIM_ELEM(data, n).real;
+			DIRECT_MULTIDIM_ELEM(data_float, 2 * n + 1) = (float)DIRECT_MULTIDIM_ELEM(data, n).imag;
+		}
+		data_float.zinit = STARTINGZ(data);
+		data_float.yinit = STARTINGY(data);
+		data_float.xinit = 0;
+	}
+	else if (precision == PROJECTOR_HALF)
+	{
+		// Scale by a power of two so that the largest value is about half the largest float16
+		RFLOAT max_abs = 0.;
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(data)
+		{
+			max_abs = XMIPP_MAX(max_abs, ABS(DIRECT_MULTIDIM_ELEM(data, n).real));
+			max_abs = XMIPP_MAX(max_abs, ABS(DIRECT_MULTIDIM_ELEM(data, n).imag));
+		}
+		data_half_scale = (max_abs > 0.) ? pow(2., CEIL(log2(max_abs / 32768.))) : 1.;
+
+		data_half.resize(ZSIZE(data), YSIZE(data), 2 * XSIZE(data));
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(data)
+		{
+			DIRECT_MULTIDIM_ELEM(data_half, 2 * n) = float2half(DIRECT_MULTIDIM_ELEM(data, n).real / data_half_scale);
+			DIRECT_MULTIDIM_ELEM(data_half, 2 * n + 1) = float2half(DIRECT_MULTIDIM_ELEM(data, n).imag / data_half_scale);
+		}
+		data_half.zinit = STARTINGZ(data);
+		data_half.yinit = STARTINGY(data);
+		data_half.xinit = 0;
+	}
+	else
+		REPORT_ERROR("Projector::compactData: BUG: unknown precision " + integerToString(precision));
+
+	data_precision = precision;
+	data.clear();
+}
+
 void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 {
 	// f2d should already be in the right size (ori_size,orihalfdim)
@@ -647,6 +709,18 @@ void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 
 	const int r_min_NN_ref_2 = r_min_nn * r_min_nn * padding_factor * padding_factor;
 
+	// The shape of the map, which may only be kept in reduced precision (see compactData)
+	long int mdl_xdim = XSIZE(data), mdl_ydim = YSIZE(data), mdl_zdim = ZSIZE(data);
+	long int mdl_yinit = STARTINGY(data), mdl_zinit = STARTINGZ(data);
+	if (data_precision != PROJECTOR_FULL_PRECISION)
+	{
+		mdl_xdim = (data_precision == PROJECTOR_FLOAT) ? XSIZE(data_float) / 2 : XSIZE(data_half) / 2;
+		mdl_ydim = (data_precision == PROJECTOR_FLOAT) ? YSIZE(data_float) : YSIZE(data_half);
+		mdl_zdim = (data_precision == PROJECTOR_FLOAT) ? ZSIZE(data_float) : ZSIZE(data_half);
+		mdl_yinit = (data_precision == PROJECTOR_FLOAT) ? STARTINGY(data_float) : STARTINGY(data_half);
+		mdl_zinit = (data_precision == PROJECTOR_FLOAT) ? STARTINGZ(data_float) : STARTINGZ(data_half);
+	}
+
 //#define DEBUG
 #ifdef DEBUG
 	std::cerr << " XSIZE(f2d)= "<< XSIZE(f2d) << std::endl;
@@ -703,31 +777,31 @@ void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 
 				int y0 = FLOOR(yp);
 				const RFLOAT fy = yp - y0;
-				y0 -=  STARTINGY(data);
+				y0 -=  mdl_yinit;
 				const int y1 = y0 + 1;
 
 				int z0 = FLOOR(zp);
 				const RFLOAT fz = zp - z0;
-				z0 -= STARTINGZ(data);
+				z0 -= mdl_zinit;
 				const int z1 = z0 + 1;
 
 				// Avoid reading outside the box
-				if (x0 < 0 || x0+1 >= data.xdim
-				 || y0 < 0 || y0+1 >= data.ydim
-				 || z0 < 0 || z0+1 >= data.zdim)
+				if (x0 < 0 || x0+1 >= mdl_xdim
+				 || y0 < 0 || y0+1 >= mdl_ydim
+				 || z0 < 0 || z0+1 >= mdl_zdim)
 				{
 					continue;
 				}
 
 				// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
-				const Complex d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
-				const Complex d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
-				const Complex d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
-				const Complex d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
-				const Complex d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
-				const Complex d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
-				const Complex d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
-				const Complex d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
+				const Complex d000 = getDataElement(z0, y0, x0);
+				const Complex d001 = getDataElement(z0, y0, x1);
+				const Complex d010 = getDataElement(z0, y1, x0);
+				const Complex d011 = getDataElement(z0, y1, x1);
+				const Complex d100 = getDataElement(z1, y0, x0);
+				const Complex d101 = getDataElement(z1, y0, x1);
+				const Complex d110 = getDataElement(z1, y1, x0);
+				const Complex d111 = getDataElement(z1, y1, x1);
 
 				// Set the interpolated value in the 2D output array
 				const Complex dx00 = LIN_INTERP(fx, d000, d001);
@@ -762,24 +836,27 @@ void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 					z0 = -z0;
 				}
 
-				const int xr = x0 - STARTINGX(data);
-				const int yr = y0 - STARTINGY(data);
-				const int zr = z0 - STARTINGZ(data);
+				const int xr = x0;
+				const int yr = y0 - mdl_yinit;
+				const int zr = z0 - mdl_zinit;
 
-				if (xr < 0 || xr >= data.xdim
-				 || yr < 0 || yr >= data.ydim
-				 || zr < 0 || zr >= data.zdim)
+				if (xr < 0 || xr >= mdl_xdim
+				 || yr < 0 || yr >= mdl_ydim
+				 || zr < 0 || zr >= mdl_zdim)
 				{
 					continue;
 				}
 
+				// xr, yr and zr are already relative to the origin of the map, so both
+				// branches index directly. (The non-conjugate branch used to apply the
+				// origin a second time through A3D_ELEM.)
 				if (is_neg_x)
 				{
-					DIRECT_A2D_ELEM(f2d, i, x) = conj(DIRECT_A3D_ELEM(data, zr, yr, xr));
+					DIRECT_A2D_ELEM(f2d, i, x) = conj(getDataElement(zr, yr, xr));
 				}
 				else
 				{
-					DIRECT_A2D_ELEM(f2d, i, x) = A3D_ELEM(data, zr, yr, xr);
+					DIRECT_A2D_ELEM(f2d, i, x) = getDataElement(zr, yr, xr);
 				}
 
 			} // endif NEAREST_NEIGHBOUR
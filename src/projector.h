@@ -23,6 +23,7 @@
 #include "src/fftw.h"
 #include "src/multidim_array.h"
 #include "src/image.h"
+#include "src/float16.h"
 
 #include <src/jaz/single_particle/volume.h>
 #include <src/jaz/gravis/t2Vector.h>
@@ -68,6 +69,13 @@ extern void scale(RFLOAT *img, size_t sz, RFLOAT val, deviceStream_t stream = 0)
 #define ACT_ON_DATA 0
 #define ACT_ON_WEIGHT 1
 
+#define PROJECTOR_FULL_PRECISION 0
+#define PROJECTOR_FLOAT 1
+#define PROJECTOR_HALF 2
+
+// Convert "double", "float" or "half" into PROJECTOR_FULL_PRECISION, PROJECTOR_FLOAT or PROJECTOR_HALF
+int textToProjectorPrecision(const std::string &precision);
+
 class Projector
 {
 public:
@@ -98,6 +106,16 @@ public:
 	// Dimension of the projections (1 or 2 or 3)
 	int data_dim;
 
+	// Precision in which project() reads the Fourier-space map (see compactData)
+	int data_precision;
+
+	// The real and imaginary parts of data, interleaved along X, once compactData() has released data
+	MultidimArray<float> data_float;
+	MultidimArray<float16> data_half;
+
+	// data_half holds the values divided by this factor, to stay within the range of float16
+	RFLOAT data_half_scale;
+
 public:
 
 	/** Empty constructor
@@ -179,6 +197,10 @@ public:
 			padding_factor = op.padding_factor;
 			ref_dim = op.ref_dim;
 			data_dim  = op.data_dim;
+			data_precision = op.data_precision;
+			data_float = op.data_float;
+			data_half = op.data_half;
+			data_half_scale = op.data_half_scale;
 		}
 		return *this;
 	}
@@ -204,6 +226,23 @@ public:
 		data.clear();
 		r_max = r_min_nn = interpolator = ref_dim = data_dim = pad_size = 0;
 		padding_factor = 0.;
+		clearCompactData();
+	}
+
+	/* Keep the map only in float or half precision (PROJECTOR_FLOAT or PROJECTOR_HALF) for project(), and release data
+	 * Values are still interpolated in RFLOAT. Only 3D maps that are projected onto 2D images are compacted;
+	 * for other maps, and for PROJECTOR_FULL_PRECISION, this does nothing.
+	 * Anything other than project() that needs data should be done before this is called.
+	 */
+	void compactData(int precision);
+
+	// Forget the reduced-precision copies of compactData(), without restoring data
+	void clearCompactData()
+	{
+		data_float.clear();
+		data_half.clear();
+		data_precision = PROJECTOR_FULL_PRECISION;
+		data_half_scale = 1.;
 	}
 
 	/*
@@ -298,6 +337,23 @@ public:
 	*/
 	void project(MultidimArray<Complex > &img_out, Matrix2D<RFLOAT> &A);
 
+	// Element of the Fourier-space map in data (or in its reduced-precision copy) with direct indices
+	inline Complex getDataElement(long int k, long int i, long int j) const
+	{
+		if (data_precision == PROJECTOR_FLOAT)
+		{
+			const float *ptr = &DIRECT_A3D_ELEM(data_float, k, i, 2 * j);
+			return Complex(ptr[0], ptr[1]);
+		}
+		else if (data_precision == PROJECTOR_HALF)
+		{
+			const float16 *ptr = &DIRECT_A3D_ELEM(data_half, k, i, 2 * j);
+			return Complex(half2float(ptr[0]) * data_half_scale, half2float(ptr[1]) * data_half_scale);
+		}
+		else
+			return DIRECT_A3D_ELEM(data, k, i, j);
+	}
+
 	/*
 	* Get the two gradients (real and imaginary) of that slice.
 	* Note: the gradient has to be computed in 3D and then mapped to 2D.
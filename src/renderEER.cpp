@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <algorithm>
@@ -20,8 +21,7 @@
 	Timer EERtimer;
 	int TIMING_READ_EER = EERtimer.setNew("read EER");
 	int TIMING_BUILD_INDEX = EERtimer.setNew("build index");
-	int TIMING_UNPACK_RLE = EERtimer.setNew("unpack RLE");
-	int TIMING_RENDER_ELECTRONS = EERtimer.setNew("render electrons");
+	int TIMING_UNPACK_RLE = EERtimer.setNew("unpack RLE and render electrons");
 #else
 	#define RCTIC(label)
 	#define RCTOC(label)
@@ -32,6 +32,7 @@ const char EERRenderer::EER_FOOTER_ERR[] = "ThermoFisherECComprERR00";
 const int EERRenderer::EER_4K= 4096;
 const int EERRenderer::EER_2K = 2048;
 const unsigned int EERRenderer::EER_LEN_FOOTER = 24;
+const unsigned int EERRenderer::EER_READ_AHEAD = 8;
 const uint16_t EERRenderer::TIFF_COMPRESSION_EER8bit = 65000;
 const uint16_t EERRenderer::TIFF_COMPRESSION_EER7bit = 65001;
 const uint16_t EERRenderer::TIFF_COMPRESSION_EERDetailed = 65002;
@@ -66,70 +67,226 @@ void EERRenderer::silenceTIFFWarnings()
 	}
 }
 
-template <typename T>
-void EERRenderer::render4K_to_16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
+namespace
 {
-	for (int i = 0; i < n_electrons; i++)
+	// Where an electron at detector pixel `position` with subpixel `symbol` lands in the rendered image.
+	// Each renderer also knows the width of the rendered image, so that this compiles to shifts and masks.
+	struct Render4K_to_16K
 	{
-		int x = ((positions[i] & 4095) << 2) | (symbols[i] & 3); // 4095 = 111111111111b, 3 = 00000011b
-		int y = ((positions[i] >> 12) << 2) | ((symbols[i] & 12) >> 2); //  4096 = 2^12, 12 = 00001100b
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
+		static inline long long index(unsigned int position, unsigned char symbol)
+		{
+			const int x = ((position & 4095) << 2) | (symbol & 3); // 4095 = 111111111111b, 3 = 00000011b
+			const int y = ((position >> 12) << 2) | ((symbol & 12) >> 2); //  4096 = 2^12, 12 = 00001100b
+			return ((long long)y << 14) | x;
+		}
+	};
 
-template <typename T>
-void EERRenderer::render4K_to_8K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
+	struct Render4K_to_8K
 	{
-		int x = ((positions[i] & 4095) << 1) | ((symbols[i] & 2) >> 1); // 4095 = 111111111111b, 2 = 00000010b
-		int y = ((positions[i] >> 12) << 1) | ((symbols[i] & 8) >> 3); //  4096 = 2^12, 8 = 00001000b
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
+		static inline long long index(unsigned int position, unsigned char symbol)
+		{
+			const int x = ((position & 4095) << 1) | ((symbol & 2) >> 1); // 4095 = 111111111111b, 2 = 00000010b
+			const int y = ((position >> 12) << 1) | ((symbol & 8) >> 3); //  4096 = 2^12, 8 = 00001000b
+			return ((long long)y << 13) | x;
+		}
+	};
 
-template <typename T>
-void EERRenderer::render4K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
+	struct Render4K_to_4K
+	{
+		static inline long long index(unsigned int position, unsigned char symbol)
+		{
+			return position; // the rendered image has the same layout as the detector
+		}
+	};
+
+	struct Render4K_to_2K
 	{
-		int x = positions[i] & 4095; // 4095 = 111111111111b
-		int y = positions[i] >> 12; //  4096 = 2^12
-		DIRECT_A2D_ELEM(image, y, x)++;
+		static inline long long index(unsigned int position, unsigned char symbol)
+		{
+			const int x = (position & 4095) >> 1; // 4095 = 111111111111b
+			const int y = (position >> 12) >> 1; //  4096 = 2^12
+			return ((long long)y << 11) | x;
+		}
+	};
+
+	struct Render2K_to_4K
+	{
+		static inline long long index(unsigned int position, unsigned char symbol)
+		{
+			const int x = ((position & 2047) << 1) | (symbol & 1); // 2047 = 11111111111b
+			const int y = ((position >> 11) << 1) | (symbol >> 1); //  2048 = 2^11
+			return ((long long)y << 12) | x;
+		}
+	};
+
+	struct Render2K_to_2K
+	{
+		static inline long long index(unsigned int position, unsigned char symbol)
+		{
+			return position;
+		}
+	};
+
+	/* Decode a frame with 7 bit run lengths, each followed by a subpixel symbol unless it is 127,
+	 * and add `delta` to the rendered image for each electron.
+	 * Returns the number of electrons; n_pix is set to the number of pixels covered by the frame.
+	 */
+	template <unsigned int SYMBOL_BITS, unsigned char SYMBOL_FLIP, typename Renderer, typename T>
+	long long decodeRLE7(const unsigned char *frame, long long frame_size, long long total_pixels, T *image, T delta, long long &n_pix)
+	{
+		const int code_bits = 7 + SYMBOL_BITS;
+		const uint64_t symbol_mask = (1 << SYMBOL_BITS) - 1;
+		const long long frame_bits = frame_size * 8;
+		long long bit_pos = 0, n_electron = 0;
+		n_pix = 0;
+
+		while (bit_pos < frame_bits)
+		{
+			// Fetch 64 bits and unpack as many codes as fit in the 57 bits that are valid
+			// after shifting out bit_offset_in_first_byte (up to 7): 5 codes of 7 + 4 bits,
+			// or 6 codes of 7 + 2 bits. The buffer is padded, so it is always safe to read ahead.
+			uint64_t chunk;
+			memcpy(&chunk, frame + (bit_pos >> 3), sizeof(chunk));
+			chunk >>= (bit_pos & 7); // 7 = 00000111 (same as % 8)
+			int bits_left = 57;
+
+			while (bits_left >= code_bits)
+			{
+				const unsigned int p = chunk & 127; // 127 = 01111111; 7 bits for RLE
+				chunk >>= 7;
+				bits_left -= 7;
+				bit_pos += 7;
+
+				n_pix += p;
+				if (n_pix >= total_pixels) return n_electron;
+				if (p == 127) continue; // this should be rare.
+
+				// See the 8+4 bit decoder for the flipped bits of the symbol
+				const unsigned char s = (unsigned char)(chunk & symbol_mask) ^ SYMBOL_FLIP;
+				chunk >>= SYMBOL_BITS;
+				bits_left -= SYMBOL_BITS;
+				bit_pos += SYMBOL_BITS;
+
+				image[Renderer::index(n_pix, s)] += delta;
+				n_electron++;
+				n_pix++;
+			}
+		}
+
+		return n_electron;
 	}
-}
 
-template <typename T>
-void EERRenderer::render2K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
+	/* Decode a frame with 8 bit run lengths and 4 bit subpixel symbols, see decodeRLE7
+	 * Every two symbols take 12 bit * 2 = 24 bit = 3 byte:
+	 * high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
+	 */
+	template <typename Renderer, typename T>
+	long long decodeRLE8(const unsigned char *frame, long long frame_size, long long total_pixels, T *image, T delta, long long &n_pix)
 	{
-		int x = ((positions[i] & 2047) << 1) | (symbols[i] & 1); // 2047 = 11111111111b
-		int y = ((positions[i] >> 11) << 1) | (symbols[i] >> 1); //  2048 = 2^11
-		DIRECT_A2D_ELEM(image, y, x)++;
+		long long pos = 0, n_electron = 0;
+		n_pix = 0;
+
+		// Because there is a footer or padding, it is safe to go beyond the limit by two bytes.
+		while (pos < frame_size)
+		{
+			// Symbol is bit tricky: 0000YyXx, where Y and X must be flipped.
+			// In other words, the bits for shifts 0, 1, 2, 3 are 10, 11, 00, 01.
+			// This can be considered as 'signed 2 bit' representation of -2, -1, 0, 1.
+			// For 2 bit symbols (2K EER): 000000YX and Y and X must be flipped.
+			// That is, shifts 0 and 1 correspond to bits 1 and 0.
+			// This is "signed 1 bit" representation of -1 and 0..
+			// ref: Lingbo Yu, TFS (Email to Takanori on 10-11 May 2023)
+			const unsigned char p1 = frame[pos];
+			const unsigned char s1 = (frame[pos + 1] & 0x0F) ^ 0x0A; // 0x0F = 00001111, 0x0A = 00001010
+			const unsigned char p2 = (frame[pos + 1] >> 4) | (frame[pos + 2] << 4);
+			const unsigned char s2 = (frame[pos + 2] >> 4) ^ 0x0A;
+
+			// Note the order. Add p before checking the size and placing a new electron.
+			n_pix += p1;
+			if (n_pix >= total_pixels) break;
+			if (p1 < 255)
+			{
+				image[Renderer::index(n_pix, s1)] += delta;
+				n_electron++;
+				n_pix++;
+			}
+
+			n_pix += p2;
+			if (n_pix >= total_pixels) break;
+			if (p2 < 255)
+			{
+				image[Renderer::index(n_pix, s2)] += delta;
+				n_electron++;
+				n_pix++;
+			}
+
+			pos += 3;
+		}
+
+		return n_electron;
 	}
 }
 
-template <typename T>
-void EERRenderer::render4K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
+template <typename T, typename Renderer>
+long long EERRenderer::decodeFrame(int iframe, T *image, T delta, long long &n_pix)
 {
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = (positions[i] & 4095) >> 1; // 4095 = 111111111111b
-		int y = (positions[i] >> 12) >> 1; //  4096 = 2^12
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
+	const unsigned char *frame = buf + frame_starts[iframe];
+	const long long frame_size = frame_sizes[iframe];
+
+	if (rle_bits == 7 && subpixel_bits == 4)
+		return decodeRLE7<4, 0x0A, Renderer>(frame, frame_size, total_pixels, image, delta, n_pix);
+	else if (rle_bits == 7 && subpixel_bits == 2)
+		// Note that we have to flip bits (see decodeRLE8).
+		return decodeRLE7<2, 3, Renderer>(frame, frame_size, total_pixels, image, delta, n_pix);
+	else // rle_bits == 8 && subpixel_bits == 4
+		return decodeRLE8<Renderer>(frame, frame_size, total_pixels, image, delta, n_pix);
 }
 
 template <typename T>
-void EERRenderer::render2K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
+long long EERRenderer::renderFrame(int iframe, MultidimArray<T> &image)
 {
-	for (int i = 0; i < n_electrons; i++)
+	T *data = MULTIDIM_ARRAY(image);
+	long long n_pix = 0, n_electron = 0;
+	T delta = 1;
+
+	// Electrons are rendered while they are decoded. If the frame turns out to be corrupted,
+	// the same electrons are decoded again and taken off.
+	for (int pass = 0; pass < 2; pass++)
 	{
-		int x = positions[i] & 2047; // 2047 = 11111111111b
-		int y = positions[i] >> 11; //  2048 = 2^11
-		DIRECT_A2D_ELEM(image, y, x)++;
+		if (width == EER_4K)
+		{
+			if (eer_upsampling == 3)
+				n_electron = decodeFrame<T, Render4K_to_16K>(iframe, data, delta, n_pix);
+			else if (eer_upsampling == 2)
+				n_electron = decodeFrame<T, Render4K_to_8K>(iframe, data, delta, n_pix);
+			else if (eer_upsampling == 1)
+				n_electron = decodeFrame<T, Render4K_to_4K>(iframe, data, delta, n_pix);
+			else // eer_upsampling == -1
+				n_electron = decodeFrame<T, Render4K_to_2K>(iframe, data, delta, n_pix);
+		}
+		else // width == EER_2K
+		{
+			if (eer_upsampling == 2)
+				n_electron = decodeFrame<T, Render2K_to_4K>(iframe, data, delta, n_pix);
+			else // eer_upsampling == 1
+				n_electron = decodeFrame<T, Render2K_to_2K>(iframe, data, delta, n_pix);
+		}
+
+		if (n_pix == total_pixels)
+			break;
+
+		if (pass == 0)
+			std::cerr << "WARNING: The number of pixels is not right in " + fn_movie + " frame " + integerToString(iframe + 1) + ". Probably this frame is corrupted. This frame is skipped." << std::endl;
+
+		n_electron = 0;
+		delta = (T)-1;
 	}
+
+#ifdef DEBUG_EER
+	printf("Decoded %lld electrons / %lld pixels from frame %5d.\n", n_electron, n_pix, iframe);
+#endif
+
+	return n_electron;
 }
 
 EERRenderer::EERRenderer()
@@ -254,7 +411,7 @@ void EERRenderer::readLegacy(FILE *fh)
 {
 	/* Load everything first */
 	RCTIC(TIMING_READ_EER);
-	buf = (unsigned char*)malloc(file_size);
+	buf = (unsigned char*)calloc(file_size + EER_READ_AHEAD, 1);
 	if (buf == NULL)
 		REPORT_ERROR("Failed to allocate the buffer.");
 	if (fread(buf, sizeof(char), file_size, fh) != file_size)
@@ -301,7 +458,7 @@ void EERRenderer::lazyReadFrames()
 
 			frame_starts.resize(nframes, 0);
 			frame_sizes.resize(nframes, 0);
-			buf = (unsigned char*)malloc(file_size); // This is big enough
+			buf = (unsigned char*)calloc(file_size + EER_READ_AHEAD, 1); // This is big enough
 			if (buf == NULL)
 				REPORT_ERROR("Failed to allocate the buffer for " + fn_movie);
 			long long pos = 0;
@@ -376,7 +533,7 @@ int EERRenderer::getHeight()
 }
 
 template <typename T>
-long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image)
+long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int nr_threads)
 {
 	if (!ready)
 		REPORT_ERROR("EERRenderer::renderNFrames called before ready.");
@@ -390,218 +547,63 @@ long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArra
 		REPORT_ERROR("Invalid frame range was requested.");
 	}
 
+	if (width == EER_4K && !(eer_upsampling == 3 || eer_upsampling == 2 || eer_upsampling == 1 || eer_upsampling == -1))
+		REPORT_ERROR("Invalid EER upsamle for 4K images. This must be 3, 2, 1 or -1.");
+	else if (width == EER_2K && !(eer_upsampling == 2 || eer_upsampling == 1))
+		REPORT_ERROR("Invalid EER upsamle for 2K images. This must be 2 or 1.");
+	else if (width != EER_4K && width != EER_2K)
+		REPORT_ERROR("Logic error: an invalid EER size at EERRenderer::renderFrames().");
+
 	// Make this 0-indexed
 	frame_start--;
 	frame_end--;
 
-	long long total_n_electron = 0;
-
-	std::vector<unsigned int> positions;
-	std::vector<unsigned char> symbols;
-	image.initZeros(getHeight(), getWidth());
-
-	for (int iframe = frame_start; iframe <= frame_end; iframe++)
+	if ((preread_start > 0 && frame_start < preread_start) ||
+	    (preread_end > 0 && frame_end > preread_end))
 	{
-		RCTIC(TIMING_UNPACK_RLE);
-		if ((preread_start > 0 && iframe < preread_start) ||
-	  	    (preread_end > 0 && iframe > preread_end))
-		{
-			std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start + 1 << ", frame_end = " << frame_end + 1<< "),  NFrames = " << getNFrames() << " preread_start = " << preread_start + 1 << " prered_end = " << preread_end + 1<< std::endl;
-			REPORT_ERROR("Tried to render frames outside pre-read region");
-		}		
-
-		long long pos = frame_starts[iframe];
-		unsigned int n_pix = 0, n_electron = 0;
-		const int max_electrons = frame_sizes[iframe] * 2; // at 4 bits per electron (very permissive bound!)
-		if (positions.size() < max_electrons)
-		{
-			positions.resize(max_electrons);
-			symbols.resize(max_electrons);
-		}
-
-		if (rle_bits == 7 && subpixel_bits == 4)
-		{
-			unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
-			unsigned char p, s;
-
-			while (true)
-			{
-				// Fetch 32 bits and unpack up to 2 chunks of 7 + 4 bits.
-				// This is faster than unpack 7 and 4 bits sequentially.
-				// Since the size of buf is larger than the actual size by the TIFF header size,
-				// it is always safe to read ahead.
-
-				long long first_byte = pos + (bit_pos >> 3);
-				const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
-				const unsigned int chunk = (*(unsigned int*)(buf + first_byte)) >> bit_offset_in_first_byte;
-
-				p = (unsigned char)(chunk & 127); // 127 = 01111111; 7 bits for RLE
-				bit_pos += 7; // TODO: we can remove this for further speed.
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue; // this should be rare.
-
-				// 15 = 00001111; 4 bits for symbol. See the 8+4 bit section for 0x0A
-				s = (unsigned char)((chunk >> 7) & 15) ^ 0x0A;
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
-
-				p = (unsigned char)((chunk >> 11) & 127);
-				bit_pos += 7;
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue;
-
-				s = (unsigned char)((chunk >> 18) & 15) ^ 0x0A;
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
-			}
-		}
-		else if (rle_bits == 7 && subpixel_bits == 2)
-		{
-			unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
-			unsigned char p, s;
+		std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start + 1 << ", frame_end = " << frame_end + 1<< "),  NFrames = " << getNFrames() << " preread_start = " << preread_start + 1 << " prered_end = " << preread_end + 1<< std::endl;
+		REPORT_ERROR("Tried to render frames outside pre-read region");
+	}
 
-			while (true)
-			{
-				// Fetch 32 bits and unpack up to 2 chunks of 7 + 2 bits.
-				// (Note: one cannot unpack 3 chunks because bit_offset_in_first_byte can be 7;
-				//  7 + 9 + 9 + 9 = 34 > 32 so the last subpixel symbol would be lost.)
-				// This is faster than unpack 7 and 2 bits sequentially.
-				// Since the size of buf is larger than the actual size by the TIFF header size,
-				// it is always safe to read ahead.
-
-				long long first_byte = pos + (bit_pos >> 3);
-				const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
-				const unsigned int chunk = (*(unsigned int*)(buf + first_byte)) >> bit_offset_in_first_byte;
-
-				p = (unsigned char)(chunk & 127); // 127 = 01111111; 7 bits for RLE
-				bit_pos += 7; // TODO: we can remove this for further speed.
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue; // this should be rare.
+	long long total_n_electron = 0;
+	image.initZeros(getHeight(), getWidth());
 
-				// 3 = 00000011; 2 bits for symbol
-				// Note that we have to flip bits (see below).
-				s = (unsigned char)((chunk >> 7) & 3) ^ 3;
-				bit_pos += 2;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
+	RCTIC(TIMING_UNPACK_RLE);
 
-				p = (unsigned char)((chunk >> 9) & 127);
-				bit_pos += 7;
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue;
+	nr_threads = XMIPP_MIN(nr_threads, frame_end - frame_start + 1);
+	if (nr_threads <= 1)
+	{
+		for (int iframe = frame_start; iframe <= frame_end; iframe++)
+			total_n_electron += renderFrame(iframe, image);
+	}
+	else
+	{
+		// Each thread renders a contiguous part of the frames into its own image
+		std::vector<MultidimArray<T> > partial_images(nr_threads - 1);
 
-				s = (unsigned char)((chunk >> 16) & 3) ^ 3;
-				bit_pos += 2;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
-			}
-		}
-		else if (rle_bits == 8 && subpixel_bits == 4)
+		#pragma omp parallel num_threads(nr_threads) reduction(+:total_n_electron)
 		{
-			// unpack every two symbols = 12 bit * 2 = 24 bit = 3 byte
-			// high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
-			// With SIMD intrinsics at the SSSE3 level, we can unpack 10 symbols (120 bits) simultaneously.
-			unsigned char p1, p2, s1, s2;
-
-			const long long pos_limit = frame_starts[iframe] + frame_sizes[iframe];
-			// Because there is a footer, it is safe to go beyond the limit by two bytes.
-			while (pos < pos_limit)
+			const int thread_id = omp_get_thread_num();
+			MultidimArray<T> &my_image = (thread_id == 0) ? image : partial_images[thread_id - 1];
+			if (thread_id > 0)
+				my_image.initZeros(getHeight(), getWidth());
+
+			#pragma omp for schedule(static)
+			for (int iframe = frame_start; iframe <= frame_end; iframe++)
+				total_n_electron += renderFrame(iframe, my_image);
+
+			// The implicit barrier above makes sure all partial images are complete
+			#pragma omp for schedule(static)
+			for (long long n = 0; n < MULTIDIM_SIZE(image); n++)
 			{
-				// Symbol is bit tricky: 0000YyXx, where Y and X must be flipped.
-				// In other words, the bits for shifts 0, 1, 2, 3 are 10, 11, 00, 01.
-				// This can be considered as 'signed 2 bit' representation of -2, -1, 0, 1.
-				// For 2 bit symbols (2K EER): 000000YX and Y and X must be flipped.
-				// That is, shifts 0 and 1 correspond to bits 1 and 0.
-				// This is "signed 1 bit" representation of -1 and 0..
-				// ref: Lingbo Yu, TFS (Email to Takanori on 10-11 May 2023)
-				p1 = buf[pos];
-				s1 = (buf[pos + 1] & 0x0F) ^ 0x0A; // 0x0F = 00001111, 0x0A = 00001010
-
-				p2 = (buf[pos + 1] >> 4) | (buf[pos + 2] << 4);
-				s2 = (buf[pos + 2] >> 4) ^ 0x0A;
-
-				// Note the order. Add p before checking the size and placing a new electron.
-				n_pix += p1;
-				if (n_pix >= total_pixels) break;
-				if (p1 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s1;
-					n_electron++;
-					n_pix++;
-				}
-
-				n_pix += p2;
-				if (n_pix >= total_pixels) break;
-				if (p2 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s2;
-					n_electron++;
-					n_pix++;
-				}
-#ifdef DEBUG_EER_DETAIL
-				printf("%d: %u %u, %u %u %d\n", pos, p1, s1, p2, s2, n_pix);
-#endif
-				pos += 3;
+				for (int i = 0; i < partial_images.size(); i++)
+					DIRECT_MULTIDIM_ELEM(image, n) += DIRECT_MULTIDIM_ELEM(partial_images[i], n);
 			}
 		}
+	}
 
-		if (n_pix != total_pixels)
-		{
-			std::cerr << "WARNING: The number of pixels is not right in " + fn_movie + " frame " + integerToString(iframe + 1) + ". Probably this frame is corrupted. This frame is skipped." << std::endl;
-			continue;
-		}
-
-		RCTOC(TIMING_UNPACK_RLE);
-
-		RCTIC(TIMING_RENDER_ELECTRONS);
-		if (width == EER_4K)
-		{
-			if (eer_upsampling == 3)
-				render4K_to_16K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 2)
-				render4K_to_8K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 1)
-				render4K_to_4K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == -1)
-				render4K_to_2K(image, positions, symbols, n_electron);
-			else
-				REPORT_ERROR("Invalid EER upsamle for 4K images. This must be 3, 2, 1 or -1.");
-		}
-		else if (width == EER_2K)
-		{
-			if (eer_upsampling == 2)
-				render2K_to_4K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 1)
-				render2K_to_2K(image, positions, symbols, n_electron);
-			else
-				REPORT_ERROR("Invalid EER upsamle for 2K images. This must be 2 or 1.");
-		}
-		else
-			REPORT_ERROR("Logic error: an invalid EER size at EERRenderer::renderFrames().");
-
-		RCTOC(TIMING_RENDER_ELECTRONS);
+	RCTOC(TIMING_UNPACK_RLE);
 
-		total_n_electron += n_electron;
-#ifdef DEBUG_EER
-		printf("Decoded %lld electrons / %d pixels from frame %5d.\n", n_electron, n_pix, iframe);
-#endif
-	}
 #ifdef DEBUG_EER
 	printf("Decoded %lld electrons in total.\n", total_n_electron);
 #endif
@@ -614,9 +616,9 @@ long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArra
 }
 
 // Instantiate for Polishing
-template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image);
-template long long EERRenderer::renderFrames<short>(int frame_start, int frame_end, MultidimArray<short> &image);
-template long long EERRenderer::renderFrames<unsigned short>(int frame_start, int frame_end, MultidimArray<unsigned short> &image);
-template long long EERRenderer::renderFrames<char>(int frame_start, int frame_end, MultidimArray<char> &image);
-template long long EERRenderer::renderFrames<signed char>(int frame_start, int frame_end, MultidimArray<signed char> &image);
-template long long EERRenderer::renderFrames<unsigned char>(int frame_start, int frame_end, MultidimArray<unsigned char> &image);
+template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image, int nr_threads);
+template long long EERRenderer::renderFrames<short>(int frame_start, int frame_end, MultidimArray<short> &image, int nr_threads);
+template long long EERRenderer::renderFrames<unsigned short>(int frame_start, int frame_end, MultidimArray<unsigned short> &image, int nr_threads);
+template long long EERRenderer::renderFrames<char>(int frame_start, int frame_end, MultidimArray<char> &image, int nr_threads);
+template long long EERRenderer::renderFrames<signed char>(int frame_start, int frame_end, MultidimArray<signed char> &image, int nr_threads);
+template long long EERRenderer::renderFrames<unsigned char>(int frame_start, int frame_end, MultidimArray<unsigned char> &image, int nr_threads);
@@ -17,6 +17,7 @@ class EERRenderer {
 	static const char EER_FOOTER_ERR[];
 	static const int EER_4K, EER_2K;
 	static const unsigned int EER_LEN_FOOTER;
+	static const unsigned int EER_READ_AHEAD; // padding at the end of buf, so that decoders can fetch whole words
 	static const uint16_t TIFF_COMPRESSION_EER8bit, TIFF_COMPRESSION_EER7bit, TIFF_COMPRESSION_EERDetailed;
 	static const ttag_t TIFFTAG_EER_RLE_DEPTH, TIFFTAG_EER_SUBPIXEL_H_DEPTH, TIFFTAG_EER_SUBPIXEL_V_DEPTH;
 
@@ -37,23 +38,13 @@ class EERRenderer {
 	void readLegacy(FILE *fh);
 	void lazyReadFrames();
 
-	template <typename T>
-	void render4K_to_16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render4K_to_8K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render4K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render4K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render2K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
+	// Decode a frame and add delta to image for each electron
+	template <typename T, typename Renderer>
+	long long decodeFrame(int iframe, T *image, T delta, long long &n_pix);
 
+	// Add the electrons of a frame to image, unless the frame is corrupted
 	template <typename T>
-	void render2K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
+	long long renderFrame(int iframe, MultidimArray<T> &image);
 
 	static TIFFErrorHandler prevTIFFWarningHandler;
 
@@ -102,8 +93,9 @@ class EERRenderer {
 	// image is cleared.
 	// This function is thread-safe (except for timing).
 	// It is caller's responsibility to make sure type T does not overflow.
+	// With nr_threads > 1, the frames are divided over the threads, each of which needs its own copy of image.
 	template <typename T>
-	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image);
+	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int nr_threads = 1);
 
 	// The gain reference for EER is not multiplicative! So the inverse is taken here.
 	// 0 means defect.
@@ -258,8 +258,31 @@ int readMRC(long int img_select, bool isStack=false, const FileName &name="")
 #endif
 
 	MRChead *header = (MRChead*)askMemory(sizeof(MRChead));
-	if (fread(header, MRCSIZE, 1, fimg) < 1)
-		REPORT_ERROR("rwMRC: error in reading header of image " + name);
+
+	// Re-use the header of a previous read from the same open file, unless the stack has grown since
+	bool header_cached = (cached_header != NULL && cached_header->size() == MRCSIZE);
+	if (header_cached)
+	{
+		memcpy(header, cached_header->data(), MRCSIZE);
+		int nz = header->nz;
+		if ((abs(header->mode) > SWAPTRIG) || (abs(header->nx) > SWAPTRIG))
+			swapbytes((char*)&nz, 4);
+		if (isStack && img_select >= nz)
+		{
+			// Discard the buffered, outdated header before reading it again
+			header_cached = false;
+			fflush(fimg);
+			rewind(fimg);
+		}
+	}
+
+	if (!header_cached)
+	{
+		if (fread(header, MRCSIZE, 1, fimg) < 1)
+			REPORT_ERROR("rwMRC: error in reading header of image " + name);
+		if (cached_header != NULL)
+			cached_header->assign((char*)header, (char*)header + MRCSIZE);
+	}
 
 	DataType datatype = parseMRCHeader(header, img_select, isStack, name);
 
@@ -280,6 +303,22 @@ int readMRC(long int img_select, bool isStack=false, const FileName &name="")
 	return readData(fimg, img_select, datatype, 0);
 }
 
+/** MRC Reader for a stack that is mapped in memory
+  * @ingroup MRC
+  * Returns false if the mapping does not hold the whole image.
+*/
+bool readMRCFromMemory(const char* map, size_t map_size, long int img_select, const FileName &name="")
+{
+	if (map_size < MRCSIZE)
+		return false;
+
+	MRChead header;
+	memcpy(&header, map, MRCSIZE);
+	DataType datatype = parseMRCHeader(&header, img_select, true, name);
+
+	return readDataFromMemory(map, map_size, img_select, datatype);
+}
+
 /** MRC Writer
   * @ingroup MRC
 */
@@ -322,11 +361,17 @@ int writeMRC(long int img_select, bool isStack=false, const int mode=WRITE_OVERW
 		imgStart = img_select;
 		imgEnd = img_select + 1;
 	}
-	if (mode == WRITE_APPEND || mode == WRITE_REPLACE)
+	if (mode == WRITE_REPLACE)
 	{
 		imgStart = 0;
 		imgEnd = 1;
 	}
+	else if (mode == WRITE_APPEND)
+	{
+		// Append all images in data to the end of the stack
+		imgStart = 0;
+		imgEnd = (isStack) ? Ndim : 1;
+	}
 	header->nx = Xdim;
 	header->ny = Ydim;
 	if (isStack)
@@ -480,7 +525,7 @@ int writeMRC(long int img_select, bool isStack=false, const int mode=WRITE_OVERW
 	// For multi-image files
 	if (mode == WRITE_APPEND && isStack)
 	{
-		header->nz = replaceNsize + 1;
+		header->nz = replaceNsize + imgEnd;
 	}
 	//else header-> is correct
 
@@ -0,0 +1,49 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/significant_samples.h"
+#include "src/error.h"
+
+void SignificantSamples::clear()
+{
+	row_start.clear();
+	translations.clear();
+}
+
+void SignificantSamples::build(const MultidimArray<RFLOAT> &weights, RFLOAT significant_weight, long int nr_trans)
+{
+	if (nr_trans <= 0 || XSIZE(weights) % nr_trans != 0)
+		REPORT_ERROR("SignificantSamples::build: BUG: the number of weights is not a multiple of the number of translations");
+
+	long int nr_orient = XSIZE(weights) / nr_trans;
+	row_start.resize(nr_orient + 1);
+	translations.clear();
+
+	long int ihidden = 0;
+	for (long int iorient = 0; iorient < nr_orient; iorient++)
+	{
+		row_start[iorient] = translations.size();
+		for (long int itrans = 0; itrans < nr_trans; itrans++, ihidden++)
+		{
+			if (DIRECT_A1D_ELEM(weights, ihidden) >= significant_weight)
+				translations.push_back(itrans);
+		}
+	}
+	row_start[nr_orient] = translations.size();
+}
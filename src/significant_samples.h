@@ -0,0 +1,75 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef SIGNIFICANT_SAMPLES_H
+#define SIGNIFICANT_SAMPLES_H
+
+#include <vector>
+#include "src/multidim_array.h"
+
+/* The coarse (orientation, translation) samples of one particle that had a significant weight in the first pass
+ *
+ * The samples are stored as a list of translations for each orientation (of all classes), like the rows of a
+ * compressed sparse row matrix, so that the second pass only visits the significant samples, and its weights
+ * only need to be stored for those: the oversampled weights of significant sample isample are at positions
+ * isample * nr_oversampled .. (isample + 1) * nr_oversampled - 1.
+ */
+class SignificantSamples
+{
+public:
+
+	// Forget all samples
+	void clear();
+
+	/* Keep the samples with a weight >= significant_weight
+	 * weights has nr_trans translations for each orientation, with the translations running fastest.
+	 */
+	void build(const MultidimArray<RFLOAT> &weights, RFLOAT significant_weight, long int nr_trans);
+
+	// Number of significant samples
+	long int size() const
+	{
+		return translations.size();
+	}
+
+	// The significant samples of orientation iorient are first(iorient) .. first(iorient + 1) - 1
+	long int first(long int iorient) const
+	{
+		return row_start[iorient];
+	}
+
+	// Whether orientation iorient has any significant translation
+	bool isSignificant(long int iorient) const
+	{
+		return row_start[iorient + 1] > row_start[iorient];
+	}
+
+	// Translation of significant sample isample (counted from the first translation of the particle)
+	long int translation(long int isample) const
+	{
+		return translations[isample];
+	}
+
+private:
+
+	std::vector<long int> row_start;
+	std::vector<int> translations;
+};
+
+#endif
@@ -8,3 +8,16 @@ TEST_CASE( "Test getCTF", "[ctf]" ) {
   float val = ctf.getCTF(10.0, 10.0);
   REQUIRE(val == Approx(0.59154));
 }
+
+//The CTF image from the frequency tables should be the same as getCTF at every pixel
+TEST_CASE( "Test getFftwImage", "[ctf]" ) {
+  CTF ctf;
+  ctf.setValues(10000.0, 12000.0, 37.0, 300.0, 2.7, 0.1, 50.0, 1.0, 0.3);
+  MultidimArray<RFLOAT> Fctf(64, 33);
+  ctf.getFftwImage(Fctf, 64, 64, 1.1, false, false, true);
+  FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(Fctf)
+  {
+    RFLOAT val = ctf.getCTF(jp / (64 * 1.1), ip / (64 * 1.1), false, false, true);
+    REQUIRE(DIRECT_A2D_ELEM(Fctf, i, j) == Approx(val));
+  }
+}
@@ -0,0 +1,52 @@
+#include <catch2/catch.hpp>
+#include "src/fftw.h"
+
+//The batched transforms of a stack should give the same results as transforming its images one by one
+TEST_CASE( "Test FourierTransformStack", "[fftw]" ) {
+  MultidimArray<RFLOAT> stack(3, 1, 12, 16), img, stack_back(3, 1, 12, 16);
+  MultidimArray<Complex> Fstack, Fimg;
+  FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(stack)
+  {
+    DIRECT_MULTIDIM_ELEM(stack, n) = sin(0.37 * n) + 0.01 * (n % 7);
+  }
+
+  FourierTransformer::FourierTransformStack(stack, Fstack);
+  REQUIRE(NSIZE(Fstack) == 3);
+  REQUIRE(XSIZE(Fstack) == 9);
+
+  FourierTransformer transformer;
+  for (int i = 0; i < NSIZE(stack); i++)
+  {
+    stack.getImage(i, img);
+    transformer.FourierTransform(img, Fimg);
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fimg)
+    {
+      Complex z = DIRECT_NZYX_ELEM(Fstack, i, 0, n / XSIZE(Fimg), n % XSIZE(Fimg));
+      REQUIRE(z.real == Approx(DIRECT_MULTIDIM_ELEM(Fimg, n).real).margin(1e-12));
+      REQUIRE(z.imag == Approx(DIRECT_MULTIDIM_ELEM(Fimg, n).imag).margin(1e-12));
+    }
+  }
+
+  //The inverse transforms (which are not normalised) should give back the original images
+  FourierTransformer::inverseFourierTransformStack(Fstack, stack_back);
+  FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(stack)
+  {
+    REQUIRE(DIRECT_MULTIDIM_ELEM(stack_back, n) == Approx(DIRECT_MULTIDIM_ELEM(stack, n)).margin(1e-10));
+  }
+}
+
+//Plans that are no longer used should be kept only up to the maximum of the cache
+TEST_CASE( "Test FFTWPlanCache eviction", "[fftw]" ) {
+  for (int size = 8; size < 8 + 2 * FFTW_PLAN_CACHE_MAX_UNUSED; size++)
+  {
+    MultidimArray<RFLOAT> img(size, size);
+    MultidimArray<Complex> Fimg;
+    img.initConstant(1.);
+
+    FourierTransformer transformer;
+    transformer.FourierTransform(img, Fimg);
+    REQUIRE(DIRECT_A2D_ELEM(Fimg, 0, 0).real == Approx(1.));
+  }
+
+  REQUIRE(FFTWPlanCache::size() <= FFTW_PLAN_CACHE_MAX_UNUSED);
+}
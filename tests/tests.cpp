@@ -2,3 +2,4 @@
 
 #include <catch2/catch.hpp>
 #include "ctf.cpp"
+#include "fftw.cpp"